@@ -0,0 +1,963 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see https://www.gnu.org/licenses/.
+
+#include "src/core/base/base.hh"
+#include "src/core/http/http.hh"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+namespace RG {
+
+enum class Scenario {
+    Small,
+    Download,
+    Upload,
+    WebSocket,
+    Overload
+};
+static const char *const ScenarioNames[] = {
+    "small",
+    "download",
+    "upload",
+    "websocket",
+    "overload"
+};
+
+static const int MaxPipeline = 64;
+static const Size MessageSize = 64;
+
+struct Config {
+    http_Config http { 8889 };
+
+    int threads = std::max(GetCoreCount() / 2, 1);
+    int connections = 64;
+    int pipeline = 1;
+    int64_t duration = 5000;
+    int64_t warmup = 1000;
+
+    Size download_size = Kibibytes(256);
+    Size upload_size = Kibibytes(64);
+    int64_t slow_time = 50;
+    bool fast_lane = true;
+
+    int tolerance = 10;
+
+    // Load shedding is disabled by default, but the overload scenario is about it
+    Config() { http.shed_target = 50; }
+};
+
+struct ScenarioResult {
+    Scenario scenario;
+
+    int64_t requests = 0;
+    int64_t errors = 0;
+    int64_t bytes = 0;
+    double rps = 0.0;
+
+    http_Histogram latency;
+};
+
+struct Connection {
+    int fd = -1;
+
+    Span<const uint8_t> request;
+    bool measure = true;
+
+    HeapArray<uint8_t> out_buf;
+    Size out_offset = 0;
+    HeapArray<uint8_t> in_buf;
+
+    // Send times of requests waiting for a response (FIFO)
+    int64_t sent[MaxPipeline];
+    int sent_head = 0;
+    int sent_count = 0;
+
+    bool in_body = false;
+    Size body_remain = 0;
+    int status = 0;
+};
+
+static Config config;
+static HeapArray<uint8_t> blob;
+
+static int64_t GetTime()
+{
+    return http_Metrics::GetTime();
+}
+
+static void HandleRequest(const http_RequestInfo &request, http_IO *io)
+{
+    if (TestStr(request.url, "/health")) {
+        http_Priority priority = config.fast_lane ? http_Priority::High : http_Priority::Normal;
+        io->RunAsync([io]() { io->AttachText(200, "OK"); }, priority);
+
+        return;
+    }
+
+    // libmicrohttpd drops keep-alive when the response is queued right away, and real
+    // handlers (goupile, thop) do most of their work in async context anyway.
+    io->RunAsync([&request, io]() {
+        if (TestStr(request.url, "/small")) {
+            http_JsonPageBuilder json;
+            if (!json.Init(io))
+                return;
+
+            json.StartObject();
+            json.Key("id"); json.Int64(42);
+            json.Key("name"); json.String("Reference handler");
+            json.Key("tags"); json.StartArray();
+            json.String("foo"); json.String("bar");
+            json.EndArray();
+            json.EndObject();
+
+            json.Finish();
+        } else if (TestStr(request.url, "/download")) {
+            StreamWriter writer;
+            if (!io->OpenForWrite(200, config.download_size, &writer))
+                return;
+
+            for (Size written = 0; written < config.download_size; written += blob.len) {
+                Size len = std::min(blob.len, config.download_size - written);
+                writer.Write(blob.Take(0, len));
+            }
+
+            writer.Close();
+        } else if (TestStr(request.url, "/upload")) {
+            if (request.method != http_RequestMethod::Post) {
+                io->AttachError(405);
+                return;
+            }
+
+            StreamReader reader;
+            if (!io->OpenForRead(config.upload_size, &reader))
+                return;
+
+            Size total = 0;
+            while (!reader.IsEOF()) {
+                uint8_t buf[16384];
+
+                Size len = reader.Read(buf);
+                if (len < 0)
+                    return;
+                total += len;
+            }
+
+            io->AttachText(200, Fmt(&io->allocator, "%1", total));
+        } else if (TestStr(request.url, "/slow")) {
+            // Pretend we're waiting for a database or something
+            WaitDelay(config.slow_time);
+            io->AttachText(200, "Done!");
+        } else if (TestStr(request.url, "/ws")) {
+            if (!io->UpgradeToWS(0))
+                return;
+
+            io->AttachWS([](http_WebSocket *ws, Span<const uint8_t> msg) { ws->Send(msg); });
+        } else {
+            io->AttachError(404);
+        }
+    });
+}
+
+static bool SendAll(int fd, Span<const uint8_t> buf)
+{
+    while (buf.len) {
+        ssize_t len = RG_RESTART_EINTR(send(fd, buf.ptr, (size_t)buf.len, MSG_NOSIGNAL), < 0);
+
+        if (len < 0) {
+            LogError("Failed to write to socket: %1", strerror(errno));
+            return false;
+        }
+
+        buf.ptr += len;
+        buf.len -= (Size)len;
+    }
+
+    return true;
+}
+
+static int ConnectToServer()
+{
+    int fd = -1;
+
+    if (config.http.sock_type == SocketType::Unix) {
+        fd = ConnectToUnixSocket(config.http.unix_path);
+        if (fd < 0)
+            return -1;
+    } else {
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            LogError("Failed to create IPv4 socket: %1", strerror(errno));
+            return -1;
+        }
+        RG_DEFER_N(err_guard) { close(fd); };
+
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)config.http.port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        if (connect(fd, (struct sockaddr *)&addr, RG_SIZE(addr)) < 0) {
+            LogError("Failed to connect to port %1: %2", config.http.port, strerror(errno));
+            return -1;
+        }
+
+        int flag = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, RG_SIZE(flag));
+
+        err_guard.Disable();
+    }
+
+    return fd;
+}
+
+static int ConnectWebSocket()
+{
+    static const char request[] = "GET /ws HTTP/1.1\r\n"
+                                  "Host: localhost\r\n"
+                                  "Connection: Upgrade\r\n"
+                                  "Upgrade: websocket\r\n"
+                                  "Sec-WebSocket-Version: 13\r\n"
+                                  "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                                  "\r\n";
+
+    int fd = ConnectToServer();
+    if (fd < 0)
+        return -1;
+    RG_DEFER_N(err_guard) { CloseSocket(fd); };
+
+    if (!SendAll(fd, MakeSpan((const uint8_t *)request, RG_SIZE(request) - 1)))
+        return -1;
+
+    // Read response headers byte by byte, so we don't eat into WebSocket frames
+    LocalArray<char, 1024> response;
+    while (!EndsWith(response, "\r\n\r\n")) {
+        if (!response.Available()) {
+            LogError("Excessive HTTP response size");
+            return -1;
+        }
+
+        ssize_t len = RG_RESTART_EINTR(recv(fd, response.end(), 1, 0), < 0);
+
+        if (len < 0) {
+            LogError("Failed to read from socket: %1", strerror(errno));
+            return -1;
+        } else if (!len) {
+            LogError("Unexpected end of stream");
+            return -1;
+        }
+
+        response.len++;
+    }
+
+    if (!StartsWith(response, "HTTP/1.1 101")) {
+        LogError("WebSocket upgrade failed");
+        return -1;
+    }
+
+    err_guard.Disable();
+    return fd;
+}
+
+static void BuildGet(const char *url, HeapArray<uint8_t> *out_request)
+{
+    char buf[256];
+
+    Span<const char> headers = Fmt(buf, "GET %1 HTTP/1.1\r\nHost: localhost\r\n\r\n", url);
+    out_request->Append(headers.As<const uint8_t>());
+}
+
+static void BuildRequest(Scenario scenario, HeapArray<uint8_t> *out_request)
+{
+    char buf[256];
+
+    switch (scenario) {
+        case Scenario::Small: { BuildGet("/small", out_request); } break;
+        case Scenario::Download: { BuildGet("/download", out_request); } break;
+
+        case Scenario::Upload: {
+            Span<const char> headers = Fmt(buf, "POST /upload HTTP/1.1\r\nHost: localhost\r\n"
+                                                "Content-Length: %1\r\n\r\n", config.upload_size);
+            out_request->Append(headers.As<const uint8_t>());
+
+            for (Size written = 0; written < config.upload_size; written += blob.len) {
+                Size len = std::min(blob.len, config.upload_size - written);
+                out_request->Append(blob.Take(0, len));
+            }
+        } break;
+
+        case Scenario::WebSocket: {
+            // Client frames must be masked, use a zero mask to keep things simple
+            static const uint8_t mask[4] = {};
+
+            out_request->Append(0x82);
+            out_request->Append((uint8_t)(0x80 | MessageSize));
+            out_request->Append(mask);
+            out_request->Append(blob.Take(0, MessageSize));
+        } break;
+
+        case Scenario::Overload: { RG_UNREACHABLE(); } break;
+    }
+}
+
+// Returns the number of complete responses, or -1 on error
+static Size ParseResponses(Scenario scenario, Connection *conn, int64_t *out_errors)
+{
+    Span<const uint8_t> remain = conn->in_buf;
+    Size count = 0;
+
+    for (;;) {
+        if (conn->in_body) {
+            Size skip = std::min(conn->body_remain, remain.len);
+
+            remain.ptr += skip;
+            remain.len -= skip;
+            conn->body_remain -= skip;
+
+            if (conn->body_remain)
+                break;
+
+            *out_errors += (conn->status >= 400);
+            conn->in_body = false;
+            count++;
+        } else if (scenario == Scenario::WebSocket) {
+            if (remain.len < 2)
+                break;
+            if (remain[0] != 0x82 || remain[1] >= 126) {
+                LogError("Unexpected WebSocket frame");
+                return -1;
+            }
+
+            conn->in_body = true;
+            conn->body_remain = remain[1];
+            conn->status = 200;
+
+            remain.ptr += 2;
+            remain.len -= 2;
+        } else {
+            const uint8_t *end = (const uint8_t *)memmem(remain.ptr, remain.len, "\r\n\r\n", 4);
+            if (!end)
+                break;
+
+            Span<const char> headers = MakeSpan((const char *)remain.ptr, end - remain.ptr);
+            Size content_len = -1;
+
+            if (!StartsWith(headers, "HTTP/1.1 ") || headers.len < 12) {
+                LogError("Malformed HTTP response");
+                return -1;
+            }
+            if (!ParseInt(headers.Take(9, 3), &conn->status, (int)ParseFlag::End))
+                return -1;
+
+            while (headers.len) {
+                Span<const char> line = SplitStrLine(headers, &headers);
+                Span<const char> value;
+                Span<const char> key = TrimStr(SplitStr(line, ':', &value));
+
+                if (TestStrI(key, "Content-Length")) {
+                    if (!ParseInt(TrimStr(value), &content_len))
+                        return -1;
+                } else if (TestStrI(key, "Transfer-Encoding")) {
+                    LogError("Chunked responses are not supported");
+                    return -1;
+                }
+            }
+            if (content_len < 0) {
+                LogError("Missing Content-Length in HTTP response");
+                return -1;
+            }
+
+            conn->in_body = true;
+            conn->body_remain = content_len;
+
+            remain.ptr = end + 4;
+            remain.len = conn->in_buf.end() - remain.ptr;
+        }
+    }
+
+    MemMove(conn->in_buf.ptr, remain.ptr, remain.len);
+    conn->in_buf.len = remain.len;
+
+    return count;
+}
+
+static bool SetNonBlocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        LogError("Failed to make socket non-blocking: %1", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+// Each worker drives its connections with poll(), and keeps up to config.pipeline
+// requests in flight on each of them.
+static bool RunWorker(Scenario scenario, Span<Connection> connections, int64_t measure, int64_t end, ScenarioResult *out_result)
+{
+    HeapArray<struct pollfd> pfds;
+    pfds.AppendDefault(connections.len);
+
+    // Give up on responses still missing a few seconds after the end
+    int64_t deadline = end + 5000000;
+
+    for (;;) {
+        int64_t now = GetTime();
+        bool busy = false;
+
+        for (Size i = 0; i < connections.len; i++) {
+            Connection *conn = &connections[i];
+
+            while (now < end && conn->sent_count < config.pipeline) {
+                int idx = (conn->sent_head + conn->sent_count) % MaxPipeline;
+
+                conn->out_buf.Append(conn->request);
+                conn->sent[idx] = now;
+                conn->sent_count++;
+            }
+
+            pfds[i].fd = conn->fd;
+            pfds[i].events = (short)((conn->sent_count ? POLLIN : 0) |
+                                     (conn->out_offset < conn->out_buf.len ? POLLOUT : 0));
+            pfds[i].revents = 0;
+
+            busy |= !!conn->sent_count;
+        }
+
+        if (!busy)
+            break;
+        if (now >= deadline) {
+            LogError("Timed out while waiting for responses");
+            return false;
+        }
+
+        if (RG_RESTART_EINTR(poll(pfds.ptr, (nfds_t)pfds.len, 100), < 0) < 0) {
+            LogError("poll() failed: %1", strerror(errno));
+            return false;
+        }
+
+        for (Size i = 0; i < connections.len; i++) {
+            Connection *conn = &connections[i];
+            const struct pollfd &pfd = pfds[i];
+
+            if (pfd.revents & POLLOUT) {
+                Span<const uint8_t> buf = conn->out_buf.Take(conn->out_offset, conn->out_buf.len - conn->out_offset);
+                ssize_t len = RG_RESTART_EINTR(send(conn->fd, buf.ptr, (size_t)buf.len, MSG_NOSIGNAL), < 0);
+
+                if (len < 0 && errno != EAGAIN) {
+                    LogError("Failed to write to socket: %1", strerror(errno));
+                    return false;
+                }
+
+                if (len > 0) {
+                    conn->out_offset += (Size)len;
+
+                    if (conn->out_offset == conn->out_buf.len) {
+                        conn->out_buf.RemoveFrom(0);
+                        conn->out_offset = 0;
+                    }
+                }
+            }
+
+            if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+                conn->in_buf.Grow(Kibibytes(64));
+
+                ssize_t len = RG_RESTART_EINTR(recv(conn->fd, conn->in_buf.end(), (size_t)conn->in_buf.Available(), 0), < 0);
+
+                if (len < 0 && errno != EAGAIN) {
+                    LogError("Failed to read from socket: %1", strerror(errno));
+                    return false;
+                } else if (!len) {
+                    LogError("Server closed the connection");
+                    return false;
+                }
+
+                if (len > 0) {
+                    conn->in_buf.len += (Size)len;
+
+                    int64_t errors = 0;
+                    Size count = ParseResponses(scenario, conn, &errors);
+                    if (count < 0)
+                        return false;
+
+                    if (count) {
+                        int64_t received = GetTime();
+
+                        for (Size j = 0; j < count; j++) {
+                            int64_t sent = conn->sent[conn->sent_head];
+
+                            conn->sent_head = (conn->sent_head + 1) % MaxPipeline;
+                            conn->sent_count--;
+
+                            if (conn->measure && sent >= measure && received < end) {
+                                out_result->requests++;
+                                out_result->latency.Add(received - sent);
+                            }
+                        }
+
+                        out_result->errors += errors;
+                    }
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+static bool RunScenario(Scenario scenario, ScenarioResult *out_result)
+{
+    ScenarioResult result = {};
+    result.scenario = scenario;
+
+    HeapArray<Connection> connections;
+    RG_DEFER {
+        for (const Connection &conn: connections) {
+            CloseSocket(conn.fd);
+        }
+    };
+
+    connections.AppendDefault(config.connections);
+    for (Connection &conn: connections) {
+        conn.fd = (scenario == Scenario::WebSocket) ? ConnectWebSocket() : ConnectToServer();
+        if (conn.fd < 0)
+            return false;
+        if (!SetNonBlocking(conn.fd))
+            return false;
+    }
+
+    HeapArray<uint8_t> request;
+    HeapArray<uint8_t> slow;
+
+    if (scenario == Scenario::Overload) {
+        // Most connections saturate the async pool with slow requests, and we measure
+        // the health checks made by the others (errors are shed slow requests).
+        BuildGet("/health", &request);
+        BuildGet("/slow", &slow);
+
+        for (Size i = 0; i < connections.len; i++) {
+            Connection *conn = &connections[i];
+
+            conn->request = (i % 4) ? slow : request;
+            conn->measure = !(i % 4);
+        }
+    } else {
+        BuildRequest(scenario, &request);
+
+        for (Connection &conn: connections) {
+            conn.request = request;
+        }
+    }
+
+    int threads = std::min(config.threads, config.connections);
+
+    int64_t start = GetTime();
+    int64_t measure = start + config.warmup * 1000;
+    int64_t end = measure + config.duration * 1000;
+
+    HeapArray<ScenarioResult> partials;
+    partials.AppendDefault(threads);
+
+    Async async(threads - 1);
+
+    for (int i = 0; i < threads; i++) {
+        Size from = (Size)i * connections.len / threads;
+        Size to = (Size)(i + 1) * connections.len / threads;
+
+        async.Run([=, &connections, &partials]() {
+            Span<Connection> slice = connections.Take(from, to - from);
+            return RunWorker(scenario, slice, measure, end, &partials[i]);
+        });
+    }
+
+    if (!async.Sync())
+        return false;
+
+    for (const ScenarioResult &partial: partials) {
+        result.requests += partial.requests;
+        result.errors += partial.errors;
+
+        for (int i = 0; i < http_Histogram::Buckets; i++) {
+            result.latency.counts[i] += partial.latency.counts[i];
+        }
+        result.latency.count += partial.latency.count;
+        result.latency.sum += partial.latency.sum;
+        result.latency.max = std::max(result.latency.max, partial.latency.max);
+    }
+
+    result.rps = (double)result.requests * 1000.0 / (double)config.duration;
+
+    switch (scenario) {
+        case Scenario::Small:
+        case Scenario::WebSocket:
+        case Scenario::Overload: {} break;
+        case Scenario::Download: { result.bytes = result.requests * config.download_size; } break;
+        case Scenario::Upload: { result.bytes = result.requests * config.upload_size; } break;
+    }
+
+    std::swap(*out_result, result);
+    return true;
+}
+
+static void PrintResults(Span<const ScenarioResult> results)
+{
+    PrintLn("%!..+%1%2%3%4%5%6%7%!0", FmtArg("Scenario").Pad(12), FmtArg("Requests").Pad(-10), FmtArg("RPS").Pad(-12),
+            FmtArg("p50").Pad(-10), FmtArg("p90").Pad(-10), FmtArg("p99").Pad(-10), FmtArg("p99.9").Pad(-10));
+
+    for (const ScenarioResult &result: results) {
+        const http_Histogram &latency = result.latency;
+
+        Print("%1%2%3", FmtArg(ScenarioNames[(int)result.scenario]).Pad(12),
+              FmtArg(result.requests).Pad(-10), FmtArg(FmtDouble(result.rps, 1)).Pad(-12));
+        for (double percentile: { 50.0, 90.0, 99.0, 99.9 }) {
+            char buf[32];
+            Fmt(buf, "%1 us", latency.GetPercentile(percentile));
+
+            Print("%1", FmtArg(buf).Pad(-10));
+        }
+        if (result.bytes) {
+            double mbps = (double)result.bytes * 1000.0 / (double)config.duration / 1048576.0;
+            Print(" %!D..(%1 MiB/s)%!0", FmtDouble(mbps, 1));
+        }
+        if (result.errors) {
+            const char *label = (result.scenario == Scenario::Overload) ? "shed" : "errors";
+            Print(" %!R..%1 %2%!0", result.errors, label);
+        }
+        PrintLn();
+    }
+}
+
+static bool SaveResults(const char *filename, Span<const ScenarioResult> results)
+{
+    StreamWriter st(filename, (int)StreamWriterFlag::Atomic);
+    if (!st.IsValid())
+        return false;
+
+    for (const ScenarioResult &result: results) {
+        PrintLn(&st, "[%1]", ScenarioNames[(int)result.scenario]);
+        PrintLn(&st, "Requests = %1", result.requests);
+        PrintLn(&st, "Errors = %1", result.errors);
+        PrintLn(&st, "RPS = %1", (int64_t)result.rps);
+        PrintLn(&st, "P50 = %1", result.latency.GetPercentile(50.0));
+        PrintLn(&st, "P90 = %1", result.latency.GetPercentile(90.0));
+        PrintLn(&st, "P99 = %1", result.latency.GetPercentile(99.0));
+        PrintLn(&st, "P999 = %1", result.latency.GetPercentile(99.9));
+        PrintLn(&st);
+    }
+
+    return st.Close();
+}
+
+// Returns false if something regressed (or if the baseline cannot be read)
+static bool CompareBaseline(const char *filename, Span<const ScenarioResult> results)
+{
+    StreamReader st(filename);
+    if (!st.IsValid())
+        return false;
+
+    IniParser ini(&st);
+    ini.PushLogFilter();
+    RG_DEFER { PopLogFilter(); };
+
+    bool valid = true;
+    bool success = true;
+
+    IniProperty prop;
+    while (ini.Next(&prop)) {
+        Scenario scenario;
+        if (!OptionToEnumI(ScenarioNames, prop.section, &scenario)) {
+            LogError("Unknown scenario '%1'", prop.section);
+            valid = false;
+            continue;
+        }
+
+        const ScenarioResult *result = std::find_if(results.begin(), results.end(),
+                                                    [&](const ScenarioResult &result) { return result.scenario == scenario; });
+        if (result == results.end())
+            result = nullptr;
+
+        do {
+            int64_t value;
+            if (!ParseInt(prop.value, &value)) {
+                valid = false;
+                continue;
+            }
+
+            if (!result)
+                continue;
+
+            if (prop.key == "RPS") {
+                double min = (double)value * (1.0 - (double)config.tolerance / 100.0);
+
+                if (result->rps < min) {
+                    LogError("Scenario %1: RPS dropped from %2 to %3", ScenarioNames[(int)scenario],
+                             value, (int64_t)result->rps);
+                    success = false;
+                }
+            } else if (prop.key == "P99") {
+                int64_t p99 = result->latency.GetPercentile(99.0);
+                double max = (double)value * (1.0 + (double)config.tolerance / 100.0);
+
+                if ((double)p99 > max) {
+                    LogError("Scenario %1: p99 latency went up from %2 us to %3 us", ScenarioNames[(int)scenario],
+                             value, p99);
+                    success = false;
+                }
+            }
+        } while (ini.NextInSection(&prop));
+    }
+    if (!ini.IsValid() || !valid)
+        return false;
+
+    return success;
+}
+
+int Main(int argc, char **argv)
+{
+    RG_CRITICAL(argc >= 1, "First argument is missing");
+
+    BlockAllocator temp_alloc;
+
+    // Options
+    HeapArray<Scenario> scenarios;
+    const char *output_filename = nullptr;
+    const char *baseline_filename = nullptr;
+
+    const auto print_usage = [=](StreamWriter *st) {
+        PrintLn(st,
+R"(Usage: %!..+%1 [options] [scenario...]%!0
+
+Options:
+    %!..+-S, --sock_type <type>%!0       Change socket type (Unix, IPv4)
+                                 %!D..(default: Unix)%!0
+    %!..+-p, --port <port>%!0            Change web server port (IPv4)
+                                 %!D..(default: %2)%!0
+
+    %!..+-t, --threads <count>%!0        Set number of client threads
+                                 %!D..(default: %3)%!0
+    %!..+-c, --connections <count>%!0    Set number of keep-alive connections
+                                 %!D..(default: %4)%!0
+    %!..+-P, --pipeline <depth>%!0       Set requests in flight per connection
+                                 %!D..(default: %5, maximum: %6)%!0
+    %!..+-d, --duration <sec>%!0         Set measured duration of each scenario
+                                 %!D..(default: %7)%!0
+        %!..+--warmup <sec>%!0           Set warmup duration of each scenario
+                                 %!D..(default: %8)%!0
+
+        %!..+--server_threads <count>%!0 Set number of HTTP server threads
+        %!..+--async_threads <count>%!0  Set number of HTTP async threads
+        %!..+--download_size <size>%!0   Set size of each download
+                                 %!D..(default: %9)%!0
+        %!..+--upload_size <size>%!0     Set size of each upload
+                                 %!D..(default: %10)%!0
+        %!..+--slow_time <ms>%!0         Set time spent in slow requests (overload)
+                                 %!D..(default: %13 ms)%!0
+        %!..+--shed_target <ms>%!0       Set queue delay target for load shedding
+                                 %!D..(default: %14 ms, 0 to disable)%!0
+        %!..+--no_fast_lane%!0           Run health checks (overload) with normal priority
+
+    %!..+-o, --output <file>%!0          Save results to INI file
+    %!..+-B, --baseline <file>%!0        Fail if results regress compared to baseline file
+        %!..+--tolerance <percent>%!0    Set tolerance for regressions
+                                 %!D..(default: %11%%)%!0
+
+Available scenarios: %!..+%12%!0
+
+Scenarios run against an in-process reference handler, all of them by default.)",
+                FelixTarget, config.http.port, config.threads, config.connections, config.pipeline, MaxPipeline,
+                config.duration / 1000, config.warmup / 1000, config.download_size, config.upload_size,
+                config.tolerance, FmtSpan(ScenarioNames), config.slow_time, config.http.shed_target);
+    };
+
+    // Handle version
+    if (argc >= 2 && TestStr(argv[1], "--version")) {
+        PrintLn("%!R..%1%!0 %!..+%2%!0", FelixTarget, FelixVersion);
+        PrintLn("Compiler: %1", FelixCompiler);
+        return 0;
+    }
+
+    config.http.sock_type = SocketType::Unix;
+
+    // Parse arguments
+    {
+        OptionParser opt(argc, argv);
+
+        while (opt.Next()) {
+            if (opt.Test("--help")) {
+                print_usage(StdOut);
+                return 0;
+            } else if (opt.Test("-S", "--sock_type", OptionType::Value)) {
+                if (!OptionToEnumI(SocketTypeNames, opt.current_value, &config.http.sock_type)) {
+                    LogError("Unknown socket type '%1'", opt.current_value);
+                    return 1;
+                }
+                if (config.http.sock_type != SocketType::Unix && config.http.sock_type != SocketType::IPv4) {
+                    LogError("Only Unix and IPv4 sockets are supported");
+                    return 1;
+                }
+            } else if (opt.Test("-p", "--port", OptionType::Value)) {
+                if (!ParseInt(opt.current_value, &config.http.port))
+                    return 1;
+            } else if (opt.Test("-t", "--threads", OptionType::Value)) {
+                if (!ParseInt(opt.current_value, &config.threads))
+                    return 1;
+                if (config.threads < 1) {
+                    LogError("Client threads must be at least 1");
+                    return 1;
+                }
+            } else if (opt.Test("-c", "--connections", OptionType::Value)) {
+                if (!ParseInt(opt.current_value, &config.connections))
+                    return 1;
+                if (config.connections < 1) {
+                    LogError("Connection count must be at least 1");
+                    return 1;
+                }
+            } else if (opt.Test("-P", "--pipeline", OptionType::Value)) {
+                if (!ParseInt(opt.current_value, &config.pipeline))
+                    return 1;
+                if (config.pipeline < 1 || config.pipeline > MaxPipeline) {
+                    LogError("Pipeline depth must be between 1 and %1", MaxPipeline);
+                    return 1;
+                }
+            } else if (opt.Test("-d", "--duration", OptionType::Value)) {
+                if (!ParseDuration(opt.current_value, &config.duration))
+                    return 1;
+                if (!config.duration) {
+                    LogError("Duration cannot be zero");
+                    return 1;
+                }
+            } else if (opt.Test("--warmup", OptionType::Value)) {
+                if (!ParseDuration(opt.current_value, &config.warmup))
+                    return 1;
+            } else if (opt.Test("--server_threads", OptionType::Value)) {
+                if (!ParseInt(opt.current_value, &config.http.threads))
+                    return 1;
+            } else if (opt.Test("--async_threads", OptionType::Value)) {
+                if (!ParseInt(opt.current_value, &config.http.async_threads))
+                    return 1;
+            } else if (opt.Test("--download_size", OptionType::Value)) {
+                if (!ParseSize(opt.current_value, &config.download_size))
+                    return 1;
+            } else if (opt.Test("--upload_size", OptionType::Value)) {
+                if (!ParseSize(opt.current_value, &config.upload_size))
+                    return 1;
+            } else if (opt.Test("--slow_time", OptionType::Value)) {
+                if (!ParseInt(opt.current_value, &config.slow_time))
+                    return 1;
+            } else if (opt.Test("--shed_target", OptionType::Value)) {
+                if (!ParseInt(opt.current_value, &config.http.shed_target))
+                    return 1;
+            } else if (opt.Test("--no_fast_lane")) {
+                config.fast_lane = false;
+            } else if (opt.Test("-o", "--output", OptionType::Value)) {
+                output_filename = opt.current_value;
+            } else if (opt.Test("-B", "--baseline", OptionType::Value)) {
+                baseline_filename = opt.current_value;
+            } else if (opt.Test("--tolerance", OptionType::Value)) {
+                if (!ParseInt(opt.current_value, &config.tolerance))
+                    return 1;
+            } else {
+                opt.LogUnknownError();
+                return 1;
+            }
+        }
+
+        for (const char *arg = opt.ConsumeNonOption(); arg; arg = opt.ConsumeNonOption()) {
+            Scenario scenario;
+            if (!OptionToEnumI(ScenarioNames, arg, &scenario)) {
+                LogError("Unknown scenario '%1'", arg);
+                return 1;
+            }
+
+            scenarios.Append(scenario);
+        }
+
+        opt.LogUnusedArguments();
+    }
+
+    if (!scenarios.len) {
+        for (Size i = 0; i < RG_LEN(ScenarioNames); i++) {
+            scenarios.Append((Scenario)i);
+        }
+    }
+
+    blob.AppendDefault(Kibibytes(64));
+    FillRandomSafe(blob);
+
+    // Run reference server in a temporary directory (for the Unix socket)
+    const char *temp_directory = nullptr;
+    if (config.http.sock_type == SocketType::Unix) {
+        temp_directory = CreateUniqueDirectory(GetTemporaryDirectory(), "httpload", &temp_alloc);
+        if (!temp_directory)
+            return 1;
+
+        config.http.unix_path = Fmt(&temp_alloc, "%1%/http.sock", temp_directory).ptr;
+    }
+    RG_DEFER {
+        if (temp_directory) {
+            UnlinkFile(config.http.unix_path);
+            UnlinkDirectory(temp_directory);
+        }
+    };
+
+    // Each connection uses two descriptors (client and server)
+    config.http.max_connections = config.connections * 2 + 64;
+
+    http_Daemon daemon;
+    {
+        PushLogFilter([](LogLevel level, const char *ctx, const char *msg, FunctionRef<LogFunc> func) {
+            if (level != LogLevel::Info) {
+                func(level, ctx, msg);
+            }
+        });
+        RG_DEFER { PopLogFilter(); };
+
+        if (!daemon.Start(config.http, HandleRequest, false))
+            return 1;
+    }
+    RG_DEFER { daemon.Stop(); };
+
+    LogInfo("Running %1 scenarios with %2 connections (pipeline = %3) over %4 client threads",
+            scenarios.len, config.connections, config.pipeline, std::min(config.threads, config.connections));
+
+    HeapArray<ScenarioResult> results;
+    for (Scenario scenario: scenarios) {
+        ScenarioResult *result = results.AppendDefault();
+
+        if (!RunScenario(scenario, result)) {
+            LogError("Scenario %1 failed", ScenarioNames[(int)scenario]);
+            return 1;
+        }
+    }
+
+    PrintLn();
+    PrintResults(results);
+
+    if (output_filename && !SaveResults(output_filename, results))
+        return 1;
+    if (baseline_filename && !CompareBaseline(baseline_filename, results))
+        return 1;
+
+    return 0;
+}
+
+}
+
+// C++ namespaces are stupid
+int main(int argc, char **argv) { return RG::RunApp(argc, argv); }
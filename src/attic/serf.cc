@@ -151,7 +151,7 @@ static void ServeFile(const char *filename, const FileInfo &file_info, const htt
 
     // Send the file
     const char *mimetype = GetMimeType(GetPathExtension(filename));
-    io->AttachFile(200, filename, mimetype);
+    io->AttachFile(200, filename, mimetype, true);
     io->AddCachingHeaders(config.max_age, etag);
 }
 
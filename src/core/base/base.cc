@@ -95,6 +95,9 @@
 #endif
 #ifdef __linux__
     #include <sys/syscall.h>
+    #if __has_include(<linux/io_uring.h>)
+        #include <linux/io_uring.h>
+    #endif
 #endif
 #ifdef __APPLE__
     #include <sys/random.h>
@@ -128,8 +131,11 @@ namespace RG {
     const char *FelixCompiler = "????";
 #endif
 
+static void FlushLogFatal();
+
 extern "C" void AssertMessage(const char *filename, int line, const char *cond)
 {
+    FlushLogFatal();
     Print(StdErr, "%1:%2: Assertion '%3' failed\n", filename, line, cond);
 }
 
@@ -187,9 +193,126 @@ Allocator *GetDefaultAllocator()
     return default_allocator;
 }
 
+#ifdef __linux__
+
+// Allocations big enough are mapped separately, aligned on huge page boundaries, and
+// marked with MADV_HUGEPAGE. Each allocation starts with a header so we can release
+// it without knowing its size (LinkedAllocator::ReleaseAll does that).
+class HugePageAllocator: public Allocator {
+    struct Header {
+        Size mapped; // 0 for small allocations made with malloc
+        Size size;
+    };
+    static_assert(RG_SIZE(Header) == 16);
+
+protected:
+    void *Allocate(Size size, unsigned int flags) override
+    {
+        Header *header;
+
+        // Don't waste most of a huge page on allocations that are too small
+        if (RG_SIZE(Header) + size >= RG_HUGE_PAGE_SIZE * 3 / 4) {
+            Size len = AlignLen(RG_SIZE(Header) + size, RG_HUGE_PAGE_SIZE);
+
+            // Map more than needed so we can align the start on a huge page
+            uint8_t *raw = (uint8_t *)mmap(nullptr, (size_t)(len + RG_HUGE_PAGE_SIZE), PROT_READ | PROT_WRITE,
+                                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            RG_CRITICAL(raw != MAP_FAILED, "Failed to allocate %1 of memory: %2", FmtMemSize(len), strerror(errno));
+
+            uint8_t *ptr = AlignUp(raw, RG_HUGE_PAGE_SIZE);
+            Size head = ptr - raw;
+            Size tail = RG_HUGE_PAGE_SIZE - head;
+
+            if (head) {
+                munmap(raw, (size_t)head);
+            }
+            if (tail) {
+                munmap(ptr + len, (size_t)tail);
+            }
+
+#ifdef MADV_HUGEPAGE
+            madvise(ptr, (size_t)len, MADV_HUGEPAGE);
+#endif
+
+            header = (Header *)ptr;
+            header->mapped = len;
+            header->size = size;
+
+            // Fresh mappings are zeroed by the kernel
+        } else {
+            header = (Header *)malloc((size_t)(RG_SIZE(Header) + size));
+            RG_CRITICAL(header, "Failed to allocate %1 of memory", FmtMemSize(size));
+
+            header->mapped = 0;
+            header->size = size;
+
+            if (flags & (int)AllocFlag::Zero) {
+                MemSet(header + 1, 0, size);
+            }
+        }
+
+        return header + 1;
+    }
+
+    void *Resize(void *ptr, Size old_size, Size new_size, unsigned int flags) override
+    {
+        if (!ptr) {
+            ptr = Allocate(new_size, flags);
+        } else if (!new_size) {
+            Release(ptr, old_size);
+            ptr = nullptr;
+        } else {
+            Header *header = (Header *)ptr - 1;
+            old_size = header->size;
+
+            void *new_ptr = Allocate(new_size, flags & ~(int)AllocFlag::Zero);
+            MemCpy(new_ptr, ptr, std::min(old_size, new_size));
+
+            if ((flags & (int)AllocFlag::Zero) && new_size > old_size) {
+                MemSet((uint8_t *)new_ptr + old_size, 0, new_size - old_size);
+            }
+
+            Release(ptr, old_size);
+            ptr = new_ptr;
+        }
+
+        return ptr;
+    }
+
+    void Release(const void *ptr, Size) override
+    {
+        if (!ptr)
+            return;
+
+        Header *header = (Header *)ptr - 1;
+
+        if (header->mapped) {
+            munmap(header, (size_t)header->mapped);
+        } else {
+            free(header);
+        }
+    }
+};
+
+Allocator *GetHugePageAllocator()
+{
+    static Allocator *huge_allocator = new HugePageAllocator;
+    return huge_allocator;
+}
+
+#else
+
+Allocator *GetHugePageAllocator()
+{
+    return GetDefaultAllocator();
+}
+
+#endif
+
 LinkedAllocator& LinkedAllocator::operator=(LinkedAllocator &&other)
 {
     ReleaseAll();
+    allocator = other.allocator;
     list = other.list;
     other.list = {};
 
@@ -293,16 +416,31 @@ void *BlockAllocatorBase::Allocate(Size size, unsigned int flags)
 
     if (AllocateSeparately(aligned_size)) {
         uint8_t *ptr = (uint8_t *)AllocateRaw(alloc, size, flags);
+
+        stats.separate++;
+        stats.separate_bytes += size;
+
         return ptr;
     } else {
-        if (!current_bucket || (current_bucket->used + aligned_size) > block_size) {
-            current_bucket = (Bucket *)AllocateRaw(alloc, RG_SIZE(Bucket) + block_size,
+        if (!current_bucket || (current_bucket->used + aligned_size) > current_bucket->size) {
+            if (current_bucket) {
+                stats.waste_bytes += current_bucket->size - current_bucket->used;
+            }
+
+            current_bucket = (Bucket *)AllocateRaw(alloc, RG_SIZE(Bucket) + next_block_size,
                                                    flags & ~(int)AllocFlag::Zero);
             current_bucket->used = 0;
+            current_bucket->size = next_block_size;
+
+            stats.blocks++;
+            stats.block_bytes += next_block_size;
+
+            next_block_size = std::min(next_block_size * 2, max_block_size);
         }
 
         uint8_t *ptr = current_bucket->data + current_bucket->used;
         current_bucket->used += aligned_size;
+        stats.used_bytes += aligned_size;
 
         if (flags & (int)AllocFlag::Zero) {
             MemSet(ptr, 0, size);
@@ -332,9 +470,10 @@ void *BlockAllocatorBase::Resize(void *ptr, Size old_size, Size new_size, unsign
 
         // Try fast path
         if (ptr && ptr == last_alloc &&
-                (current_bucket->used + aligned_delta) <= block_size &&
+                (current_bucket->used + aligned_delta) <= current_bucket->size &&
                 !AllocateSeparately(aligned_new_size)) {
             current_bucket->used += aligned_delta;
+            stats.used_bytes += aligned_delta;
 
             if ((flags & (int)AllocFlag::Zero) && new_size > old_size) {
                 MemSet((uint8_t *)ptr + old_size, 0, new_size - old_size);
@@ -342,13 +481,15 @@ void *BlockAllocatorBase::Resize(void *ptr, Size old_size, Size new_size, unsign
         } else if (AllocateSeparately(aligned_old_size)) {
             LinkedAllocator *alloc = GetAllocator();
             ptr = ResizeRaw(alloc, ptr, old_size, new_size, flags);
+
+            stats.separate_bytes += new_size - old_size;
         } else {
             void *new_ptr = Allocate(new_size, flags & ~(int)AllocFlag::Zero);
             if (new_size > old_size) {
                 MemCpy(new_ptr, ptr, old_size);
 
                 if (flags & (int)AllocFlag::Zero) {
-                    MemSet((uint8_t *)ptr + old_size, 0, new_size - old_size);
+                    MemSet((uint8_t *)new_ptr + old_size, 0, new_size - old_size);
                 }
             } else {
                 MemCpy(new_ptr, ptr, new_size);
@@ -372,15 +513,22 @@ void BlockAllocatorBase::Release(const void *ptr, Size size)
 
         if (ptr == last_alloc) {
             current_bucket->used -= aligned_size;
+            stats.used_bytes -= aligned_size;
 
             if (!current_bucket->used) {
-                ReleaseRaw(alloc, current_bucket, RG_SIZE(Bucket) + block_size);
+                stats.blocks--;
+                stats.block_bytes -= current_bucket->size;
+
+                ReleaseRaw(alloc, current_bucket, RG_SIZE(Bucket) + current_bucket->size);
                 current_bucket = nullptr;
             }
 
             last_alloc = nullptr;
         } else if (AllocateSeparately(aligned_size)) {
             ReleaseRaw(alloc, ptr, size);
+
+            stats.separate--;
+            stats.separate_bytes -= size;
         }
     }
 }
@@ -388,14 +536,37 @@ void BlockAllocatorBase::Release(const void *ptr, Size size)
 void BlockAllocatorBase::CopyFrom(BlockAllocatorBase *other)
 {
     block_size = other->block_size;
+    max_block_size = other->max_block_size;
+    next_block_size = other->next_block_size;
     current_bucket = other->current_bucket;
     last_alloc = other->last_alloc;
+    stats = other->stats;
 }
 
 void BlockAllocatorBase::ForgetCurrentBlock()
 {
+    next_block_size = block_size;
     current_bucket = nullptr;
     last_alloc = nullptr;
+    stats = {};
+}
+
+// Leave room for the headers (huge page allocator, linked allocator and bucket)
+static Size AdjustHugeBlockSize(Size max_block_size, unsigned int flags)
+{
+    if (flags & (int)BlockAllocatorFlag::HugePages) {
+        max_block_size = AlignLen(max_block_size, RG_HUGE_PAGE_SIZE) - 64;
+    }
+
+    return max_block_size;
+}
+
+BlockAllocator::BlockAllocator(Size block_size, Size max_block_size, unsigned int flags)
+    : BlockAllocatorBase(block_size, AdjustHugeBlockSize(max_block_size, flags))
+{
+    if (flags & (int)BlockAllocatorFlag::HugePages) {
+        allocator = LinkedAllocator(GetHugePageAllocator());
+    }
 }
 
 BlockAllocator& BlockAllocator::operator=(BlockAllocator &&other)
@@ -426,6 +597,312 @@ void IndirectBlockAllocator::ReleaseAll()
     allocator->ReleaseAll();
 }
 
+static const Size PoolSlabHeader = 64;
+static const Size PoolMaxSize = 8192;
+static const int PoolClassCount = 32;
+
+// Slabs are aligned on RG_POOL_ALLOCATOR_SLAB_SIZE, so we can find the slab (and the owner
+// heap) from any pointer. Large allocations use the same header, with a null heap.
+struct PoolSlab {
+    PoolHeap *heap;
+    int class_idx;
+    Size used;
+    Size size;
+
+    PoolSlab *prev;
+    PoolSlab *next;
+};
+static_assert(RG_SIZE(PoolSlab) <= PoolSlabHeader);
+
+class PoolHeap {
+public:
+    const void *owner; // Address of thread-local marker
+    PoolHeap *next;
+
+    void *free_lists[PoolClassCount] = {};
+    PoolSlab *current[PoolClassCount] = {};
+    PoolSlab *slabs = nullptr;
+
+    // Objects released by other threads, linked through their first bytes
+    std::atomic<void *> remote { nullptr };
+};
+
+struct PoolHeapCache {
+    int64_t id;
+    PoolHeap *heap;
+};
+
+static std::atomic<int64_t> pool_next_id { 1 };
+
+// A new thread can reuse the marker address of a dead thread, and will take over its heaps
+static thread_local char pool_thread_marker;
+static thread_local PoolHeapCache pool_heap_cache[4];
+
+// 16 to 128 bytes by steps of 16, then 4 classes for each power-of-two up to 8 kiB
+static int GetPoolClass(Size size)
+{
+    if (size <= 128)
+        return (int)std::max((size + 15) / 16 - 1, (Size)0);
+
+    int bits = 64 - CountLeadingZeros((uint64_t)(size - 1));
+    Size step = (Size)1 << (bits - 3);
+    int sub = (int)((size - 1 - ((Size)1 << (bits - 1))) / step);
+
+    return 8 + (bits - 8) * 4 + sub;
+}
+
+static Size GetPoolClassSize(int class_idx)
+{
+    if (class_idx < 8)
+        return (class_idx + 1) * 16;
+
+    Size base = (Size)128 << ((class_idx - 8) / 4);
+    Size sub = (class_idx - 8) % 4;
+
+    return base + (sub + 1) * (base / 4);
+}
+
+static PoolSlab *AllocatePoolSlab(Size size)
+{
+    void *ptr = nullptr;
+
+#ifdef _WIN32
+    ptr = _aligned_malloc((size_t)size, (size_t)RG_POOL_ALLOCATOR_SLAB_SIZE);
+#else
+    if (posix_memalign(&ptr, (size_t)RG_POOL_ALLOCATOR_SLAB_SIZE, (size_t)size) != 0) {
+        ptr = nullptr;
+    }
+#endif
+    RG_CRITICAL(ptr, "Failed to allocate %1 of memory", FmtMemSize(size));
+
+    return (PoolSlab *)ptr;
+}
+
+static void ReleasePoolSlab(PoolSlab *slab)
+{
+#ifdef _WIN32
+    _aligned_free(slab);
+#else
+    free(slab);
+#endif
+}
+
+static inline PoolSlab *PointerToSlab(const void *ptr)
+{
+    return (PoolSlab *)((uintptr_t)ptr & ~(uintptr_t)(RG_POOL_ALLOCATOR_SLAB_SIZE - 1));
+}
+
+PoolAllocator::PoolAllocator()
+    : id(pool_next_id++)
+{
+    static_assert(!(RG_POOL_ALLOCATOR_SLAB_SIZE & (RG_POOL_ALLOCATOR_SLAB_SIZE - 1)));
+    static_assert(RG_POOL_ALLOCATOR_SLAB_SIZE >= 2 * PoolMaxSize);
+}
+
+PoolAllocator::~PoolAllocator()
+{
+    while (heaps) {
+        PoolHeap *heap = heaps;
+        heaps = heap->next;
+
+        while (heap->slabs) {
+            PoolSlab *slab = heap->slabs;
+            heap->slabs = slab->next;
+
+            ReleasePoolSlab(slab);
+        }
+
+        delete heap;
+    }
+
+    while (large) {
+        PoolSlab *slab = large;
+        large = slab->next;
+
+        ReleasePoolSlab(slab);
+    }
+}
+
+void *PoolAllocator::Allocate(Size size, unsigned int flags)
+{
+    RG_ASSERT(size >= 0);
+
+    void *ptr;
+
+    if (size > PoolMaxSize) {
+        PoolSlab *slab = AllocatePoolSlab(PoolSlabHeader + size);
+
+        slab->heap = nullptr;
+        slab->class_idx = -1;
+        slab->size = size;
+        slab->prev = nullptr;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            slab->next = large;
+            if (large) {
+                large->prev = slab;
+            }
+            large = slab;
+        }
+
+        ptr = (uint8_t *)slab + PoolSlabHeader;
+    } else {
+        PoolHeap *heap = GetHeap();
+        int class_idx = GetPoolClass(size);
+
+        // Take back everything other threads have released before we grow
+        if (!heap->free_lists[class_idx]) [[unlikely]] {
+            void *remote = heap->remote.exchange(nullptr, std::memory_order_acquire);
+
+            while (remote) {
+                void *next = *(void **)remote;
+                PoolSlab *slab = PointerToSlab(remote);
+
+                *(void **)remote = heap->free_lists[slab->class_idx];
+                heap->free_lists[slab->class_idx] = remote;
+
+                remote = next;
+            }
+        }
+
+        ptr = heap->free_lists[class_idx];
+
+        if (ptr) [[likely]] {
+            heap->free_lists[class_idx] = *(void **)ptr;
+        } else {
+            Size class_size = GetPoolClassSize(class_idx);
+            PoolSlab *slab = heap->current[class_idx];
+
+            if (!slab || slab->used + class_size > RG_POOL_ALLOCATOR_SLAB_SIZE) {
+                slab = AllocatePoolSlab(RG_POOL_ALLOCATOR_SLAB_SIZE);
+
+                slab->heap = heap;
+                slab->class_idx = class_idx;
+                slab->used = PoolSlabHeader;
+                slab->size = class_size;
+                slab->prev = nullptr;
+                slab->next = heap->slabs;
+
+                heap->slabs = slab;
+                heap->current[class_idx] = slab;
+            }
+
+            ptr = (uint8_t *)slab + slab->used;
+            slab->used += class_size;
+        }
+    }
+
+    if (flags & (int)AllocFlag::Zero) {
+        MemSet(ptr, 0, size);
+    }
+
+    return ptr;
+}
+
+void *PoolAllocator::Resize(void *ptr, Size old_size, Size new_size, unsigned int flags)
+{
+    RG_ASSERT(new_size >= 0);
+
+    if (!ptr) {
+        ptr = Allocate(new_size, flags);
+    } else if (!new_size) {
+        Release(ptr, old_size);
+        ptr = nullptr;
+    } else {
+        PoolSlab *slab = PointerToSlab(ptr);
+
+        // Slab size is the class size for small objects, and the capacity of large ones
+        if (old_size < 0) {
+            old_size = slab->size;
+        }
+
+        bool fits;
+        if (slab->heap) {
+            fits = (new_size <= PoolMaxSize && GetPoolClass(new_size) == slab->class_idx);
+        } else {
+            fits = (new_size > PoolMaxSize && new_size <= slab->size);
+        }
+
+        if (!fits) {
+            void *new_ptr = Allocate(new_size, flags & ~(int)AllocFlag::Zero);
+            MemCpy(new_ptr, ptr, std::min(old_size, new_size));
+            Release(ptr, old_size);
+
+            ptr = new_ptr;
+        }
+
+        if ((flags & (int)AllocFlag::Zero) && new_size > old_size) {
+            MemSet((uint8_t *)ptr + old_size, 0, new_size - old_size);
+        }
+    }
+
+    return ptr;
+}
+
+void PoolAllocator::Release(const void *ptr, Size)
+{
+    if (!ptr)
+        return;
+
+    PoolSlab *slab = PointerToSlab(ptr);
+    PoolHeap *heap = slab->heap;
+
+    if (!heap) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (slab->next) {
+            slab->next->prev = slab->prev;
+        }
+        if (slab->prev) {
+            slab->prev->next = slab->next;
+        } else {
+            large = slab->next;
+        }
+
+        ReleasePoolSlab(slab);
+    } else if (heap->owner == &pool_thread_marker) {
+        *(void **)ptr = heap->free_lists[slab->class_idx];
+        heap->free_lists[slab->class_idx] = (void *)ptr;
+    } else {
+        void *head = heap->remote.load(std::memory_order_relaxed);
+
+        do {
+            *(void **)ptr = head;
+        } while (!heap->remote.compare_exchange_weak(head, (void *)ptr, std::memory_order_release,
+                                                                         std::memory_order_relaxed));
+    }
+}
+
+PoolHeap *PoolAllocator::GetHeap()
+{
+    PoolHeapCache *cache = &pool_heap_cache[id % RG_LEN(pool_heap_cache)];
+
+    if (cache->id == id) [[likely]]
+        return cache->heap;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    PoolHeap *heap = heaps;
+    while (heap && heap->owner != &pool_thread_marker) {
+        heap = heap->next;
+    }
+
+    if (!heap) {
+        heap = new PoolHeap;
+
+        heap->owner = &pool_thread_marker;
+        heap->next = heaps;
+        heaps = heap;
+    }
+
+    cache->id = id;
+    cache->heap = heap;
+
+    return heap;
+}
+
 #if defined(_WIN32)
 
 bool LockMemory(void *ptr, Size len)
@@ -684,6 +1161,41 @@ TimeSpec DecomposeTime(int64_t time, TimeMode mode)
 // Strings
 // ------------------------------------------------------------------------
 
+Size SplitFields(Span<const char> str, char sep, Span<Span<const char>> out_fields)
+{
+    RG_ASSERT(out_fields.len > 0);
+
+    Size count = 0;
+    Size start = 0;
+    Size i = 0;
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(__aarch64__)
+    // Most lines are short, so 64-byte blocks would not help much
+    for (; i + 16 <= str.len && count + 1 < out_fields.len; i += 16) {
+        uint32_t mask = MatchChars16(str.ptr + i, sep, sep);
+
+        while (mask && count + 1 < out_fields.len) {
+            Size end = i + CountTrailingZeros(mask);
+
+            out_fields[count++] = str.Take(start, end - start);
+            start = end + 1;
+
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    for (; i < str.len && count + 1 < out_fields.len; i++) {
+        if (str[i] == sep) {
+            out_fields[count++] = str.Take(start, i - start);
+            start = i + 1;
+        }
+    }
+
+    out_fields[count++] = str.Take(start, str.len - start);
+    return count;
+}
+
 bool CopyString(const char *str, Span<char> buf)
 {
 #ifdef RG_DEBUG
@@ -743,7 +1255,7 @@ static const char DigitPairs[201] = "0001020304050607080910111213141516171819202
                                     "50515253545556575859606162636465666768697071727374"
                                     "75767778798081828384858687888990919293949596979899";
 
-static Span<char> FormatUnsignedToDecimal(uint64_t value, char out_buf[32])
+Span<char> FormatUnsignedToDecimal(uint64_t value, char out_buf[32])
 {
     Size offset = 32;
     {
@@ -1019,7 +1531,7 @@ static inline void ProcessArg(const FmtArg &arg, AppendFunc append)
                         out_buf.Append('-');
                     }
 
-                    out_buf.Append(FormatUnsignedToDecimal((uint64_t)-arg.u.i, num_buf));
+                    out_buf.Append(FormatUnsignedToDecimal(-(uint64_t)arg.u.i, num_buf));
                     out = out_buf;
                 } else {
                     out = FormatUnsignedToDecimal((uint64_t)arg.u.i, num_buf);
@@ -1568,6 +2080,16 @@ static inline bool FormatBufferWithVt100()
     return use_vt100;
 }
 
+bool FmtUseVt100()
+{
+    return FormatBufferWithVt100();
+}
+
+void FmtArgument(const FmtArg &arg, FunctionRef<void(Span<const char>)> append)
+{
+    ProcessArg(arg, append);
+}
+
 Span<char> FmtFmt(const char *fmt, Span<const FmtArg> args, Span<char> out_buf)
 {
     RG_ASSERT(out_buf.len >= 0);
@@ -1732,15 +2254,336 @@ const char *DebugLogContext(const char *filename, int line)
 }
 #endif
 
-static void RunLogFilter(Size idx, LogLevel level, const char *ctx, const char *msg)
-{
-    const std::function<LogFilterFunc> &func = *log_filters[idx];
+#ifndef __wasi__
 
-    func(level, ctx, msg, [&](LogLevel level, const char *ctx, const char *msg) {
+struct LogRing {
+    Span<uint8_t> buf;
+
+    // Head is only written by the producer, tail by the consumer
+    std::atomic<Size> head { 0 };
+    std::atomic<Size> tail { 0 };
+
+    std::atomic<Size> dropped { 0 };
+    std::atomic_bool released { false };
+};
+
+struct LogRecord {
+    LogLevel level;
+    Size ctx_len; // -1 when there is no context
+    Size msg_len;
+};
+
+static std::atomic_bool log_async { false };
+static std::atomic_int log_producers { 0 };
+static std::mutex log_rings_mutex;
+static HeapArray<LogRing *> log_rings;
+
+// Held by whoever calls the log handler and drains rings
+static std::mutex log_handler_mutex;
+static thread_local bool log_draining = false;
+
+static std::thread log_thread;
+static std::mutex log_thread_mutex;
+static std::condition_variable log_thread_cv;
+static bool log_thread_stop = false;
+
+static thread_local LogRing *log_ring = nullptr;
+static thread_local bool log_ring_released = false;
+
+#ifndef __MINGW32__
+// Let the consumer free the ring once everything has been written. Other thread-local
+// destructors may still log after this one runs, these messages are written synchronously.
+struct LogRingGuard {
+    ~LogRingGuard()
+    {
+        if (log_ring) {
+            log_ring->released = true;
+            log_ring = nullptr;
+        }
+        log_ring_released = true;
+    }
+};
+static thread_local LogRingGuard log_ring_guard;
+#endif
+
+static void CopyToRing(LogRing *ring, Size pos, const void *ptr, Size len)
+{
+    Size offset = pos & (ring->buf.len - 1);
+    Size len1 = std::min(len, ring->buf.len - offset);
+
+    MemCpy(ring->buf.ptr + offset, ptr, len1);
+    MemCpy(ring->buf.ptr, (const uint8_t *)ptr + len1, len - len1);
+}
+
+static void CopyFromRing(const LogRing *ring, Size pos, void *out_ptr, Size len)
+{
+    Size offset = pos & (ring->buf.len - 1);
+    Size len1 = std::min(len, ring->buf.len - offset);
+
+    MemCpy(out_ptr, ring->buf.ptr + offset, len1);
+    MemCpy((uint8_t *)out_ptr + len1, ring->buf.ptr, len - len1);
+}
+
+static bool PushLogRecord(LogLevel level, const char *ctx, const char *msg)
+{
+    if (!log_ring) [[unlikely]] {
+        LogRing *ring = new LogRing;
+        ring->buf = MakeSpan((uint8_t *)AllocateRaw(nullptr, RG_ASYNC_LOG_BUFFER_SIZE), RG_ASYNC_LOG_BUFFER_SIZE);
+
+        std::lock_guard<std::mutex> lock(log_rings_mutex);
+        log_rings.Append(ring);
+
+        log_ring = ring;
+#ifndef __MINGW32__
+        (void)&log_ring_guard;
+#endif
+    }
+
+    LogRecord record = { level, ctx ? (Size)strlen(ctx) : -1, (Size)strlen(msg) };
+    Size len = AlignLen(RG_SIZE(record) + std::max(record.ctx_len, (Size)0) + record.msg_len, 8);
+
+    Size head = log_ring->head.load(std::memory_order_relaxed);
+    Size tail = log_ring->tail.load(std::memory_order_acquire);
+
+    if (len > log_ring->buf.len - (head - tail)) {
+        log_ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    CopyToRing(log_ring, head, &record, RG_SIZE(record));
+    if (ctx) {
+        CopyToRing(log_ring, head + RG_SIZE(record), ctx, record.ctx_len);
+    }
+    CopyToRing(log_ring, head + RG_SIZE(record) + std::max(record.ctx_len, (Size)0), msg, record.msg_len);
+
+    log_ring->head.store(head + len, std::memory_order_release);
+
+    return true;
+}
+
+// Call with log_handler_mutex locked
+static void DrainLogRings()
+{
+    HeapArray<char> buf;
+
+    log_draining = true;
+    RG_DEFER { log_draining = false; };
+
+    // The handler may log something, don't hold log_rings_mutex while calling it.
+    // Only drainers free rings, so these pointers stay valid.
+    HeapArray<LogRing *> rings;
+    {
+        std::lock_guard<std::mutex> lock(log_rings_mutex);
+        rings.Append(log_rings);
+    }
+
+    for (LogRing *ring: rings) {
+        Size tail = ring->tail.load(std::memory_order_relaxed);
+        Size head = ring->head.load(std::memory_order_acquire);
+
+        while (tail < head) {
+            LogRecord record;
+            CopyFromRing(ring, tail, &record, RG_SIZE(record));
+
+            Size ctx_len = std::max(record.ctx_len, (Size)0);
+            Size len = AlignLen(RG_SIZE(record) + ctx_len + record.msg_len, 8);
+
+            buf.RemoveFrom(0);
+            buf.Grow(ctx_len + record.msg_len + 2);
+            CopyFromRing(ring, tail + RG_SIZE(record), buf.ptr, ctx_len + record.msg_len);
+
+            char *ctx = buf.ptr;
+            char *msg = buf.ptr + ctx_len + 1;
+            MemMove(msg, buf.ptr + ctx_len, record.msg_len);
+            ctx[ctx_len] = 0;
+            msg[record.msg_len] = 0;
+
+            log_handler(record.level, record.ctx_len >= 0 ? ctx : nullptr, msg);
+
+            tail += len;
+        }
+        ring->tail.store(tail, std::memory_order_release);
+
+        Size dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+        if (dropped) {
+            char msg[128];
+            Fmt(msg, "Dropped %1 log messages (buffer is full)", dropped);
+
+            log_handler(LogLevel::Warning, "Warning: ", msg);
+        }
+    }
+
+    // Free rings of dead threads
+    {
+        std::lock_guard<std::mutex> lock(log_rings_mutex);
+
+        Size j = 0;
+        for (Size i = 0; i < log_rings.len; i++) {
+            LogRing *ring = log_rings[i];
+            log_rings[j] = ring;
+
+            if (ring->released && ring->tail == ring->head) {
+                ReleaseRaw(nullptr, ring->buf.ptr, ring->buf.len);
+                delete ring;
+            } else {
+                j++;
+            }
+        }
+        log_rings.len = j;
+    }
+}
+
+static void EmitLog(LogLevel level, const char *ctx, const char *msg)
+{
+    // The log thread already holds the handler lock
+    if (log_draining) {
+        log_handler(level, ctx, msg);
+        return;
+    }
+
+    if (!log_ring_released) {
+        // DisableAsyncLog() waits for producers to be done before the final flush, which
+        // works because both sides use sequentially consistent operations.
+        log_producers++;
+
+        if (log_async) {
+            bool pushed = PushLogRecord(level, ctx, msg);
+            log_producers--;
+
+            if (pushed) {
+                if (level == LogLevel::Error) {
+                    log_thread_cv.notify_one();
+                }
+                return;
+            }
+
+            // Errors are never dropped, write everything we have and this one synchronously
+            if (level == LogLevel::Error) {
+                log_ring->dropped.fetch_sub(1, std::memory_order_relaxed);
+
+                std::lock_guard<std::mutex> lock(log_handler_mutex);
+                DrainLogRings();
+                log_handler(level, ctx, msg);
+            }
+
+            return;
+        }
+
+        log_producers--;
+    }
+
+    // Synchronous mode, or the ring of this thread is gone (thread exit)
+    std::lock_guard<std::mutex> lock(log_handler_mutex);
+    if (log_async.load(std::memory_order_relaxed)) {
+        DrainLogRings();
+    }
+    log_handler(level, ctx, msg);
+}
+
+bool EnableAsyncLog()
+{
+    static_assert(!(RG_ASYNC_LOG_BUFFER_SIZE & (RG_ASYNC_LOG_BUFFER_SIZE - 1)));
+
+    if (log_async)
+        return true;
+
+    static bool registered = false;
+    if (!registered) {
+        atexit(DisableAsyncLog);
+        registered = true;
+    }
+
+    log_thread_stop = false;
+    log_thread = std::thread([]() {
+        std::unique_lock<std::mutex> lock(log_thread_mutex);
+
+        while (!log_thread_stop) {
+            log_thread_cv.wait_for(lock, std::chrono::milliseconds(RG_ASYNC_LOG_DELAY));
+
+            lock.unlock();
+            {
+                std::lock_guard<std::mutex> lock(log_handler_mutex);
+                DrainLogRings();
+            }
+            lock.lock();
+        }
+    });
+
+    log_async = true;
+
+    return true;
+}
+
+void DisableAsyncLog()
+{
+    if (!log_async)
+        return;
+
+    log_async = false;
+
+    // Threads that saw log_async before we cleared it may still be pushing records,
+    // wait for them so the final flush gets everything.
+    while (log_producers) {
+        std::this_thread::yield();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(log_thread_mutex);
+        log_thread_stop = true;
+    }
+    log_thread_cv.notify_one();
+    log_thread.join();
+
+    FlushLog();
+}
+
+void FlushLog()
+{
+    if (log_draining)
+        return;
+
+    std::lock_guard<std::mutex> lock(log_handler_mutex);
+    DrainLogRings();
+}
+
+static void FlushLogFatal()
+{
+    // Don't deadlock if we crash while holding the lock
+    if (log_draining || !log_handler_mutex.try_lock())
+        return;
+    RG_DEFER { log_handler_mutex.unlock(); };
+
+    DrainLogRings();
+}
+
+#else
+
+static void EmitLog(LogLevel level, const char *ctx, const char *msg)
+{
+    log_handler(level, ctx, msg);
+}
+
+bool EnableAsyncLog()
+{
+    LogError("Asynchronous logging is not supported on this platform");
+    return false;
+}
+
+void DisableAsyncLog() {}
+void FlushLog() {}
+static void FlushLogFatal() {}
+
+#endif
+
+static void RunLogFilter(Size idx, LogLevel level, const char *ctx, const char *msg)
+{
+    const std::function<LogFilterFunc> &func = *log_filters[idx];
+
+    func(level, ctx, msg, [&](LogLevel level, const char *ctx, const char *msg) {
         if (idx > 0) {
             RunLogFilter(idx - 1, level, ctx, msg);
         } else {
-            log_handler(level, ctx, msg);
+            EmitLog(level, ctx, msg);
         }
     });
 }
@@ -1782,20 +2625,20 @@ void LogFmt(LogLevel level, const char *ctx, const char *fmt, Span<const FmtArg>
         }
     }
 
-#ifndef __wasi__
-    static std::mutex mutex;
-    std::unique_lock<std::mutex> lock(mutex);
-#endif
-
+    // Filters are thread-local, so we only need to serialize handler calls, which
+    // EmitLog() does with log_handler_mutex (or defers to the log thread).
     if (log_filters_len) {
         RunLogFilter(log_filters_len - 1, level, ctx, msg_buf);
     } else {
-        log_handler(level, ctx, msg_buf);
+        EmitLog(level, ctx, msg_buf);
     }
 }
 
 void SetLogHandler(const std::function<LogFunc> &func)
 {
+#ifndef __wasi__
+    std::lock_guard<std::mutex> lock(log_handler_mutex);
+#endif
     log_handler = func;
 }
 
@@ -2177,32 +3020,33 @@ static FileType FileModeToType(mode_t mode)
     }
 }
 
-StatResult StatFile(const char *filename, unsigned int flags, FileInfo *out_info)
-{
 #if defined(__linux__) && defined(STATX_TYPE) && !defined(CORE_NO_STATX)
-    int stat_flags = (flags & (int)StatFlag::FollowSymlink) ? 0 : AT_SYMLINK_NOFOLLOW;
-    int stat_mask = STATX_TYPE | STATX_MODE | STATX_MTIME | STATX_BTIME | STATX_SIZE;
 
-    struct statx sxb;
-    if (statx(AT_FDCWD, filename, stat_flags, stat_mask, &sxb) < 0) {
-        switch (errno) {
-            case ENOENT: {
-                if (!(flags & (int)StatFlag::IgnoreMissing)) {
-                    LogError("Cannot stat '%1': %2", filename, strerror(errno));
-                }
-                return StatResult::MissingPath;
-            } break;
-            case EACCES: {
-                LogError("Cannot stat '%1': %2", filename, strerror(errno));
-                return StatResult::AccessDenied;
-            } break;
-            default: {
-                LogError("Cannot stat '%1': %2", filename, strerror(errno));
-                return StatResult::OtherError;
-            } break;
-        }
+// Shared with IoBatch, which runs statx through io_uring
+static const int StatxMask = STATX_TYPE | STATX_MODE | STATX_MTIME | STATX_BTIME | STATX_SIZE;
+
+static StatResult HandleStatxError(const char *filename, unsigned int flags, int err)
+{
+    switch (err) {
+        case ENOENT: {
+            if (!(flags & (int)StatFlag::IgnoreMissing)) {
+                LogError("Cannot stat '%1': %2", filename, strerror(err));
+            }
+            return StatResult::MissingPath;
+        } break;
+        case EACCES: {
+            LogError("Cannot stat '%1': %2", filename, strerror(err));
+            return StatResult::AccessDenied;
+        } break;
+        default: {
+            LogError("Cannot stat '%1': %2", filename, strerror(err));
+            return StatResult::OtherError;
+        } break;
     }
+}
 
+static void ConvertStatx(const struct statx &sxb, FileInfo *out_info)
+{
     out_info->type = FileModeToType(sxb.stx_mode);
     out_info->size = (int64_t)sxb.stx_size;
     out_info->mtime = (int64_t)sxb.stx_mtime.tv_sec * 1000 +
@@ -2216,6 +3060,20 @@ StatResult StatFile(const char *filename, unsigned int flags, FileInfo *out_info
     out_info->mode = (unsigned int)sxb.stx_mode & ~S_IFMT;
     out_info->uid = sxb.stx_uid;
     out_info->gid = sxb.stx_gid;
+}
+
+#endif
+
+StatResult StatFile(const char *filename, unsigned int flags, FileInfo *out_info)
+{
+#if defined(__linux__) && defined(STATX_TYPE) && !defined(CORE_NO_STATX)
+    int stat_flags = (flags & (int)StatFlag::FollowSymlink) ? 0 : AT_SYMLINK_NOFOLLOW;
+
+    struct statx sxb;
+    if (statx(AT_FDCWD, filename, stat_flags, StatxMask, &sxb) < 0)
+        return HandleStatxError(filename, flags, errno);
+
+    ConvertStatx(sxb, out_info);
 #else
     int stat_flags = (flags & (int)StatFlag::FollowSymlink) ? 0 : AT_SYMLINK_NOFOLLOW;
 
@@ -5906,75 +6764,742 @@ int Async::GetWorkerCount()
 #endif
 
 // ------------------------------------------------------------------------
-// Streams
+// Batch I/O
 // ------------------------------------------------------------------------
 
-static StreamReader StdInStream(STDIN_FILENO, "<stdin>");
-static StreamWriter StdOutStream(STDOUT_FILENO, "<stdout>", (int)StreamWriterFlag::LineBuffer);
-static StreamWriter StdErrStream(STDERR_FILENO, "<stderr>", (int)StreamWriterFlag::LineBuffer);
+// Ask for headers recent enough to know about all the operations we use (5.17+),
+// the running kernel is probed at runtime anyway.
+#if defined(__linux__) && defined(IORING_FEAT_CQE_SKIP) && defined(STATX_TYPE) && !defined(CORE_NO_STATX)
+    #define IO_BATCH_URING
+#endif
 
-extern StreamReader *const StdIn = &StdInStream;
-extern StreamWriter *const StdOut = &StdOutStream;
-extern StreamWriter *const StdErr = &StdErrStream;
+enum class IoOperationType {
+    Stat,
+    Read,
+    Write,
+    MakeDirectory
+};
 
-static CreateDecompressorFunc *DecompressorFunctions[RG_LEN(CompressionTypeNames)];
-static CreateCompressorFunc *CompressorFunctions[RG_LEN(CompressionTypeNames)];
+struct IoOperation {
+    IoOperationType type;
 
-void StreamReader::SetDecoder(StreamDecoder *decoder)
-{
-    RG_ASSERT(decoder);
-    RG_ASSERT(!filename);
-    RG_ASSERT(!this->decoder);
+    const char *filename;
+    unsigned int flags;
 
-    this->decoder = decoder;
-}
+    int fd;
+    int64_t offset;
+    Span<uint8_t> buf;
+    int buf_idx;
 
-bool StreamReader::Open(Span<const uint8_t> buf, const char *filename,
-                        CompressionType compression_type)
-{
-    Close(true);
+    std::function<void(StatResult ret, const FileInfo &file_info)> stat_func;
+    std::function<void(Size len)> read_func;
+    std::function<void(bool success)> done_func;
 
-    RG_DEFER_N(err_guard) { error = true; };
-    error = false;
-    raw_read = 0;
-    read_total = 0;
-    read_max = -1;
+    // Results
+    StatResult stat_ret;
+    FileInfo file_info;
+    Size len;
+#ifdef IO_BATCH_URING
+    struct statx sxb;
+#endif
 
-    this->filename = filename ? DuplicateString(filename, &str_alloc).ptr : "<memory>";
+    void Finish()
+    {
+        switch (type) {
+            case IoOperationType::Stat: { stat_func(stat_ret, file_info); } break;
+            case IoOperationType::Read: { read_func(len); } break;
+            case IoOperationType::Write:
+            case IoOperationType::MakeDirectory: { done_func(len >= 0); } break;
+        }
+    }
+};
 
-    source.type = SourceType::Memory;
-    source.u.memory.buf = buf;
-    source.u.memory.pos = 0;
+class IoQueue {
+public:
+    int depth;
+    Async *async = nullptr;
+
+    HeapArray<IoOperation> ops;
+    HeapArray<Span<uint8_t>> buffers;
+    BlockAllocator str_alloc;
+
+#ifdef IO_BATCH_URING
+    int ring_fd = -1;
+    void *ring_ptr = nullptr;
+    size_t ring_size = 0;
+    io_uring_sqe *sqes = nullptr;
+    size_t sqes_size = 0;
+
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_array;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    io_uring_cqe *cqes;
+    unsigned int cq_mask;
+
+    bool supported[4] = {};
+#endif
 
-    if (!InitDecompressor(compression_type))
-        return false;
+    IoQueue(int depth, Async *parent);
+    ~IoQueue();
 
-    err_guard.Disable();
-    return true;
-}
+    bool IsAccelerated() const;
+    bool RegisterBuffers(Span<const Span<uint8_t>> buffers);
 
-bool StreamReader::Open(int fd, const char *filename, CompressionType compression_type)
-{
-    Close(true);
+    bool Run();
 
-    RG_DEFER_N(err_guard) { error = true; };
-    error = false;
-    raw_read = 0;
-    read_total = 0;
-    read_max = -1;
+private:
+    void Dispatch(IoOperation *op);
+    void RunDirect(IoOperation *op);
+    void Finish(IoOperation *op);
 
-    RG_ASSERT(fd >= 0);
-    RG_ASSERT(filename);
-    this->filename = DuplicateString(filename, &str_alloc).ptr;
+#ifdef IO_BATCH_URING
+    bool InitRing();
+    void ReleaseRing();
 
-    source.type = SourceType::File;
-    source.u.file.fd = fd;
-    source.u.file.owned = false;
+    bool RunRing();
+    void PrepareEntry(IoOperation *op, io_uring_sqe *sqe);
+    void FinishEntry(IoOperation *op, int res);
+#endif
+};
 
-    if (!InitDecompressor(compression_type))
-        return false;
+static Size ReadAt(int fd, int64_t offset, Span<uint8_t> buf)
+{
+    Size read_len = 0;
 
-    err_guard.Disable();
+    while (read_len < buf.len) {
+#ifdef _WIN32
+        HANDLE h = (HANDLE)_get_osfhandle(fd);
+
+        OVERLAPPED ov = {};
+        ov.Offset = (DWORD)(offset & 0xFFFFFFFFu);
+        ov.OffsetHigh = (DWORD)(offset >> 32);
+
+        DWORD len = (DWORD)std::min(buf.len - read_len, (Size)UINT32_MAX);
+        DWORD ret = 0;
+
+        if (!::ReadFile(h, buf.ptr + read_len, len, &ret, &ov)) {
+            if (GetLastError() == ERROR_HANDLE_EOF)
+                break;
+
+            LogError("Failed to read file: %1", GetWin32ErrorString());
+            return -1;
+        }
+#else
+        ssize_t ret = RG_RESTART_EINTR(pread(fd, buf.ptr + read_len, (size_t)(buf.len - read_len), (off_t)offset), < 0);
+
+        if (ret < 0) {
+            LogError("Failed to read file: %1", strerror(errno));
+            return -1;
+        }
+#endif
+        if (!ret)
+            break;
+
+        read_len += (Size)ret;
+        offset += (int64_t)ret;
+    }
+
+    return read_len;
+}
+
+static bool WriteAt(int fd, int64_t offset, Span<const uint8_t> buf)
+{
+    while (buf.len) {
+#ifdef _WIN32
+        HANDLE h = (HANDLE)_get_osfhandle(fd);
+
+        OVERLAPPED ov = {};
+        ov.Offset = (DWORD)(offset & 0xFFFFFFFFu);
+        ov.OffsetHigh = (DWORD)(offset >> 32);
+
+        DWORD len = (DWORD)std::min(buf.len, (Size)UINT32_MAX);
+        DWORD ret = 0;
+
+        if (!::WriteFile(h, buf.ptr, len, &ret, &ov)) {
+            LogError("Failed to write file: %1", GetWin32ErrorString());
+            return false;
+        }
+#else
+        ssize_t ret = RG_RESTART_EINTR(pwrite(fd, buf.ptr, (size_t)buf.len, (off_t)offset), < 0);
+
+        if (ret < 0) {
+            LogError("Failed to write file: %1", strerror(errno));
+            return false;
+        }
+#endif
+
+        buf.ptr += (Size)ret;
+        buf.len -= (Size)ret;
+        offset += (int64_t)ret;
+    }
+
+    return true;
+}
+
+IoQueue::IoQueue(int depth, Async *parent)
+    : depth(depth)
+{
+    RG_ASSERT(depth > 0);
+
+    if (parent) {
+        async = new Async(parent);
+    }
+
+#ifdef IO_BATCH_URING
+    InitRing();
+#endif
+}
+
+IoQueue::~IoQueue()
+{
+    delete async;
+
+#ifdef IO_BATCH_URING
+    ReleaseRing();
+#endif
+}
+
+bool IoQueue::IsAccelerated() const
+{
+#ifdef IO_BATCH_URING
+    return ring_fd >= 0;
+#else
+    return false;
+#endif
+}
+
+bool IoQueue::RegisterBuffers(Span<const Span<uint8_t>> new_buffers)
+{
+    RG_ASSERT(!ops.len);
+
+#ifdef IO_BATCH_URING
+    if (ring_fd >= 0) {
+        if (buffers.len) {
+            syscall(__NR_io_uring_register, ring_fd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+            buffers.Clear();
+        }
+
+        HeapArray<struct iovec> iov;
+        for (Span<uint8_t> buf: new_buffers) {
+            iov.Append({ buf.ptr, (size_t)buf.len });
+        }
+
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, iov.ptr, (unsigned int)iov.len) < 0) {
+            // Not fatal, we'll do without fixed buffers (RLIMIT_MEMLOCK is a common reason)
+            LogDebug("Failed to register io_uring buffers: %1", strerror(errno));
+            return false;
+        }
+
+        buffers.Append(new_buffers);
+        return true;
+    }
+#endif
+
+    // Nothing to do without io_uring
+    return true;
+}
+
+bool IoQueue::Run()
+{
+    RG_DEFER {
+        ops.Clear();
+        str_alloc.ReleaseAll();
+    };
+
+#ifdef IO_BATCH_URING
+    if (ring_fd >= 0) {
+        bool success = RunRing();
+        success &= !async || async->Sync();
+
+        return success;
+    }
+#endif
+
+    for (IoOperation &op: ops) {
+        Dispatch(&op);
+    }
+
+    return !async || async->Sync();
+}
+
+void IoQueue::Dispatch(IoOperation *op)
+{
+    if (async) {
+        async->Run([this, op]() {
+            RunDirect(op);
+            return true;
+        });
+    } else {
+        RunDirect(op);
+    }
+}
+
+void IoQueue::RunDirect(IoOperation *op)
+{
+    switch (op->type) {
+        case IoOperationType::Stat: {
+            op->file_info = {};
+            op->stat_ret = StatFile(op->filename, op->flags, &op->file_info);
+        } break;
+        case IoOperationType::Read: { op->len = ReadAt(op->fd, op->offset, op->buf); } break;
+        case IoOperationType::Write: { op->len = WriteAt(op->fd, op->offset, op->buf) ? op->buf.len : -1; } break;
+        case IoOperationType::MakeDirectory: { op->len = MakeDirectory(op->filename, op->flags) ? 0 : -1; } break;
+    }
+
+    op->Finish();
+}
+
+void IoQueue::Finish(IoOperation *op)
+{
+    if (async) {
+        async->Run([op]() {
+            op->Finish();
+            return true;
+        });
+    } else {
+        op->Finish();
+    }
+}
+
+#ifdef IO_BATCH_URING
+
+bool IoQueue::InitRing()
+{
+    io_uring_params params = {};
+
+    ring_fd = (int)syscall(__NR_io_uring_setup, (unsigned int)depth, &params);
+    if (ring_fd < 0) {
+        LogDebug("Cannot use io_uring, falling back to direct I/O: %1", strerror(errno));
+        return false;
+    }
+    RG_DEFER_N(err_guard) { ReleaseRing(); };
+
+    // Single mmap (5.4) makes things simpler
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        LogDebug("Kernel io_uring support is too old, falling back to direct I/O");
+        return false;
+    }
+
+    // Map rings
+    {
+        size_t sq_size = params.sq_off.array + params.sq_entries * RG_SIZE(unsigned int);
+        size_t cq_size = params.cq_off.cqes + params.cq_entries * RG_SIZE(io_uring_cqe);
+
+        ring_size = std::max(sq_size, cq_size);
+        ring_ptr = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (ring_ptr == MAP_FAILED) {
+            LogDebug("Failed to map io_uring rings: %1", strerror(errno));
+            ring_ptr = nullptr;
+            return false;
+        }
+
+        sqes_size = params.sq_entries * RG_SIZE(io_uring_sqe);
+        sqes = (io_uring_sqe *)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            LogDebug("Failed to map io_uring entries: %1", strerror(errno));
+            sqes = nullptr;
+            return false;
+        }
+
+        uint8_t *ptr = (uint8_t *)ring_ptr;
+
+        sq_head = (unsigned int *)(ptr + params.sq_off.head);
+        sq_tail = (unsigned int *)(ptr + params.sq_off.tail);
+        sq_array = (unsigned int *)(ptr + params.sq_off.array);
+        sq_mask = *(unsigned int *)(ptr + params.sq_off.ring_mask);
+        sq_entries = params.sq_entries;
+        cq_head = (unsigned int *)(ptr + params.cq_off.head);
+        cq_tail = (unsigned int *)(ptr + params.cq_off.tail);
+        cqes = (io_uring_cqe *)(ptr + params.cq_off.cqes);
+        cq_mask = *(unsigned int *)(ptr + params.cq_off.ring_mask);
+    }
+
+    // Probe supported operations, the others will run directly
+    {
+        Size probe_size = RG_SIZE(io_uring_probe) + 256 * RG_SIZE(io_uring_probe_op);
+        io_uring_probe *probe = (io_uring_probe *)AllocateRaw(nullptr, probe_size, (int)AllocFlag::Zero);
+        RG_DEFER { ReleaseRaw(nullptr, probe, probe_size); };
+
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+            LogDebug("Failed to probe io_uring operations: %1", strerror(errno));
+            return false;
+        }
+
+        const auto test = [&](int opcode) {
+            return opcode <= probe->last_op && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+        };
+
+        supported[(int)IoOperationType::Stat] = test(IORING_OP_STATX);
+        supported[(int)IoOperationType::Read] = test(IORING_OP_READ) && test(IORING_OP_READ_FIXED);
+        supported[(int)IoOperationType::Write] = test(IORING_OP_WRITE) && test(IORING_OP_WRITE_FIXED);
+        supported[(int)IoOperationType::MakeDirectory] = test(IORING_OP_MKDIRAT);
+    }
+
+    err_guard.Disable();
+    return true;
+}
+
+void IoQueue::ReleaseRing()
+{
+    if (sqes) {
+        munmap(sqes, sqes_size);
+        sqes = nullptr;
+    }
+    if (ring_ptr) {
+        munmap(ring_ptr, ring_size);
+        ring_ptr = nullptr;
+    }
+    if (ring_fd >= 0) {
+        close(ring_fd);
+        ring_fd = -1;
+    }
+}
+
+bool IoQueue::RunRing()
+{
+    Size next = 0;
+    unsigned int inflight = 0;
+    unsigned int to_submit = 0;
+    bool broken = false;
+
+    while (next < ops.len || inflight) {
+        // Fill submission queue
+        {
+            unsigned int tail = *sq_tail;
+            unsigned int head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+
+            while (next < ops.len && inflight < sq_entries && tail - head < sq_entries) {
+                IoOperation *op = &ops[next];
+
+                if (broken || !supported[(int)op->type] || op->buf.len > UINT32_MAX) [[unlikely]] {
+                    Dispatch(op);
+
+                    next++;
+                    continue;
+                }
+
+                unsigned int idx = tail & sq_mask;
+                io_uring_sqe *sqe = &sqes[idx];
+
+                PrepareEntry(op, sqe);
+                sqe->user_data = (uint64_t)next;
+                sq_array[idx] = idx;
+
+                tail++;
+                next++;
+                inflight++;
+                to_submit++;
+            }
+
+            __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+        }
+
+        if (!inflight)
+            continue;
+
+        int ret = (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+
+        if (ret >= 0) {
+            to_submit -= (unsigned int)ret;
+        } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            if (!broken) {
+                LogError("Failed to run I/O batch, falling back to direct I/O: %1", strerror(errno));
+                broken = true;
+            }
+
+            // Take back the entries the kernel has not consumed, and run them directly
+            unsigned int head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+            unsigned int tail = *sq_tail;
+
+            for (unsigned int i = head; i != tail; i++) {
+                const io_uring_sqe *sqe = &sqes[sq_array[i & sq_mask]];
+
+                Dispatch(&ops[(Size)sqe->user_data]);
+                inflight--;
+            }
+
+            __atomic_store_n(sq_tail, head, __ATOMIC_RELEASE);
+            to_submit = 0;
+
+            // Submitted operations still use their buffers and strings, which are freed
+            // once we return. Keep reaping until they are all done, without spinning.
+            if (inflight) {
+                WaitDelay(1);
+            }
+        }
+
+        // Reap completions
+        {
+            unsigned int head = *cq_head;
+            unsigned int tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+            while (head != tail) {
+                const io_uring_cqe *cqe = &cqes[head & cq_mask];
+
+                FinishEntry(&ops[(Size)cqe->user_data], cqe->res);
+
+                head++;
+                inflight--;
+            }
+
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        }
+    }
+
+    return true;
+}
+
+void IoQueue::PrepareEntry(IoOperation *op, io_uring_sqe *sqe)
+{
+    MemSet(sqe, 0, RG_SIZE(*sqe));
+
+    switch (op->type) {
+        case IoOperationType::Stat: {
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uint64_t)(uintptr_t)op->filename;
+            sqe->len = StatxMask;
+            sqe->statx_flags = (op->flags & (int)StatFlag::FollowSymlink) ? 0 : AT_SYMLINK_NOFOLLOW;
+            sqe->off = (uint64_t)(uintptr_t)&op->sxb;
+        } break;
+
+        case IoOperationType::Read:
+        case IoOperationType::Write: {
+            bool write = (op->type == IoOperationType::Write);
+
+            if (op->buf_idx >= 0) {
+                sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+                sqe->buf_index = (uint16_t)op->buf_idx;
+            } else {
+                sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+            }
+            sqe->fd = op->fd;
+            sqe->addr = (uint64_t)(uintptr_t)op->buf.ptr;
+            sqe->len = (uint32_t)op->buf.len;
+            sqe->off = (uint64_t)op->offset;
+        } break;
+
+        case IoOperationType::MakeDirectory: {
+            sqe->opcode = IORING_OP_MKDIRAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uint64_t)(uintptr_t)op->filename;
+            sqe->len = 0755;
+        } break;
+    }
+}
+
+void IoQueue::FinishEntry(IoOperation *op, int res)
+{
+    switch (op->type) {
+        case IoOperationType::Stat: {
+            op->file_info = {};
+
+            if (res >= 0) {
+                ConvertStatx(op->sxb, &op->file_info);
+                op->stat_ret = StatResult::Success;
+            } else {
+                op->stat_ret = HandleStatxError(op->filename, op->flags, -res);
+            }
+        } break;
+
+        case IoOperationType::Read: {
+            if (res < 0) {
+                LogError("Failed to read file: %1", strerror(-res));
+                op->len = -1;
+            } else if (res && res < op->buf.len) {
+                // Short reads are rare, finish the job directly
+                Size more = ReadAt(op->fd, op->offset + res, op->buf.Take(res, op->buf.len - res));
+                op->len = (more >= 0) ? res + more : -1;
+            } else {
+                op->len = res;
+            }
+        } break;
+
+        case IoOperationType::Write: {
+            if (res < 0) {
+                LogError("Failed to write file: %1", strerror(-res));
+                op->len = -1;
+            } else if (res < op->buf.len) {
+                bool success = WriteAt(op->fd, op->offset + res, op->buf.Take(res, op->buf.len - res));
+                op->len = success ? op->buf.len : -1;
+            } else {
+                op->len = res;
+            }
+        } break;
+
+        case IoOperationType::MakeDirectory: {
+            if (res < 0 && (res != -EEXIST || op->flags)) {
+                LogError("Cannot create directory '%1': %2", op->filename, strerror(-res));
+                op->len = -1;
+            } else {
+                op->len = 0;
+            }
+        } break;
+    }
+
+    Finish(op);
+}
+
+#endif
+
+IoBatch::IoBatch(int depth, Async *parent)
+{
+    queue = new IoQueue(depth, parent);
+}
+
+IoBatch::~IoBatch()
+{
+    delete queue;
+}
+
+bool IoBatch::RegisterBuffers(Span<const Span<uint8_t>> buffers)
+{
+    return queue->RegisterBuffers(buffers);
+}
+
+void IoBatch::Stat(const char *filename, unsigned int flags,
+                   std::function<void(StatResult ret, const FileInfo &file_info)> func)
+{
+    IoOperation *op = queue->ops.AppendDefault();
+
+    op->type = IoOperationType::Stat;
+    op->filename = DuplicateString(filename, &queue->str_alloc).ptr;
+    op->flags = flags;
+    op->stat_func = func;
+}
+
+static int FindBuffer(Span<const Span<uint8_t>> buffers, Span<const uint8_t> buf)
+{
+    for (Size i = 0; i < buffers.len; i++) {
+        Span<const uint8_t> it = buffers[i];
+
+        if (buf.ptr >= it.ptr && buf.end() <= it.end())
+            return (int)i;
+    }
+
+    return -1;
+}
+
+void IoBatch::Read(int fd, int64_t offset, Span<uint8_t> buf, std::function<void(Size len)> func)
+{
+    IoOperation *op = queue->ops.AppendDefault();
+
+    op->type = IoOperationType::Read;
+    op->fd = fd;
+    op->offset = offset;
+    op->buf = buf;
+    op->buf_idx = FindBuffer(queue->buffers, buf);
+    op->read_func = func;
+}
+
+void IoBatch::Write(int fd, int64_t offset, Span<const uint8_t> buf, std::function<void(bool success)> func)
+{
+    IoOperation *op = queue->ops.AppendDefault();
+
+    op->type = IoOperationType::Write;
+    op->fd = fd;
+    op->offset = offset;
+    op->buf = MakeSpan((uint8_t *)buf.ptr, buf.len);
+    op->buf_idx = FindBuffer(queue->buffers, buf);
+    op->done_func = func;
+}
+
+void IoBatch::MakeDirectory(const char *directory, bool error_if_exists, std::function<void(bool success)> func)
+{
+    IoOperation *op = queue->ops.AppendDefault();
+
+    op->type = IoOperationType::MakeDirectory;
+    op->filename = DuplicateString(directory, &queue->str_alloc).ptr;
+    op->flags = error_if_exists;
+    op->done_func = func;
+}
+
+bool IoBatch::Sync()
+{
+    return queue->Run();
+}
+
+bool IoBatch::IsAccelerated() const
+{
+    return queue->IsAccelerated();
+}
+
+// ------------------------------------------------------------------------
+// Streams
+// ------------------------------------------------------------------------
+
+static StreamReader StdInStream(STDIN_FILENO, "<stdin>");
+static StreamWriter StdOutStream(STDOUT_FILENO, "<stdout>", (int)StreamWriterFlag::LineBuffer);
+static StreamWriter StdErrStream(STDERR_FILENO, "<stderr>", (int)StreamWriterFlag::LineBuffer);
+
+extern StreamReader *const StdIn = &StdInStream;
+extern StreamWriter *const StdOut = &StdOutStream;
+extern StreamWriter *const StdErr = &StdErrStream;
+
+static CreateDecompressorFunc *DecompressorFunctions[RG_LEN(CompressionTypeNames)];
+static CreateCompressorFunc *CompressorFunctions[RG_LEN(CompressionTypeNames)];
+
+void StreamReader::SetDecoder(StreamDecoder *decoder)
+{
+    RG_ASSERT(decoder);
+    RG_ASSERT(!filename);
+    RG_ASSERT(!this->decoder);
+
+    this->decoder = decoder;
+}
+
+bool StreamReader::Open(Span<const uint8_t> buf, const char *filename,
+                        CompressionType compression_type)
+{
+    Close(true);
+
+    RG_DEFER_N(err_guard) { error = true; };
+    error = false;
+    raw_read = 0;
+    read_total = 0;
+    read_max = -1;
+
+    this->filename = filename ? DuplicateString(filename, &str_alloc).ptr : "<memory>";
+
+    source.type = SourceType::Memory;
+    source.u.memory.buf = buf;
+    source.u.memory.pos = 0;
+
+    if (!InitDecompressor(compression_type))
+        return false;
+
+    err_guard.Disable();
+    return true;
+}
+
+bool StreamReader::Open(int fd, const char *filename, CompressionType compression_type)
+{
+    Close(true);
+
+    RG_DEFER_N(err_guard) { error = true; };
+    error = false;
+    raw_read = 0;
+    read_total = 0;
+    read_max = -1;
+
+    RG_ASSERT(fd >= 0);
+    RG_ASSERT(filename);
+    this->filename = DuplicateString(filename, &str_alloc).ptr;
+
+    source.type = SourceType::File;
+    source.u.file.fd = fd;
+    source.u.file.owned = false;
+    source.u.file.map = {};
+    source.u.file.map_pos = 0;
+
+    if (!InitDecompressor(compression_type))
+        return false;
+
+    err_guard.Disable();
     return true;
 }
 
@@ -5998,9 +7523,14 @@ OpenResult StreamReader::Open(const char *filename, CompressionType compression_
             return ret;
     }
     source.u.file.owned = true;
+    source.u.file.map = {};
+    source.u.file.map_pos = 0;
 
     if (!InitDecompressor(compression_type))
         return OpenResult::OtherError;
+    if (mapping && !decoder) {
+        MapFile();
+    }
 
     err_guard.Disable();
     return OpenResult::Success;
@@ -6041,12 +7571,18 @@ bool StreamReader::Close(bool implicit)
     switch (source.type) {
         case SourceType::Memory: { source.u.memory = {}; } break;
         case SourceType::File: {
+#if !defined(_WIN32) && !defined(__wasi__)
+            if (source.u.file.map.ptr) {
+                munmap((void *)source.u.file.map.ptr, (size_t)source.u.file.map.len);
+            }
+#endif
             if (source.u.file.owned && source.u.file.fd >= 0) {
                 CloseDescriptor(source.u.file.fd);
             }
 
             source.u.file.fd = -1;
             source.u.file.owned = false;
+            source.u.file.map = {};
         } break;
         case SourceType::Function: { source.u.func.~function(); } break;
     }
@@ -6077,6 +7613,11 @@ bool StreamReader::Rewind()
     switch (source.type) {
         case SourceType::Memory: { source.u.memory.pos = 0; } break;
         case SourceType::File: {
+            if (source.u.file.map.ptr) {
+                source.u.file.map_pos = 0;
+                break;
+            }
+
             if (lseek(source.u.file.fd, 0, SEEK_SET) < 0) {
                 LogError("Failed to rewind '%1': %2", filename, strerror(errno));
                 error = true;
@@ -6191,6 +7732,60 @@ Size StreamReader::ReadAll(Size max_len, HeapArray<uint8_t> *out_buf)
     }
 }
 
+Span<const uint8_t> StreamReader::ReadView(Size max_len)
+{
+    if (error) [[unlikely]]
+        return {};
+
+    Span<const uint8_t> buf = {};
+    Size *pos = nullptr;
+
+    if (!decoder) {
+        if (source.type == SourceType::Memory) {
+            buf = source.u.memory.buf;
+            pos = &source.u.memory.pos;
+        } else if (IsMapped()) {
+            buf = source.u.file.map;
+            pos = &source.u.file.map_pos;
+        }
+    }
+
+    // Slow path, go through our own buffer
+    if (!pos) {
+        max_len = (max_len >= 0) ? max_len : Kibibytes(64);
+
+        view_buf.RemoveFrom(0);
+        view_buf.Grow(max_len);
+
+        Size read_len = Read(max_len, view_buf.ptr);
+        if (read_len < 0)
+            return {};
+
+        return MakeSpan(view_buf.ptr, read_len);
+    }
+
+    ComputeRawLen();
+
+    Size len = buf.len - *pos;
+    len = (max_len >= 0) ? std::min(len, max_len) : len;
+
+    if (read_max >= 0 && len > read_max - read_total) [[unlikely]] {
+        LogError("Exceeded max stream size of %1", FmtDiskSize(read_max));
+        error = true;
+        return {};
+    }
+
+    Span<const uint8_t> view = MakeSpan(buf.ptr + *pos, len);
+
+    *pos += len;
+    source.eof = (*pos >= buf.len);
+    eof = source.eof;
+    raw_read += len;
+    read_total += len;
+
+    return view;
+}
+
 int64_t StreamReader::ComputeRawLen()
 {
     if (error) [[unlikely]]
@@ -6243,6 +7838,30 @@ bool StreamReader::InitDecompressor(CompressionType type)
     return true;
 }
 
+void StreamReader::MapFile()
+{
+#if !defined(_WIN32) && !defined(__wasi__)
+    int64_t len = ComputeRawLen();
+
+    // Not worth the mmap/munmap round-trip for small files
+    if (len < Kibibytes(64) || len > RG_SIZE_MAX)
+        return;
+
+    void *ptr = mmap(nullptr, (size_t)len, PROT_READ, MAP_PRIVATE, source.u.file.fd, 0);
+
+    if (ptr == MAP_FAILED) {
+        // Not a problem, we'll read it the usual way
+        LogDebug("Failed to map '%1': %2", filename, strerror(errno));
+        return;
+    }
+
+    posix_madvise(ptr, (size_t)len, POSIX_MADV_SEQUENTIAL);
+
+    source.u.file.map = MakeSpan((const uint8_t *)ptr, (Size)len);
+    source.u.file.map_pos = 0;
+#endif
+}
+
 Size StreamReader::ReadRaw(Size max_len, void *out_buf)
 {
     ComputeRawLen();
@@ -6260,6 +7879,17 @@ Size StreamReader::ReadRaw(Size max_len, void *out_buf)
         } break;
 
         case SourceType::File: {
+            if (source.u.file.map.ptr) {
+                Span<const uint8_t> map = source.u.file.map;
+
+                read_len = std::min(max_len, map.len - source.u.file.map_pos);
+                MemCpy(out_buf, map.ptr + source.u.file.map_pos, read_len);
+                source.u.file.map_pos += read_len;
+                source.eof = (source.u.file.map_pos >= map.len);
+
+                break;
+            }
+
 #ifdef _WIN32
             max_len = std::min(max_len, (Size)UINT_MAX);
             read_len = _read(source.u.file.fd, out_buf, (unsigned int)max_len);
@@ -6331,6 +7961,74 @@ bool LineReader::Next(Span<char> *out_line)
     }
 }
 
+bool LineReader::NextView(Span<const char> *out_line)
+{
+    if (eof) {
+        line_number = 0;
+        return false;
+    }
+    if (error) [[unlikely]]
+        return false;
+
+    // Previous line was assembled in buf
+    if (line.ptr == buf.ptr) {
+        buf.RemoveFrom(0);
+    }
+
+    for (;;) {
+        if (!chunk.len) {
+            Span<const uint8_t> next = st->ReadView();
+
+            if (!st->IsValid()) {
+                error = true;
+                return false;
+            }
+
+            // Return whatever is left, but don't make up an empty line after the final newline
+            if (!next.len) {
+                eof = true;
+
+                if (!buf.len) {
+                    line_number = 0;
+                    return false;
+                }
+
+                line = buf;
+                line_number++;
+                *out_line = line;
+                return true;
+            }
+
+            chunk = next.As<const char>();
+        }
+
+        Span<const char> remain;
+        Span<const char> part = SplitStr(chunk, '\n', &remain);
+
+        // Line continues in next chunk
+        if (part.len == chunk.len) {
+            buf.Append(part);
+            chunk = {};
+
+            continue;
+        }
+        chunk = remain;
+
+        if (buf.len) {
+            buf.Append(part);
+            part = buf;
+        }
+        if (part.len && part[part.len - 1] == '\r') {
+            part.len--;
+        }
+
+        line = MakeSpan((char *)part.ptr, part.len);
+        line_number++;
+        *out_line = part;
+        return true;
+    }
+}
+
 void LineReader::PushLogFilter()
 {
     RG::PushLogFilter([this](LogLevel level, const char *ctx, const char *msg, FunctionRef<LogFunc> func) {
@@ -6355,6 +8053,24 @@ void StreamWriter::SetEncoder(StreamEncoder *encoder)
     this->encoder = encoder;
 }
 
+void StreamWriter::SetCompressionThreads(int threads)
+{
+    RG_ASSERT(!filename);
+    RG_ASSERT(threads);
+
+    compression_threads = threads;
+    compression_parent = nullptr;
+}
+
+void StreamWriter::SetCompressionThreads(Async *parent)
+{
+    RG_ASSERT(!filename);
+    RG_ASSERT(parent);
+
+    compression_threads = 0;
+    compression_parent = parent;
+}
+
 bool StreamWriter::Open(HeapArray<uint8_t> *mem, const char *filename,
                         CompressionType compression_type, CompressionSpeed compression_speed)
 {
@@ -6844,6 +8560,120 @@ StreamCompressorHelper::StreamCompressorHelper(CompressionType compression_type,
     CompressorFunctions[(int)compression_type] = func;
 }
 
+int StreamEncoder::GetCompressionThreads() const
+{
+    int threads = writer->compression_threads;
+    return (threads > 0) ? threads : GetCoreCount();
+}
+
+Async *StreamEncoder::CreateCompressionAsync() const
+{
+    if (writer->compression_parent) {
+        return new Async(writer->compression_parent);
+    } else {
+        RG_ASSERT(writer->compression_threads);
+        return new Async(writer->compression_threads);
+    }
+}
+
+StreamBlockEncoder::StreamBlockEncoder(StreamWriter *writer, Size block_size)
+    : StreamEncoder(writer), block_size(block_size)
+{
+    RG_ASSERT(block_size > 0);
+
+    async = CreateCompressionAsync();
+
+    int workers = GetCompressionThreads();
+    for (HeapArray<Block> &batch: batches) {
+        batch.AppendDefault(workers);
+    }
+}
+
+StreamBlockEncoder::~StreamBlockEncoder()
+{
+    // Waits for running tasks, which still reference our blocks
+    delete async;
+}
+
+bool StreamBlockEncoder::Write(Span<const uint8_t> buf)
+{
+    while (buf.len) {
+        Block *block = &batches[0][filled];
+
+        Size copy_len = std::min(buf.len, block_size - block->in.len);
+        block->in.Append(buf.Take(0, copy_len));
+        buf = buf.Take(copy_len, buf.len - copy_len);
+
+        if (block->in.len == block_size && ++filled == batches[0].len) {
+            if (!Dispatch(false))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+bool StreamBlockEncoder::Finalize()
+{
+    if (!Dispatch(true))
+        return false;
+    if (!Drain())
+        return false;
+
+    return WriteFooter();
+}
+
+bool StreamBlockEncoder::WriteBlock(Span<const uint8_t> compressed, Size, uint32_t)
+{
+    return WriteRaw(compressed);
+}
+
+bool StreamBlockEncoder::Dispatch(bool last)
+{
+    // Keep a single batch in flight
+    if (!Drain())
+        return false;
+
+    // The last block may be partial (or even empty), but it must be flagged as such
+    Size count = last ? filled + 1 : filled;
+
+    for (Size i = 0; i < count; i++) {
+        Block *block = &batches[0][i];
+        bool last_block = last && i == count - 1;
+
+        async->Run([this, block, last_block]() {
+            block->out.RemoveFrom(0);
+            block->checksum = 0;
+
+            return CompressBlock(block->in, last_block, &block->out, &block->checksum);
+        });
+    }
+
+    std::swap(batches[0], batches[1]);
+    filled = 0;
+    pending = count;
+
+    return true;
+}
+
+bool StreamBlockEncoder::Drain()
+{
+    if (!pending)
+        return true;
+
+    bool success = async->Sync();
+
+    for (Size i = 0; i < pending; i++) {
+        Block *block = &batches[1][i];
+
+        success = success && WriteBlock(block->out, block->in.len, block->checksum);
+        block->in.RemoveFrom(0);
+    }
+    pending = 0;
+
+    return success;
+}
+
 bool SpliceStream(StreamReader *reader, int64_t max_len, StreamWriter *writer)
 {
     if (!reader->IsValid())
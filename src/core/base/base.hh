@@ -68,6 +68,13 @@
         #pragma intrinsic(__rdtsc)
     #endif
 #endif
+#if defined(__AVX2__)
+    #include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+    #include <emmintrin.h>
+#elif defined(__aarch64__)
+    #include <arm_neon.h>
+#endif
 
 struct sigaction;
 struct BrotliEncoderStateStruct;
@@ -84,6 +91,10 @@ namespace RG {
 
 #define RG_DEFAULT_ALLOCATOR MallocAllocator
 #define RG_BLOCK_ALLOCATOR_DEFAULT_SIZE Kibibytes(4)
+#define RG_BLOCK_ALLOCATOR_MAX_SIZE Mebibytes(1)
+#define RG_HUGE_PAGE_SIZE Mebibytes(2)
+// Must be a power-of-two
+#define RG_POOL_ALLOCATOR_SLAB_SIZE Kibibytes(64)
 
 #define RG_HEAPARRAY_BASE_CAPACITY 8
 #define RG_HEAPARRAY_GROWTH_FACTOR 2.0
@@ -92,11 +103,19 @@ namespace RG {
 #define RG_HASHTABLE_BASE_CAPACITY 8
 #define RG_HASHTABLE_MAX_LOAD_FACTOR 0.5
 
+// Must be a power-of-two, and at least 16 (one control group)
+#define RG_SWISSTABLE_BASE_CAPACITY 16
+#define RG_SWISSTABLE_MAX_LOAD_FACTOR 0.875
+
 #define RG_FMT_STRING_BASE_CAPACITY 256
 #define RG_FMT_STRING_PRINT_BUFFER_SIZE 1024
 
 #define RG_LINE_READER_STEP_SIZE 65536
 
+// Must be a power-of-two
+#define RG_ASYNC_LOG_BUFFER_SIZE Kibibytes(64)
+#define RG_ASYNC_LOG_DELAY 20
+
 #define RG_ASYNC_MAX_THREADS 2048
 #define RG_ASYNC_MAX_IDLE_TIME 10000
 #define RG_ASYNC_MAX_PENDING_TASKS 1024
@@ -1193,20 +1212,44 @@ private:
     static Bucket *PointerToBucket(void *ptr);
 };
 
+struct BlockAllocatorStats {
+    Size blocks; // Blocks currently in use
+    Size block_bytes;
+    Size used_bytes; // Bytes handed out from these blocks
+    Size waste_bytes; // Space left unused at the end of full blocks
+
+    Size separate; // Allocations too big to share a block
+    Size separate_bytes;
+};
+
+enum class BlockAllocatorFlag {
+    HugePages = 1 << 0 // Only used on Linux, through transparent huge pages
+};
+
+// Blocks start at block_size and double each time a new one is needed, up to
+// max_block_size. Allocations bigger than half of the initial block size are
+// made separately.
 class BlockAllocatorBase: public Allocator {
     struct Bucket {
         Size used;
+        Size size;
         uint8_t data[];
     };
 
     Size block_size;
+    Size max_block_size;
+    Size next_block_size;
 
     Bucket *current_bucket = nullptr;
     uint8_t *last_alloc = nullptr;
 
+    BlockAllocatorStats stats = {};
+
 public:
-    BlockAllocatorBase(Size block_size = RG_BLOCK_ALLOCATOR_DEFAULT_SIZE)
-        : block_size(block_size)
+    BlockAllocatorBase(Size block_size = RG_BLOCK_ALLOCATOR_DEFAULT_SIZE,
+                       Size max_block_size = RG_BLOCK_ALLOCATOR_MAX_SIZE)
+        : block_size(block_size), max_block_size(std::max(block_size, max_block_size)),
+          next_block_size(block_size)
     {
         RG_ASSERT(block_size > 0);
     }
@@ -1221,6 +1264,8 @@ public:
         return alloc->IsUsed();
     }
 
+    const BlockAllocatorStats &GetStats() const { return stats; }
+
 protected:
     void CopyFrom(BlockAllocatorBase *other);
     void ForgetCurrentBlock();
@@ -1228,9 +1273,15 @@ protected:
     virtual LinkedAllocator *GetAllocator() = 0;
 
 private:
+    // The threshold must not depend on the current block size, or Release() and Resize()
+    // could not tell which allocations were made separately.
     bool AllocateSeparately(Size aligned_size) const { return aligned_size > block_size / 2; }
 };
 
+// Returns an allocator which backs big allocations with transparent huge pages when
+// possible (Linux), and uses the default allocator otherwise.
+Allocator *GetHugePageAllocator();
+
 class BlockAllocator final: public BlockAllocatorBase {
     LinkedAllocator allocator;
 
@@ -1238,8 +1289,10 @@ protected:
     LinkedAllocator *GetAllocator() override { return &allocator; }
 
 public:
-    BlockAllocator(Size block_size = RG_BLOCK_ALLOCATOR_DEFAULT_SIZE)
-        : BlockAllocatorBase(block_size) {}
+    // With BlockAllocatorFlag::HugePages, the maximum block size is adjusted so that
+    // the biggest blocks exactly fill one or more huge pages.
+    BlockAllocator(Size block_size = RG_BLOCK_ALLOCATOR_DEFAULT_SIZE,
+                   Size max_block_size = RG_BLOCK_ALLOCATOR_MAX_SIZE, unsigned int flags = 0);
 
     BlockAllocator(BlockAllocator &&other) { *this = std::move(other); }
     BlockAllocator& operator=(BlockAllocator &&other);
@@ -1263,6 +1316,29 @@ public:
     void ReleaseAll();
 };
 
+// Thread-safe allocator for small objects released individually (up to 8 kiB). Each thread
+// gets its own size-class freelists, and memory released by another thread is handed back
+// to the owner thread in batches. Bigger allocations are passed to the system allocator.
+// Everything is released when the pool is destroyed.
+class PoolAllocator final: public Allocator {
+    int64_t id;
+
+    std::mutex mutex;
+    class PoolHeap *heaps = nullptr;
+    struct PoolSlab *large = nullptr;
+
+public:
+    PoolAllocator();
+    ~PoolAllocator() override;
+
+    void *Allocate(Size size, unsigned int flags = 0) override;
+    void *Resize(void *ptr, Size old_size, Size new_size, unsigned int flags = 0) override;
+    void Release(const void *ptr, Size size) override;
+
+private:
+    PoolHeap *GetHeap();
+};
+
 #ifndef __wasi__
 bool LockMemory(void *ptr, Size len);
 void UnlockMemory(void *ptr, Size len);
@@ -1563,6 +1639,100 @@ static inline bool EndsWith(Span<const char> str, const char *suffix)
     return j < 0;
 }
 
+// Bit i of the result is set when ptr[i] is equal to c1 or c2, for 16 consecutive bytes
+// (which must all be readable). Pass the same character twice to look for only one.
+#if defined(__SSE2__) || defined(_M_X64)
+static inline uint32_t MatchChars16(const char *ptr, char c1, char c2)
+{
+    __m128i chunk = _mm_loadu_si128((const __m128i *)ptr);
+    __m128i eq = _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(c1)),
+                              _mm_cmpeq_epi8(chunk, _mm_set1_epi8(c2)));
+
+    return (uint32_t)_mm_movemask_epi8(eq);
+}
+#elif defined(__aarch64__)
+static inline uint32_t MoveMask16(uint8x16_t mask)
+{
+    static const uint8_t bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+
+    uint8x16_t masked = vandq_u8(mask, vld1q_u8(bits));
+    return (uint32_t)vaddv_u8(vget_low_u8(masked)) | ((uint32_t)vaddv_u8(vget_high_u8(masked)) << 8);
+}
+
+static inline uint32_t MatchChars16(const char *ptr, char c1, char c2)
+{
+    uint8x16_t chunk = vld1q_u8((const uint8_t *)ptr);
+    uint8x16_t eq = vorrq_u8(vceqq_u8(chunk, vdupq_n_u8((uint8_t)c1)),
+                             vceqq_u8(chunk, vdupq_n_u8((uint8_t)c2)));
+
+    return MoveMask16(eq);
+}
+#else
+static inline uint32_t MatchChars16(const char *ptr, char c1, char c2)
+{
+    uint32_t mask = 0;
+    for (int i = 0; i < 16; i++) {
+        mask |= (uint32_t)(ptr[i] == c1 || ptr[i] == c2) << i;
+    }
+    return mask;
+}
+#endif
+
+// Same thing for 64 bytes, to classify whole blocks at once
+static inline uint64_t MatchChars64(const char *ptr, char c1, char c2)
+{
+#if defined(__AVX2__)
+    __m256i lo = _mm256_loadu_si256((const __m256i *)ptr);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(ptr + 32));
+    __m256i v1 = _mm256_set1_epi8(c1);
+    __m256i v2 = _mm256_set1_epi8(c2);
+
+    uint32_t mask_lo = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(lo, v1), _mm256_cmpeq_epi8(lo, v2)));
+    uint32_t mask_hi = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(hi, v1), _mm256_cmpeq_epi8(hi, v2)));
+
+    return (uint64_t)mask_lo | ((uint64_t)mask_hi << 32);
+#else
+    uint64_t mask = (uint64_t)MatchChars16(ptr, c1, c2) |
+                    ((uint64_t)MatchChars16(ptr + 16, c1, c2) << 16) |
+                    ((uint64_t)MatchChars16(ptr + 32, c1, c2) << 32) |
+                    ((uint64_t)MatchChars16(ptr + 48, c1, c2) << 48);
+    return mask;
+#endif
+}
+
+// Returns the offset of the first c1 or c2 character, or -1
+static inline Size FindChar(Span<const char> str, char c1, char c2)
+{
+    Size i = 0;
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(__aarch64__)
+    for (; i + 64 <= str.len; i += 64) {
+        uint64_t mask = MatchChars64(str.ptr + i, c1, c2);
+
+        if (mask)
+            return i + CountTrailingZeros(mask);
+    }
+    for (; i + 16 <= str.len; i += 16) {
+        uint32_t mask = MatchChars16(str.ptr + i, c1, c2);
+
+        if (mask)
+            return i + CountTrailingZeros(mask);
+    }
+#endif
+
+    for (; i < str.len; i++) {
+        if (str[i] == c1 || str[i] == c2)
+            return i;
+    }
+
+    return -1;
+}
+static inline Size FindChar(Span<const char> str, char c) { return FindChar(str, c, c); }
+
+// Split str on each sep character into out_fields, and return the number of fields.
+// If there are too many fields, the last one gets the rest of the string.
+Size SplitFields(Span<const char> str, char sep, Span<Span<const char>> out_fields);
+
 static inline Size FindStr(Span<const char> str, Span<const char> needle)
 {
     if (!needle.len)
@@ -1587,15 +1757,13 @@ static inline Size FindStr(const char *str, const char *needle)
 
 static inline Span<char> SplitStr(Span<char> str, char split_char, Span<char> *out_remainder = nullptr)
 {
-    Size part_len = 0;
-    while (part_len < str.len) {
-        if (str[part_len] == split_char) {
-            if (out_remainder) {
-                *out_remainder = str.Take(part_len + 1, str.len - part_len - 1);
-            }
-            return str.Take(0, part_len);
+    Size part_len = FindChar(str, split_char);
+
+    if (part_len >= 0) {
+        if (out_remainder) {
+            *out_remainder = str.Take(part_len + 1, str.len - part_len - 1);
         }
-        part_len++;
+        return str.Take(0, part_len);
     }
 
     if (out_remainder) {
@@ -3008,138 +3176,569 @@ private:
     }
 };
 
-template <typename T>
-class HashTraits {
-public:
-    static constexpr uint64_t Hash(const T &key) { return key.Hash(); }
-    static constexpr bool Test(const T &key1, const T &key2) { return key1 == key2; }
-};
+// Open addressing table with a separate array of control bytes, one per slot. Full slots
+// store 7 bits of the hash, and probing tests 16 control bytes at once (SSE2 or NEON), so
+// most lookups touch a single data slot. Slots never move once set (unlike HashTable),
+// and deletion only leaves a tombstone when the group was full.
+template <typename KeyType, typename ValueType,
+          typename Handler = typename std::remove_pointer<ValueType>::type::HashHandler>
+class SwissHashTable {
+    enum : int8_t {
+        CtrlEmpty = -128,
+        CtrlDeleted = -2
+    };
 
-// Stole the Hash function from Thomas Wang (see here: https://gist.github.com/badboy/6267743)
-#define DEFINE_INTEGER_HASH_TRAITS_32(Type, ...) \
-    template <> \
-    class HashTraits<Type> { \
-    public: \
-        static __VA_ARGS__ uint64_t Hash(Type key) \
-        { \
-            uint32_t hash = (uint32_t)key; \
-             \
-            hash = (hash ^ 61) ^ (hash >> 16); \
-            hash += hash << 3; \
-            hash ^= hash >> 4; \
-            hash *= 0x27D4EB2D; \
-            hash ^= hash >> 15; \
-             \
-            return (uint64_t)hash; \
-        } \
-         \
-        static __VA_ARGS__ bool Test(Type key1, Type key2) { return key1 == key2; } \
-    }
-#define DEFINE_INTEGER_HASH_TRAITS_64(Type, ...) \
-    template <> \
-    class HashTraits<Type> { \
-    public: \
-        static __VA_ARGS__ uint64_t Hash(Type key) \
-        { \
-            uint64_t hash = (uint64_t)key; \
-             \
-            hash = (~hash) + (hash << 18); \
-            hash ^= hash >> 31; \
-            hash *= 21; \
-            hash ^= hash >> 11; \
-            hash += hash << 6; \
-            hash ^= hash >> 22; \
-             \
-            return hash; \
-        } \
-         \
-        static __VA_ARGS__ bool Test(Type key1, Type key2) { return key1 == key2; } \
-    }
+    class Group {
+#if defined(__SSE2__) || defined(_M_X64)
+        __m128i ctrl;
 
-DEFINE_INTEGER_HASH_TRAITS_32(char, constexpr);
-DEFINE_INTEGER_HASH_TRAITS_32(unsigned char, constexpr);
-DEFINE_INTEGER_HASH_TRAITS_32(short, constexpr);
-DEFINE_INTEGER_HASH_TRAITS_32(unsigned short, constexpr);
-DEFINE_INTEGER_HASH_TRAITS_32(int, constexpr);
-DEFINE_INTEGER_HASH_TRAITS_32(unsigned int, constexpr);
-#ifdef __LP64__
-    DEFINE_INTEGER_HASH_TRAITS_64(long, constexpr);
-    DEFINE_INTEGER_HASH_TRAITS_64(unsigned long, constexpr);
-#else
-    DEFINE_INTEGER_HASH_TRAITS_32(long, constexpr);
-    DEFINE_INTEGER_HASH_TRAITS_32(unsigned long, constexpr);
-#endif
-DEFINE_INTEGER_HASH_TRAITS_64(long long, constexpr);
-DEFINE_INTEGER_HASH_TRAITS_64(unsigned long long, constexpr);
-#if RG_SIZE_MAX == INT64_MAX
-    DEFINE_INTEGER_HASH_TRAITS_64(void *);
-    DEFINE_INTEGER_HASH_TRAITS_64(const void *);
+    public:
+        Group(const int8_t *ptr) : ctrl(_mm_loadu_si128((const __m128i *)ptr)) {}
+
+        uint32_t Match(int8_t h2) const
+            { return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), ctrl)); }
+        uint32_t MatchFree() const { return (uint32_t)_mm_movemask_epi8(ctrl); }
+#elif defined(__aarch64__)
+        int8x16_t ctrl;
+
+    public:
+        Group(const int8_t *ptr) : ctrl(vld1q_s8(ptr)) {}
+
+        uint32_t Match(int8_t h2) const { return MoveMask16(vceqq_s8(ctrl, vdupq_n_s8(h2))); }
+        uint32_t MatchFree() const { return MoveMask16(vcltzq_s8(ctrl)); }
 #else
-    DEFINE_INTEGER_HASH_TRAITS_32(void *);
-    DEFINE_INTEGER_HASH_TRAITS_32(const void *);
+        const int8_t *ctrl;
+
+    public:
+        Group(const int8_t *ptr) : ctrl(ptr) {}
+
+        uint32_t Match(int8_t h2) const
+        {
+            uint32_t mask = 0;
+            for (int i = 0; i < 16; i++) {
+                mask |= (uint32_t)(ctrl[i] == h2) << i;
+            }
+            return mask;
+        }
+        uint32_t MatchFree() const
+        {
+            uint32_t mask = 0;
+            for (int i = 0; i < 16; i++) {
+                mask |= (uint32_t)(ctrl[i] < 0) << i;
+            }
+            return mask;
+        }
 #endif
 
-#undef DEFINE_INTEGER_HASH_TRAITS_32
-#undef DEFINE_INTEGER_HASH_TRAITS_64
+        uint32_t MatchEmpty() const { return Match(CtrlEmpty); }
+    };
 
-template <>
-class HashTraits<const char *> {
 public:
-    // FNV-1a
-    static constexpr uint64_t Hash(Span<const char> key)
-    {
-        uint64_t hash = 0xCBF29CE484222325ull;
-        for (char c: key) {
-            hash ^= (uint64_t)c;
-            hash *= 0x100000001B3ull;
+    template <typename T>
+    class Iterator {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef ValueType value_type;
+        typedef Size difference_type;
+        typedef Iterator *pointer;
+        typedef Iterator &reference;
+
+        T *table = nullptr;
+        Size offset;
+
+        Iterator() = default;
+        Iterator(T *table, Size offset)
+            : table(table), offset(offset - 1) { operator++(); }
+
+        ValueType &operator*()
+        {
+            RG_ASSERT(!table->IsEmpty(offset));
+            return table->data[offset];
+        }
+        const ValueType &operator*() const
+        {
+            RG_ASSERT(!table->IsEmpty(offset));
+            return table->data[offset];
         }
 
-        return hash;
-    }
-    static constexpr uint64_t Hash(const char *key)
-    {
-        uint64_t hash = 0xCBF29CE484222325ull;
-        for (Size i = 0; key[i]; i++) {
-            hash ^= (uint64_t)key[i];
-            hash *= 0x100000001B3ull;
+        Iterator &operator++()
+        {
+            RG_ASSERT(offset < table->capacity);
+            while (++offset < table->capacity && table->IsEmpty(offset));
+            return *this;
         }
 
-        return hash;
-    }
+        Iterator operator++(int)
+        {
+            Iterator ret = *this;
+            ++(*this);
+            return ret;
+        }
 
-    static constexpr bool Test(const char *key1, const char *key2) { return TestStr(key1, key2); }
-    static constexpr bool Test(const char *key1, Span<const char> key2) { return key2 == key1; }
-};
+        // Other values don't move, so iteration is unaffected
+        void Remove() { table->Remove(&table->data[offset]); }
 
-template <>
-class HashTraits<Span<const char>> {
-public:
-    // FNV-1a
-    static constexpr uint64_t Hash(Span<const char> key)
-    {
-        uint64_t hash = 0xCBF29CE484222325ull;
-        for (char c: key) {
-            hash ^= (uint64_t)c;
-            hash *= 0x100000001B3ull;
-        }
+        bool operator==(const Iterator &other) const
+            { return table == other.table && offset == other.offset; }
+        bool operator!=(const Iterator &other) const { return !(*this == other); }
+    };
 
-        return hash;
-    }
-    static constexpr uint64_t Hash(const char *key)
+    typedef Size value_type;
+    typedef Iterator<SwissHashTable> iterator_type;
+
+    int8_t *ctrl = nullptr;
+    ValueType *data = nullptr;
+    Size count = 0;
+    Size capacity = 0;
+    Size deleted = 0;
+    Allocator *allocator = nullptr;
+
+    SwissHashTable() = default;
+    SwissHashTable(std::initializer_list<ValueType> l)
     {
-        uint64_t hash = 0xCBF29CE484222325ull;
-        for (Size i = 0; key[i]; i++) {
-            hash ^= (uint64_t)key[i];
-            hash *= 0x100000001B3ull;
+        for (const ValueType &value: l) {
+            Set(value);
         }
-
-        return hash;
     }
+    ~SwissHashTable() { Clear(); }
+
+    SwissHashTable(SwissHashTable &&other) { *this = std::move(other); }
+    SwissHashTable &operator=(SwissHashTable &&other)
+    {
+        Clear();
+        MemMove(this, &other, RG_SIZE(other));
+        MemSet(&other, 0, RG_SIZE(other));
+        return *this;
+    }
+    SwissHashTable(const SwissHashTable &other) { *this = other; }
+    SwissHashTable &operator=(const SwissHashTable &other)
+    {
+        Clear();
+        for (const ValueType &value: other) {
+            Set(value);
+        }
+        return *this;
+    }
+
+    void Clear()
+    {
+        count = 0;
+        deleted = 0;
+        Rehash(0);
+    }
+
+    void RemoveAll()
+    {
+        if constexpr(!std::is_trivial<ValueType>::value) {
+            for (Size i = 0; i < capacity; i++) {
+                data[i].~ValueType();
+                new (&data[i]) ValueType();
+            }
+        }
+
+        count = 0;
+        deleted = 0;
+        if (ctrl) {
+            MemSet(ctrl, CtrlEmpty, capacity);
+        }
+    }
+
+    Iterator<SwissHashTable> begin() { return Iterator<SwissHashTable>(this, 0); }
+    Iterator<const SwissHashTable> begin() const { return Iterator<const SwissHashTable>(this, 0); }
+    Iterator<SwissHashTable> end() { return Iterator<SwissHashTable>(this, capacity); }
+    Iterator<const SwissHashTable> end() const { return Iterator<const SwissHashTable>(this, capacity); }
+
+    template <typename T = KeyType>
+    ValueType *Find(const T &key)
+        { return (ValueType *)((const SwissHashTable *)this)->Find(key); }
+    template <typename T = KeyType>
+    const ValueType *Find(const T &key) const
+    {
+        if (!capacity)
+            return nullptr;
+
+        uint64_t hash = Handler::HashKey(key);
+        return Find(hash, key, nullptr);
+    }
+    template <typename T = KeyType>
+    ValueType FindValue(const T &key, const ValueType &default_value)
+        { return (ValueType)((const SwissHashTable *)this)->FindValue(key, default_value); }
+    template <typename T = KeyType>
+    const ValueType FindValue(const T &key, const ValueType &default_value) const
+    {
+        const ValueType *it = Find(key);
+        return it ? *it : default_value;
+    }
+
+    ValueType *Set(const ValueType &value)
+    {
+        const KeyType &key = Handler::GetKey(value);
+
+        bool inserted;
+        ValueType *ptr = Insert(key, &inserted);
+
+        *ptr = value;
+
+        return ptr;
+    }
+    ValueType *SetDefault(const KeyType &key)
+    {
+        bool inserted;
+        ValueType *ptr = Insert(key, &inserted);
+
+        ptr->~ValueType();
+        new (ptr) ValueType();
+
+        return ptr;
+    }
+
+    ValueType *TrySet(const ValueType &value, bool *out_inserted = nullptr)
+    {
+        const KeyType &key = Handler::GetKey(value);
+
+        bool inserted;
+        ValueType *ptr = Insert(key, &inserted);
+
+        if (inserted) {
+            *ptr = value;
+        }
+
+        if (out_inserted) {
+            *out_inserted = inserted;
+        }
+        return ptr;
+    }
+    ValueType *TrySetDefault(const KeyType &key, bool *out_inserted = nullptr)
+    {
+        bool inserted;
+        ValueType *ptr = Insert(key, &inserted);
+
+        if (out_inserted) {
+            *out_inserted = inserted;
+        }
+        return ptr;
+    }
+
+    void Remove(ValueType *it)
+    {
+        if (!it)
+            return;
+
+        Size idx = it - data;
+        RG_ASSERT(!IsEmpty(idx));
+
+        it->~ValueType();
+        new (it) ValueType();
+        count--;
+
+        // Probe sequences stop at the first group with an empty slot, so if this group
+        // has one no lookup can have gone through it and we don't need a tombstone.
+        Group group(ctrl + (idx & ~(Size)15));
+        if (group.MatchEmpty()) {
+            ctrl[idx] = CtrlEmpty;
+        } else {
+            ctrl[idx] = CtrlDeleted;
+            deleted++;
+        }
+    }
+    template <typename T = KeyType>
+    void Remove(const T &key) { Remove(Find(key)); }
+
+    void Trim()
+    {
+        if (count) {
+            Size new_capacity = (Size)1 << (64 - CountLeadingZeros((uint64_t)count));
+
+            if (new_capacity < RG_SWISSTABLE_BASE_CAPACITY) {
+                new_capacity = RG_SWISSTABLE_BASE_CAPACITY;
+            } else if (count > (double)new_capacity * RG_SWISSTABLE_MAX_LOAD_FACTOR) {
+                new_capacity *= 2;
+            }
+
+            Rehash(new_capacity);
+        } else {
+            Rehash(0);
+        }
+    }
+
+private:
+    template <typename T = KeyType>
+    const ValueType *Find(uint64_t hash, const T &key, Size *out_free) const
+    {
+        Size mask = (capacity >> 4) - 1;
+        Size group_idx = (Size)(hash >> 7) & mask;
+        int8_t h2 = (int8_t)(hash & 0x7F);
+
+        if (out_free) {
+            *out_free = -1;
+        }
+
+        // Triangular probing visits each group once when the group count is a power-of-two
+        for (Size step = 1;; step++) {
+            Size base = group_idx << 4;
+            Group group(ctrl + base);
+
+            for (uint32_t bits = group.Match(h2); bits; bits &= bits - 1) {
+                Size idx = base + CountTrailingZeros(bits);
+                const KeyType &it_key = Handler::GetKey(data[idx]);
+
+                if (Handler::TestKeys(it_key, key)) [[likely]]
+                    return &data[idx];
+            }
+
+            if (out_free && *out_free < 0) {
+                uint32_t free = group.MatchFree();
+                if (free) {
+                    *out_free = base + CountTrailingZeros(free);
+                }
+            }
+            if (group.MatchEmpty())
+                return nullptr;
+
+            RG_ASSERT(step <= mask);
+            group_idx = (group_idx + step) & mask;
+        }
+
+        RG_UNREACHABLE();
+    }
+
+    ValueType *Insert(const KeyType &key, bool *out_inserted)
+    {
+        uint64_t hash = Handler::HashKey(key);
+        Size idx;
+
+        if (capacity) {
+            ValueType *it = (ValueType *)Find(hash, key, &idx);
+
+            if (it) {
+                *out_inserted = false;
+                return it;
+            }
+
+            if (count + deleted >= (Size)((double)capacity * RG_SWISSTABLE_MAX_LOAD_FACTOR)) {
+                // Don't grow if most of the load comes from tombstones, rebuild in place
+                if (count >= (Size)((double)capacity * RG_SWISSTABLE_MAX_LOAD_FACTOR / 2)) {
+                    Rehash(capacity << 1);
+                } else {
+                    Rehash(capacity);
+                }
+                idx = FindFree(hash);
+            }
+        } else {
+            Rehash(RG_SWISSTABLE_BASE_CAPACITY);
+            idx = FindFree(hash);
+        }
+
+        deleted -= (ctrl[idx] == CtrlDeleted);
+        ctrl[idx] = (int8_t)(hash & 0x7F);
+        count++;
+
+        *out_inserted = true;
+        return &data[idx];
+    }
+
+    Size FindFree(uint64_t hash) const
+    {
+        Size mask = (capacity >> 4) - 1;
+        Size group_idx = (Size)(hash >> 7) & mask;
+
+        for (Size step = 1;; step++) {
+            Size base = group_idx << 4;
+            Group group(ctrl + base);
+
+            uint32_t free = group.MatchFree();
+            if (free)
+                return base + CountTrailingZeros(free);
+
+            RG_ASSERT(step <= mask);
+            group_idx = (group_idx + step) & mask;
+        }
+
+        RG_UNREACHABLE();
+    }
+
+    void Rehash(Size new_capacity)
+    {
+        if (new_capacity == capacity && !deleted)
+            return;
+        RG_ASSERT(count <= new_capacity);
+
+        int8_t *old_ctrl = ctrl;
+        ValueType *old_data = data;
+        Size old_capacity = capacity;
+
+        if (new_capacity) {
+            RG_ASSERT(new_capacity >= 16);
+
+            ctrl = (int8_t *)AllocateRaw(allocator, new_capacity);
+            data = (ValueType *)AllocateRaw(allocator, new_capacity * RG_SIZE(ValueType));
+            MemSet(ctrl, CtrlEmpty, new_capacity);
+            for (Size i = 0; i < new_capacity; i++) {
+                new (&data[i]) ValueType();
+            }
+            capacity = new_capacity;
+            deleted = 0;
+
+            for (Size i = 0; i < old_capacity; i++) {
+                if (old_ctrl[i] >= 0) {
+                    uint64_t hash = Handler::HashKey(Handler::GetKey(old_data[i]));
+                    Size new_idx = FindFree(hash);
+
+                    ctrl[new_idx] = (int8_t)(hash & 0x7F);
+                    data[new_idx] = std::move(old_data[i]);
+                }
+            }
+        } else {
+            ctrl = nullptr;
+            data = nullptr;
+            capacity = 0;
+        }
+
+        if constexpr(!std::is_trivial<ValueType>::value) {
+            for (Size i = 0; i < old_capacity; i++) {
+                old_data[i].~ValueType();
+            }
+        }
+
+        ReleaseRaw(allocator, old_ctrl, old_capacity);
+        ReleaseRaw(allocator, old_data, old_capacity * RG_SIZE(ValueType));
+    }
+
+    bool IsEmpty(Size idx) const { return ctrl[idx] < 0; }
+};
+
+template <typename T>
+class HashTraits {
+public:
+    static constexpr uint64_t Hash(const T &key) { return key.Hash(); }
+    static constexpr bool Test(const T &key1, const T &key2) { return key1 == key2; }
+};
+
+// Stole the Hash function from Thomas Wang (see here: https://gist.github.com/badboy/6267743)
+#define DEFINE_INTEGER_HASH_TRAITS_32(Type, ...) \
+    template <> \
+    class HashTraits<Type> { \
+    public: \
+        static __VA_ARGS__ uint64_t Hash(Type key) \
+        { \
+            uint32_t hash = (uint32_t)key; \
+             \
+            hash = (hash ^ 61) ^ (hash >> 16); \
+            hash += hash << 3; \
+            hash ^= hash >> 4; \
+            hash *= 0x27D4EB2D; \
+            hash ^= hash >> 15; \
+             \
+            return (uint64_t)hash; \
+        } \
+         \
+        static __VA_ARGS__ bool Test(Type key1, Type key2) { return key1 == key2; } \
+    }
+#define DEFINE_INTEGER_HASH_TRAITS_64(Type, ...) \
+    template <> \
+    class HashTraits<Type> { \
+    public: \
+        static __VA_ARGS__ uint64_t Hash(Type key) \
+        { \
+            uint64_t hash = (uint64_t)key; \
+             \
+            hash = (~hash) + (hash << 18); \
+            hash ^= hash >> 31; \
+            hash *= 21; \
+            hash ^= hash >> 11; \
+            hash += hash << 6; \
+            hash ^= hash >> 22; \
+             \
+            return hash; \
+        } \
+         \
+        static __VA_ARGS__ bool Test(Type key1, Type key2) { return key1 == key2; } \
+    }
+
+DEFINE_INTEGER_HASH_TRAITS_32(char, constexpr);
+DEFINE_INTEGER_HASH_TRAITS_32(unsigned char, constexpr);
+DEFINE_INTEGER_HASH_TRAITS_32(short, constexpr);
+DEFINE_INTEGER_HASH_TRAITS_32(unsigned short, constexpr);
+DEFINE_INTEGER_HASH_TRAITS_32(int, constexpr);
+DEFINE_INTEGER_HASH_TRAITS_32(unsigned int, constexpr);
+#ifdef __LP64__
+    DEFINE_INTEGER_HASH_TRAITS_64(long, constexpr);
+    DEFINE_INTEGER_HASH_TRAITS_64(unsigned long, constexpr);
+#else
+    DEFINE_INTEGER_HASH_TRAITS_32(long, constexpr);
+    DEFINE_INTEGER_HASH_TRAITS_32(unsigned long, constexpr);
+#endif
+DEFINE_INTEGER_HASH_TRAITS_64(long long, constexpr);
+DEFINE_INTEGER_HASH_TRAITS_64(unsigned long long, constexpr);
+#if RG_SIZE_MAX == INT64_MAX
+    DEFINE_INTEGER_HASH_TRAITS_64(void *);
+    DEFINE_INTEGER_HASH_TRAITS_64(const void *);
+#else
+    DEFINE_INTEGER_HASH_TRAITS_32(void *);
+    DEFINE_INTEGER_HASH_TRAITS_32(const void *);
+#endif
+
+#undef DEFINE_INTEGER_HASH_TRAITS_32
+#undef DEFINE_INTEGER_HASH_TRAITS_64
+
+template <>
+class HashTraits<const char *> {
+public:
+    // FNV-1a
+    static constexpr uint64_t Hash(Span<const char> key)
+    {
+        uint64_t hash = 0xCBF29CE484222325ull;
+        for (char c: key) {
+            hash ^= (uint64_t)c;
+            hash *= 0x100000001B3ull;
+        }
+
+        return hash;
+    }
+    static constexpr uint64_t Hash(const char *key)
+    {
+        uint64_t hash = 0xCBF29CE484222325ull;
+        for (Size i = 0; key[i]; i++) {
+            hash ^= (uint64_t)key[i];
+            hash *= 0x100000001B3ull;
+        }
+
+        return hash;
+    }
+
+    static constexpr bool Test(const char *key1, const char *key2) { return TestStr(key1, key2); }
+    static constexpr bool Test(const char *key1, Span<const char> key2) { return key2 == key1; }
+};
+
+template <>
+class HashTraits<Span<const char>> {
+public:
+    // FNV-1a
+    static constexpr uint64_t Hash(Span<const char> key)
+    {
+        uint64_t hash = 0xCBF29CE484222325ull;
+        for (char c: key) {
+            hash ^= (uint64_t)c;
+            hash *= 0x100000001B3ull;
+        }
+
+        return hash;
+    }
+    static constexpr uint64_t Hash(const char *key)
+    {
+        uint64_t hash = 0xCBF29CE484222325ull;
+        for (Size i = 0; key[i]; i++) {
+            hash ^= (uint64_t)key[i];
+            hash *= 0x100000001B3ull;
+        }
+
+        return hash;
+    }
+
+    static constexpr bool Test(Span<const char> key1, Span<const char> key2) { return key1 == key2; }
+    static constexpr bool Test(Span<const char> key1, const char * key2) { return key1 == key2; }
+};
 
-    static constexpr bool Test(Span<const char> key1, Span<const char> key2) { return key1 == key2; }
-    static constexpr bool Test(Span<const char> key1, const char * key2) { return key1 == key2; }
-};
-
 #define RG_HASHTABLE_HANDLER_EX_N(Name, ValueType, KeyType, KeyMember, HashFunc, TestFunc) \
     class Name { \
     public: \
@@ -3165,7 +3764,8 @@ public:
 #define RG_HASHTABLE_HANDLER_NT(Name, ValueType, KeyType, KeyMember) \
     RG_HASHTABLE_HANDLER_EX_N(Name, ValueType, KeyType, KeyMember, HashTraits<KeyType>::Hash, HashTraits<KeyType>::Test)
 
-template <typename KeyType, typename ValueType>
+template <typename KeyType, typename ValueType,
+          template <typename, typename, typename> class TableType = HashTable>
 class HashMap {
 public:
     struct Bucket {
@@ -3175,7 +3775,7 @@ public:
         RG_HASHTABLE_HANDLER(Bucket, key);
     };
 
-    HashTable<KeyType, Bucket> table;
+    TableType<KeyType, Bucket, typename Bucket::HashHandler> table;
 
     HashMap() = default;
     HashMap(std::initializer_list<Bucket> l) : table(l) {}
@@ -3249,7 +3849,8 @@ public:
     void Trim() { table.Trim(); }
 };
 
-template <typename ValueType>
+template <typename ValueType,
+          template <typename, typename, typename> class TableType = HashTable>
 class HashSet {
     class Handler {
     public:
@@ -3262,7 +3863,7 @@ class HashSet {
     };
 
 public:
-    HashTable<ValueType, ValueType, Handler> table;
+    TableType<ValueType, ValueType, Handler> table;
 
     HashSet() = default;
     HashSet(std::initializer_list<ValueType> l) : table(l) {}
@@ -3292,6 +3893,11 @@ public:
     void Trim() { table.Trim(); }
 };
 
+template <typename KeyType, typename ValueType>
+using SwissHashMap = HashMap<KeyType, ValueType, SwissHashTable>;
+template <typename ValueType>
+using SwissHashSet = HashSet<ValueType, SwissHashTable>;
+
 // XXX: Switch to perfect hashing later on
 template <Size N, typename KeyType, typename ValueType>
 class ConstMap {
@@ -3815,6 +4421,302 @@ DEFINE_FMT_VARIANT(PrintLn, void, StreamWriter *)
 
 #undef DEFINE_FMT_VARIANT
 
+// Compile-time format strings: Fmt<"%1%/%2">(&buf, a, b) gives the same result as
+// Fmt(&buf, "%1%/%2", a, b), but the format string is parsed and checked at compile
+// time, and strings, characters and integers are written without going through FmtArg.
+// Use it for hot paths, the runtime version is fine everywhere else.
+
+template <Size N>
+struct FmtLiteral {
+    char str[N] = {};
+
+    constexpr FmtLiteral(const char (&literal)[N])
+    {
+        for (Size i = 0; i < N; i++) {
+            str[i] = literal[i];
+        }
+    }
+};
+
+enum class FmtSegmentType {
+    Text,
+    Ansi,
+    Argument
+};
+
+struct FmtSegment {
+    FmtSegmentType type;
+    Size offset; // Argument index for FmtSegmentType::Argument
+    Size len;
+};
+
+template <Size N>
+struct FmtProgram {
+    FmtSegment segments[N] = {};
+    Size segments_len = 0;
+
+    // ANSI sequences take at most 3 times the length of their specifier
+    char text[3 * N] = {};
+    Size text_len = 0;
+
+    Size args_len = 0;
+    uint64_t used_args = 0;
+    bool has_ansi = false;
+    bool valid = true;
+};
+
+static constexpr inline int FmtAnsiColorCode(char c)
+{
+    switch (c) {
+        case 'd': return 30;
+        case 'r': return 31;
+        case 'g': return 32;
+        case 'y': return 33;
+        case 'b': return 34;
+        case 'm': return 35;
+        case 'c': return 36;
+        case 'w': return 37;
+        case 'D': return 90;
+        case 'R': return 91;
+        case 'G': return 92;
+        case 'Y': return 93;
+        case 'B': return 94;
+        case 'M': return 95;
+        case 'C': return 96;
+        case 'W': return 97;
+        case '.': return 39;
+    }
+
+    return -1;
+}
+
+template <Size N>
+constexpr FmtProgram<N> CompileFmt(const char (&fmt)[N])
+{
+    FmtProgram<N> prog;
+
+    const auto append = [&](FmtSegmentType type, char c) {
+        if (!prog.segments_len || prog.segments[prog.segments_len - 1].type != type) {
+            prog.segments[prog.segments_len++] = { type, prog.text_len, 0 };
+        }
+
+        prog.text[prog.text_len++] = c;
+        prog.segments[prog.segments_len - 1].len++;
+    };
+    const auto append_code = [&](int code) {
+        if (code >= 100) {
+            append(FmtSegmentType::Ansi, (char)('0' + code / 100));
+        }
+        append(FmtSegmentType::Ansi, (char)('0' + code / 10 % 10));
+        append(FmtSegmentType::Ansi, (char)('0' + code % 10));
+    };
+
+    for (Size i = 0; i < N - 1;) {
+        if (fmt[i] != '%') {
+            append(FmtSegmentType::Text, fmt[i++]);
+            continue;
+        }
+
+        if (fmt[i + 1] >= '0' && fmt[i + 1] <= '9') {
+            Size idx = 0;
+
+            i++;
+            while (fmt[i] >= '0' && fmt[i] <= '9') {
+                idx = idx * 10 + (fmt[i++] - '0');
+            }
+
+            if (!idx || idx > 64) {
+                prog.valid = false;
+                return prog;
+            }
+
+            prog.segments[prog.segments_len++] = { FmtSegmentType::Argument, idx - 1, 0 };
+            prog.args_len = std::max(prog.args_len, idx);
+            prog.used_args |= 1ull << (idx - 1);
+        } else if (fmt[i + 1] == '%') {
+            append(FmtSegmentType::Text, '%');
+            i += 2;
+        } else if (fmt[i + 1] == '/') {
+            // Same as *RG_PATH_SEPARATORS, which comes later
+#ifdef _WIN32
+            append(FmtSegmentType::Text, '\\');
+#else
+            append(FmtSegmentType::Text, '/');
+#endif
+            i += 2;
+        } else if (fmt[i + 1] == '!') {
+            append(FmtSegmentType::Ansi, '\x1B');
+            append(FmtSegmentType::Ansi, '[');
+
+            if (fmt[i + 2] == '0') {
+                append(FmtSegmentType::Ansi, '0');
+                i += 3;
+            } else {
+                int fg = FmtAnsiColorCode(fmt[i + 2]);
+                int bg = (fmt[i + 2] && fmt[i + 3]) ? FmtAnsiColorCode(fmt[i + 3]) : -1;
+
+                if (fg < 0 || bg < 0) {
+                    prog.valid = false;
+                    return prog;
+                }
+
+                append_code(fg);
+                append(FmtSegmentType::Ansi, ';');
+                append_code(bg + 10);
+
+                switch (fmt[i + 4]) {
+                    case '+': { append(FmtSegmentType::Ansi, ';'); append(FmtSegmentType::Ansi, '1'); } break;
+                    case '-': { append(FmtSegmentType::Ansi, ';'); append(FmtSegmentType::Ansi, '2'); } break;
+                    case '_': { append(FmtSegmentType::Ansi, ';'); append(FmtSegmentType::Ansi, '4'); } break;
+                    case '^': { append(FmtSegmentType::Ansi, ';'); append(FmtSegmentType::Ansi, '7'); } break;
+                    case '.': {} break;
+
+                    default: {
+                        prog.valid = false;
+                        return prog;
+                    } break;
+                }
+
+                i += 5;
+            }
+
+            append(FmtSegmentType::Ansi, 'm');
+            prog.has_ansi = true;
+        } else {
+            prog.valid = false;
+            return prog;
+        }
+    }
+
+    return prog;
+}
+
+Span<char> FormatUnsignedToDecimal(uint64_t value, char out_buf[32]);
+void FmtArgument(const FmtArg &arg, FunctionRef<void(Span<const char>)> append);
+bool FmtUseVt100();
+
+template <typename T, typename AppendFunc>
+void FmtValue(const T &value, AppendFunc append)
+{
+    if constexpr (std::is_same_v<T, char>) {
+        append(value);
+    } else if constexpr (std::is_same_v<T, const char *> || std::is_same_v<T, char *>) {
+        append(value ? Span<const char>(value) : Span<const char>("(null)"));
+    } else if constexpr (std::is_same_v<T, bool>) {
+        FmtArgument(FmtArg(value), append);
+    } else if constexpr (std::is_integral_v<T>) {
+        char buf[32];
+
+        if constexpr (std::is_signed_v<T>) {
+            if (value < 0) {
+                append('-');
+                append(FormatUnsignedToDecimal(-(uint64_t)value, buf));
+            } else {
+                append(FormatUnsignedToDecimal((uint64_t)value, buf));
+            }
+        } else {
+            append(FormatUnsignedToDecimal((uint64_t)value, buf));
+        }
+    } else if constexpr (std::is_same_v<T, Span<const char>> || std::is_same_v<T, Span<char>>) {
+        append(value);
+    } else {
+        FmtArgument(FmtArg(value), append);
+    }
+}
+
+template <Size Idx, typename T, typename... Args>
+const auto &FmtGetArgument(const T &first, const Args &... args)
+{
+    if constexpr (Idx == 0) {
+        return first;
+    } else {
+        return FmtGetArgument<Idx - 1>(args...);
+    }
+}
+
+template <FmtLiteral FmtStr, typename Vt100Func, typename AppendFunc, typename... Args>
+void DoFormatCompiled(Vt100Func use_vt100, AppendFunc append, const Args &... args)
+{
+    static constexpr FmtProgram prog = CompileFmt(FmtStr.str);
+
+    static_assert(prog.valid, "Invalid format string");
+    static_assert(prog.args_len <= sizeof...(Args), "Format string refers to missing arguments");
+    static_assert(prog.used_args == (sizeof...(Args) ? ~0ull >> (64 - sizeof...(Args)) : 0ull),
+                  "Format string does not use all arguments");
+
+    bool vt100 = prog.has_ansi && use_vt100();
+
+    const auto write = [&]<Size I>() {
+        constexpr FmtSegment seg = prog.segments[I];
+
+        if constexpr (seg.type == FmtSegmentType::Text) {
+            append(Span<const char>(prog.text + seg.offset, seg.len));
+        } else if constexpr (seg.type == FmtSegmentType::Ansi) {
+            if (vt100) {
+                append(Span<const char>(prog.text + seg.offset, seg.len));
+            }
+        } else {
+            FmtValue(FmtGetArgument<seg.offset>(args...), append);
+        }
+    };
+
+    [&]<Size... I>(std::integer_sequence<Size, I...>) {
+        (write.template operator()<I>(), ...);
+    }(std::make_integer_sequence<Size, prog.segments_len>());
+}
+
+template <FmtLiteral FmtStr, typename... Args>
+Span<char> Fmt(Span<char> out_buf, Args... args)
+{
+    RG_ASSERT(out_buf.len >= 0);
+
+    if (!out_buf.len)
+        return {};
+    out_buf.len--;
+
+    Size available_len = out_buf.len;
+
+    DoFormatCompiled<FmtStr>(FmtUseVt100, [&](Span<const char> frag) {
+        Size copy_len = std::min(frag.len, available_len);
+        if (copy_len <= 0)
+            return;
+
+        MemCpy(out_buf.end() - available_len, frag.ptr, copy_len);
+        available_len -= copy_len;
+    }, args...);
+
+    out_buf.len -= available_len;
+    out_buf.ptr[out_buf.len] = 0;
+
+    return out_buf;
+}
+
+template <FmtLiteral FmtStr, typename... Args>
+Span<char> Fmt(HeapArray<char> *out_buf, Args... args)
+{
+    Size start_len = out_buf->len;
+
+    out_buf->Grow(RG_FMT_STRING_BASE_CAPACITY);
+    DoFormatCompiled<FmtStr>(FmtUseVt100, [&](Span<const char> frag) {
+        out_buf->Grow(frag.len + 1);
+        MemCpy(out_buf->end(), frag.ptr, frag.len);
+        out_buf->len += frag.len;
+    }, args...);
+    out_buf->ptr[out_buf->len] = 0;
+
+    return out_buf->Take(start_len, out_buf->len - start_len);
+}
+
+template <FmtLiteral FmtStr, typename... Args>
+Span<char> Fmt(Allocator *alloc, Args... args)
+{
+    RG_ASSERT(alloc);
+
+    HeapArray<char> buf(alloc);
+    Fmt<FmtStr>(&buf, args...);
+    return buf.TrimAndLeak(1);
+}
+
 // Print formatted strings to stdout
 template <typename... Args>
 void Print(const char *fmt, Args... args)
@@ -3884,6 +4786,15 @@ void DefaultLogHandler(LogLevel level, const char *ctx, const char *msg);
 void PushLogFilter(const std::function<LogFilterFunc> &func);
 void PopLogFilter();
 
+// Once enabled, each logging thread gets its own ring buffer, and a background thread calls
+// the log handler with the queued messages. Log filters still run synchronously, in the
+// logging thread. When the buffer of a thread is full, messages are dropped (and a warning
+// with the count shows up later), except for errors which are written synchronously.
+// Everything is flushed on exit, on assertion failures, and when calling FlushLog().
+bool EnableAsyncLog();
+void DisableAsyncLog();
+void FlushLog();
+
 #ifdef _WIN32
 bool RedirectLogToWindowsEvents(const char *name);
 #endif
@@ -4435,6 +5346,42 @@ public:
     friend class AsyncPool;
 };
 
+// ------------------------------------------------------------------------
+// Batch I/O
+// ------------------------------------------------------------------------
+
+// Queue many small file operations and run them together with Sync(). On Linux this uses
+// io_uring when the kernel allows it. Elsewhere (or when io_uring is blocked, by seccomp
+// for example), operations run one by one, on the threads of the parent Async if any.
+//
+// Callbacks run on the thread calling Sync(), or on the Async threads if a parent was
+// given, and they must not queue new operations to the same batch.
+class IoBatch {
+    RG_DELETE_COPY(IoBatch)
+
+    class IoQueue *queue;
+
+public:
+    IoBatch(int depth = 256, Async *parent = nullptr);
+    ~IoBatch();
+
+    // Call before queuing anything. Reads and writes that fall inside one of these
+    // buffers skip per-operation page mapping (io_uring fixed buffers).
+    bool RegisterBuffers(Span<const Span<uint8_t>> buffers);
+
+    void Stat(const char *filename, unsigned int flags,
+              std::function<void(StatResult ret, const FileInfo &file_info)> func);
+    void Read(int fd, int64_t offset, Span<uint8_t> buf, std::function<void(Size len)> func);
+    void Write(int fd, int64_t offset, Span<const uint8_t> buf, std::function<void(bool success)> func);
+    void MakeDirectory(const char *directory, bool error_if_exists, std::function<void(bool success)> func);
+
+    // Failed operations are logged and reported to their callback, Sync() only fails
+    // when the batch itself could not run.
+    bool Sync();
+
+    bool IsAccelerated() const;
+};
+
 // ------------------------------------------------------------------------
 // Streams
 // ------------------------------------------------------------------------
@@ -4473,6 +5420,10 @@ class StreamReader {
             struct {
                 int fd;
                 bool owned;
+
+                // Set when the file is mapped (see SetMapping)
+                Span<const uint8_t> map;
+                Size map_pos;
             } file;
             std::function<Size(Span<uint8_t> buf)> func;
 
@@ -4485,11 +5436,13 @@ class StreamReader {
     } source;
 
     StreamDecoder *decoder = nullptr;
+    bool mapping = false;
 
     int64_t raw_len = -1;
     Size raw_read = 0;
     bool eof = false;
 
+    HeapArray<uint8_t> view_buf;
     BlockAllocator str_alloc;
 
 public:
@@ -4511,6 +5464,11 @@ public:
     // Call before Open!
     void SetDecoder(StreamDecoder *decoder);
 
+    // Call before Open! Regular uncompressed files opened by name are mapped in memory
+    // instead of being read, and ReadView() hands out views into the mapping. Don't use
+    // this for files that may be truncated while you read them (SIGBUS).
+    void SetMapping(bool enable) { mapping = enable; }
+
     bool Open(Span<const uint8_t> buf, const char *filename = nullptr,
               CompressionType compression_type = CompressionType::None);
     bool Open(int fd, const char *filename,
@@ -4527,6 +5485,7 @@ public:
     int64_t GetReadLimit() { return read_max; }
     bool IsValid() const { return filename && !error; }
     bool IsEOF() const { return eof; }
+    bool IsMapped() const { return source.type == SourceType::File && source.u.file.map.ptr; }
 
     int GetDescriptor() const;
 
@@ -4540,6 +5499,11 @@ public:
     Size ReadAll(Size max_len, HeapArray<char> *out_buf)
         { return ReadAll(max_len, (HeapArray<uint8_t> *)out_buf); }
 
+    // The view is only valid until the next read. It points directly into the source for memory
+    // and mapped streams, and into an internal buffer otherwise. Returns an empty view on
+    // EOF and on error, use IsValid() to distinguish them.
+    Span<const uint8_t> ReadView(Size max_len = -1);
+
     int64_t ComputeRawLen();
     int64_t GetRawRead() const { return raw_read; }
 
@@ -4547,6 +5511,7 @@ private:
     bool Close(bool implicit);
 
     bool InitDecompressor(CompressionType type);
+    void MapFile();
 
     Size ReadRaw(Size max_len, void *out_buf);
 
@@ -4614,6 +5579,7 @@ class LineReader {
 
     HeapArray<char> buf;
     Span<char> view = {};
+    Span<const char> chunk = {};
 
     StreamReader *st;
     bool error;
@@ -4633,6 +5599,11 @@ public:
     bool Next(Span<char> *out_line);
     bool Next(Span<const char> *out_line) { return Next((Span<char> *)out_line); }
 
+    // Lines are not NUL-terminated, but they point directly into the source when possible
+    // (see StreamReader::ReadView), and are only copied when they straddle two chunks.
+    // Don't mix with Next() on the same reader.
+    bool NextView(Span<const char> *out_line);
+
     void PushLogFilter();
 };
 
@@ -4687,6 +5658,8 @@ class StreamWriter {
     } dest;
 
     StreamEncoder *encoder = nullptr;
+    int compression_threads = 0;
+    Async *compression_parent = nullptr;
 
     int64_t raw_written = 0;
 
@@ -4719,6 +5692,12 @@ public:
     // Call before Open!
     void SetEncoder(StreamEncoder *encoder);
 
+    // Call before Open! Compressors that support it will use several threads, from a
+    // dedicated pool (threads > 0), the default pool (-1) or the pool of a parent Async.
+    void SetCompressionThreads(int threads);
+    void SetCompressionThreads(Async *parent);
+    bool IsCompressionParallel() const { return compression_threads || compression_parent; }
+
     bool Open(HeapArray<uint8_t> *mem, const char *filename = nullptr,
               CompressionType compression_type = CompressionType::None,
               CompressionSpeed compression_speed = CompressionSpeed::Default);
@@ -4766,6 +5745,34 @@ private:
     friend class StreamEncoder;
 };
 
+template <FmtLiteral FmtStr, typename... Args>
+void Print(StreamWriter *out_st, Args... args)
+{
+    LocalArray<char, RG_FMT_STRING_PRINT_BUFFER_SIZE> buf;
+
+    DoFormatCompiled<FmtStr>([&]() { return out_st->IsVt100(); }, [&](Span<const char> frag) {
+        if (frag.len > RG_LEN(buf.data) - buf.len) {
+            out_st->Write(buf);
+            buf.len = 0;
+        }
+        if (frag.len >= RG_LEN(buf.data)) {
+            out_st->Write(frag);
+        } else {
+            MemCpy(buf.data + buf.len, frag.ptr, frag.len);
+            buf.len += frag.len;
+        }
+    }, args...);
+
+    out_st->Write(buf);
+}
+
+template <FmtLiteral FmtStr, typename... Args>
+void PrintLn(StreamWriter *out_st, Args... args)
+{
+    Print<FmtStr>(out_st, args...);
+    out_st->Write('\n');
+}
+
 static inline bool WriteFile(Span<const uint8_t> buf, const char *filename, unsigned int flags = 0)
 {
     StreamWriter st(filename, flags);
@@ -4794,9 +5801,50 @@ protected:
     const char *GetFileName() const { return writer->filename; }
     bool IsValid() const { return writer->IsValid(); }
 
+    int GetCompressionThreads() const;
+    Async *CreateCompressionAsync() const;
+
     bool WriteRaw(Span<const uint8_t> buf) { return writer->WriteRaw(buf); }
 };
 
+// Splits the stream in blocks that are compressed independently by worker threads, and
+// written in order. One batch compresses while the next one fills up, so memory use is
+// bounded to two batches of one block per worker.
+class StreamBlockEncoder: public StreamEncoder {
+    struct Block {
+        HeapArray<uint8_t> in;
+        HeapArray<uint8_t> out;
+        uint32_t checksum;
+    };
+
+    Size block_size;
+    Async *async;
+
+    HeapArray<Block> batches[2];
+    Size filled = 0;
+    Size pending = 0;
+
+public:
+    StreamBlockEncoder(StreamWriter *writer, Size block_size);
+    ~StreamBlockEncoder();
+
+    bool Write(Span<const uint8_t> buf) override;
+    bool Finalize() override;
+
+protected:
+    // Called from worker threads, must not touch shared state
+    virtual bool CompressBlock(Span<const uint8_t> buf, bool last,
+                               HeapArray<uint8_t> *out_buf, uint32_t *out_checksum) = 0;
+
+    // Called in stream order
+    virtual bool WriteBlock(Span<const uint8_t> compressed, Size len, uint32_t checksum);
+    virtual bool WriteFooter() { return true; }
+
+private:
+    bool Dispatch(bool last);
+    bool Drain();
+};
+
 typedef StreamEncoder *CreateCompressorFunc(StreamWriter *writer, CompressionType type, CompressionSpeed speed);
 
 class StreamCompressorHelper {
@@ -4811,6 +5859,14 @@ public:
         return compressor; \
     } \
     static StreamCompressorHelper RG_UNIQUE_NAME(CreateCompressorHelper)((Type), RG_UNIQUE_NAME(CreateCompressor))
+#define RG_REGISTER_PARALLEL_COMPRESSOR(Type, Cls, ParallelCls) \
+    static StreamEncoder *RG_UNIQUE_NAME(CreateCompressor)(StreamWriter *writer, CompressionType type, CompressionSpeed speed) \
+    { \
+        StreamEncoder *compressor = writer->IsCompressionParallel() ? (StreamEncoder *)new ParallelCls(writer, type, speed) \
+                                                                    : (StreamEncoder *)new Cls(writer, type, speed); \
+        return compressor; \
+    } \
+    static StreamCompressorHelper RG_UNIQUE_NAME(CreateCompressorHelper)((Type), RG_UNIQUE_NAME(CreateCompressor))
 
 bool SpliceStream(StreamReader *reader, int64_t max_len, StreamWriter *writer);
 
@@ -191,7 +191,90 @@ bool LZ4Compressor::Finalize()
     return true;
 }
 
+// Writes a single LZ4 frame with independent blocks, which any LZ4 decoder can read,
+// instead of concatenated frames that some decoders (including ours) stop after.
+class LZ4BlockCompressor: public StreamBlockEncoder {
+    int level = 0;
+
+public:
+    LZ4BlockCompressor(StreamWriter *writer, CompressionType type, CompressionSpeed speed);
+    ~LZ4BlockCompressor() {}
+
+protected:
+    bool CompressBlock(Span<const uint8_t> buf, bool last,
+                       HeapArray<uint8_t> *out_buf, uint32_t *out_checksum) override;
+    bool WriteFooter() override;
+};
+
+LZ4BlockCompressor::LZ4BlockCompressor(StreamWriter *writer, CompressionType, CompressionSpeed speed)
+    : StreamBlockEncoder(writer, Mebibytes(1))
+{
+    switch (speed) {
+        case CompressionSpeed::Default: { level = LZ4HC_CLEVEL_MIN; } break;
+        case CompressionSpeed::Slow: { level = LZ4HC_CLEVEL_MAX; } break;
+        case CompressionSpeed::Fast: { level = 0; } break;
+    }
+
+    LZ4F_preferences_t prefs = {};
+    prefs.frameInfo.blockSizeID = LZ4F_max1MB;
+    prefs.frameInfo.blockMode = LZ4F_blockIndependent;
+    prefs.compressionLevel = level;
+
+    LZ4F_cctx *encoder;
+    LZ4F_errorCode_t err = LZ4F_createCompressionContext(&encoder, LZ4F_VERSION);
+    if (LZ4F_isError(err))
+        RG_BAD_ALLOC();
+    RG_DEFER { LZ4F_freeCompressionContext(encoder); };
+
+    uint8_t header[LZ4F_HEADER_SIZE_MAX];
+    size_t ret = LZ4F_compressBegin(encoder, header, RG_SIZE(header), &prefs);
+    if (LZ4F_isError(ret))
+        RG_BAD_ALLOC();
+
+    WriteRaw(MakeSpan(header, (Size)ret));
+}
+
+bool LZ4BlockCompressor::CompressBlock(Span<const uint8_t> buf, bool,
+                                       HeapArray<uint8_t> *out_buf, uint32_t *)
+{
+    if (!buf.len)
+        return true;
+
+    int bound = LZ4_compressBound((int)buf.len);
+    out_buf->Grow(4 + bound);
+
+    const char *src = (const char *)buf.ptr;
+    char *dest = (char *)out_buf->ptr + 4;
+    int ret;
+
+    if (level >= LZ4HC_CLEVEL_MIN) {
+        ret = LZ4_compress_HC(src, dest, (int)buf.len, bound, level);
+    } else {
+        ret = LZ4_compress_default(src, dest, (int)buf.len, bound);
+    }
+
+    // Store incompressible blocks as-is, the high bit of the size marks them
+    uint32_t size;
+    if (ret > 0 && ret < buf.len) {
+        size = LittleEndian((uint32_t)ret);
+        out_buf->len = 4 + ret;
+    } else {
+        size = LittleEndian((uint32_t)buf.len | 0x80000000u);
+        MemCpy(dest, buf.ptr, buf.len);
+        out_buf->len = 4 + buf.len;
+    }
+    MemCpy(out_buf->ptr, &size, RG_SIZE(size));
+
+    return true;
+}
+
+bool LZ4BlockCompressor::WriteFooter()
+{
+    static const uint8_t end_mark[4] = {};
+    return WriteRaw(end_mark);
+}
+
 RG_REGISTER_DECOMPRESSOR(CompressionType::LZ4, LZ4Decompressor);
-RG_REGISTER_COMPRESSOR(CompressionType::LZ4, LZ4Compressor);
+RG_REGISTER_PARALLEL_COMPRESSOR(CompressionType::LZ4, LZ4Compressor, LZ4BlockCompressor);
 
 }
@@ -345,9 +345,211 @@ bool MinizCompressor::Finalize()
     return true;
 }
 
+// Same as zlib crc32_combine(), which miniz lacks
+static uint32_t MultiplyGF2(const uint32_t *mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+
+    while (vec) {
+        if (vec & 1) {
+            sum ^= *mat;
+        }
+        vec >>= 1;
+        mat++;
+    }
+
+    return sum;
+}
+
+static void SquareGF2(uint32_t *square, const uint32_t *mat)
+{
+    for (int i = 0; i < 32; i++) {
+        square[i] = MultiplyGF2(mat, mat[i]);
+    }
+}
+
+static uint32_t CombineCrc32(uint32_t crc1, uint32_t crc2, Size len2)
+{
+    if (len2 <= 0)
+        return crc1;
+
+    uint32_t even[32];
+    uint32_t odd[32];
+
+    // Operator for one zero bit in odd
+    odd[0] = 0xEDB88320u;
+    for (int i = 1; i < 32; i++) {
+        odd[i] = 1u << (i - 1);
+    }
+
+    SquareGF2(even, odd); // Two zero bits
+    SquareGF2(odd, even); // Four zero bits
+
+    // Apply len2 zeros to crc1 (first square puts the operator for one zero byte in even)
+    do {
+        SquareGF2(even, odd);
+        if (len2 & 1) {
+            crc1 = MultiplyGF2(even, crc1);
+        }
+        len2 >>= 1;
+
+        if (!len2)
+            break;
+
+        SquareGF2(odd, even);
+        if (len2 & 1) {
+            crc1 = MultiplyGF2(odd, crc1);
+        }
+        len2 >>= 1;
+    } while (len2);
+
+    return crc1 ^ crc2;
+}
+
+static uint32_t CombineAdler32(uint32_t adler1, uint32_t adler2, Size len2)
+{
+    static const uint32_t Base = 65521;
+
+    uint32_t rem = (uint32_t)(len2 % Base);
+    uint32_t sum1 = adler1 & 0xFFFF;
+    uint32_t sum2 = (rem * sum1) % Base;
+
+    sum1 += (adler2 & 0xFFFF) + Base - 1;
+    sum2 += ((adler1 >> 16) & 0xFFFF) + ((adler2 >> 16) & 0xFFFF) + Base - rem;
+
+    if (sum1 >= Base) sum1 -= Base;
+    if (sum1 >= Base) sum1 -= Base;
+    if (sum2 >= Base * 2) sum2 -= Base * 2;
+    if (sum2 >= Base) sum2 -= Base;
+
+    return sum1 | (sum2 << 16);
+}
+
+// Each block is deflated on its own and ends with a sync flush (empty stored block) to
+// stay byte-aligned, so concatenating them gives a valid Deflate stream. Unlike pigz we
+// don't prime blocks with the previous 32 kB (tdefl has no dictionary support), which
+// costs a little ratio at block boundaries.
+class MinizBlockCompressor: public StreamBlockEncoder {
+    int flags = 0;
+
+    bool is_gzip = false;
+    uint32_t checksum = 0;
+    Size uncompressed_size = 0;
+
+public:
+    MinizBlockCompressor(StreamWriter *writer, CompressionType type, CompressionSpeed speed);
+    ~MinizBlockCompressor() {}
+
+protected:
+    bool CompressBlock(Span<const uint8_t> buf, bool last,
+                       HeapArray<uint8_t> *out_buf, uint32_t *out_checksum) override;
+    bool WriteBlock(Span<const uint8_t> compressed, Size len, uint32_t checksum) override;
+    bool WriteFooter() override;
+};
+
+MinizBlockCompressor::MinizBlockCompressor(StreamWriter *writer, CompressionType type, CompressionSpeed speed)
+    : StreamBlockEncoder(writer, Mebibytes(1))
+{
+    is_gzip = (type == CompressionType::Gzip);
+
+    switch (speed) {
+        case CompressionSpeed::Default: { flags = 32 | TDEFL_GREEDY_PARSING_FLAG; } break;
+        case CompressionSpeed::Slow: { flags = 512; } break;
+        case CompressionSpeed::Fast: { flags = 1 | TDEFL_GREEDY_PARSING_FLAG; } break;
+    }
+
+    if (is_gzip) {
+        static uint8_t gzip_header[] = {
+            0x1F, 0x8B, // Fixed bytes
+            8,          // Deflate
+            0,          // FLG
+            0, 0, 0, 0, // MTIME
+            0,          // XFL
+            0           // OS
+        };
+
+        checksum = MZ_CRC32_INIT;
+        WriteRaw(gzip_header);
+    } else {
+        static uint8_t zlib_header[] = {
+            0x78, 0x9C // Deflate with 32 kB window, FCHECK matches
+        };
+
+        checksum = MZ_ADLER32_INIT;
+        WriteRaw(zlib_header);
+    }
+}
+
+bool MinizBlockCompressor::CompressBlock(Span<const uint8_t> buf, bool last,
+                                         HeapArray<uint8_t> *out_buf, uint32_t *out_checksum)
+{
+    // Too big for the stack of worker threads
+    tdefl_compressor *deflator = AllocateOne<tdefl_compressor>(nullptr);
+    RG_DEFER { ReleaseOne(nullptr, deflator); };
+
+    tdefl_status status = tdefl_init(deflator, [](const void *buf, int len, void *udata) {
+        HeapArray<uint8_t> *out_buf = (HeapArray<uint8_t> *)udata;
+        out_buf->Append(MakeSpan((const uint8_t *)buf, len));
+        return (int)true;
+    }, out_buf, flags);
+    RG_ASSERT(status == TDEFL_STATUS_OKAY);
+
+    uint8_t dummy; // Avoid UB in miniz
+    const uint8_t *ptr = buf.len ? buf.ptr : &dummy;
+
+    if (last) {
+        status = tdefl_compress_buffer(deflator, ptr, (size_t)buf.len, TDEFL_FINISH);
+        if (status != TDEFL_STATUS_DONE) {
+            LogError("Failed to end Deflate stream for '%1'", GetFileName());
+            return false;
+        }
+    } else {
+        status = tdefl_compress_buffer(deflator, ptr, (size_t)buf.len, TDEFL_SYNC_FLUSH);
+        if (status != TDEFL_STATUS_OKAY) {
+            LogError("Failed to deflate stream to '%1'", GetFileName());
+            return false;
+        }
+    }
+
+    if (is_gzip) {
+        *out_checksum = (uint32_t)mz_crc32(MZ_CRC32_INIT, buf.ptr, (size_t)buf.len);
+    } else {
+        *out_checksum = (uint32_t)mz_adler32(MZ_ADLER32_INIT, buf.ptr, (size_t)buf.len);
+    }
+
+    return true;
+}
+
+bool MinizBlockCompressor::WriteBlock(Span<const uint8_t> compressed, Size len, uint32_t block_checksum)
+{
+    if (is_gzip) {
+        checksum = CombineCrc32(checksum, block_checksum, len);
+    } else {
+        checksum = CombineAdler32(checksum, block_checksum, len);
+    }
+    uncompressed_size += len;
+
+    return WriteRaw(compressed);
+}
+
+bool MinizBlockCompressor::WriteFooter()
+{
+    if (is_gzip) {
+        uint32_t gzip_footer[] = {
+            LittleEndian(checksum),
+            LittleEndian((uint32_t)uncompressed_size)
+        };
+
+        return WriteRaw(MakeSpan((uint8_t *)gzip_footer, RG_SIZE(gzip_footer)));
+    } else {
+        uint32_t zlib_footer = BigEndian(checksum);
+        return WriteRaw(MakeSpan((uint8_t *)&zlib_footer, RG_SIZE(zlib_footer)));
+    }
+}
+
 RG_REGISTER_DECOMPRESSOR(CompressionType::Zlib, MinizDecompressor);
 RG_REGISTER_DECOMPRESSOR(CompressionType::Gzip, MinizDecompressor);
-RG_REGISTER_COMPRESSOR(CompressionType::Zlib, MinizCompressor);
-RG_REGISTER_COMPRESSOR(CompressionType::Gzip, MinizCompressor);
+RG_REGISTER_PARALLEL_COMPRESSOR(CompressionType::Zlib, MinizCompressor, MinizBlockCompressor);
+RG_REGISTER_PARALLEL_COMPRESSOR(CompressionType::Gzip, MinizCompressor, MinizBlockCompressor);
 
 }
@@ -126,6 +126,12 @@ ZstdCompressor::ZstdCompressor(StreamWriter *writer, CompressionType, Compressio
     }
 
     ZSTD_CCtx_setParameter(ctx, ZSTD_c_checksumFlag, 1);
+
+    // Zstandard has its own worker threads, it cannot share an Async pool. This fails
+    // silently (and we stay single-threaded) when built without ZSTD_MULTITHREAD.
+    if (writer->IsCompressionParallel()) {
+        ZSTD_CCtx_setParameter(ctx, ZSTD_c_nbWorkers, GetCompressionThreads());
+    }
 }
 
 ZstdCompressor::~ZstdCompressor()
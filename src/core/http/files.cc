@@ -0,0 +1,686 @@
+// Copyright 2023 Niels Martignène <niels.martignene@protonmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of
+// this software and associated documentation files (the “Software”), to deal in
+// the Software without restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the
+// Software, and to permit persons to whom the Software is furnished to do so,
+// subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+
+
+#include "src/core/base/base.hh"
+#include "server.hh"
+#include "misc.hh"
+
+#ifdef __linux__
+    #include <sys/inotify.h>
+    #include <unistd.h>
+#endif
+
+namespace RG {
+
+// Sidecars are tried in this order, the plain file comes last
+static const struct {
+    CompressionType encoding;
+    const char *extension;
+} Sidecars[] = {
+    { CompressionType::Brotli, ".br" },
+    { CompressionType::Zstd, ".zst" },
+    { CompressionType::Gzip, ".gz" }
+};
+
+struct http_FileVariant {
+    CompressionType encoding;
+    const char *filename;
+    int64_t size;
+
+    Span<const uint8_t> data; // Only set for cached files
+};
+
+struct http_FileEntry: public RetainObject<http_FileEntry> {
+    const char *filename;
+    LocalArray<http_FileVariant, RG_LEN(Sidecars) + 1> variants;
+
+    // Set by http_FileCache, to find entries from inotify events
+    int wd;
+    const char *watch_key;
+
+    // Least recently used entries are at the end
+    http_FileEntry *prev;
+    http_FileEntry *next;
+
+    BlockAllocator str_alloc;
+
+    RG_HASHTABLE_HANDLER(http_FileEntry, filename);
+};
+
+static bool LoadFileEntry(const char *filename, bool sidecars, Size max_data, http_FileEntry *out_entry)
+{
+    FileInfo file_info;
+    if (StatFile(filename, &file_info) != StatResult::Success)
+        return false;
+    if (file_info.type != FileType::File) {
+        LogError("Path '%1' is not a file", filename);
+        return false;
+    }
+
+    out_entry->filename = DuplicateString(filename, &out_entry->str_alloc).ptr;
+
+    if (sidecars) {
+        for (const auto &sidecar: Sidecars) {
+            const char *sidecar_filename = Fmt(&out_entry->str_alloc, "%1%2", filename, sidecar.extension).ptr;
+
+            FileInfo sidecar_info;
+            if (StatFile(sidecar_filename, (int)StatFlag::IgnoreMissing, &sidecar_info) != StatResult::Success)
+                continue;
+
+            // Ignore sidecars older than the file, they are probably stale
+            if (sidecar_info.type != FileType::File || sidecar_info.mtime < file_info.mtime)
+                continue;
+
+            out_entry->variants.Append({ sidecar.encoding, sidecar_filename, sidecar_info.size, {} });
+        }
+    }
+    out_entry->variants.Append({ CompressionType::None, out_entry->filename, file_info.size, {} });
+
+    if (max_data > 0) {
+        for (http_FileVariant &variant: out_entry->variants) {
+            if (variant.size > max_data)
+                continue;
+
+            HeapArray<uint8_t> buf;
+            if (ReadFile(variant.filename, max_data, &buf) != variant.size)
+                return false;
+
+            variant.data = buf.TrimAndLeak();
+        }
+    }
+
+    return true;
+}
+
+static void ReleaseFileEntry(http_FileEntry *entry)
+{
+    if (!entry->Unref()) {
+        for (const http_FileVariant &variant: entry->variants) {
+            ReleaseSpan(nullptr, variant.data);
+        }
+
+        delete entry;
+    }
+}
+
+#ifdef __linux__
+
+// Keeps small files in memory, along with the stat results of bigger ones. Entries are
+// invalidated with inotify: each directory gets one watch, which is removed once nothing
+// in the directory is cached (or being loaded) anymore.
+class http_FileCache {
+    RG_DELETE_COPY(http_FileCache)
+
+    struct Watch {
+        int wd;
+
+        // Cached entries and loads in progress
+        Size users;
+
+        RG_HASHTABLE_HANDLER(Watch, wd);
+    };
+
+    // Loads run without the lock, events that happen meanwhile mark them as stale
+    struct PendingLoad {
+        int wd;
+        Span<const char> basename;
+        bool stale;
+    };
+
+    Size max_size;
+    int inotify_fd = -1;
+
+    std::mutex mutex;
+
+    HashTable<const char *, http_FileEntry *> map;
+    HashMap<const char *, http_FileEntry *> watched_entries;
+    http_FileEntry *first = nullptr;
+    http_FileEntry *last = nullptr;
+    Size total_size = 0;
+
+    HashTable<int, Watch> watches;
+    HashMap<const char *, int> directories;
+    HeapArray<PendingLoad *> loads;
+
+public:
+    http_FileCache(Size max_size) : max_size(max_size) {}
+    ~http_FileCache();
+
+    bool Init();
+
+    // Returned entries must be given back with ReleaseFileEntry()
+    http_FileEntry *Find(const char *filename);
+
+private:
+    int RetainWatch(const char *filename);
+    void ReleaseWatch(int wd);
+    void ForgetWatch(int wd);
+
+    void ProcessEvents();
+    void InvalidateFile(int wd, Span<const char> basename);
+    void InvalidateDirectory(int wd);
+    void Remove(http_FileEntry *entry);
+    void Clear();
+
+    void Link(http_FileEntry *entry);
+    void Unlink(http_FileEntry *entry);
+
+    static Size ComputeEntrySize(const http_FileEntry *entry);
+};
+
+http_FileCache::~http_FileCache()
+{
+    Clear();
+
+    if (inotify_fd >= 0) {
+        close(inotify_fd);
+    }
+}
+
+bool http_FileCache::Init()
+{
+    RG_ASSERT(inotify_fd < 0);
+
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        LogError("Failed to initialize inotify: %1", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+http_FileEntry *http_FileCache::Find(const char *filename)
+{
+    PendingLoad load = {};
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        // Cheap when nothing changed (one read syscall), and it makes sure we never serve
+        // something that changed before the request came in.
+        ProcessEvents();
+
+        http_FileEntry *entry = map.FindValue(filename, nullptr);
+
+        if (entry) {
+            Unlink(entry);
+            Link(entry);
+
+            entry->Ref();
+            return entry;
+        }
+
+        // Watch directory before stat, so we can't miss changes in between
+        load.wd = RetainWatch(filename);
+        load.basename = SplitStrReverseAny(filename, RG_PATH_SEPARATORS);
+
+        if (load.wd >= 0) {
+            loads.Append(&load);
+        }
+    }
+
+    // Stat and read without the lock, other requests should not wait for the disk.
+    // Don't let a single big file flush everything else. Sidecars are always loaded,
+    // because the same file can be served with or without them.
+    http_FileEntry *entry = new http_FileEntry;
+
+    // One reference for the caller
+    entry->Ref();
+
+    if (!LoadFileEntry(filename, true, max_size / 16, entry)) {
+        ReleaseFileEntry(entry);
+        entry = nullptr;
+    }
+
+    // Don't cache anything we can't invalidate
+    if (load.wd < 0)
+        return entry;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    ProcessEvents();
+
+    for (Size i = 0; i < loads.len; i++) {
+        if (loads[i] == &load) {
+            std::swap(loads[i], loads[loads.len - 1]);
+            loads.RemoveLast(1);
+
+            break;
+        }
+    }
+
+    // Something changed while we were loading the file, and the events could not invalidate
+    // an entry that was not in the cache yet. Serve it but don't keep it around.
+    if (!entry || load.stale) {
+        ReleaseWatch(load.wd);
+        return entry;
+    }
+
+    // Another request may have been faster, keep the one already in the cache
+    if (http_FileEntry *prev = map.FindValue(filename, nullptr); prev) {
+        ReleaseWatch(load.wd);
+
+        Unlink(prev);
+        Link(prev);
+
+        prev->Ref();
+        ReleaseFileEntry(entry);
+
+        return prev;
+    }
+
+    // Inotify events give us the directory and the basename, different paths to the same
+    // file (such as 'a/b' and 'a/./b') end up with the same key. Keep the newest one.
+    entry->wd = load.wd;
+    entry->watch_key = Fmt(&entry->str_alloc, "%1/%2", load.wd, load.basename).ptr;
+
+    if (http_FileEntry *alias = watched_entries.FindValue(entry->watch_key, nullptr); alias) {
+        Remove(alias);
+    }
+
+    Size entry_size = ComputeEntrySize(entry);
+
+    while (last && total_size + entry_size > max_size) {
+        Remove(last);
+    }
+
+    // And one for the cache, which takes over the watch reference
+    entry->Ref();
+    map.Set(entry);
+    watched_entries.Set(entry->watch_key, entry);
+    Link(entry);
+
+    return entry;
+}
+
+// Call with mutex locked
+int http_FileCache::RetainWatch(const char *filename)
+{
+    Span<const char> directory = GetPathDirectory(filename);
+
+    if (int *ptr = directories.Find(directory); ptr) {
+        Watch *watch = watches.Find(*ptr);
+        watch->users++;
+
+        return watch->wd;
+    }
+
+    const char *key = DuplicateString(directory, GetDefaultAllocator()).ptr;
+    const char *path = directory.len ? key : ".";
+
+    int wd = inotify_add_watch(inotify_fd, path, IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB |
+                                                 IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO |
+                                                 IN_MOVE_SELF);
+
+    if (wd < 0) {
+        LogError("Failed to watch directory '%1': %2", path, strerror(errno));
+
+        ReleaseRaw(nullptr, key, -1);
+        return -1;
+    }
+
+    directories.Set(key, wd);
+
+    // Different directory strings can lead to the same watch
+    bool inserted;
+    Watch *watch = watches.TrySetDefault(wd, &inserted);
+
+    if (inserted) {
+        watch->wd = wd;
+        watch->users = 1;
+    } else {
+        watch->users++;
+    }
+
+    return wd;
+}
+
+// Call with mutex locked
+void http_FileCache::ReleaseWatch(int wd)
+{
+    Watch *watch = watches.Find(wd);
+
+    // The directory may be gone already (see InvalidateDirectory)
+    if (!watch)
+        return;
+    if (--watch->users)
+        return;
+
+    inotify_rm_watch(inotify_fd, wd);
+    ForgetWatch(wd);
+}
+
+// Call with mutex locked
+void http_FileCache::ForgetWatch(int wd)
+{
+    // Removing from the table moves other buckets around, so collect keys first
+    HeapArray<const char *> keys;
+    for (const auto &it: directories.table) {
+        if (it.value == wd) {
+            keys.Append(it.key);
+        }
+    }
+
+    for (const char *key: keys) {
+        directories.Remove(key);
+        ReleaseRaw(nullptr, key, -1);
+    }
+
+    watches.Remove(wd);
+}
+
+// Call with mutex locked
+void http_FileCache::ProcessEvents()
+{
+    alignas(struct inotify_event) uint8_t buf[16384];
+
+    for (;;) {
+        ssize_t len = RG_RESTART_EINTR(read(inotify_fd, buf, RG_SIZE(buf)), < 0);
+
+        if (len < 0) {
+            if (errno != EAGAIN) {
+                LogError("Failed to read inotify events: %1", strerror(errno));
+                Clear();
+            }
+            return;
+        }
+
+        for (Size offset = 0; offset < len;) {
+            const struct inotify_event *event = (const struct inotify_event *)(buf + offset);
+            offset += RG_SIZE(*event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                // Start from scratch, this is rare enough
+                Clear();
+            } else if (event->mask & IN_MOVE_SELF) {
+                // Paths below it are not valid anymore, IN_IGNORED will follow
+                inotify_rm_watch(inotify_fd, event->wd);
+            } else if (event->mask & IN_IGNORED) {
+                InvalidateDirectory(event->wd);
+            } else if (event->len) {
+                Span<const char> basename = event->name;
+
+                InvalidateFile(event->wd, basename);
+
+                // Changes to sidecars invalidate the main file
+                for (const auto &sidecar: Sidecars) {
+                    if (EndsWith(basename, sidecar.extension)) {
+                        basename.len -= strlen(sidecar.extension);
+                        InvalidateFile(event->wd, basename);
+
+                        break;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Call with mutex locked
+void http_FileCache::InvalidateFile(int wd, Span<const char> basename)
+{
+    for (PendingLoad *load: loads) {
+        load->stale |= (load->wd == wd && load->basename == basename);
+    }
+
+    char key[512];
+    Fmt(key, "%1/%2", wd, basename);
+
+    if (http_FileEntry *entry = watched_entries.FindValue(key, nullptr); entry) {
+        Remove(entry);
+    }
+}
+
+// Call with mutex locked
+void http_FileCache::InvalidateDirectory(int wd)
+{
+    Watch *watch = watches.Find(wd);
+
+    // Nothing to do for watches we removed ourselves
+    if (!watch)
+        return;
+
+    for (PendingLoad *load: loads) {
+        load->stale |= (load->wd == wd);
+    }
+
+    // Forget the watch first: the kernel has dropped it, and releasing the entries below
+    // must not try to remove it again.
+    ForgetWatch(wd);
+
+    // The directory is gone (or moved), this is rare enough to walk the whole list
+    for (http_FileEntry *it = first; it;) {
+        http_FileEntry *entry = it;
+        it = it->next;
+
+        if (entry->wd == wd) {
+            Remove(entry);
+        }
+    }
+}
+
+// Call with mutex locked
+void http_FileCache::Remove(http_FileEntry *entry)
+{
+    map.Remove(entry->filename);
+    watched_entries.Remove(entry->watch_key);
+    Unlink(entry);
+
+    ReleaseWatch(entry->wd);
+    ReleaseFileEntry(entry);
+}
+
+// Call with mutex locked
+void http_FileCache::Clear()
+{
+    for (PendingLoad *load: loads) {
+        load->stale = true;
+    }
+
+    while (first) {
+        Remove(first);
+    }
+
+    RG_ASSERT(!total_size);
+}
+
+void http_FileCache::Link(http_FileEntry *entry)
+{
+    entry->prev = nullptr;
+    entry->next = first;
+
+    if (first) {
+        first->prev = entry;
+    } else {
+        last = entry;
+    }
+    first = entry;
+
+    total_size += ComputeEntrySize(entry);
+}
+
+void http_FileCache::Unlink(http_FileEntry *entry)
+{
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        first = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        last = entry->prev;
+    }
+
+    entry->prev = nullptr;
+    entry->next = nullptr;
+
+    total_size -= ComputeEntrySize(entry);
+}
+
+Size http_FileCache::ComputeEntrySize(const http_FileEntry *entry)
+{
+    Size size = RG_SIZE(*entry) + (Size)strlen(entry->filename);
+
+    for (const http_FileVariant &variant: entry->variants) {
+        size += variant.data.len;
+    }
+
+    return size;
+}
+
+bool http_Daemon::InitFileCache(Size max_size)
+{
+    RG_ASSERT(!file_cache);
+
+    if (!max_size)
+        return true;
+
+    http_FileCache *cache = new http_FileCache(max_size);
+
+    if (!cache->Init()) {
+        delete cache;
+        return false;
+    }
+
+    file_cache = cache;
+    return true;
+}
+
+void http_Daemon::StopFileCache()
+{
+    delete file_cache;
+    file_cache = nullptr;
+}
+
+#else
+
+// Without inotify, we would need some other way to invalidate entries
+class http_FileCache {
+public:
+    http_FileEntry *Find(const char *) { RG_UNREACHABLE(); }
+};
+
+bool http_Daemon::InitFileCache(Size)
+{
+    return true;
+}
+
+void http_Daemon::StopFileCache()
+{
+}
+
+#endif
+
+bool http_IO::AttachFile(int code, const char *filename, const char *mime_type, bool sidecars)
+{
+    http_FileEntry *entry = nullptr;
+
+    if (daemon->file_cache) {
+        entry = daemon->file_cache->Find(filename);
+        if (!entry)
+            return false;
+    } else {
+        entry = new http_FileEntry;
+        entry->Ref();
+
+        if (!LoadFileEntry(filename, sidecars, 0, entry)) {
+            delete entry;
+            return false;
+        }
+    }
+    RG_DEFER { ReleaseFileEntry(entry); };
+
+    // Pick best sidecar, the plain file (last variant) is always there. Clients that don't
+    // send Accept-Encoding (curl, wget) get the plain file even though HTTP allows anything.
+    const http_FileVariant *variant = &entry->variants[entry->variants.len - 1];
+    if (const char *accept_str = request.GetHeaderValue("Accept-Encoding"); sidecars && accept_str) {
+        uint32_t acceptable_encodings = http_ParseAcceptableEncodings(accept_str);
+
+        for (const http_FileVariant &it: entry->variants) {
+            if (acceptable_encodings & (1u << (int)it.encoding)) {
+                variant = &it;
+                break;
+            }
+        }
+    }
+
+    int64_t offset = 0;
+    int64_t len = variant->size;
+
+    // Handle single range requests, we can ignore the others and send everything. This
+    // includes invalid or unsatisfiable ranges, which RFC 9110 allows servers to ignore.
+    if (code == 200 && variant->encoding == CompressionType::None) {
+        if (const char *str = request.GetHeaderValue("Range"); str) {
+            LocalArray<http_ByteRange, 16> ranges;
+
+            if (http_ParseRange(str, variant->size, &ranges) && ranges.len == 1) {
+                const http_ByteRange &range = ranges[0];
+
+                code = 206;
+                offset = range.start;
+                len = range.end - range.start;
+            }
+        }
+    }
+
+    MHD_Response *response;
+    if (variant->data.ptr) {
+        const auto release_entry = [](void *udata) {
+            http_FileEntry *entry = (http_FileEntry *)udata;
+            ReleaseFileEntry(entry);
+        };
+
+        entry->Ref();
+
+        response = MHD_create_response_from_buffer_with_free_callback_cls((size_t)len, (void *)(variant->data.ptr + offset),
+                                                                          release_entry, entry);
+    } else {
+        int fd = OpenFile(variant->filename, (int)OpenFlag::Read);
+        if (fd < 0)
+            return false;
+
+        response = MHD_create_response_from_fd_at_offset64((uint64_t)len, fd, (uint64_t)offset);
+    }
+    AttachResponse(code, response, (Size)len);
+
+    if (code == 206) {
+        char buf[128];
+        AddHeader("Content-Range", Fmt(buf, "bytes %1-%2/%3", offset, offset + len - 1, variant->size).ptr);
+    }
+    if (variant->encoding == CompressionType::None) {
+        AddHeader("Accept-Ranges", "bytes");
+    }
+    if (sidecars && entry->variants.len > 1) {
+        AddHeader("Vary", "Accept-Encoding");
+    }
+    AddEncodingHeader(variant->encoding);
+
+    if (mime_type) {
+        AddHeader("Content-Type", mime_type);
+    }
+
+    return true;
+}
+
+}
@@ -22,5 +22,6 @@
 #pragma once
 
 #include "http.hh"
+#include "metrics.hh"
 #include "misc.hh"
 #include "session.hh"
@@ -0,0 +1,481 @@
+// Copyright 2023 Niels Martignène <niels.martignene@protonmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of
+// this software and associated documentation files (the “Software”), to deal in
+// the Software without restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the
+// Software, and to permit persons to whom the Software is furnished to do so,
+// subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+
+
+#include "src/core/base/base.hh"
+#include "metrics.hh"
+#include "src/core/wrap/json.hh"
+
+#include <chrono>
+
+namespace RG {
+
+static std::atomic_int64_t next_metrics_id { 1 };
+
+int http_Histogram::GetBucket(int64_t value)
+{
+    if (value < (1 << SubBits))
+        return (int)std::max(value, (int64_t)0);
+
+    int shift = 63 - CountLeadingZeros((uint64_t)value) - SubBits;
+    int sub = (int)(value >> shift) & ((1 << SubBits) - 1);
+    int idx = ((shift + 1) << SubBits) + sub;
+
+    return std::min(idx, Buckets - 1);
+}
+
+int64_t http_Histogram::GetBucketLimit(int idx)
+{
+    if (idx < (1 << SubBits))
+        return idx + 1;
+
+    int shift = (idx >> SubBits) - 1;
+    int sub = idx & ((1 << SubBits) - 1);
+
+    return (int64_t)((1 << SubBits) + sub + 1) << shift;
+}
+
+void http_Histogram::Add(int64_t value, int64_t times)
+{
+    counts[GetBucket(value)] += times;
+    count += times;
+    sum += value * times;
+    max = std::max(max, value);
+}
+
+int64_t http_Histogram::GetPercentile(double percentile) const
+{
+    if (!count)
+        return 0;
+
+    int64_t threshold = (int64_t)std::ceil((double)count * percentile / 100.0);
+    int64_t cumulative = 0;
+
+    for (int i = 0; i < Buckets; i++) {
+        cumulative += counts[i];
+
+        if (cumulative >= threshold)
+            return std::min(GetBucketLimit(i) - 1, max);
+    }
+
+    return max;
+}
+
+static void WriteLabel(StreamWriter *st, Span<const char> value)
+{
+    for (char c: value) {
+        switch (c) {
+            case '\\': { st->Write("\\\\"); } break;
+            case '"': { st->Write("\\\""); } break;
+            case '\n': { st->Write("\\n"); } break;
+            default: { st->Write(c); } break;
+        }
+    }
+}
+
+static void ExportSummary(StreamWriter *st, const char *name, Span<const http_RouteMetrics> routes,
+                          const http_Histogram http_RouteMetrics::*member)
+{
+    static const double Quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+    Print(st, "# TYPE %1 summary\n", name);
+
+    for (const http_RouteMetrics &route: routes) {
+        const http_Histogram &histogram = route.*member;
+
+        for (double quantile: Quantiles) {
+            int64_t value = histogram.GetPercentile(quantile * 100.0);
+
+            Print(st, "%1{route=\"", name);
+            WriteLabel(st, route.route);
+            Print(st, "\",quantile=\"%1\"} %2\n", quantile, (double)value / 1000000.0);
+        }
+
+        Print(st, "%1_sum{route=\"", name);
+        WriteLabel(st, route.route);
+        Print(st, "\"} %1\n", (double)histogram.sum / 1000000.0);
+
+        Print(st, "%1_count{route=\"", name);
+        WriteLabel(st, route.route);
+        Print(st, "\"} %1\n", histogram.count);
+    }
+}
+
+void http_MetricsSnapshot::ExportText(StreamWriter *st) const
+{
+    PrintLn(st, "# TYPE http_requests_total counter");
+    for (const http_RouteMetrics &route: routes) {
+        for (Size i = 0; i < RG_LEN(route.status_classes); i++) {
+            if (!route.status_classes[i])
+                continue;
+
+            Print(st, "http_requests_total{route=\"");
+            WriteLabel(st, route.route);
+            Print(st, "\",code=\"%1xx\"} %2\n", i + 1, route.status_classes[i]);
+        }
+    }
+
+    PrintLn(st, "# TYPE http_response_bytes_total counter");
+    for (const http_RouteMetrics &route: routes) {
+        Print(st, "http_response_bytes_total{route=\"");
+        WriteLabel(st, route.route);
+        Print(st, "\"} %1\n", route.bytes_sent);
+    }
+
+    PrintLn(st, "# TYPE http_requests_in_flight gauge");
+    PrintLn(st, "http_requests_in_flight %1", in_flight);
+    PrintLn(st, "# TYPE http_async_tasks_queued gauge");
+    PrintLn(st, "http_async_tasks_queued %1", async_queued);
+    PrintLn(st, "# TYPE http_async_tasks_running gauge");
+    PrintLn(st, "http_async_tasks_running %1", async_running);
+    PrintLn(st, "# TYPE http_async_shed_total counter");
+    PrintLn(st, "http_async_shed_total %1", async_shed);
+
+    ExportSummary(st, "http_first_byte_seconds", routes, &http_RouteMetrics::first_byte);
+    ExportSummary(st, "http_request_duration_seconds", routes, &http_RouteMetrics::total);
+}
+
+static void ExportHistogram(json_Writer *json, const http_Histogram &histogram)
+{
+    json->StartObject();
+    json->Key("count"); json->Int64(histogram.count);
+    json->Key("sum"); json->Int64(histogram.sum);
+    json->Key("p50"); json->Int64(histogram.GetPercentile(50.0));
+    json->Key("p90"); json->Int64(histogram.GetPercentile(90.0));
+    json->Key("p99"); json->Int64(histogram.GetPercentile(99.0));
+    json->Key("p999"); json->Int64(histogram.GetPercentile(99.9));
+    json->Key("max"); json->Int64(histogram.max);
+    json->EndObject();
+}
+
+static void ExportStatusClasses(json_Writer *json, const int64_t status_classes[5])
+{
+    json->StartObject();
+    for (Size i = 0; i < 5; i++) {
+        char key[8];
+        Fmt(key, "%1xx", i + 1);
+
+        json->Key(key); json->Int64(status_classes[i]);
+    }
+    json->EndObject();
+}
+
+void http_MetricsSnapshot::ExportJson(StreamWriter *st) const
+{
+    json_Writer json(st);
+
+    json.StartObject();
+
+    json.Key("requests"); json.Int64(requests);
+    json.Key("in_flight"); json.Int64(in_flight);
+    json.Key("async_queued"); json.Int64(async_queued);
+    json.Key("async_running"); json.Int64(async_running);
+    json.Key("async_shed"); json.Int64(async_shed);
+    json.Key("status"); ExportStatusClasses(&json, status_classes);
+    json.Key("bytes_sent"); json.Int64(bytes_sent);
+
+    // Durations are in microseconds
+    json.Key("routes"); json.StartArray();
+    for (const http_RouteMetrics &route: routes) {
+        json.StartObject();
+
+        json.Key("route"); json.String(route.route);
+        json.Key("requests"); json.Int64(route.requests);
+        json.Key("status"); ExportStatusClasses(&json, route.status_classes);
+        json.Key("bytes_sent"); json.Int64(route.bytes_sent);
+        json.Key("first_byte"); ExportHistogram(&json, route.first_byte);
+        json.Key("total"); ExportHistogram(&json, route.total);
+
+        json.EndObject();
+    }
+    json.EndArray();
+
+    json.EndObject();
+}
+
+struct http_Metrics::RouteSlot {
+    std::atomic_int64_t requests { 0 };
+    std::atomic_int64_t status_classes[5] = {};
+    std::atomic_int64_t bytes_sent { 0 };
+
+    std::atomic_int64_t first_byte[http_Histogram::Buckets] = {};
+    std::atomic_int64_t first_byte_sum { 0 };
+    std::atomic_int64_t first_byte_max { 0 };
+    std::atomic_int64_t total[http_Histogram::Buckets] = {};
+    std::atomic_int64_t total_sum { 0 };
+    std::atomic_int64_t total_max { 0 };
+};
+
+struct http_Metrics::ThreadSlot {
+    std::atomic_int64_t started { 0 };
+    std::atomic_int64_t completed { 0 };
+    std::atomic_int64_t async_queued { 0 };
+    std::atomic_int64_t async_started { 0 };
+    std::atomic_int64_t async_done { 0 };
+    std::atomic_int64_t async_shed { 0 };
+
+    std::atomic<RouteSlot *> routes[MaxRoutes] = {};
+
+    // Only used by owner thread
+    HashMap<const char *, Size> routes_cache;
+};
+
+// Each counter has a single writer, no need for atomic read-modify-write
+static inline void Bump(std::atomic_int64_t *counter, int64_t delta = 1)
+{
+    counter->store(counter->load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+static inline void BumpMax(std::atomic_int64_t *counter, int64_t value)
+{
+    if (value > counter->load(std::memory_order_relaxed)) {
+        counter->store(value, std::memory_order_relaxed);
+    }
+}
+
+http_Metrics::http_Metrics()
+    : id(next_metrics_id++)
+{
+    // Last route collects everything once there are too many
+    routes.Append("(other)");
+}
+
+http_Metrics::~http_Metrics()
+{
+    for (ThreadSlot *slot: slots) {
+        for (std::atomic<RouteSlot *> &route: slot->routes) {
+            delete route.load();
+        }
+        delete slot;
+    }
+}
+
+int64_t http_Metrics::GetTime()
+{
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return (int64_t)std::chrono::duration_cast<std::chrono::microseconds>(now).count();
+}
+
+void http_Metrics::RequestStarted()
+{
+    ThreadSlot *slot = GetThreadSlot();
+    Bump(&slot->started);
+}
+
+void http_Metrics::RequestCompleted(const char *route, int status, int64_t bytes, int64_t first_byte, int64_t total)
+{
+    ThreadSlot *slot = GetThreadSlot();
+    RouteSlot *rs = GetRouteSlot(slot, route);
+
+    Bump(&slot->completed);
+
+    Bump(&rs->requests);
+    if (status >= 100 && status < 600) {
+        Bump(&rs->status_classes[status / 100 - 1]);
+    }
+    if (bytes > 0) {
+        Bump(&rs->bytes_sent, bytes);
+    }
+
+    if (first_byte >= 0) {
+        Bump(&rs->first_byte[http_Histogram::GetBucket(first_byte)]);
+        Bump(&rs->first_byte_sum, first_byte);
+        BumpMax(&rs->first_byte_max, first_byte);
+    }
+    Bump(&rs->total[http_Histogram::GetBucket(total)]);
+    Bump(&rs->total_sum, total);
+    BumpMax(&rs->total_max, total);
+}
+
+void http_Metrics::AsyncQueued()
+{
+    ThreadSlot *slot = GetThreadSlot();
+    Bump(&slot->async_queued);
+}
+
+void http_Metrics::AsyncStarted()
+{
+    ThreadSlot *slot = GetThreadSlot();
+    Bump(&slot->async_started);
+}
+
+void http_Metrics::AsyncDone()
+{
+    ThreadSlot *slot = GetThreadSlot();
+    Bump(&slot->async_done);
+}
+
+void http_Metrics::AsyncShed()
+{
+    ThreadSlot *slot = GetThreadSlot();
+    Bump(&slot->async_shed);
+}
+
+void http_Metrics::Snapshot(http_MetricsSnapshot *out_snapshot)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    http_MetricsSnapshot snapshot;
+
+    snapshot.routes.AppendDefault(routes.len);
+    for (Size i = 0; i < routes.len; i++) {
+        snapshot.routes[i].route = routes[i];
+    }
+
+    int64_t started = 0;
+    int64_t completed = 0;
+    int64_t async_queued = 0;
+    int64_t async_started = 0;
+    int64_t async_done = 0;
+    int64_t async_shed = 0;
+
+    for (ThreadSlot *slot: slots) {
+        started += slot->started.load(std::memory_order_relaxed);
+        completed += slot->completed.load(std::memory_order_relaxed);
+        async_queued += slot->async_queued.load(std::memory_order_relaxed);
+        async_started += slot->async_started.load(std::memory_order_relaxed);
+        async_done += slot->async_done.load(std::memory_order_relaxed);
+        async_shed += slot->async_shed.load(std::memory_order_relaxed);
+
+        for (Size i = 0; i < routes.len; i++) {
+            const RouteSlot *rs = slot->routes[i].load(std::memory_order_acquire);
+            http_RouteMetrics *route = &snapshot.routes[i];
+
+            if (!rs)
+                continue;
+
+            route->requests += rs->requests.load(std::memory_order_relaxed);
+            for (Size j = 0; j < RG_LEN(route->status_classes); j++) {
+                route->status_classes[j] += rs->status_classes[j].load(std::memory_order_relaxed);
+            }
+            route->bytes_sent += rs->bytes_sent.load(std::memory_order_relaxed);
+
+            for (int j = 0; j < http_Histogram::Buckets; j++) {
+                int64_t first_byte = rs->first_byte[j].load(std::memory_order_relaxed);
+                int64_t total = rs->total[j].load(std::memory_order_relaxed);
+
+                route->first_byte.counts[j] += first_byte;
+                route->first_byte.count += first_byte;
+                route->total.counts[j] += total;
+                route->total.count += total;
+            }
+            route->first_byte.sum += rs->first_byte_sum.load(std::memory_order_relaxed);
+            route->first_byte.max = std::max(route->first_byte.max, rs->first_byte_max.load(std::memory_order_relaxed));
+            route->total.sum += rs->total_sum.load(std::memory_order_relaxed);
+            route->total.max = std::max(route->total.max, rs->total_max.load(std::memory_order_relaxed));
+        }
+    }
+
+    // Skip routes without any request
+    Size j = 0;
+    for (Size i = 0; i < snapshot.routes.len; i++) {
+        const http_RouteMetrics &route = snapshot.routes[i];
+
+        if (!route.requests)
+            continue;
+
+        snapshot.requests += route.requests;
+        for (Size k = 0; k < RG_LEN(route.status_classes); k++) {
+            snapshot.status_classes[k] += route.status_classes[k];
+        }
+        snapshot.bytes_sent += route.bytes_sent;
+
+        snapshot.routes[j++] = route;
+    }
+    snapshot.routes.RemoveFrom(j);
+
+    // Counters are read one after the other, don't show transient negative values
+    snapshot.in_flight = std::max(started - completed, (int64_t)0);
+    snapshot.async_queued = std::max(async_queued - async_started, (int64_t)0);
+    snapshot.async_running = std::max(async_started - async_done, (int64_t)0);
+    snapshot.async_shed = async_shed;
+
+    std::swap(*out_snapshot, snapshot);
+}
+
+http_Metrics::ThreadSlot *http_Metrics::GetThreadSlot()
+{
+    struct CacheEntry {
+        int64_t id;
+        ThreadSlot *slot;
+    };
+
+    // Most threads only ever see one daemon
+    static thread_local LocalArray<CacheEntry, 8> cache;
+
+    for (const CacheEntry &entry: cache) {
+        if (entry.id == id) [[likely]]
+            return entry.slot;
+    }
+
+    ThreadSlot *slot = new ThreadSlot;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        slots.Append(slot);
+    }
+
+    if (!cache.Available()) {
+        MemMove(cache.data, cache.data + 1, (cache.len - 1) * RG_SIZE(CacheEntry));
+        cache.len--;
+    }
+    cache.Append({ id, slot });
+
+    return slot;
+}
+
+http_Metrics::RouteSlot *http_Metrics::GetRouteSlot(ThreadSlot *slot, const char *route)
+{
+    Size idx = slot->routes_cache.FindValue(route, -1);
+
+    if (idx < 0) [[unlikely]] {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        bool inserted;
+        auto bucket = routes_map.TrySetDefault(route, &inserted);
+
+        if (inserted) {
+            if (routes.len < MaxRoutes) {
+                bucket->key = DuplicateString(route, &str_alloc).ptr;
+                bucket->value = routes.len;
+
+                routes.Append(bucket->key);
+            } else {
+                bucket->key = DuplicateString(route, &str_alloc).ptr;
+                bucket->value = 0;
+            }
+        }
+
+        idx = bucket->value;
+        slot->routes_cache.Set(bucket->key, idx);
+    }
+
+    RouteSlot *rs = slot->routes[idx].load(std::memory_order_relaxed);
+
+    if (!rs) [[unlikely]] {
+        rs = new RouteSlot;
+        slot->routes[idx].store(rs, std::memory_order_release);
+    }
+
+    return rs;
+}
+
+}
@@ -0,0 +1,113 @@
+// Copyright 2023 Niels Martignène <niels.martignene@protonmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of
+// this software and associated documentation files (the “Software”), to deal in
+// the Software without restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the
+// Software, and to permit persons to whom the Software is furnished to do so,
+// subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+
+
+#pragma once
+
+#include "src/core/base/base.hh"
+
+namespace RG {
+
+// Log-linear buckets (similar to HdrHistogram): each power of two is split in 8 sub-buckets,
+// so recorded values are within 12.5% of the real ones. Values are in microseconds.
+class http_Histogram {
+public:
+    static const int SubBits = 3;
+    static const int Buckets = (40 - SubBits + 1) << SubBits;
+
+    int64_t counts[Buckets] = {};
+    int64_t count = 0;
+    int64_t sum = 0;
+    int64_t max = 0;
+
+    static int GetBucket(int64_t value);
+    static int64_t GetBucketLimit(int idx);
+
+    void Add(int64_t value, int64_t times = 1);
+    int64_t GetPercentile(double percentile) const;
+};
+
+struct http_RouteMetrics {
+    const char *route;
+
+    int64_t requests;
+    int64_t status_classes[5]; // 1xx to 5xx
+    int64_t bytes_sent;
+
+    http_Histogram first_byte; // From request start to response queued
+    http_Histogram total; // From request start to request completion
+};
+
+struct http_MetricsSnapshot {
+    int64_t requests = 0;
+    int64_t in_flight = 0;
+    int64_t async_queued = 0;
+    int64_t async_running = 0;
+    int64_t async_shed = 0;
+    int64_t status_classes[5] = {};
+    int64_t bytes_sent = 0;
+
+    HeapArray<http_RouteMetrics> routes;
+
+    void ExportText(StreamWriter *st) const; // Prometheus text format
+    void ExportJson(StreamWriter *st) const;
+};
+
+// Counters live in per-thread slots with a single writer each, so recording never contends
+// with other threads. Snapshot() sums everything up.
+class http_Metrics {
+    RG_DELETE_COPY(http_Metrics)
+
+    static const Size MaxRoutes = 256;
+
+    struct RouteSlot;
+    struct ThreadSlot;
+
+    int64_t id;
+
+    std::mutex mutex;
+    HeapArray<ThreadSlot *> slots;
+    HashMap<const char *, Size> routes_map;
+    HeapArray<const char *> routes;
+    BlockAllocator str_alloc;
+
+public:
+    http_Metrics();
+    ~http_Metrics();
+
+    static int64_t GetTime();
+
+    void RequestStarted();
+    void RequestCompleted(const char *route, int status, int64_t bytes, int64_t first_byte, int64_t total);
+
+    void AsyncQueued();
+    void AsyncStarted();
+    void AsyncDone();
+    void AsyncShed();
+
+    void Snapshot(http_MetricsSnapshot *out_snapshot);
+
+private:
+    ThreadSlot *GetThreadSlot();
+    RouteSlot *GetRouteSlot(ThreadSlot *slot, const char *route);
+};
+
+}
@@ -216,9 +216,10 @@ void http_JsonPageBuilder::Finish()
     MHD_Response *response =
         MHD_create_response_from_buffer_with_free_callback((size_t)buf.len, buf.ptr,
                                                            ReleaseDataCallback);
+    Size len = buf.len;
     buf.Leak();
 
-    io->AttachResponse(200, response);
+    io->AttachResponse(200, response, len);
     io->AddEncodingHeader(encoding);
     io->AddHeader("Content-Type", "application/json");
 }
@@ -47,6 +47,8 @@
 
 namespace RG {
 
+static const Size WriteChunkSize = Kibibytes(64);
+
 bool http_Config::SetProperty(Span<const char> key, Span<const char> value, Span<const char> root_directory)
 {
     if (key == "SocketType" || key == "IPStack") {
@@ -69,6 +71,8 @@ bool http_Config::SetProperty(Span<const char> key, Span<const char> value, Span
         return ParseInt(value, &threads);
     } else if (key == "AsyncThreads") {
         return ParseInt(value, &async_threads);
+    } else if (key == "FastThreads") {
+        return ParseInt(value, &fast_threads);
     } else if (key == "ClientAddress") {
         if (!OptionToEnumI(http_ClientAddressModeNames, value, &client_addr_mode)) {
             LogError("Unknown client address mode '%1'", value);
@@ -76,6 +80,17 @@ bool http_Config::SetProperty(Span<const char> key, Span<const char> value, Span
         }
 
         return true;
+    } else if (key == "Metrics") {
+        return ParseBool(value, &metrics);
+    } else if (key == "MetricsPath") {
+        metrics_path = value.len ? DuplicateString(value, &str_alloc).ptr : nullptr;
+        return true;
+    } else if (key == "ShedTarget") {
+        return ParseInt(value, &shed_target);
+    } else if (key == "ShedInterval") {
+        return ParseInt(value, &shed_interval);
+    } else if (key == "FileCacheSize") {
+        return ParseSize(value, &file_cache_size);
     }
 
     LogError("Unknown HTTP property '%1'", key);
@@ -140,6 +155,27 @@ bool http_Config::Validate() const
         LogError("HTTP async threads %1 is invalid (minimum: 1)", async_threads);
         valid = false;
     }
+    if (fast_threads < 3) {
+        // Like async_threads, one thread is counted for the caller (which does not run tasks here)
+        LogError("HTTP fast threads %1 is invalid (minimum: 3)", fast_threads);
+        valid = false;
+    }
+    if (shed_target < 0) {
+        LogError("HTTP shed target cannot be negative (%1)", shed_target);
+        valid = false;
+    }
+    if (shed_interval <= 0) {
+        LogError("HTTP shed interval %1 is invalid (minimum: 1)", shed_interval);
+        valid = false;
+    }
+    if (file_cache_size < 0) {
+        LogError("HTTP file cache size cannot be negative (%1)", file_cache_size);
+        valid = false;
+    }
+    if (metrics_path && metrics_path[0] != '/') {
+        LogError("HTTP metrics path must start with '/'");
+        valid = false;
+    }
 
     return valid;
 }
@@ -221,8 +257,27 @@ bool http_Daemon::Start(const http_Config &config,
         return false;
 #endif
 
+    if (!InitFileCache(config.file_cache_size))
+        return false;
+
     handle_func = func;
     async = new Async(config.async_threads - 1);
+    if (config.shed_target) {
+        // High priority work only needs its own pool when normal work can be shed
+        fast_async = new Async(config.fast_threads - 1);
+    }
+
+    shed_target = config.shed_target * 1000;
+    shed_interval = config.shed_interval * 1000;
+    shed_window_end = 0;
+    shed_window_tasks = 0;
+    shed_window_late = 0;
+    overloaded = false;
+
+    if (config.metrics) {
+        metrics = new http_Metrics;
+        metrics_path = config.metrics_path ? DuplicateString(config.metrics_path, &str_alloc).ptr : nullptr;
+    }
 
     running = true;
     daemon = MHD_start_daemon(flags, 0, nullptr, nullptr,
@@ -246,12 +301,19 @@ void http_Daemon::Stop()
 {
     running = false;
 
+    // Close remaining WebSockets, async tasks may still be running close handlers
+    StopReactor();
+
     if (async) {
 #ifdef _WIN32
         WSASetEvent(stop_handle);
 
         async->Sync();
+        if (fast_async) {
+            fast_async->Sync();
+        }
         delete async;
+        delete fast_async;
 
         WSACloseEvent(stop_handle);
 #else
@@ -259,7 +321,11 @@ void http_Daemon::Stop()
         RG_IGNORE write(stop_pfd[1], &dummy, 1);
 
         async->Sync();
+        if (fast_async) {
+            fast_async->Sync();
+        }
         delete async;
+        delete fast_async;
 
         close(stop_pfd[0]);
         close(stop_pfd[1]);
@@ -273,8 +339,23 @@ void http_Daemon::Stop()
     }
     listen_fd = -1;
 
+    delete metrics;
+    StopFileCache();
+
     async = nullptr;
+    fast_async = nullptr;
     daemon = nullptr;
+    metrics = nullptr;
+    metrics_path = nullptr;
+}
+
+bool http_Daemon::GetMetrics(http_MetricsSnapshot *out_snapshot)
+{
+    if (!metrics)
+        return false;
+
+    metrics->Snapshot(out_snapshot);
+    return true;
 }
 
 static bool GetClientAddress(MHD_Connection *conn, http_ClientAddressMode addr_mode, Span<char> out_address)
@@ -385,10 +466,17 @@ MHD_Result http_Daemon::HandleRequest(void *cls, MHD_Connection *conn, const cha
         io->request.conn = conn;
         io->request.url = url;
 
+        if (daemon->metrics) {
+            io->start_time = http_Metrics::GetTime();
+            io->metrics_route = "(invalid)";
+
+            daemon->metrics->RequestStarted();
+        }
+
         // Is that even possible? Dunno, but make sure it never happens!
         if (url[0] != '/') [[unlikely]] {
             io->AttachError(400);
-            return MHD_queue_response(conn, (unsigned int)io->code, io->response);
+            return io->QueueResponse();
         }
 
         if (TestStr(method, "HEAD")) {
@@ -396,11 +484,18 @@ MHD_Result http_Daemon::HandleRequest(void *cls, MHD_Connection *conn, const cha
             io->request.headers_only = true;
         } else if (!OptionToEnumI(http_RequestMethodNames, method, &io->request.method)) {
             io->AttachError(405);
-            return MHD_queue_response(conn, (unsigned int)io->code, io->response);
+            return io->QueueResponse();
         }
+        io->metrics_route = http_RequestMethodNames[(int)io->request.method];
+
         if (!GetClientAddress(conn, daemon->client_addr_mode, io->request.client_addr)) {
             io->AttachError(422);
-            return MHD_queue_response(conn, (unsigned int)io->code, io->response);
+            return io->QueueResponse();
+        }
+
+        if (daemon->metrics_path && TestStr(url, daemon->metrics_path)) {
+            daemon->ServeMetrics(io);
+            return io->QueueResponse();
         }
     }
 
@@ -442,13 +537,13 @@ MHD_Result http_Daemon::HandleRequest(void *cls, MHD_Connection *conn, const cha
     // Handle write or attached response (if any)
     if (io->force_queue) {
         io->Resume();
-        return MHD_queue_response(conn, (unsigned int)io->code, io->response);
+        return io->QueueResponse();
     } else if (io->state == http_IO::State::Idle) {
         if (io->code < 0) {
             // Default to internal error (if nothing else)
             io->AttachError(500);
         }
-        return MHD_queue_response(conn, (unsigned int)io->code, io->response);
+        return io->QueueResponse();
     } else {
         // We must not suspend on first call because libmicrohttpd will call us back the same
         // way if we do so, with *upload_data_size = 0. Which means we'd have no reliable way
@@ -472,14 +567,23 @@ ssize_t http_Daemon::HandleWrite(void *cls, uint64_t, char *buf, size_t max)
     // Can't read anymore!
     RG_ASSERT(!io->read_buf.len);
 
-    if (io->write_buf.len) {
-        Size copy_len = std::min(io->write_buf.len - io->write_offset, (Size)max);
-        MemCpy(buf, io->write_buf.ptr + io->write_offset, copy_len);
+    if (io->write_count) {
+        const HeapArray<uint8_t> &chunk = io->write_ring[io->write_head];
+        Size copy_len = std::min(chunk.len - io->write_offset, (Size)max);
+
+        // The async handler only touches the ring tail, so we can copy without the lock
+        lock.unlock();
+        MemCpy(buf, chunk.ptr + io->write_offset, copy_len);
+        lock.lock();
 
         io->write_offset += copy_len;
+        io->response_len += copy_len;
 
-        if (io->write_offset >= io->write_buf.len) {
-            io->write_buf.RemoveFrom(0);
+        if (io->write_offset >= chunk.len) {
+            // Keep the memory around, it will be reused for another chunk
+            io->write_ring[io->write_head].RemoveFrom(0);
+            io->write_head = (io->write_head + 1) % RG_LEN(io->write_ring);
+            io->write_count--;
             io->write_offset = 0;
 
             io->write_cv.notify_one();
@@ -493,6 +597,9 @@ ssize_t http_Daemon::HandleWrite(void *cls, uint64_t, char *buf, size_t max)
         LogError("Truncated HTTP response stream");
         return MHD_CONTENT_READER_END_WITH_ERROR;
     } else {
+        // Ask for whatever the handler has, instead of waiting for a full chunk
+        io->write_starved.store(true, std::memory_order_relaxed);
+
         // I tried to suspend here, but it triggered assert errors from libmicrohttpd,
         // and I don't know if it's not allowed, or if there's a bug. Need to investigate.
         return 0;
@@ -506,14 +613,55 @@ void http_Daemon::RunNextAsync(http_IO *io)
         std::function<void()> func;
         std::swap(io->async_func, func);
 
-        async->Run([=, this]() {
+        http_Priority priority = io->async_priority;
+        bool admit = io->admitted || priority == http_Priority::High || !shed_target;
+
+        // Low priority requests don't even get queued when the server is overloaded
+        if (!admit && priority == http_Priority::Low && overloaded.load(std::memory_order_relaxed)) {
+            // Rejected requests don't count, but the window must still end or nothing clears the flag
+            CloseAdmissionWindow(http_Metrics::GetTime());
+
+            if (overloaded.load(std::memory_order_relaxed)) {
+                ShedRequest(io);
+                return;
+            }
+        }
+        io->admitted = true;
+
+        if (metrics) {
+            metrics->AsyncQueued();
+        }
+
+        int64_t queue_time = admit ? -1 : http_Metrics::GetTime();
+
+        Async *target = (priority == http_Priority::High && fast_async) ? fast_async : async;
+
+        target->Run([=, this]() {
             io->PushLogFilter();
             RG_DEFER { PopLogFilter(); };
 
-            if (running) [[likely]] {
+            if (metrics) {
+                metrics->AsyncStarted();
+            }
+
+            bool shed = false;
+
+            if (queue_time >= 0) {
+                int64_t now = http_Metrics::GetTime();
+                shed = UpdateAdmission(now - queue_time, now);
+            }
+
+            if (shed) {
+                std::lock_guard<std::mutex> lock(io->mutex);
+                ShedRequest(io);
+            } else if (running) [[likely]] {
                 func();
             }
 
+            if (metrics) {
+                metrics->AsyncDone();
+            }
+
             std::unique_lock<std::mutex> lock(io->mutex);
 
             if (io->state == http_IO::State::Zombie) {
@@ -536,13 +684,73 @@ void http_Daemon::RunNextAsync(http_IO *io)
     }
 }
 
-void http_Daemon::RequestCompleted(void *, MHD_Connection *, void **con_cls, MHD_RequestTerminationCode)
+// Similar to CoDel, look at queue delay over a whole interval to tell a standing queue (overload)
+// apart from a short burst. CoDel uses the minimum delay, but tasks don't run in FIFO order
+// (each Async worker has its own queue), so some always start right away even when most wait
+// for a long time. Instead, the queue is overloaded when most tasks wait longer than the target.
+bool http_Daemon::UpdateAdmission(int64_t delay, int64_t now)
+{
+    bool late = (delay > shed_target);
+
+    shed_window_tasks.fetch_add(1, std::memory_order_relaxed);
+    shed_window_late.fetch_add(late, std::memory_order_relaxed);
+
+    CloseAdmissionWindow(now);
+
+    // Only shed requests that waited too long, so the ones that got through quickly still run
+    return late && overloaded.load(std::memory_order_relaxed);
+}
+
+// Windows without any queued task (e.g. only low priority requests, all rejected) end the overload
+void http_Daemon::CloseAdmissionWindow(int64_t now)
+{
+    int64_t end = shed_window_end.load(std::memory_order_relaxed);
+
+    if (now >= end && shed_window_end.compare_exchange_strong(end, now + shed_interval, std::memory_order_relaxed)) {
+        int64_t tasks = shed_window_tasks.exchange(0, std::memory_order_relaxed);
+        int64_t late = shed_window_late.exchange(0, std::memory_order_relaxed);
+        bool overload = (late * 2 > tasks);
+
+        if (overload != overloaded.load(std::memory_order_relaxed)) {
+            if (overload) {
+                LogError("Async queue is overloaded (%1 of %2 tasks waited more than %3 ms), shedding requests",
+                         late, tasks, shed_target / 1000);
+            } else {
+                LogInfo("Async queue is back to normal");
+            }
+        }
+
+        overloaded.store(overload, std::memory_order_relaxed);
+    }
+}
+
+// Call with io->mutex locked
+void http_Daemon::ShedRequest(http_IO *io)
+{
+    if (metrics) {
+        metrics->AsyncShed();
+    }
+
+    io->AttachError(503, "Server is overloaded, try again later");
+    io->AddHeader("Retry-After", "1");
+}
+
+void http_Daemon::RequestCompleted(void *cls, MHD_Connection *, void **con_cls, MHD_RequestTerminationCode)
 {
+    http_Daemon *daemon = (http_Daemon *)cls;
     http_IO *io = *(http_IO **)con_cls;
 
     if (io) {
         std::unique_lock<std::mutex> lock(io->mutex);
 
+        if (io->start_time >= 0) {
+            int64_t now = http_Metrics::GetTime();
+            int64_t first_byte = (io->queue_time >= 0) ? io->queue_time - io->start_time : -1;
+
+            daemon->metrics->RequestCompleted(io->metrics_route, io->code, io->response_len,
+                                              first_byte, now - io->start_time);
+        }
+
         if (io->state == http_IO::State::Async || io->state == http_IO::State::WebSocket) {
             io->state = http_IO::State::Zombie;
 
@@ -621,9 +829,10 @@ bool http_IO::NegociateEncoding(CompressionType preferred1, CompressionType pref
     }
 }
 
-void http_IO::RunAsync(std::function<void()> func)
+void http_IO::RunAsync(std::function<void()> func, http_Priority priority)
 {
     async_func = func;
+    async_priority = priority;
     async_func_response = false;
 }
 
@@ -689,11 +898,53 @@ void http_IO::ResetResponse()
     response = MHD_create_response_empty((MHD_ResponseFlags)0);
 }
 
-void http_IO::AttachResponse(int new_code, MHD_Response *new_response)
+void http_Daemon::ServeMetrics(http_IO *io)
+{
+    const http_RequestInfo &request = io->request;
+
+    io->metrics_route = metrics_path;
+
+    if (request.method != http_RequestMethod::Get) {
+        io->AttachError(405);
+        return;
+    }
+
+    http_MetricsSnapshot snapshot;
+    metrics->Snapshot(&snapshot);
+
+    HeapArray<uint8_t> buf;
+    StreamWriter st(&buf, "<metrics>");
+
+    const char *format = request.GetQueryValue("format");
+    const char *mime_type;
+
+    if (!format || TestStr(format, "text")) {
+        snapshot.ExportText(&st);
+        mime_type = "text/plain; version=0.0.4";
+    } else if (TestStr(format, "json")) {
+        snapshot.ExportJson(&st);
+        mime_type = "application/json";
+    } else {
+        LogError("Unknown metrics format '%1'", format);
+        io->AttachError(422);
+        return;
+    }
+
+    st.Close();
+
+    Span<const uint8_t> data = buf.TrimAndLeak();
+    io->AddFinalizer([=]() { ReleaseSpan(nullptr, data); });
+
+    io->AttachBinary(200, data, mime_type);
+    io->AddCachingHeaders(0);
+}
+
+void http_IO::AttachResponse(int new_code, MHD_Response *new_response, Size len)
 {
     RG_ASSERT(new_code >= 0);
 
     code = new_code;
+    response_len = std::max(len, (Size)0);
 
     MHD_move_response_headers(response, new_response);
     MHD_destroy_response(response);
@@ -710,12 +961,12 @@ void http_IO::AttachText(int code, Span<const char> str, const char *mime_type)
     MHD_Response *response =
         MHD_create_response_from_buffer(str.len, (void *)str.ptr, MHD_RESPMEM_PERSISTENT);
 
-    AttachResponse(code, response);
+    AttachResponse(code, response, str.len);
     AddHeader("Content-Type", mime_type);
 }
 
 bool http_IO::AttachBinary(int code, Span<const uint8_t> data, const char *mime_type,
-                           CompressionType src_encoding)
+                           CompressionType src_encoding, http_Priority priority)
 {
     CompressionType dest_encoding;
     if (!NegociateEncoding(src_encoding, &dest_encoding))
@@ -737,13 +988,13 @@ bool http_IO::AttachBinary(int code, Span<const uint8_t> data, const char *mime_
                 if (!SpliceStream(&reader, Megabytes(8), &writer))
                     return;
                 writer.Close();
-            });
+            }, priority);
             async_func_response = true;
         }
     } else {
         MHD_Response *response =
             MHD_create_response_from_buffer((size_t)data.len, (void *)data.ptr, MHD_RESPMEM_PERSISTENT);
-        AttachResponse(code, response);
+        AttachResponse(code, response, data.len);
         AddEncodingHeader(dest_encoding);
     }
 
@@ -764,31 +1015,11 @@ void http_IO::AttachError(int code, const char *details)
                           MHD_get_reason_phrase_for((unsigned int)code), details);
 
     MHD_Response *response = MHD_create_response_from_buffer((size_t)page.len, page.ptr, MHD_RESPMEM_PERSISTENT);
-    AttachResponse(code, response);
+    AttachResponse(code, response, page.len);
 
     AddHeader("Content-Type", "text/plain");
 }
 
-bool http_IO::AttachFile(int code, const char *filename, const char *mime_type)
-{
-    FileInfo file_info;
-    if (StatFile(filename, &file_info) != StatResult::Success)
-        return false;
-
-    int fd = OpenFile(filename, (int)OpenFlag::Read);
-    if (fd < 0)
-        return false;
-
-    MHD_Response *response = MHD_create_response_from_fd((uint64_t)file_info.size, fd);
-    AttachResponse(code, response);
-
-    if (mime_type) {
-        AddHeader("Content-Type", mime_type);
-    }
-
-    return true;
-}
-
 void http_IO::AttachNothing(int code)
 {
     // We don't want libmicrohttpd to send Content-Length, so we use a callback response
@@ -869,6 +1100,23 @@ bool http_IO::OpenForWrite(int code, Size len, CompressionType encoding, StreamW
     return success;
 }
 
+void http_IO::AbortWrite()
+{
+    RG_ASSERT(state != State::Sync && state != State::WebSocket);
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    write_abort = true;
+
+    // Headers have not been sent yet, replace the response with an error
+    if (!force_queue) {
+        write_buf.RemoveFrom(0);
+
+        ResetResponse();
+        AttachError(500);
+    }
+}
+
 void http_IO::AddFinalizer(const std::function<void()> &func)
 {
     finalizers.Append(func);
@@ -922,18 +1170,82 @@ Size http_IO::Read(Span<uint8_t> out_buf)
     return read_len;
 }
 
+static void ReleaseDataCallback(void *ptr)
+{
+    ReleaseRaw(nullptr, ptr, -1);
+}
+
 bool http_IO::Write(Span<const uint8_t> buf)
 {
-    std::unique_lock<std::mutex> lock(mutex);
+    RG_ASSERT(state != State::Sync);
+    RG_ASSERT(!write_eof);
+
+    // Never end an aborted stream, so HandleWrite() resets the connection instead
+    if (write_abort)
+        return false;
+
+    // StreamWriter closes the stream with an empty write
+    if (!buf.len)
+        return PushWriteChunk(true);
+
+    // Fill current chunk without the lock, small writes (such as JSON rows) are common
+    while (buf.len) {
+        if (!write_buf.capacity) {
+            write_buf.Grow(WriteChunkSize);
+        }
+
+        Size copy_len = std::min(buf.len, WriteChunkSize - write_buf.len);
 
+        MemCpy(write_buf.end(), buf.ptr, copy_len);
+        write_buf.len += copy_len;
+        buf.ptr += copy_len;
+        buf.len -= copy_len;
+
+        if (write_buf.len == WriteChunkSize && !PushWriteChunk(false))
+            return false;
+    }
+
+    // Don't let libmicrohttpd wait for the chunk to fill up when it has nothing else to send
+    if (write_buf.len && write_starved.load(std::memory_order_relaxed))
+        return PushWriteChunk(false);
+
+    return true;
+}
+
+bool http_IO::FlushWrite()
+{
     RG_ASSERT(state != State::Sync);
     RG_ASSERT(!write_eof);
 
+    if (write_abort)
+        return false;
+    if (!write_buf.len)
+        return true;
+
+    return PushWriteChunk(false);
+}
+
+bool http_IO::PushWriteChunk(bool eof)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
     if (!force_queue) {
-        MHD_Response *new_response =
-            MHD_create_response_from_callback(write_len, Kilobytes(16),
-                                              &http_Daemon::HandleWrite, this, nullptr);
-        AttachResponse(write_code, new_response);
+        MHD_Response *new_response;
+
+        Size len = 0;
+
+        if (eof) {
+            // The whole response fits in one chunk, hand it over to libmicrohttpd
+            new_response = MHD_create_response_from_buffer_with_free_callback((size_t)write_buf.len, write_buf.ptr,
+                                                                              ReleaseDataCallback);
+            len = write_buf.len;
+            write_buf.Leak();
+        } else {
+            // Bytes are counted in HandleWrite() as they go out
+            new_response = MHD_create_response_from_callback(write_len, WriteChunkSize,
+                                                             &http_Daemon::HandleWrite, this, nullptr);
+        }
+        AttachResponse(write_code, new_response, len);
 
         force_queue = true;
     }
@@ -941,8 +1253,7 @@ bool http_IO::Write(Span<const uint8_t> buf)
     // Make sure we switch to write state
     Resume();
 
-    write_eof |= !buf.len;
-    while (state == State::Async && write_buf.len >= Kilobytes(4)) {
+    while (state == State::Async && write_count == RG_LEN(write_ring)) {
         if (!daemon->running) {
             LogError("Server is shutting down");
             return false;
@@ -950,16 +1261,36 @@ bool http_IO::Write(Span<const uint8_t> buf)
 
         write_cv.wait(lock);
     }
-    write_buf.Append(buf);
 
-    if (!write_eof && state == State::Zombie) {
+    if (!eof && state == State::Zombie) {
         LogError("Connection aborted while writing");
         return false;
     }
 
+    if (write_buf.len) {
+        Size idx = (write_head + write_count) % RG_LEN(write_ring);
+
+        // Swap buffers to reuse memory from chunks already sent
+        std::swap(write_buf, write_ring[idx]);
+        write_buf.RemoveFrom(0);
+        write_count++;
+
+        write_starved.store(false, std::memory_order_relaxed);
+    }
+    write_eof = eof;
+
     return true;
 }
 
+MHD_Result http_IO::QueueResponse()
+{
+    if (start_time >= 0 && queue_time < 0) {
+        queue_time = http_Metrics::GetTime();
+    }
+
+    return MHD_queue_response(request.conn, (unsigned int)code, response);
+}
+
 void http_IO::Suspend()
 {
     if (!suspended) {
@@ -31,6 +31,7 @@
     #endif
 #endif
 #include "vendor/libmicrohttpd/src/include/microhttpd.h"
+#include "metrics.hh"
 
 namespace RG {
 
@@ -45,6 +46,19 @@ static const char *const http_ClientAddressModeNames[] = {
     "X-Real-IP"
 };
 
+// High priority work runs on a separate (small) pool, use it for cheap requests such as
+// health checks, which must stay responsive when the server is overloaded.
+enum class http_Priority {
+    High,
+    Normal,
+    Low
+};
+static const char *const http_PriorityNames[] = {
+    "High",
+    "Normal",
+    "Low"
+};
+
 struct http_Config {
 #ifdef __OpenBSD__
     SocketType sock_type = SocketType::IPv4;
@@ -58,8 +72,20 @@ struct http_Config {
     int64_t idle_timeout = 60000;
     int threads = std::max(GetCoreCount(), 4);
     int async_threads = std::max(GetCoreCount() * 4, 16);
+    int fast_threads = 4;
     http_ClientAddressMode client_addr_mode = http_ClientAddressMode::Socket;
 
+    bool metrics = false;
+    const char *metrics_path = nullptr;
+
+    // Shed async work when most tasks wait longer than target during a whole interval (0 to disable)
+    int64_t shed_target = 0;
+    int64_t shed_interval = 500;
+
+    // Memory used to keep hot static files (served with AttachFile) around, 0 to disable.
+    // Off by default, because many users serve one-shot files (such as exports) with AttachFile.
+    Size file_cache_size = 0;
+
     BlockAllocator str_alloc;
 
     bool SetProperty(Span<const char> key, Span<const char> value, Span<const char> root_directory = {});
@@ -72,6 +98,7 @@ struct http_Config {
 
 struct http_RequestInfo;
 class http_IO;
+class http_WebSocket;
 
 class http_Daemon {
     RG_DELETE_COPY(http_Daemon)
@@ -90,6 +117,24 @@ class http_Daemon {
     std::function<void(const http_RequestInfo &request, http_IO *io)> handle_func;
 
     Async *async = nullptr;
+    Async *fast_async = nullptr;
+
+    // Admission control (CoDel-like), times are in microseconds
+    int64_t shed_target = 0;
+    int64_t shed_interval = 0;
+    std::atomic_int64_t shed_window_end { 0 };
+    std::atomic_int64_t shed_window_tasks { 0 };
+    std::atomic_int64_t shed_window_late { 0 };
+    std::atomic_bool overloaded { false };
+
+    std::mutex reactor_mutex;
+    class http_Reactor *reactor = nullptr;
+
+    class http_FileCache *file_cache = nullptr;
+
+    http_Metrics *metrics = nullptr;
+    const char *metrics_path = nullptr;
+    BlockAllocator str_alloc;
 
 public:
     http_Daemon() {}
@@ -102,16 +147,31 @@ public:
 
     void Stop();
 
+    // Returns false if metrics are disabled (see http_Config::metrics)
+    bool GetMetrics(http_MetricsSnapshot *out_snapshot);
+
 private:
     static MHD_Result HandleRequest(void *cls, MHD_Connection *conn, const char *url, const char *method,
                                     const char *, const char *upload_data, size_t *upload_data_size,
                                     void **con_cls);
     static ssize_t HandleWrite(void *cls, uint64_t pos, char *buf, size_t max);
     void RunNextAsync(http_IO *io);
+    bool UpdateAdmission(int64_t delay, int64_t now);
+    void CloseAdmissionWindow(int64_t now);
+    void ShedRequest(http_IO *io);
 
     static void RequestCompleted(void *cls, MHD_Connection *, void **con_cls, MHD_RequestTerminationCode toe);
 
+    void ServeMetrics(http_IO *io);
+
+    http_Reactor *InitReactor();
+    void StopReactor();
+
+    bool InitFileCache(Size max_size);
+    void StopFileCache();
+
     friend http_IO;
+    friend http_WebSocket;
 };
 
 enum class http_RequestMethod {
@@ -153,6 +213,61 @@ enum class http_WebSocketFlag {
     Text = 1 << 0
 };
 
+// Upgraded socket handed over to the daemon reactor with http_IO::AttachWS(). Send() and
+// Close() can be used from any thread, as long as you hold a reference.
+class http_WebSocket: public RetainObject<http_WebSocket> {
+    RG_DELETE_COPY(http_WebSocket)
+
+    http_Daemon *daemon;
+    struct MHD_UpgradeResponseHandle *urh;
+    MHD_socket fd;
+    int opcode;
+    char client_addr[65];
+
+    std::function<void(http_WebSocket *ws, Span<const uint8_t> msg)> message_func;
+    std::function<void(http_WebSocket *ws)> close_func;
+
+    // Only used by the reactor thread
+    HeapArray<uint8_t> recv_buf;
+    HeapArray<uint8_t> message;
+    int message_opcode = 0;
+    uint32_t events = 0;
+
+    std::mutex mutex;
+    BucketArray<HeapArray<uint8_t>> inbox;
+    Size inbox_size = 0;
+    bool dispatching = false;
+    bool paused = false;
+    BucketArray<HeapArray<uint8_t>> outbox;
+    Size out_offset = 0;
+    bool flush_pending = false;
+    bool closing = false;
+    bool closed = false;
+
+public:
+    void *udata = nullptr;
+
+    http_WebSocket() = default;
+
+    const char *GetClientAddress() const { return client_addr; }
+
+    bool Send(Span<const uint8_t> msg);
+    bool Send(Span<const char> msg) { return Send(msg.As<const uint8_t>()); }
+    void Close();
+
+    bool IsClosed();
+
+private:
+    // Call with mutex locked
+    void QueueFrame(int frame_opcode, Span<const uint8_t> payload);
+
+    // Don't hold the mutex, Async::Run() may run the task right away under load
+    void ScheduleDispatch();
+
+    friend http_Reactor;
+    friend http_IO;
+};
+
 class http_IO {
     RG_DELETE_COPY(http_IO)
 
@@ -175,7 +290,9 @@ class http_IO {
     bool suspended = false;
 
     std::function<void()> async_func;
+    http_Priority async_priority = http_Priority::Normal;
     bool async_func_response = false;
+    bool admitted = false;
     const char *last_err = nullptr;
     bool force_queue = false;
 
@@ -184,12 +301,21 @@ class http_IO {
     Size read_len = 0;
     bool read_eof = false;
 
+    // Streamed responses go through a small ring of chunks: the async handler fills write_buf
+    // without locking and hands it over once full, while libmicrohttpd drains the ring. When
+    // libmicrohttpd finds the ring empty, it sets write_starved and the next write hands over
+    // a partial chunk, so that slow streams (such as progress output) don't stall.
     int write_code;
     uint64_t write_len;
     std::condition_variable write_cv;
     HeapArray<uint8_t> write_buf;
+    HeapArray<uint8_t> write_ring[8];
+    Size write_head = 0;
+    Size write_count = 0;
     Size write_offset = 0;
     bool write_eof = false;
+    bool write_abort = false;
+    std::atomic_bool write_starved { false };
 
     int ws_opcode;
     std::condition_variable ws_cv;
@@ -203,6 +329,11 @@ class http_IO {
 
     HeapArray<std::function<void()>> finalizers;
 
+    int64_t start_time = -1;
+    int64_t queue_time = -1;
+    int64_t response_len = 0;
+    const char *metrics_route = nullptr;
+
 public:
     BlockAllocator allocator;
 
@@ -212,7 +343,8 @@ public:
     bool NegociateEncoding(CompressionType preferred, CompressionType *out_encoding);
     bool NegociateEncoding(CompressionType preferred1, CompressionType preferred2, CompressionType *out_encoding);
 
-    void RunAsync(std::function<void()> func);
+    // Normal and low priority requests may get a 503 error instead when the server is overloaded
+    void RunAsync(std::function<void()> func, http_Priority priority = http_Priority::Normal);
 
     void AddHeader(const char *key, const char *value);
     void AddEncodingHeader(CompressionType encoding);
@@ -220,12 +352,14 @@ public:
                          bool http_only = false);
     void AddCachingHeaders(int64_t max_age, const char *etag = nullptr);
 
-    void AttachResponse(int code, MHD_Response *new_response);
+    void AttachResponse(int code, MHD_Response *new_response, Size len = 0);
     void AttachText(int code, Span<const char> str, const char *mime_type = "text/plain");
     bool AttachBinary(int code, Span<const uint8_t> data, const char *mime_type,
-                      CompressionType compression_type = CompressionType::None);
+                      CompressionType compression_type = CompressionType::None,
+                      http_Priority priority = http_Priority::Normal);
     void AttachError(int code, const char *details = nullptr);
-    bool AttachFile(int code, const char *filename, const char *mime_type = nullptr);
+    // Precompressed sidecars (.br, .zst, .gz) are only considered when sidecars is true
+    bool AttachFile(int code, const char *filename, const char *mime_type = nullptr, bool sidecars = false);
     void AttachNothing(int code);
 
     void ResetResponse();
@@ -236,6 +370,15 @@ public:
     bool OpenForWrite(int code, Size len, StreamWriter *out_st)
         { return OpenForWrite(code, len, CompressionType::None, out_st); }
 
+    // Give up on a response opened with OpenForWrite(): the client gets a 500 error if nothing
+    // was sent yet, or a reset connection instead of the end of the stream. Writes fail after this.
+    void AbortWrite();
+
+    // Send what was written so far, without waiting for the current chunk to fill up. Slow
+    // streams don't need this once the first chunk is out (partial chunks are handed over
+    // whenever libmicrohttpd runs dry), but the headers only go out with the first chunk.
+    bool FlushWrite();
+
     // These must be run in async context (with RunAsync), except for IsWS
     bool IsWS() const;
     bool UpgradeToWS(unsigned int flags);
@@ -243,12 +386,27 @@ public:
     bool OpenForWriteWS(CompressionType encoding, StreamWriter *out_st);
     bool OpenForWriteWS(StreamWriter *out_st) { return OpenForWriteWS(CompressionType::None, out_st); }
 
+    // Hand the upgraded socket over to the daemon reactor (Linux only), so the async handler
+    // can return. Each complete message is then given to message_func in a short async task
+    // (one at a time for each socket), and close_func runs once the connection is gone.
+    // Must be run in async context, after UpgradeToWS().
+    bool AttachWS(std::function<void(http_WebSocket *ws, Span<const uint8_t> msg)> message_func,
+                  std::function<void(http_WebSocket *ws)> close_func = {},
+                  RetainPtr<http_WebSocket> *out_ws = nullptr);
+
     void AddFinalizer(const std::function<void()> &func);
 
+    // Requests are grouped by method in metrics unless you set a route, which must be
+    // a small set of values (e.g. "/api/records/save", not the actual URL).
+    void SetMetricsRoute(const char *route) { metrics_route = route; }
+
 private:
     void PushLogFilter();
 
+    MHD_Result QueueResponse();
+
     Size Read(Span<uint8_t> out_buf);
+    bool PushWriteChunk(bool eof);
     bool Write(Span<const uint8_t> buf);
 
     static void HandleUpgrade(void *cls, struct MHD_Connection *, void *,
@@ -35,6 +35,8 @@ class http_SessionManager {
     static const int64_t MaxLockDelay = 120 * 60000;
     static const int64_t RegenerateDelay = 5 * 60000;
 
+    static const Size ShardCount = 32;
+
     struct SessionHandle {
         char session_key[65];
         char session_rnd[33];
@@ -48,11 +50,21 @@ class http_SessionManager {
         RG_HASHTABLE_HANDLER_T(SessionHandle, const char *, session_key);
     };
 
+    // Sessions are spread over shards by key hash, so that concurrent logins and lookups
+    // don't all fight for the same lock.
+    //
+    // Each handle expires MaxKeyDelay after it is created (login and lock expiry are checked
+    // in FindHandle, and regenerated keys get a new handle), so handles are appended to
+    // each shard in expiry order and pruning stops at the first live one.
+    struct Shard {
+        std::shared_mutex mutex;
+        BucketArray<SessionHandle> sessions;
+        HashTable<const char *, SessionHandle *> sessions_map;
+    };
+
     const char *cookie_path = "/";
 
-    std::shared_mutex mutex;
-    BucketArray<SessionHandle> sessions;
-    HashTable<const char *, SessionHandle *> sessions_map;
+    Shard shards[ShardCount];
 
 public:
     http_SessionManager() = default;
@@ -61,11 +73,9 @@ public:
 
     void Open(const http_RequestInfo &, http_IO *io, RetainPtr<T> udata)
     {
-        std::lock_guard<std::shared_mutex> lock_excl(mutex);
+        std::unique_lock<std::shared_mutex> lock_excl;
 
-        SessionHandle *handle = CreateHandle();
-        if (!handle)
-            return;
+        SessionHandle *handle = CreateHandle(nullptr, &lock_excl);
         int64_t now = GetMonotonicTime();
 
         handle->login_time = now;
@@ -80,25 +90,38 @@ public:
 
     void Close(const http_RequestInfo &request, http_IO *io)
     {
-        std::lock_guard<std::shared_mutex> lock_excl(mutex);
+        const char *session_key = request.GetCookieValue("session_key");
+        const char *session_rnd = request.GetCookieValue("session_rnd");
+
+        if (session_key) {
+            Shard *shard = GetShard(session_key);
+            std::lock_guard<std::shared_mutex> lock_excl(shard->mutex);
 
-        // We don't care about those but for performance reasons FindHandle()
-        // always writes those.
-        bool mismatch;
-        bool locked;
-        SessionHandle **ptr = FindHandle(request, &mismatch, &locked);
+            // We don't care about those but for performance reasons FindHandle()
+            // always writes those.
+            bool mismatch;
+            bool locked;
+            SessionHandle **ptr = FindHandle(shard, session_key, session_rnd, &mismatch, &locked);
+
+            shard->sessions_map.Remove(ptr);
+        }
 
-        sessions_map.Remove(ptr);
         DeleteSessionCookies(io);
     }
 
     RetainPtr<T> Find(const http_RequestInfo &request, http_IO *io)
     {
-        std::shared_lock<std::shared_mutex> lock_shr(mutex);
+        const char *session_key = request.GetCookieValue("session_key");
+        const char *session_rnd = request.GetCookieValue("session_rnd");
+        if (!session_key)
+            return nullptr;
+
+        Shard *shard = GetShard(session_key);
+        std::shared_lock<std::shared_mutex> lock_shr(shard->mutex);
 
         bool mismatch = false;
         bool locked = false;
-        SessionHandle **ptr = FindHandle(request, &mismatch, &locked);
+        SessionHandle **ptr = FindHandle(shard, session_key, session_rnd, &mismatch, &locked);
 
         if (ptr) {
             SessionHandle *handle = *ptr;
@@ -114,14 +137,11 @@ public:
                 int64_t login_time = handle->login_time;
                 int64_t lock_time = handle->lock_time;
 
+                // The new key probably belongs to another shard
                 lock_shr.unlock();
-                std::lock_guard<std::shared_mutex> lock_excl(mutex);
+                std::unique_lock<std::shared_mutex> lock_excl;
 
-                handle = CreateHandle(locked ? session_rnd : nullptr);
-                if (!handle) {
-                    DeleteSessionCookies(io);
-                    return nullptr;
-                }
+                handle = CreateHandle(locked ? session_rnd : nullptr, &lock_excl);
 
                 handle->login_time = login_time;
                 handle->register_time = now;
@@ -150,85 +170,106 @@ public:
 
     void Prune()
     {
-        std::lock_guard<std::shared_mutex> lock_excl(mutex);
-
         int64_t now = GetMonotonicTime();
 
-        Size expired = 0;
-        for (const SessionHandle &handle: sessions) {
-            if (now - handle.register_time < MaxKeyDelay)
-                break;
-
-            sessions_map.Remove(handle.session_key);
-            expired++;
-        }
+        // Only one shard is locked at a time
+        for (Shard &shard: shards) {
+            std::lock_guard<std::shared_mutex> lock_excl(shard.mutex);
 
-        sessions.RemoveFirst(expired);
+            ExpireHandles(&shard, now);
 
-        sessions.Trim();
-        sessions_map.Trim();
+            shard.sessions.Trim();
+            shard.sessions_map.Trim();
+        }
     }
 
     void ApplyAll(FunctionRef<void(T *udata)> func)
     {
-        std::lock_guard<std::shared_mutex> lock_excl(mutex);
+        for (Shard &shard: shards) {
+            std::lock_guard<std::shared_mutex> lock_excl(shard.mutex);
 
-        for (const SessionHandle &handle: sessions) {
-            func(handle.udata.GetRaw());
+            for (const SessionHandle &handle: shard.sessions) {
+                func(handle.udata.GetRaw());
+            }
         }
     }
 
 private:
-    SessionHandle *CreateHandle(const char *session_rnd = nullptr)
+    Shard *GetShard(const char *session_key)
+    {
+        // Use high bits, the hash table uses the low ones
+        uint64_t hash = HashTraits<const char *>::Hash(session_key);
+        return &shards[(hash >> 32) % ShardCount];
+    }
+
+    // Returns the new handle, with its shard locked in out_lock
+    SessionHandle *CreateHandle(const char *session_rnd, std::unique_lock<std::shared_mutex> *out_lock)
     {
-        SessionHandle *handle = sessions.AppendDefault();
+        static_assert(RG_SIZE(SessionHandle::session_key) == 65);
 
         // Register handle with unique key
         for (;;) {
-            static_assert(RG_SIZE(SessionHandle::session_key) == 65);
-
+            char session_key[65];
             {
                 uint64_t buf[4];
                 FillRandomSafe(buf, RG_SIZE(buf));
-                Fmt(handle->session_key, "%1%2%3%4",
+                Fmt(session_key, "%1%2%3%4",
                     FmtHex(buf[0]).Pad0(-16), FmtHex(buf[1]).Pad0(-16),
                     FmtHex(buf[2]).Pad0(-16), FmtHex(buf[3]).Pad0(-16));
             }
 
-            bool inserted;
-            sessions_map.TrySet(handle, &inserted);
+            Shard *shard = GetShard(session_key);
+            std::unique_lock<std::shared_mutex> lock_excl(shard->mutex);
 
-            if (inserted) [[likely]]
-                break;
+            if (shard->sessions_map.Find(session_key)) [[unlikely]]
+                continue;
+
+            // Cheap because nothing needs to be scanned, and it spreads the work done in Prune()
+            ExpireHandles(shard, GetMonotonicTime());
+
+            SessionHandle *handle = shard->sessions.AppendDefault();
+
+            CopyString(session_key, handle->session_key);
+            shard->sessions_map.Set(handle);
+
+            // Reuse or create public randomized key (for use in session-specific URLs)
+            if (session_rnd) {
+                RG_ASSERT(strlen(session_rnd) + 1 == RG_SIZE(handle->session_rnd));
+                CopyString(session_rnd, handle->session_rnd);
+            } else {
+                static_assert(RG_SIZE(handle->session_rnd) == 33);
+
+                uint64_t buf[2];
+                FillRandomSafe(&buf, RG_SIZE(buf));
+                Fmt(handle->session_rnd, "%1%2", FmtHex(buf[0]).Pad0(-16), FmtHex(buf[1]).Pad0(-16));
+            }
+
+            *out_lock = std::move(lock_excl);
+            return handle;
         }
+    }
 
-        // Reuse or create public randomized key (for use in session-specific URLs)
-        if (session_rnd) {
-            RG_ASSERT(strlen(session_rnd) + 1 == RG_SIZE(handle->session_rnd));
-            CopyString(session_rnd, handle->session_rnd);
-        } else {
-            static_assert(RG_SIZE(handle->session_rnd) == 33);
+    // Call with shard locked exclusively
+    void ExpireHandles(Shard *shard, int64_t now)
+    {
+        Size expired = 0;
+        for (const SessionHandle &handle: shard->sessions) {
+            if (now - handle.register_time < MaxKeyDelay)
+                break;
 
-            uint64_t buf[2];
-            FillRandomSafe(&buf, RG_SIZE(buf));
-            Fmt(handle->session_rnd, "%1%2", FmtHex(buf[0]).Pad0(-16), FmtHex(buf[1]).Pad0(-16));
+            shard->sessions_map.Remove(handle.session_key);
+            expired++;
         }
 
-        return handle;
+        shard->sessions.RemoveFirst(expired);
     }
 
-    SessionHandle **FindHandle(const http_RequestInfo &request, bool *out_mismatch, bool *out_locked)
+    SessionHandle **FindHandle(Shard *shard, const char *session_key, const char *session_rnd,
+                               bool *out_mismatch, bool *out_locked)
     {
         int64_t now = GetMonotonicTime();
 
-        const char *session_key = request.GetCookieValue("session_key");
-        const char *session_rnd = request.GetCookieValue("session_rnd");
-        if (!session_key) {
-            *out_mismatch = false;
-            return nullptr;
-        }
-
-        SessionHandle **ptr = sessions_map.Find(session_key);
+        SessionHandle **ptr = shard->sessions_map.Find(session_key);
         if (!ptr) {
             *out_mismatch = true;
             return nullptr;
@@ -32,6 +32,10 @@
     #include <fcntl.h>
     #include <poll.h>
 #endif
+#ifdef __linux__
+    #include <sys/epoll.h>
+    #include <sys/eventfd.h>
+#endif
 
 namespace RG {
 
@@ -434,4 +438,742 @@ bool http_IO::WriteWS(Span<const uint8_t> buf)
     return true;
 }
 
+#ifdef __linux__
+
+static const Size MaxMessageSize = Kibibytes(256);
+static const Size MaxInboxSize = Mebibytes(1);
+
+// Owns upgraded sockets: reads and parses frames without blocking, hands complete messages
+// to the daemon async threads, and writes queued frames (many at once with writev).
+class http_Reactor {
+    http_Daemon *daemon;
+
+    int epoll_fd = -1;
+    int event_fd = -1;
+    std::thread thread;
+
+    std::mutex mutex;
+    HashSet<void *> sockets;
+    HeapArray<http_WebSocket *> wakes;
+    bool stop = false;
+
+public:
+    http_Reactor(http_Daemon *daemon) : daemon(daemon) {}
+    ~http_Reactor();
+
+    bool Start();
+    void Stop();
+
+    bool Register(http_WebSocket *ws);
+    void Wake(http_WebSocket *ws);
+
+private:
+    void Run();
+
+    bool Receive(http_WebSocket *ws);
+    bool ParseFrames(http_WebSocket *ws);
+    bool Flush(http_WebSocket *ws);
+    void UpdateEvents(http_WebSocket *ws);
+
+    void Destroy(http_WebSocket *ws);
+};
+
+http_Reactor::~http_Reactor()
+{
+    Stop();
+
+    CloseDescriptor(epoll_fd);
+    CloseDescriptor(event_fd);
+}
+
+bool http_Reactor::Start()
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        LogError("Failed to create epoll instance: %1", strerror(errno));
+        return false;
+    }
+
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0) {
+        LogError("Failed to create eventfd: %1", strerror(errno));
+        return false;
+    }
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &ev) < 0) {
+        LogError("Failed to register eventfd: %1", strerror(errno));
+        return false;
+    }
+
+    thread = std::thread([this]() { Run(); });
+
+    return true;
+}
+
+void http_Reactor::Stop()
+{
+    if (!thread.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+
+    uint64_t one = 1;
+    RG_IGNORE write(event_fd, &one, RG_SIZE(one));
+
+    thread.join();
+
+    // Close everything that remains, Send() and Close() do nothing after this
+    HeapArray<http_WebSocket *> remain;
+    for (void *ptr: sockets.table) {
+        remain.Append((http_WebSocket *)ptr);
+    }
+    for (http_WebSocket *ws: remain) {
+        Destroy(ws);
+    }
+
+    for (http_WebSocket *ws: wakes) {
+        RetainPtr<http_WebSocket> ptr(ws, false);
+    }
+    wakes.Clear();
+}
+
+bool http_Reactor::Register(http_WebSocket *ws)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (stop) {
+        LogError("Server is shutting down");
+        return false;
+    }
+
+    ws->events = EPOLLIN | EPOLLRDHUP;
+
+    struct epoll_event ev = {};
+    ev.events = ws->events;
+    ev.data.ptr = ws;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ws->fd, &ev) < 0) {
+        LogError("Failed to register WebSocket: %1", strerror(errno));
+        return false;
+    }
+
+    // The reactor keeps a reference until the socket is closed
+    ws->Ref();
+    sockets.Set(ws);
+
+    // Data may have come with the upgrade request, parse it from the reactor thread
+    if (ws->recv_buf.len) {
+        ws->Ref();
+        wakes.Append(ws);
+
+        uint64_t one = 1;
+        RG_IGNORE write(event_fd, &one, RG_SIZE(one));
+    }
+
+    return true;
+}
+
+void http_Reactor::Wake(http_WebSocket *ws)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (stop)
+        return;
+
+    ws->Ref();
+    wakes.Append(ws);
+
+    if (wakes.len == 1) {
+        uint64_t one = 1;
+        RG_IGNORE write(event_fd, &one, RG_SIZE(one));
+    }
+}
+
+void http_Reactor::Run()
+{
+    HeapArray<http_WebSocket *> pending;
+
+    for (;;) {
+        struct epoll_event events[256];
+        int count = RG_RESTART_EINTR(epoll_wait(epoll_fd, events, RG_LEN(events), -1), < 0);
+
+        if (count < 0) {
+            LogError("Failed to poll WebSocket reactor: %1", strerror(errno));
+            return;
+        }
+
+        for (int i = 0; i < count; i++) {
+            http_WebSocket *ws = (http_WebSocket *)events[i].data.ptr;
+
+            if (!ws) {
+                uint64_t dummy;
+                RG_IGNORE read(event_fd, &dummy, RG_SIZE(dummy));
+
+                std::lock_guard<std::mutex> lock(mutex);
+
+                if (stop)
+                    return;
+
+                std::swap(pending, wakes);
+                continue;
+            }
+
+            if (ws->closed)
+                continue;
+
+            bool valid = true;
+
+            if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                valid = false;
+            } else if (events[i].events & (EPOLLIN | EPOLLRDHUP)) {
+                valid = Receive(ws) && ParseFrames(ws);
+            }
+            if (valid && (events[i].events & EPOLLOUT)) {
+                valid = Flush(ws);
+            }
+
+            if (!valid) {
+                Destroy(ws);
+            }
+        }
+
+        // Sockets with new frames to send, or with reading paused until handlers catch up
+        for (http_WebSocket *ws: pending) {
+            RetainPtr<http_WebSocket> ptr(ws, false);
+
+            if (ws->closed)
+                continue;
+
+            bool valid = ParseFrames(ws) && Flush(ws);
+
+            if (!valid) {
+                Destroy(ws);
+            }
+        }
+        pending.RemoveFrom(0);
+    }
+}
+
+bool http_Reactor::Receive(http_WebSocket *ws)
+{
+    // Don't let a single socket hog the reactor
+    for (Size total = 0; total < Kibibytes(256);) {
+        {
+            std::lock_guard<std::mutex> lock(ws->mutex);
+            if (ws->paused)
+                break;
+        }
+
+        ws->recv_buf.Grow(Kibibytes(4));
+
+        Size available = ws->recv_buf.capacity - ws->recv_buf.len;
+        ssize_t len = recv(ws->fd, ws->recv_buf.end(), (size_t)available, 0);
+
+        if (len < 0) {
+            if (errno == EWOULDBLOCK || errno == EAGAIN)
+                break;
+            if (errno == EINTR)
+                continue;
+
+            LogError("Failed to read from WebSocket: %1", strerror(errno));
+            return false;
+        } else if (!len) {
+            return false;
+        }
+
+        ws->recv_buf.len += (Size)len;
+        total += (Size)len;
+
+        if (len < available)
+            break;
+    }
+
+    return true;
+}
+
+bool http_Reactor::ParseFrames(http_WebSocket *ws)
+{
+    Size offset = 0;
+
+    RG_DEFER {
+        MemMove(ws->recv_buf.ptr, ws->recv_buf.ptr + offset, ws->recv_buf.len - offset);
+        ws->recv_buf.len -= offset;
+    };
+
+    while (ws->recv_buf.len - offset >= 2) {
+        const uint8_t *frame = ws->recv_buf.ptr + offset;
+        Size avail = ws->recv_buf.len - offset;
+
+        bool fin = frame[0] & 0x80;
+        int rsv = (frame[0] >> 4) & 0x7;
+        int opcode = frame[0] & 0xF;
+        bool masked = frame[1] & 0x80;
+        Size payload = frame[1] & 0x7F;
+
+        if (rsv) {
+            LogError("Unsupported WebSocket RSV bits");
+            return false;
+        }
+        if (!masked) {
+            LogError("Client to server messages must be masked");
+            return false;
+        }
+
+        Size header;
+        if (payload == 126) {
+            if (avail < 8)
+                break;
+
+            uint16_t payload16;
+            MemCpy(&payload16, frame + 2, 2);
+
+            payload = BigEndian(payload16);
+            header = 8;
+        } else if (payload == 127) {
+            if (avail < 14)
+                break;
+
+            uint64_t payload64;
+            MemCpy(&payload64, frame + 2, 8);
+            payload64 = BigEndian(payload64);
+
+            if (payload64 > (uint64_t)MaxMessageSize) {
+                LogError("Excessive WS packet length %1 (maximum = %2)", FmtMemSize(payload64), FmtMemSize(MaxMessageSize));
+                return false;
+            }
+
+            payload = (Size)payload64;
+            header = 14;
+        } else {
+            header = 6;
+        }
+        if (avail < header + payload)
+            break;
+
+        const uint8_t *mask = frame + header - 4;
+        Span<uint8_t> data = MakeSpan((uint8_t *)frame + header, payload);
+
+        for (Size i = 0; i < data.len; i++) {
+            data[i] ^= mask[i & 0x3];
+        }
+
+        offset += header + payload;
+
+        switch (opcode) {
+            case 0: // Continuation
+            case 1: // Text
+            case 2: { // Binary
+                if (opcode) {
+                    if (ws->message_opcode) {
+                        LogError("Unexpected WebSocket frame in fragmented message");
+                        return false;
+                    }
+                    ws->message_opcode = opcode;
+                } else if (!ws->message_opcode) {
+                    LogError("Unexpected WebSocket continuation frame");
+                    return false;
+                }
+
+                if (ws->message.len + data.len > MaxMessageSize) {
+                    LogError("Excessive WS message length (maximum = %1)", FmtMemSize(MaxMessageSize));
+                    return false;
+                }
+                ws->message.Append(data);
+
+                if (fin) {
+                    {
+                        std::lock_guard<std::mutex> lock(ws->mutex);
+
+                        HeapArray<uint8_t> *msg = ws->inbox.AppendDefault();
+                        std::swap(*msg, ws->message);
+
+                        ws->inbox_size += msg->len;
+                        ws->message_opcode = 0;
+
+                        // Stop reading until handlers catch up
+                        ws->paused = (ws->inbox_size >= MaxInboxSize);
+                    }
+
+                    ws->ScheduleDispatch();
+                }
+            } break;
+
+            case 8: { // Close
+                std::lock_guard<std::mutex> lock(ws->mutex);
+
+                if (!ws->closing) {
+                    ws->QueueFrame(8, data.Take(0, std::min(data.len, (Size)2)));
+                    ws->closing = true;
+                }
+            } break;
+
+            case 9: { // Ping
+                std::lock_guard<std::mutex> lock(ws->mutex);
+
+                if (!ws->closing) {
+                    ws->QueueFrame(10, data);
+                }
+            } break;
+
+            case 10: {} break; // Pong
+
+            default: {
+                LogError("Unsupported WebSocket opcode %1", opcode);
+                return false;
+            } break;
+        }
+    }
+
+    // Control frames need to be sent
+    return Flush(ws);
+}
+
+bool http_Reactor::Flush(http_WebSocket *ws)
+{
+    std::unique_lock<std::mutex> lock(ws->mutex);
+
+    ws->flush_pending = false;
+
+    while (ws->outbox.len) {
+        struct iovec iov[64];
+        Size iov_len = 0;
+
+        for (const HeapArray<uint8_t> &frame: ws->outbox) {
+            if (iov_len >= RG_LEN(iov))
+                break;
+
+            Size skip = iov_len ? 0 : ws->out_offset;
+
+            iov[iov_len].iov_base = (void *)(frame.ptr + skip);
+            iov[iov_len].iov_len = (size_t)(frame.len - skip);
+            iov_len++;
+        }
+
+        ssize_t len = writev(ws->fd, iov, (int)iov_len);
+
+        if (len < 0) {
+            if (errno == EWOULDBLOCK || errno == EAGAIN)
+                break;
+            if (errno == EINTR)
+                continue;
+
+            LogError("Failed to write to WebSocket: %1", strerror(errno));
+            return false;
+        }
+
+        // Drop everything that was sent
+        Size sent = ws->out_offset + (Size)len;
+        Size done = 0;
+
+        while (done < ws->outbox.len && ws->outbox[done].len <= sent) {
+            sent -= ws->outbox[done].len;
+            done++;
+        }
+
+        ws->outbox.RemoveFirst(done);
+        ws->out_offset = sent;
+    }
+
+    if (ws->closing && !ws->outbox.len)
+        return false;
+
+    lock.unlock();
+    UpdateEvents(ws);
+
+    return true;
+}
+
+void http_Reactor::UpdateEvents(http_WebSocket *ws)
+{
+    uint32_t events = 0;
+    {
+        std::lock_guard<std::mutex> lock(ws->mutex);
+
+        if (!ws->paused) {
+            events |= EPOLLIN | EPOLLRDHUP;
+        }
+        if (ws->outbox.len) {
+            events |= EPOLLOUT;
+        }
+    }
+
+    if (events != ws->events) {
+        struct epoll_event ev = {};
+        ev.events = events;
+        ev.data.ptr = ws;
+
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, ws->fd, &ev);
+        ws->events = events;
+    }
+}
+
+void http_Reactor::Destroy(http_WebSocket *ws)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, ws->fd, nullptr);
+
+    {
+        std::lock_guard<std::mutex> lock(ws->mutex);
+
+        ws->closed = true;
+        ws->outbox.Clear();
+    }
+
+    // Let handlers see what is left, and then run close_func
+    ws->ScheduleDispatch();
+
+    MHD_upgrade_action(ws->urh, MHD_UPGRADE_ACTION_CLOSE);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        sockets.Remove(ws);
+    }
+
+    RetainPtr<http_WebSocket> ptr(ws, false);
+}
+
+http_Reactor *http_Daemon::InitReactor()
+{
+    std::lock_guard<std::mutex> lock(reactor_mutex);
+
+    if (!reactor) {
+        http_Reactor *new_reactor = new http_Reactor(this);
+
+        if (!new_reactor->Start()) {
+            delete new_reactor;
+            return nullptr;
+        }
+
+        reactor = new_reactor;
+    }
+
+    return reactor;
+}
+
+void http_Daemon::StopReactor()
+{
+    std::lock_guard<std::mutex> lock(reactor_mutex);
+
+    // Sockets are all closed once Stop() returns, so nobody uses the reactor after this
+    if (reactor) {
+        reactor->Stop();
+
+        delete reactor;
+        reactor = nullptr;
+    }
+}
+
+void http_WebSocket::QueueFrame(int frame_opcode, Span<const uint8_t> payload)
+{
+    HeapArray<uint8_t> *frame = outbox.AppendDefault();
+
+    frame->Grow(14 + payload.len);
+    frame->Append((uint8_t)(0x80 | frame_opcode));
+
+    if (payload.len >= 65536) {
+        uint64_t len64 = BigEndian((uint64_t)payload.len);
+
+        frame->Append((uint8_t)127);
+        frame->Append(MakeSpan((const uint8_t *)&len64, 8));
+    } else if (payload.len >= 126) {
+        uint16_t len16 = BigEndian((uint16_t)payload.len);
+
+        frame->Append((uint8_t)126);
+        frame->Append(MakeSpan((const uint8_t *)&len16, 2));
+    } else {
+        frame->Append((uint8_t)payload.len);
+    }
+
+    frame->Append(payload);
+}
+
+void http_WebSocket::ScheduleDispatch()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (dispatching)
+            return;
+        if (!inbox.len && !closed)
+            return;
+
+        dispatching = true;
+    }
+
+    Ref();
+    daemon->async->Run([this]() {
+        RetainPtr<http_WebSocket> ptr(this, false);
+
+        for (;;) {
+            HeapArray<uint8_t> msg;
+            bool next = false;
+            bool resume = false;
+            std::function<void(http_WebSocket *ws)> notify;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+
+                if (inbox.len) {
+                    next = true;
+
+                    std::swap(msg, inbox[0]);
+                    inbox.RemoveFirst();
+                    inbox_size -= msg.len;
+
+                    if (paused && !closed && inbox_size < MaxInboxSize / 2) {
+                        paused = false;
+                        resume = true;
+                    }
+                } else {
+                    if (closed) {
+                        std::swap(notify, close_func);
+                    }
+                    dispatching = false;
+                }
+            }
+
+            // The daemon may be stopping, and StopReactor() deletes the reactor without waiting
+            // for dispatch tasks. Hold reactor_mutex so it can't go away while we use it.
+            if (resume) {
+                std::lock_guard<std::mutex> lock(daemon->reactor_mutex);
+
+                if (daemon->reactor) {
+                    std::unique_lock<std::mutex> ws_lock(mutex);
+
+                    if (!closed) {
+                        ws_lock.unlock();
+                        daemon->reactor->Wake(this);
+                    }
+                }
+            }
+
+            if (!next) {
+                if (notify) {
+                    notify(this);
+                }
+                break;
+            }
+
+            message_func(this, msg);
+        }
+
+        return true;
+    });
+}
+
+bool http_WebSocket::Send(Span<const uint8_t> msg)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (closed || closing)
+        return false;
+
+    QueueFrame(opcode, msg);
+
+    if (!flush_pending) {
+        flush_pending = true;
+        daemon->reactor->Wake(this);
+    }
+
+    return true;
+}
+
+void http_WebSocket::Close()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (closed || closing)
+        return;
+
+    // Normal closure
+    static const uint8_t code[2] = { 0x03, 0xE8 };
+
+    QueueFrame(8, code);
+    closing = true;
+
+    if (!flush_pending) {
+        flush_pending = true;
+        daemon->reactor->Wake(this);
+    }
+}
+
+bool http_WebSocket::IsClosed()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return closed || closing;
+}
+
+bool http_IO::AttachWS(std::function<void(http_WebSocket *ws, Span<const uint8_t> msg)> message_func,
+                       std::function<void(http_WebSocket *ws)> close_func,
+                       RetainPtr<http_WebSocket> *out_ws)
+{
+    RG_ASSERT(message_func);
+
+    http_Reactor *reactor = daemon->InitReactor();
+    if (!reactor)
+        return false;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (state != State::WebSocket || !ws_urh) {
+        LogError("Cannot attach WebSocket before upgrade");
+        return false;
+    }
+
+    http_WebSocket *ws = new http_WebSocket;
+    RetainPtr<http_WebSocket> ptr(ws, [](http_WebSocket *ws) { delete ws; });
+
+    ws->daemon = daemon;
+    ws->urh = ws_urh;
+    ws->fd = ws_fd;
+    ws->opcode = ws_opcode;
+    CopyString(request.client_addr, ws->client_addr);
+    ws->message_func = message_func;
+    ws->close_func = close_func;
+    std::swap(ws->recv_buf, ws_buf);
+
+    if (!reactor->Register(ws)) {
+        std::swap(ws->recv_buf, ws_buf);
+        return false;
+    }
+
+    // The reactor owns the socket now
+    ws_urh = nullptr;
+
+    if (out_ws) {
+        *out_ws = ptr;
+    }
+    return true;
+}
+
+#else
+
+http_Reactor *http_Daemon::InitReactor()
+{
+    return nullptr;
+}
+
+void http_Daemon::StopReactor()
+{
+}
+
+bool http_IO::AttachWS(std::function<void(http_WebSocket *ws, Span<const uint8_t> msg)>,
+                       std::function<void(http_WebSocket *ws)>, RetainPtr<http_WebSocket> *)
+{
+    LogError("Event-driven WebSockets are not supported on this platform");
+    return false;
+}
+
+bool http_WebSocket::Send(Span<const uint8_t>) { RG_UNREACHABLE(); }
+void http_WebSocket::Close() { RG_UNREACHABLE(); }
+bool http_WebSocket::IsClosed() { RG_UNREACHABLE(); }
+
+#endif
+
 }
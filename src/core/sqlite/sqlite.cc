@@ -227,6 +227,126 @@ bool sq_Database::Transaction(FunctionRef<bool()> func)
     }
 }
 
+bool sq_Database::GroupTransaction(FunctionRef<bool()> func)
+{
+    // Limit latency for the first members of a batch
+    static const int MaxBatchMembers = 64;
+
+    // Nested calls run inside the outer transaction
+    {
+        std::unique_lock<std::mutex> lock(wait_mutex);
+
+        if (running_exclusive && running_exclusive_thread == std::this_thread::get_id()) {
+            lock.unlock();
+            return Transaction(func);
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(group_mutex);
+
+    // Wait for our turn, only one member runs at a time
+    group_pending++;
+    while (group_busy) {
+        group_cv.wait(lock);
+    }
+    group_pending--;
+    group_busy = true;
+
+    GroupBatch *batch = group_batch;
+
+    if (batch) {
+        // Take over the exclusive lock held for the open transaction
+        std::lock_guard<std::mutex> lock(wait_mutex);
+
+        RG_ASSERT(running_exclusive == 1);
+        running_exclusive_thread = std::this_thread::get_id();
+    } else {
+        lock.unlock();
+
+        LockExclusive();
+
+        if (!Run("BEGIN IMMEDIATE TRANSACTION")) {
+            UnlockExclusive();
+
+            lock.lock();
+            group_busy = false;
+            group_cv.notify_all();
+
+            return false;
+        }
+
+        lock.lock();
+
+        batch = new GroupBatch();
+        group_batch = batch;
+    }
+    batch->members++;
+
+    lock.unlock();
+
+    bool success = Run("SAVEPOINT grp");
+
+    if (success) {
+        success = func();
+
+        if (!success) {
+            Run("ROLLBACK TO grp");
+        }
+        success &= Run("RELEASE grp");
+    }
+
+    // Some errors (such as SQLITE_FULL) roll back the whole transaction, in which case
+    // previous members must fail too, and we can't add anything else to the batch.
+    // Nothing else can end the transaction: the batch holds the exclusive lock, and nested
+    // Transaction() calls from func don't BEGIN or COMMIT anything. So if the connection
+    // is back in autocommit mode, SQLite rolled everything back.
+    bool broken = sqlite3_get_autocommit(db);
+
+    lock.lock();
+
+    if (!broken && group_pending && batch->members < MaxBatchMembers) {
+        // Let the next member run inside the same transaction
+        group_busy = false;
+        group_cv.notify_all();
+
+        batch->waiting++;
+        while (!batch->done) {
+            group_cv.wait(lock);
+        }
+        success &= batch->success;
+
+        if (!--batch->waiting) {
+            delete batch;
+        }
+
+        return success;
+    } else {
+        // Nobody else is waiting, commit everything
+        group_batch = nullptr;
+        lock.unlock();
+
+        bool committed = !broken && Run("COMMIT");
+
+        if (!committed && !sqlite3_get_autocommit(db)) {
+            Run("ROLLBACK");
+        }
+        UnlockExclusive();
+
+        lock.lock();
+
+        batch->done = true;
+        batch->success = committed;
+        group_busy = false;
+        group_cv.notify_all();
+
+        if (!batch->waiting) {
+            delete batch;
+        }
+
+        return success && committed;
+    }
+}
+
 bool sq_Database::Prepare(const char *sql, sq_Statement *out_stmt)
 {
     out_stmt->Finalize();
@@ -137,6 +137,31 @@ class sq_Database {
     std::thread::id running_exclusive_thread;
     std::atomic_bool lock_reads { false };
 
+    // Group commit state, see GroupTransaction(). While group_batch is set, the exclusive
+    // lock (running_exclusive == 1) belongs to the batch and not to a thread:
+    //
+    // - The first member calls LockExclusive() and opens the transaction. Each following
+    //   member takes the lock over by setting running_exclusive_thread to itself (with
+    //   wait_mutex held), without touching running_exclusive. This keeps reentrancy working
+    //   for the running member, and nested calls are recognized the same way.
+    // - group_busy makes sure only one member runs at a time, so running_exclusive_thread
+    //   always designates the running member. Members waiting for the commit must not use
+    //   the database, they are not the lock owner anymore.
+    // - Only the last member (the one that commits or rolls back) calls UnlockExclusive(),
+    //   even though another thread called LockExclusive(). The lock does not care which
+    //   thread unlocks it, and nobody else may unlock it while the batch is open.
+    struct GroupBatch {
+        int members;
+        int waiting;
+        bool done;
+        bool success;
+    };
+    std::mutex group_mutex;
+    std::condition_variable group_cv;
+    int group_pending = 0;
+    bool group_busy = false;
+    GroupBatch *group_batch = nullptr;
+
     bool snapshot = false;
     std::thread snapshot_thread;
     std::mutex snapshot_mutex;
@@ -173,6 +198,11 @@ public:
 
     bool Transaction(FunctionRef<bool()> func);
 
+    // Concurrent callers share a single transaction (and a single commit), and func runs
+    // inside a savepoint so that a failure only rolls back its own changes. This returns
+    // once the shared transaction is committed, and fails if the commit does.
+    bool GroupTransaction(FunctionRef<bool()> func);
+
     bool Prepare(const char *sql, sq_Statement *out_stmt);
     template <typename... Args>
     bool Prepare(const char *sql, sq_Statement *out_stmt, Args... args)
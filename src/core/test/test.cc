@@ -12,13 +12,55 @@
 // along with this program. If not, see https://www.gnu.org/licenses/.
 
 #include "src/core/base/base.hh"
+#include "src/core/wrap/json.hh"
 #include "test.hh"
 
+#ifdef __linux__
+    #include <linux/perf_event.h>
+    #include <sys/ioctl.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+#endif
+
 namespace RG {
 
+static const int64_t WarmupTime = 100 * 1000000ll;
+static const int64_t MinSampleTime = 10 * 1000000ll;
+
+struct BenchmarkResult {
+    const char *key; // path/name
+
+    Size samples;
+    Size iterations; // per sample
+
+    double median; // nanoseconds per call
+    double mad;
+    double min;
+
+    double instructions; // -1 if unavailable
+    double cache_misses;
+
+    RG_HASHTABLE_HANDLER(BenchmarkResult, key);
+};
+
 static HeapArray<const TestInfo *> tests;
 static HeapArray<const BenchmarkInfo *> benchmarks;
 
+static const BenchmarkInfo *current_bench;
+static Size bench_samples = 10;
+static double bench_threshold = 0.05;
+static BucketArray<BenchmarkResult> bench_results;
+static BlockAllocator bench_alloc;
+
+static HashTable<const char *, BenchmarkResult> bench_baseline;
+static Size bench_regressions = 0;
+
+#ifdef __linux__
+static bool perf_enabled = false;
+static int perf_instructions_fd = -1;
+static int perf_misses_fd = -1;
+#endif
+
 TestInfo::TestInfo(const char *path, void (*func)(Size *out_total, Size *out_failures))
     : path(path), func(func)
 {
@@ -31,15 +73,325 @@ BenchmarkInfo::BenchmarkInfo(const char *path, void (*func)())
     benchmarks.Append(this);
 }
 
+static int64_t GetPreciseTime()
+{
+    auto now = std::chrono::steady_clock::now();
+    return (int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+}
+
+#ifdef __linux__
+
+static int OpenPerfCounter(uint64_t config)
+{
+    perf_event_attr attr = {};
+
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = RG_SIZE(attr);
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    int fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    return fd;
+}
+
+static bool InitPerfCounters()
+{
+    perf_instructions_fd = OpenPerfCounter(PERF_COUNT_HW_INSTRUCTIONS);
+    perf_misses_fd = OpenPerfCounter(PERF_COUNT_HW_CACHE_MISSES);
+
+    if (perf_instructions_fd < 0 || perf_misses_fd < 0) {
+        LogWarning("Cannot use hardware performance counters: %1", strerror(errno));
+
+        CloseDescriptor(perf_instructions_fd);
+        CloseDescriptor(perf_misses_fd);
+        perf_instructions_fd = -1;
+        perf_misses_fd = -1;
+
+        return false;
+    }
+
+    return true;
+}
+
+static void StartPerfCounters()
+{
+    ioctl(perf_instructions_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(perf_misses_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(perf_instructions_fd, PERF_EVENT_IOC_ENABLE, 0);
+    ioctl(perf_misses_fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static void StopPerfCounters(uint64_t *out_instructions, uint64_t *out_misses)
+{
+    ioctl(perf_instructions_fd, PERF_EVENT_IOC_DISABLE, 0);
+    ioctl(perf_misses_fd, PERF_EVENT_IOC_DISABLE, 0);
+
+    if (read(perf_instructions_fd, out_instructions, RG_SIZE(*out_instructions)) != RG_SIZE(*out_instructions)) {
+        *out_instructions = 0;
+    }
+    if (read(perf_misses_fd, out_misses, RG_SIZE(*out_misses)) != RG_SIZE(*out_misses)) {
+        *out_misses = 0;
+    }
+}
+
+#endif
+
+static double ComputeMedian(Span<double> values)
+{
+    RG_ASSERT(values.len);
+
+    std::sort(values.begin(), values.end());
+
+    if (values.len % 2) {
+        return values[values.len / 2];
+    } else {
+        return (values[values.len / 2 - 1] + values[values.len / 2]) / 2.0;
+    }
+}
+
+static FmtArg FmtNanoseconds(double ns)
+{
+    if (ns < 1000.0) {
+        return FmtDouble(ns, 1).Pad(-7);
+    } else if (ns < 1000000.0) {
+        return FmtDouble(ns / 1000.0, 2).Pad(-7);
+    } else if (ns < 1000000000.0) {
+        return FmtDouble(ns / 1000000.0, 2).Pad(-7);
+    } else {
+        return FmtDouble(ns / 1000000000.0, 2).Pad(-7);
+    }
+}
+
+static const char *GetNanosecondsUnit(double ns)
+{
+    if (ns < 1000.0) {
+        return "ns";
+    } else if (ns < 1000000.0) {
+        return "us";
+    } else if (ns < 1000000000.0) {
+        return "ms";
+    } else {
+        return "s";
+    }
+}
+
+void RunBenchmark(const char *name, Size iterations, FunctionRef<void()> func)
+{
+    Print("  %!..+%1%!0", FmtArg(name).Pad(34));
+    StdOut->Flush();
+
+    const auto run = [&](Size count) {
+        for (Size i = 0; i < count; i++) {
+            func();
+#if defined(__clang__) || !defined(_MSC_VER)
+            __asm__ __volatile__("" : : : "memory");
+#endif
+        }
+    };
+
+    // Warm up caches, branch predictors and CPU frequency, and estimate the cost of each call
+    Size batch;
+    {
+        int64_t start = GetPreciseTime();
+        int64_t elapsed = 0;
+        Size calls = 0;
+
+        do {
+            run(1);
+
+            elapsed = GetPreciseTime() - start;
+            calls++;
+        } while (elapsed < WarmupTime && calls < iterations);
+
+        double per_call = std::max((double)elapsed / (double)calls, 1.0);
+
+        Size calibrated = (Size)std::ceil((double)MinSampleTime / per_call);
+        Size required = (iterations + bench_samples - 1) / bench_samples;
+
+        batch = std::max(std::max(calibrated, required), (Size)1);
+    }
+
+    HeapArray<double> times;
+    HeapArray<double> instructions;
+    HeapArray<double> misses;
+
+    for (Size i = 0; i < bench_samples; i++) {
+#ifdef __linux__
+        if (perf_enabled) {
+            StartPerfCounters();
+        }
+#endif
+
+        int64_t start = GetPreciseTime();
+        run(batch);
+        int64_t elapsed = GetPreciseTime() - start;
+
+        times.Append((double)elapsed / (double)batch);
+
+#ifdef __linux__
+        if (perf_enabled) {
+            uint64_t sample_instructions;
+            uint64_t sample_misses;
+            StopPerfCounters(&sample_instructions, &sample_misses);
+
+            instructions.Append((double)sample_instructions / (double)batch);
+            misses.Append((double)sample_misses / (double)batch);
+        }
+#endif
+    }
+
+    BenchmarkResult *result = bench_results.AppendDefault();
+
+    result->key = Fmt(&bench_alloc, "%1/%2", current_bench ? current_bench->path : "", name).ptr;
+    result->samples = bench_samples;
+    result->iterations = batch;
+    result->median = ComputeMedian(times);
+    result->min = *std::min_element(times.begin(), times.end());
+    for (double &time: times) {
+        time = std::abs(time - result->median);
+    }
+    result->mad = ComputeMedian(times);
+    result->instructions = instructions.len ? ComputeMedian(instructions) : -1.0;
+    result->cache_misses = misses.len ? ComputeMedian(misses) : -1.0;
+
+    Print(" %!c..%1 %2%!0 +- %3%% %!D..(%4 x %5)%!0",
+          FmtNanoseconds(result->median), GetNanosecondsUnit(result->median),
+          FmtDouble(result->mad / result->median * 100.0, 1).Pad(-4), bench_samples, batch);
+    if (result->instructions >= 0.0) {
+        Print(" %1 instructions, %2 cache misses",
+              FmtDouble(result->instructions, 0), FmtDouble(result->cache_misses, 1));
+    }
+
+    if (const BenchmarkResult *base = bench_baseline.Find(result->key); base) {
+        double delta = result->median - base->median;
+        double ratio = result->median / base->median;
+
+        // Ignore differences that are small or within the noise of both runs
+        bool significant = std::abs(ratio - 1.0) > bench_threshold &&
+                           std::abs(delta) > 3.0 * (result->mad + base->mad);
+
+        FmtArg diff = FmtDouble((ratio - 1.0) * 100.0, 1, 1);
+        const char *sign = (delta > 0) ? "+" : "";
+
+        if (significant && delta > 0) {
+            Print(" %!R..%1%2%%%!0", sign, diff);
+            bench_regressions++;
+        } else if (significant) {
+            Print(" %!G..%1%2%%%!0", sign, diff);
+        } else {
+            Print(" %!D..%1%2%%%!0", sign, diff);
+        }
+    }
+
+    PrintLn();
+}
+
+static bool LoadBaseline(const char *filename)
+{
+    StreamReader reader(filename);
+    if (!reader.IsValid())
+        return false;
+    json_Parser parser(&reader, &bench_alloc);
+
+    parser.ParseObject();
+    while (parser.InObject()) {
+        Span<const char> key = {};
+        parser.ParseKey(&key);
+
+        if (key == "benchmarks") {
+            parser.ParseArray();
+            while (parser.InArray()) {
+                BenchmarkResult result = {};
+
+                parser.ParseObject();
+                while (parser.InObject()) {
+                    Span<const char> key = {};
+                    parser.ParseKey(&key);
+
+                    if (key == "key") {
+                        parser.ParseString(&result.key);
+                    } else if (key == "median") {
+                        parser.ParseDouble(&result.median);
+                    } else if (key == "mad") {
+                        parser.ParseDouble(&result.mad);
+                    } else {
+                        parser.Skip();
+                    }
+                }
+
+                if (result.key && result.median > 0.0) {
+                    bench_baseline.Set(result);
+                }
+            }
+        } else {
+            parser.Skip();
+        }
+    }
+    if (!parser.IsValid())
+        return false;
+
+    return true;
+}
+
+static bool SaveResults(const char *filename)
+{
+    StreamWriter writer(filename, (int)StreamWriterFlag::Atomic);
+    if (!writer.IsValid())
+        return false;
+    json_PrettyWriter json(&writer);
+
+    json.StartObject();
+    json.Key("benchmarks"); json.StartArray();
+    for (const BenchmarkResult &result: bench_results) {
+        json.StartObject();
+
+        json.Key("key"); json.String(result.key);
+        json.Key("samples"); json.Int64(result.samples);
+        json.Key("iterations"); json.Int64(result.iterations);
+        json.Key("median"); json.Double(result.median);
+        json.Key("mad"); json.Double(result.mad);
+        json.Key("min"); json.Double(result.min);
+        if (result.instructions >= 0.0) {
+            json.Key("instructions"); json.Double(result.instructions);
+            json.Key("cache_misses"); json.Double(result.cache_misses);
+        }
+
+        json.EndObject();
+    }
+    json.EndArray();
+    json.EndObject();
+
+    json.Flush();
+    writer.Write('\n');
+
+    return writer.Close();
+}
+
 int Main(int argc, char **argv)
 {
     RG_CRITICAL(argc >= 1, "First argument is missing");
 
     // Options
     const char *pattern = nullptr;
+    const char *json_filename = nullptr;
+    const char *baseline_filename = nullptr;
 
     const auto print_usage = [=](StreamWriter *st) {
-        PrintLn(st, R"(Usage: %1 [pattern])", FelixTarget);
+        PrintLn(st,
+R"(Usage: %!..+%1 [options] [pattern]%!0
+
+Options:
+    %!..+-s, --samples <count>%!0        Set number of samples for each benchmark
+                                 %!D..(default: %2)%!0
+        %!..+--counters%!0               Measure instructions and cache misses
+                                 %!D..(Linux only, needs perf_event access)%!0
+
+        %!..+--json <file>%!0            Save benchmark results as JSON
+        %!..+--compare <file>%!0         Compare benchmark results with saved JSON file
+        %!..+--threshold <percent>%!0    Set minimal difference reported as a regression
+                                 %!D..(default: %3%%)%!0)", FelixTarget, bench_samples, bench_threshold * 100.0);
     };
 
     // Parse arguments
@@ -50,6 +402,34 @@ int Main(int argc, char **argv)
             if (opt.Test("--help")) {
                 print_usage(StdOut);
                 return 0;
+            } else if (opt.Test("-s", "--samples", OptionType::Value)) {
+                if (!ParseInt(opt.current_value, &bench_samples))
+                    return 1;
+                if (bench_samples < 1) {
+                    LogError("Number of samples must be positive");
+                    return 1;
+                }
+            } else if (opt.Test("--counters")) {
+#ifdef __linux__
+                perf_enabled = true;
+#else
+                LogError("Performance counters are only supported on Linux");
+                return 1;
+#endif
+            } else if (opt.Test("--json", OptionType::Value)) {
+                json_filename = opt.current_value;
+            } else if (opt.Test("--compare", OptionType::Value)) {
+                baseline_filename = opt.current_value;
+            } else if (opt.Test("--threshold", OptionType::Value)) {
+                int percent;
+                if (!ParseInt(opt.current_value, &percent))
+                    return 1;
+                if (percent < 0) {
+                    LogError("Regression threshold cannot be negative");
+                    return 1;
+                }
+
+                bench_threshold = (double)percent / 100.0;
             } else {
                 opt.LogUnknownError();
                 return 1;
@@ -60,6 +440,14 @@ int Main(int argc, char **argv)
         opt.LogUnusedArguments();
     }
 
+#ifdef __linux__
+    if (perf_enabled) {
+        perf_enabled = InitPerfCounters();
+    }
+#endif
+    if (baseline_filename && !LoadBaseline(baseline_filename))
+        return 1;
+
     // We want to group the output, make sure everything is sorted correctly
     std::sort(tests.begin(), tests.end(), [](const TestInfo *test1, const TestInfo *test2) {
         return CmpStr(test1->path, test2->path) < 0;
@@ -112,7 +500,11 @@ int Main(int argc, char **argv)
 
         if (enable) {
             PrintLn("%!m..%1%!0", bench.path);
+
+            current_bench = &bench;
             bench.func();
+            current_bench = nullptr;
+
             PrintLn();
 
             matches++;
@@ -124,6 +516,14 @@ int Main(int argc, char **argv)
         return 1;
     }
 
+    if (json_filename && !SaveResults(json_filename))
+        return 1;
+    if (bench_regressions) {
+        LogError("Found %1 significant %2 compared to '%3'", bench_regressions,
+                 bench_regressions > 1 ? "regressions" : "regression", baseline_filename);
+        return 1;
+    }
+
     return 0;
 }
 
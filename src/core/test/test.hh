@@ -81,25 +81,9 @@ struct BenchmarkInfo {
     static void FuncName()
 #define BENCHMARK_FUNCTION(Path) BENCHMARK_FUNCTION_(RG_UNIQUE_NAME(func_), RG_UNIQUE_NAME(bench_), "bench/" Path)
 
-static inline void RunBenchmark(const char *name, Size iterations, FunctionRef<void()> func)
-{
-    Print("  %!..+%1%!0", FmtArg(name).Pad(34));
-    StdOut->Flush();
-
-    int64_t time = GetMonotonicTime();
-    int64_t clock = GetClockCounter();
-
-    for (Size i = 0; i < iterations; i++) {
-        func();
-#if defined(__clang__) || !defined(_MSC_VER)
-        __asm__ __volatile__("" : : : "memory");
-#endif
-    }
-
-    time = GetMonotonicTime() - time;
-    clock = GetClockCounter() - clock;
-
-    PrintLn(" %!c..%1 ms%!0 (%2 cycles per iteration)", time, clock / iterations);
-}
+// The function is run repeatedly (after a warmup phase) to collect several timing samples,
+// and the median time per call is reported. Each sample runs enough calls to last a few
+// milliseconds, and all samples together run at least the given number of iterations.
+void RunBenchmark(const char *name, Size iterations, FunctionRef<void()> func);
 
 }
@@ -597,6 +597,825 @@ TEST_FUNCTION("base/PathCheck")
 #endif
 }
 
+TEST_FUNCTION("base/SwissHashTable")
+{
+    FastRandom rng(42);
+
+    // Integer keys, checked against HashMap with random inserts and removals
+    {
+        HashMap<int, int> ref;
+        SwissHashMap<int, int> map;
+
+        for (int i = 0; i < 200000; i++) {
+            int key = rng.GetInt(0, 20000);
+
+            if (rng.GetInt(0, 3)) {
+                ref.Set(key, i);
+                map.Set(key, i);
+            } else {
+                ref.Remove(key);
+                map.Remove(key);
+            }
+        }
+
+        TEST_EQ(map.table.count, ref.table.count);
+
+        Size mismatches = 0;
+        for (int key = 0; key < 20000; key++) {
+            mismatches += (map.FindValue(key, -1) != ref.FindValue(key, -1));
+        }
+        TEST_EQ(mismatches, 0);
+
+        Size iterated = 0;
+        for (const auto &bucket: map.table) {
+            mismatches += (ref.FindValue(bucket.key, -1) != bucket.value);
+            iterated++;
+        }
+        TEST_EQ(mismatches, 0);
+        TEST_EQ(iterated, ref.table.count);
+
+        map.Trim();
+        TEST_EQ(map.table.deleted, 0);
+        TEST_EQ(map.FindValue(-1, -2), -2);
+    }
+
+    // String keys, and removal while iterating
+    {
+        BlockAllocator str_alloc;
+        SwissHashSet<const char *> set;
+
+        for (int i = 0; i < 5000; i++) {
+            const char *str = Fmt(&str_alloc, "str%1", i).ptr;
+            set.Set(str);
+        }
+        TEST_EQ(set.table.count, 5000);
+        TEST(set.Find("str4999"));
+        TEST(!set.Find("str5000"));
+
+        for (auto it = set.table.begin(); it != set.table.end(); it++) {
+            const char *str = *it;
+            int value = 0;
+            ParseInt(str + 3, &value);
+
+            if (value % 2) {
+                it.Remove();
+            }
+        }
+        TEST_EQ(set.table.count, 2500);
+        TEST(set.Find("str4998"));
+        TEST(!set.Find("str4999"));
+
+        set.RemoveAll();
+        TEST_EQ(set.table.count, 0);
+        TEST(!set.Find("str4998"));
+    }
+
+    // Non-trivial values survive rehashing
+    {
+        SwissHashMap<int, HeapArray<int>> map;
+
+        for (int i = 0; i < 1000; i++) {
+            HeapArray<int> *array = &map.TrySetDefault(i)->value;
+            array->Append(i);
+            array->Append(-i);
+        }
+
+        Size mismatches = 0;
+        for (int i = 0; i < 1000; i++) {
+            const HeapArray<int> *array = map.Find(i);
+            mismatches += !array || array->len != 2 || (*array)[0] != i || (*array)[1] != -i;
+        }
+        TEST_EQ(mismatches, 0);
+    }
+}
+
+TEST_FUNCTION("base/ParallelCompression")
+{
+    static const CompressionType types[] = {
+        CompressionType::Zlib,
+        CompressionType::Gzip,
+        CompressionType::LZ4,
+        CompressionType::Zstd
+    };
+
+    HeapArray<char> data;
+    {
+        FastRandom rng(42);
+
+        // Compressible enough, and spans several blocks with a partial one at the end
+        while (data.len < Mebibytes(9) + 12345) {
+            Fmt(&data, "%1;%2;%3\n", rng.GetInt(0, 100000), rng.GetInt(0, 16), FmtHex(rng.GetInt(0, INT_MAX)));
+        }
+    }
+
+    for (CompressionType type: types) {
+        for (Size len: { (Size)0, (Size)1000, data.len }) {
+            HeapArray<uint8_t> compressed;
+            {
+                StreamWriter writer;
+                writer.SetCompressionThreads(4);
+                writer.Open(&compressed, "<memory>", type);
+                writer.Write(data.Take(0, len));
+                TEST(writer.Close());
+            }
+
+            HeapArray<char> decompressed;
+            {
+                StreamReader reader(compressed.Take(), "<memory>", type);
+                reader.ReadAll(-1, &decompressed);
+                TEST(reader.IsValid());
+            }
+
+            TEST_EX(decompressed.len == len && !memcmp(decompressed.ptr, data.ptr, (size_t)len),
+                    "%1 roundtrip for %2 bytes", CompressionTypeNames[(int)type], len);
+        }
+    }
+}
+
+TEST_FUNCTION("base/IoBatch")
+{
+    BlockAllocator temp_alloc;
+
+    const char *directory = CreateUniqueDirectory(GetTemporaryDirectory(), "test", &temp_alloc);
+    TEST(directory);
+    if (!directory)
+        return;
+    RG_DEFER { UnlinkDirectory(directory); };
+
+    const char *subdirectory = Fmt(&temp_alloc, "%1%/sub", directory).ptr;
+    const char *filename = Fmt(&temp_alloc, "%1%/data.bin", directory).ptr;
+
+    int fd = OpenFile(filename, (int)OpenFlag::Read | (int)OpenFlag::Write);
+    TEST(fd >= 0);
+    if (fd < 0)
+        return;
+    RG_DEFER {
+        CloseDescriptor(fd);
+        UnlinkFile(filename);
+    };
+
+    uint8_t buf[8192];
+    for (Size i = 0; i < RG_SIZE(buf); i++) {
+        buf[i] = (uint8_t)(i * 7);
+    }
+    uint8_t out[8192] = {};
+
+    IoBatch batch(4);
+    batch.RegisterBuffers({ MakeSpan(buf, RG_SIZE(buf)) });
+
+    // First pass: writes (registered and not) and directory creation
+    {
+        int done = 0;
+
+        batch.Write(fd, 0, MakeSpan(buf, 4096), [&](bool success) { done += success; });
+        batch.Write(fd, 4096, MakeSpan(buf + 4096, 4096), [&](bool success) { done += success; });
+        batch.MakeDirectory(subdirectory, true, [&](bool success) { done += success; });
+        batch.MakeDirectory(directory, false, [&](bool success) { done += success; });
+
+        TEST(batch.Sync());
+        TEST_EQ(done, 4);
+    }
+    RG_DEFER { UnlinkDirectory(subdirectory); };
+
+    // Second pass: more operations than the queue depth
+    {
+        Size lens[3] = { -2, -2, -2 };
+        StatResult rets[3] = {};
+        int64_t sizes[3] = {};
+
+        batch.Read(fd, 0, MakeSpan(out, 5000), [&](Size len) { lens[0] = len; });
+        batch.Read(fd, 5000, MakeSpan(out + 5000, 4000), [&](Size len) { lens[1] = len; });
+        batch.Read(fd, 10000, MakeSpan(out, 100), [&](Size len) { lens[2] = len; });
+        batch.Stat(filename, 0, [&](StatResult ret, const FileInfo &file_info) {
+            rets[0] = ret;
+            sizes[0] = file_info.size;
+        });
+        batch.Stat(subdirectory, 0, [&](StatResult ret, const FileInfo &file_info) {
+            rets[1] = ret;
+            sizes[1] = (int64_t)file_info.type;
+        });
+        batch.Stat(Fmt(&temp_alloc, "%1%/missing", directory).ptr, (int)StatFlag::IgnoreMissing,
+                   [&](StatResult ret, const FileInfo &) { rets[2] = ret; });
+
+        TEST(batch.Sync());
+
+        TEST_EQ(lens[0], 5000);
+        TEST_EQ(lens[1], 3192);
+        TEST_EQ(lens[2], 0);
+        TEST(!memcmp(out, buf, RG_SIZE(buf)));
+
+        TEST(rets[0] == StatResult::Success);
+        TEST_EQ(sizes[0], 8192);
+        TEST(rets[1] == StatResult::Success);
+        TEST_EQ(sizes[1], (int64_t)FileType::Directory);
+        TEST(rets[2] == StatResult::MissingPath);
+    }
+}
+
+TEST_FUNCTION("base/StreamView")
+{
+    BlockAllocator temp_alloc;
+
+    HeapArray<char> data;
+    {
+        FastRandom rng(42);
+
+        // Mix line endings and lengths, and end without a newline
+        while (data.len < Kibibytes(300)) {
+            Size len = rng.GetInt(0, 300);
+            for (Size i = 0; i < len; i++) {
+                data.Append((char)('a' + rng.GetInt(0, 26)));
+            }
+            data.Append(rng.GetInt(0, 4) ? "\n" : "\r\n");
+        }
+        data.Append("last");
+    }
+
+    const char *filename = CreateUniqueFile(GetTemporaryDirectory(), "test", ".txt", &temp_alloc);
+    TEST(filename);
+    if (!filename)
+        return;
+    RG_DEFER { UnlinkFile(filename); };
+    TEST(WriteFile(data, filename));
+
+    HeapArray<Span<const char>> lines;
+    {
+        Span<const char> remain = data;
+
+        while (remain.len) {
+            Span<const char> line = SplitStrLine(remain, &remain);
+            lines.Append(line);
+        }
+    }
+
+    for (bool mapping: { false, true }) {
+        StreamReader st;
+        st.SetMapping(mapping);
+        TEST(st.Open(filename) == OpenResult::Success);
+        TEST_EQ(st.IsMapped(), mapping);
+
+        LineReader reader(&st);
+
+        Size idx = 0;
+        Span<const char> line;
+        while (reader.NextView(&line)) {
+            if (idx >= lines.len || line != lines[idx]) {
+                TEST_EX(false, "Line %1 mismatch (mapping = %2)", idx + 1, mapping);
+                break;
+            }
+            idx++;
+        }
+
+        TEST(reader.IsValid());
+        TEST_EQ(idx, lines.len);
+    }
+
+    // No extra empty line after the final newline, same as Next()
+    {
+        static const char *const expect[] = { "abc", "def", "", "ghi" };
+        Span<const char> terminated = "abc\r\ndef\n\nghi\n";
+
+        TEST(WriteFile(terminated, filename));
+
+        for (bool mapping: { false, true }) {
+            StreamReader st;
+            st.SetMapping(mapping);
+            TEST(st.Open(filename) == OpenResult::Success);
+
+            LineReader reader(&st);
+
+            Size idx = 0;
+            Span<const char> line;
+            while (reader.NextView(&line)) {
+                if (idx >= RG_LEN(expect) || line != expect[idx]) {
+                    TEST_EX(false, "Line %1 mismatch (mapping = %2)", idx + 1, mapping);
+                    break;
+                }
+                idx++;
+            }
+
+            TEST(reader.IsValid());
+            TEST_EQ(idx, RG_LEN(expect));
+        }
+
+        StreamReader st(terminated.As<const uint8_t>());
+        LineReader reader(&st);
+
+        Size count = 0;
+        Span<char> line;
+        while (reader.Next(&line)) {
+            count++;
+        }
+        TEST_EQ(count, RG_LEN(expect));
+    }
+
+    // Views point into memory sources
+    {
+        StreamReader st(data.As<const uint8_t>());
+
+        Span<const uint8_t> view = st.ReadView(1000);
+        TEST(view.ptr == (const uint8_t *)data.ptr && view.len == 1000);
+        view = st.ReadView();
+        TEST(view.ptr == (const uint8_t *)data.ptr + 1000 && view.len == data.len - 1000);
+        TEST(st.IsEOF());
+        TEST(!st.ReadView().len && st.IsValid());
+    }
+}
+
+TEST_FUNCTION("base/FindChar")
+{
+    FastRandom rng(42);
+
+    char buf[300];
+    for (Size i = 0; i < RG_SIZE(buf); i++) {
+        buf[i] = (char)('a' + rng.GetInt(0, 26));
+    }
+
+    // Try all alignments and lengths around the SIMD block sizes
+    for (Size offset = 0; offset < 17; offset++) {
+        for (Size len = 0; len <= RG_SIZE(buf) - offset; len++) {
+            Span<const char> str = MakeSpan(buf + offset, len);
+
+            Size expect = -1;
+            for (Size i = 0; i < str.len; i++) {
+                if (str[i] == 'q' || str[i] == 'z') {
+                    expect = i;
+                    break;
+                }
+            }
+
+            Size ret = FindChar(str, 'q', 'z');
+            if (ret != expect) {
+                TEST_EX(false, "FindChar(%1 + %2) = %3, expected %4", offset, len, ret, expect);
+                return;
+            }
+        }
+    }
+
+    // Split fields
+    {
+        HeapArray<char> line;
+        HeapArray<Span<const char>> expect;
+
+        // Keep pointers into line stable
+        line.Grow(Kibibytes(4));
+
+        for (Size i = 0; i < 100; i++) {
+            Size start = line.len;
+            Size len = rng.GetInt(0, 12);
+
+            for (Size j = 0; j < len; j++) {
+                line.Append((char)('a' + rng.GetInt(0, 26)));
+            }
+            expect.Append(MakeSpan(line.ptr + start, len));
+
+            line.Append(';');
+        }
+        line.len--;
+
+        LocalArray<Span<const char>, 128> fields;
+        fields.len = SplitFields(line, ';', fields.data);
+        TEST_EQ(fields.len, expect.len);
+        TEST(std::equal(fields.begin(), fields.end(), expect.begin(), expect.end()));
+
+        // Too many fields, rest goes into the last one
+        fields.len = SplitFields(line, ';', MakeSpan(fields.data, 10));
+        TEST_EQ(fields.len, 10);
+        TEST(std::equal(fields.begin(), fields.begin() + 9, expect.begin()));
+        TEST(fields[9].ptr == expect[9].ptr && fields[9].end() == line.end());
+
+        fields.len = SplitFields("", ';', fields.data);
+        TEST_EQ(fields.len, 1);
+        TEST_EQ(fields[0].len, 0);
+    }
+}
+
+TEST_FUNCTION("base/FmtCompiled")
+{
+    char buf[512];
+    char buf2[512];
+
+#define TEST_FMT(FmtStr, ...) \
+        do { \
+            Fmt(buf, FmtStr, __VA_ARGS__); \
+            Fmt<FmtStr>(buf2, __VA_ARGS__); \
+            TEST_STR(buf2, buf); \
+        } while (false)
+
+    TEST_FMT("%1:%2:%3:%4:%5:%6:%%", 1234, 42, -313.3, "str", (void*)1000, 'X');
+    TEST_FMT("%1%/%2%/%3", "/home/user", Span<const char>("blobs/xyz", 5), "0a1");
+    TEST_FMT("%2 %1 %2", INT64_MIN, INT64_MAX);
+    TEST_FMT("[%1] [%2] [%3]", (unsigned char)200, UINT64_MAX, (short)-7);
+    TEST_FMT("%1|%2|%3", true, (const char *)nullptr, FmtHex(0xDEAD).Pad0(-8));
+    TEST_FMT("%1 %2", FmtArg("ab").Repeat(3), FmtDouble(1.5, 3));
+    TEST_FMT("%!R.+%1%!0 %!..-%2%!0", "red", 42);
+    TEST_FMT("%1%2%3%4%5%6%7%8%9%10%11", 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11);
+
+#undef TEST_FMT
+
+    // Negating INT64_MIN must not overflow (and trap with -ftrapv)
+    {
+        Fmt(buf, "%1", INT64_MIN);
+        TEST_STR(buf, "-9223372036854775808");
+        Fmt<"%1">(buf2, INT64_MIN);
+        TEST_STR(buf2, "-9223372036854775808");
+    }
+
+    // Output buffers and truncation
+    {
+        HeapArray<char> heap;
+        Fmt<"%1-%2">(&heap, "abc", 12);
+        Fmt<"/%1">(&heap, 'x');
+        TEST_STR(heap.ptr, "abc-12/x");
+
+        char small[6];
+        Span<char> ret = Fmt<"%1-%2">(small, "abc", 12345);
+        TEST_STR(ret.ptr, "abc-1");
+        TEST_EQ(ret.len, 5);
+
+        BlockAllocator temp_alloc;
+        TEST_STR(Fmt<"%%%1%%">(&temp_alloc, 5).ptr, "%5%");
+        TEST_STR(Fmt<"no args">(&temp_alloc).ptr, "no args");
+    }
+}
+
+TEST_FUNCTION("base/AsyncLog")
+{
+    struct Message {
+        LogLevel level;
+        int thread;
+        int idx;
+    };
+
+    HeapArray<Message> messages;
+    Size dropped = 0;
+
+    SetLogHandler([&](LogLevel level, const char *, const char *msg) {
+        Message message = { level, -1, -1 };
+
+        if (sscanf(msg, "%d:%d", &message.thread, &message.idx) != 2) {
+            long long count = 0;
+            sscanf(msg, "Dropped %lld", &count);
+            dropped += (Size)count;
+        }
+
+        messages.Append(message);
+    });
+    RG_DEFER { SetLogHandler(DefaultLogHandler); };
+
+    TEST(EnableAsyncLog());
+    RG_DEFER { DisableAsyncLog(); };
+
+    // Everything should come out, in order for each thread
+    {
+        std::thread threads[4];
+        for (int i = 0; i < RG_LEN(threads); i++) {
+            threads[i] = std::thread([i]() {
+                for (int j = 0; j < 200; j++) {
+                    LogInfo("%1:%2", i, j);
+                }
+            });
+        }
+        for (std::thread &thread: threads) {
+            thread.join();
+        }
+
+        FlushLog();
+
+        int counters[RG_LEN(threads)] = {};
+        bool ordered = true;
+
+        for (const Message &message: messages) {
+            if (message.thread >= 0 && message.thread < RG_LEN(threads)) {
+                ordered &= (message.idx == counters[message.thread]++);
+            }
+        }
+
+        TEST_EQ(messages.len, 800);
+        TEST(ordered);
+        for (int counter: counters) {
+            TEST_EQ(counter, 200);
+        }
+        TEST_EQ(dropped, 0);
+    }
+
+    // Overflow drops non-error messages, but these are accounted for
+    {
+        messages.Clear();
+
+        Size received = 0;
+        Size errors = 0;
+
+        std::thread thread([]() {
+            for (int j = 0; j < 20000; j++) {
+                if (j % 1000 == 999) {
+                    LogError("%1:%2", 0, j);
+                } else {
+                    LogWarning("%1:%2", 0, j);
+                }
+            }
+        });
+        thread.join();
+
+        FlushLog();
+
+        int prev = -1;
+        bool ordered = true;
+
+        for (const Message &message: messages) {
+            if (message.thread == 0) {
+                ordered &= (message.idx > prev);
+                prev = message.idx;
+
+                received++;
+                errors += (message.level == LogLevel::Error);
+            }
+        }
+
+        TEST(ordered);
+        TEST_EQ(received + dropped, 20000);
+        TEST_EQ(errors, 20);
+    }
+
+    // Thread-local destructors can log after the ring of their thread is gone
+    {
+        messages.Clear();
+        dropped = 0;
+
+        struct LateLogger {
+            bool used = false;
+            ~LateLogger() { LogInfo("%1:%2", 1, 0); }
+        };
+
+        std::thread thread([]() {
+            // Constructed before the ring guard, so destroyed after it
+            static thread_local LateLogger logger;
+            logger.used = true;
+
+            LogInfo("%1:%2", 0, 0);
+        });
+        thread.join();
+
+        FlushLog();
+
+        Size received = 0;
+        for (const Message &message: messages) {
+            received += (message.thread >= 0);
+        }
+
+        TEST_EQ(received, 2);
+    }
+
+    // Nothing must get lost when async logging stops while other threads are logging
+    {
+        messages.Clear();
+        dropped = 0;
+
+        std::thread threads[4];
+        for (int i = 0; i < RG_LEN(threads); i++) {
+            threads[i] = std::thread([i]() {
+                for (int j = 0; j < 2000; j++) {
+                    LogInfo("%1:%2", i, j);
+                }
+            });
+        }
+
+        WaitDelay(1);
+        DisableAsyncLog();
+
+        for (std::thread &thread: threads) {
+            thread.join();
+        }
+
+        Size received = 0;
+        for (const Message &message: messages) {
+            received += (message.thread >= 0);
+        }
+
+        TEST_EQ(received + dropped, 8000);
+    }
+}
+
+TEST_FUNCTION("base/PoolAllocator")
+{
+    PoolAllocator pool;
+
+    // Fill objects of all small sizes and a few large ones, and check nothing overlaps
+    {
+        HeapArray<Span<uint8_t>> allocations;
+
+        for (Size size = 1; size <= 20000; size += (size < 1024) ? 7 : 331) {
+            Span<uint8_t> mem = AllocateSpan<uint8_t>(&pool, size);
+            MemSet(mem.ptr, (int)(size & 0xFF), mem.len);
+
+            allocations.Append(mem);
+        }
+
+        bool valid = true;
+        for (Span<uint8_t> mem: allocations) {
+            for (uint8_t c: mem) {
+                valid &= (c == (uint8_t)(mem.len & 0xFF));
+            }
+            ReleaseSpan(&pool, mem);
+        }
+        TEST(valid);
+    }
+
+    // Resize and zero
+    {
+        uint8_t *ptr = (uint8_t *)AllocateRaw(&pool, 10, (int)AllocFlag::Zero);
+        TEST(std::all_of(ptr, ptr + 10, [](uint8_t c) { return !c; }));
+
+        MemSet(ptr, 'x', 10);
+        ptr = (uint8_t *)ResizeRaw(&pool, ptr, 10, 100, (int)AllocFlag::Zero);
+        TEST(std::all_of(ptr, ptr + 10, [](uint8_t c) { return c == 'x'; }));
+        TEST(std::all_of(ptr + 10, ptr + 100, [](uint8_t c) { return !c; }));
+
+        ptr = (uint8_t *)ResizeRaw(&pool, ptr, 100, 30000);
+        TEST(std::all_of(ptr, ptr + 10, [](uint8_t c) { return c == 'x'; }));
+
+        ptr = (uint8_t *)ResizeRaw(&pool, ptr, 30000, 12);
+        TEST(std::all_of(ptr, ptr + 10, [](uint8_t c) { return c == 'x'; }));
+
+        ReleaseRaw(&pool, ptr, 12);
+    }
+
+    // Memory released by another thread goes back to the owner
+    {
+        HashSet<void *> pointers;
+        HeapArray<void *> allocations;
+
+        for (Size i = 0; i < 1000; i++) {
+            void *ptr = AllocateRaw(&pool, 48);
+
+            pointers.Set(ptr);
+            allocations.Append(ptr);
+        }
+
+        std::thread thread([&]() {
+            for (void *ptr: allocations) {
+                ReleaseRaw(&pool, ptr, 48);
+            }
+        });
+        thread.join();
+
+        Size reused = 0;
+        for (Size i = 0; i < 1000; i++) {
+            void *ptr = AllocateRaw(&pool, 48);
+            reused += pointers.Find(ptr) ? 1 : 0;
+        }
+        TEST_EQ(reused, 1000);
+    }
+
+    // Use with standard containers
+    {
+        HeapArray<int> array(&pool);
+
+        for (int i = 0; i < 10000; i++) {
+            array.Append(i);
+        }
+
+        TEST_EQ(array.len, 10000);
+        TEST_EQ(array[9999], 9999);
+    }
+}
+
+TEST_FUNCTION("base/BlockAllocator")
+{
+    // Blocks grow geometrically
+    {
+        BlockAllocator alloc;
+
+        for (Size i = 0; i < 10000; i++) {
+            char *ptr = (char *)AllocateRaw(&alloc, 100);
+            MemSet(ptr, 'x', 100);
+        }
+
+        const BlockAllocatorStats &stats = alloc.GetStats();
+
+        TEST_EQ(stats.used_bytes, 10000 * 104);
+        TEST(stats.blocks < 10);
+        TEST(stats.used_bytes + stats.waste_bytes <= stats.block_bytes);
+        TEST_EQ(stats.separate, 0);
+    }
+
+    // Blocks stop growing at the maximum size
+    {
+        BlockAllocator alloc(Kibibytes(4), Kibibytes(16));
+
+        for (Size i = 0; i < 1000; i++) {
+            AllocateRaw(&alloc, 1000);
+        }
+
+        const BlockAllocatorStats &stats = alloc.GetStats();
+        TEST(stats.blocks >= 1000 * 1000 / Kibibytes(16));
+    }
+
+    // Separate allocations, release and statistics
+    {
+        BlockAllocator alloc;
+
+        void *big = AllocateRaw(&alloc, Kibibytes(3));
+        TEST_EQ(alloc.GetStats().separate, 1);
+        TEST_EQ(alloc.GetStats().separate_bytes, Kibibytes(3));
+
+        big = ResizeRaw(&alloc, big, Kibibytes(3), Kibibytes(5));
+        TEST_EQ(alloc.GetStats().separate_bytes, Kibibytes(5));
+
+        ReleaseRaw(&alloc, big, Kibibytes(5));
+        TEST_EQ(alloc.GetStats().separate, 0);
+
+        void *small = AllocateRaw(&alloc, 20);
+        TEST_EQ(alloc.GetStats().blocks, 1);
+        TEST_EQ(alloc.GetStats().used_bytes, 24);
+
+        small = ResizeRaw(&alloc, small, 20, 36, (int)AllocFlag::Zero);
+        TEST_EQ(alloc.GetStats().used_bytes, 40);
+
+        ReleaseRaw(&alloc, small, 36);
+        TEST_EQ(alloc.GetStats().blocks, 0);
+        TEST_EQ(alloc.GetStats().used_bytes, 0);
+
+        AllocateRaw(&alloc, 100);
+        alloc.ReleaseAll();
+        TEST_EQ(alloc.GetStats().blocks, 0);
+        TEST_EQ(alloc.GetStats().block_bytes, 0);
+    }
+
+    // Separate allocations are still released once blocks have grown
+    {
+        class CountingAllocator: public Allocator {
+        public:
+            Size live = 0;
+
+            void *Allocate(Size size, unsigned int flags) override
+            {
+                live += size;
+                return AllocateRaw(nullptr, size, flags);
+            }
+            void *Resize(void *ptr, Size old_size, Size new_size, unsigned int flags) override
+            {
+                live += new_size - old_size;
+                return ResizeRaw(nullptr, ptr, old_size, new_size, flags);
+            }
+            void Release(const void *ptr, Size size) override
+            {
+                live -= size;
+                ReleaseRaw(nullptr, ptr, size);
+            }
+        };
+
+        CountingAllocator counter;
+        LinkedAllocator linked(&counter);
+        IndirectBlockAllocator alloc(&linked, Kibibytes(4));
+
+        void *big = AllocateRaw(&alloc, 3000);
+        Size before = counter.live;
+
+        for (Size i = 0; i < 64; i++) {
+            AllocateRaw(&alloc, 2000);
+        }
+        Size grown = counter.live;
+        TEST(grown > before);
+
+        big = ResizeRaw(&alloc, big, 3000, 5000);
+        TEST_EQ(counter.live, grown + 2000);
+
+        ReleaseRaw(&alloc, big, 5000);
+        TEST_EQ(counter.live, grown - before);
+        TEST_EQ(alloc.GetStats().separate, 0);
+        TEST_EQ(alloc.GetStats().separate_bytes, 0);
+    }
+
+    // Huge page backed blocks
+    {
+        BlockAllocator alloc(Kibibytes(4), RG_BLOCK_ALLOCATOR_MAX_SIZE, (int)BlockAllocatorFlag::HugePages);
+
+        HeapArray<uint32_t *> pointers;
+        for (Size i = 0; i < 100000; i++) {
+            uint32_t *ptr = (uint32_t *)AllocateRaw(&alloc, 100);
+            ptr[0] = (uint32_t)i;
+            ptr[24] = (uint32_t)i;
+
+            pointers.Append(ptr);
+        }
+
+        Span<uint8_t> big = AllocateSpan<uint8_t>(&alloc, Mebibytes(3), (int)AllocFlag::Zero);
+        TEST(std::all_of(big.begin(), big.end(), [](uint8_t c) { return !c; }));
+
+        bool valid = true;
+        for (Size i = 0; i < pointers.len; i++) {
+            valid &= (pointers[i][0] == (uint32_t)i && pointers[i][24] == (uint32_t)i);
+        }
+        TEST(valid);
+
+        TEST(alloc.GetStats().blocks < 20);
+
+        BlockAllocator moved = std::move(alloc);
+        TEST_EQ(moved.GetStats().used_bytes, 100000 * 104);
+    }
+}
+
 BENCHMARK_FUNCTION("base/Fmt")
 {
     static const int iterations = 1600000;
@@ -666,6 +1485,32 @@ BENCHMARK_FUNCTION("base/Fmt")
     RunBenchmark("base Print", iterations, [&]() {
         Print(&writer, "%1:%2:%3:%4:%5:%6:%%\n", 1234, 42, -313.3, "str", (void*)1000, 'X');
     });
+
+    RunBenchmark("base Fmt (compiled)", iterations, [&]() {
+        LocalArray<char, 1024> buf;
+        buf.len = Fmt<"%1:%2:%3:%4:%5:%6:%%\n">(buf.data, 1234, 42, -313.3, "str", (void*)1000, 'X').len;
+    });
+
+    RunBenchmark("base Fmt (compiled, heap)", iterations, [&]() {
+        HeapArray<char> buf;
+        Fmt<"%1:%2:%3:%4:%5:%6:%%\n">(&buf, 1234, 42, -313.3, "str", (void*)1000, 'X');
+        buf.RemoveFrom(0);
+    });
+
+    RunBenchmark("base Print (compiled)", iterations, [&]() {
+        Print<"%1:%2:%3:%4:%5:%6:%%\n">(&writer, 1234, 42, -313.3, "str", (void*)1000, 'X');
+    });
+
+    // Typical path building, as in rekkord
+    RunBenchmark("base Fmt (path)", iterations, [&]() {
+        LocalArray<char, 1024> buf;
+        buf.len = Fmt(buf.data, "%1%/%2%/%3", "/home/user/repository", "blobs", "0a1").len;
+    });
+
+    RunBenchmark("base Fmt (path, compiled)", iterations, [&]() {
+        LocalArray<char, 1024> buf;
+        buf.len = Fmt<"%1%/%2%/%3">(buf.data, "/home/user/repository", "blobs", "0a1").len;
+    });
 }
 
 BENCHMARK_FUNCTION("base/MatchPathName")
@@ -712,4 +1557,486 @@ BENCHMARK_FUNCTION("base/Random")
     });
 }
 
+BENCHMARK_FUNCTION("base/HashTable")
+{
+    static const int iterations = 2000000;
+    static const int keys = 100000;
+
+    FastRandom rng(42);
+
+    HeapArray<int> ints;
+    HeapArray<const char *> strings;
+    BlockAllocator str_alloc;
+    for (int i = 0; i < keys; i++) {
+        int value = rng.GetInt(0, INT_MAX);
+        ints.Append(value);
+        strings.Append(Fmt(&str_alloc, "%1", FmtHex(value)).ptr);
+    }
+
+    Size idx;
+
+    {
+        HashMap<int, int> map;
+        SwissHashMap<int, int> swiss;
+
+        idx = 0;
+        RunBenchmark("HashMap<int>::Set", iterations, [&]() {
+            map.Set(ints[idx++ % keys], 1);
+        });
+        idx = 0;
+        RunBenchmark("SwissHashMap<int>::Set", iterations, [&]() {
+            swiss.Set(ints[idx++ % keys], 1);
+        });
+
+        idx = 0;
+        RunBenchmark("HashMap<int>::Find (hit)", iterations, [&]() {
+            map.Find(ints[idx++ % keys]);
+        });
+        idx = 0;
+        RunBenchmark("SwissHashMap<int>::Find (hit)", iterations, [&]() {
+            swiss.Find(ints[idx++ % keys]);
+        });
+
+        idx = 0;
+        RunBenchmark("HashMap<int>::Find (miss)", iterations, [&]() {
+            map.Find(-ints[idx++ % keys]);
+        });
+        idx = 0;
+        RunBenchmark("SwissHashMap<int>::Find (miss)", iterations, [&]() {
+            swiss.Find(-ints[idx++ % keys]);
+        });
+    }
+
+    {
+        HashMap<const char *, int> map;
+        SwissHashMap<const char *, int> swiss;
+
+        idx = 0;
+        RunBenchmark("HashMap<str>::Set", iterations, [&]() {
+            map.Set(strings[idx++ % keys], 1);
+        });
+        idx = 0;
+        RunBenchmark("SwissHashMap<str>::Set", iterations, [&]() {
+            swiss.Set(strings[idx++ % keys], 1);
+        });
+
+        idx = 0;
+        RunBenchmark("HashMap<str>::Find (hit)", iterations, [&]() {
+            map.Find(strings[idx++ % keys]);
+        });
+        idx = 0;
+        RunBenchmark("SwissHashMap<str>::Find (hit)", iterations, [&]() {
+            swiss.Find(strings[idx++ % keys]);
+        });
+
+        idx = 0;
+        RunBenchmark("HashMap<str>::Find (miss)", iterations, [&]() {
+            map.Find("zzz");
+        });
+        idx = 0;
+        RunBenchmark("SwissHashMap<str>::Find (miss)", iterations, [&]() {
+            swiss.Find("zzz");
+        });
+    }
+
+    {
+        HashSet<int> set;
+        SwissHashSet<int> swiss;
+
+        RunBenchmark("HashSet<int> (set/remove)", iterations, [&]() {
+            int value = rng.GetInt(0, keys);
+            bool inserted;
+            int *ptr = set.TrySet(value, &inserted);
+
+            if (!inserted) {
+                set.Remove(ptr);
+            }
+        });
+        RunBenchmark("SwissHashSet<int> (set/remove)", iterations, [&]() {
+            int value = rng.GetInt(0, keys);
+            bool inserted;
+            int *ptr = swiss.TrySet(value, &inserted);
+
+            if (!inserted) {
+                swiss.Remove(ptr);
+            }
+        });
+    }
+}
+
+BENCHMARK_FUNCTION("base/Compression")
+{
+    static const int iterations = 4;
+
+    static const CompressionType types[] = {
+        CompressionType::Gzip,
+        CompressionType::LZ4,
+        CompressionType::Zstd
+    };
+
+    HeapArray<char> data;
+    {
+        FastRandom rng(42);
+
+        while (data.len < Mebibytes(64)) {
+            Fmt(&data, "%1;%2;%3\n", rng.GetInt(0, 100000), rng.GetInt(0, 16), FmtHex(rng.GetInt(0, INT_MAX)));
+        }
+    }
+
+    HeapArray<uint8_t> compressed;
+
+    for (CompressionType type: types) {
+        for (int threads: { 0, -1 }) {
+            char name[64];
+            Fmt(name, "%1 (%2)", CompressionTypeNames[(int)type], threads ? "parallel" : "single");
+
+            RunBenchmark(name, iterations, [&]() {
+                StreamWriter writer;
+                if (threads) {
+                    writer.SetCompressionThreads(threads);
+                }
+                writer.Open(&compressed, "<memory>", type);
+                writer.Write(data);
+                writer.Close();
+
+                compressed.RemoveFrom(0);
+            });
+        }
+    }
+}
+
+BENCHMARK_FUNCTION("base/IoBatch")
+{
+    static const int iterations = 20;
+
+    BlockAllocator temp_alloc;
+
+    HeapArray<const char *> filenames;
+    EnumerateFiles("src", nullptr, 8, 100000, &temp_alloc, &filenames);
+
+    IoBatch batch;
+
+    char name[64];
+    Fmt(name, "IoBatch (%1)", batch.IsAccelerated() ? "io_uring" : "fallback");
+
+    RunBenchmark("StatFile", iterations, [&]() {
+        for (const char *filename: filenames) {
+            FileInfo file_info;
+            StatFile(filename, &file_info);
+        }
+    });
+
+    RunBenchmark(name, iterations, [&]() {
+        for (const char *filename: filenames) {
+            batch.Stat(filename, 0, [](StatResult, const FileInfo &) {});
+        }
+
+        batch.Sync();
+    });
+}
+
+BENCHMARK_FUNCTION("base/LineReader")
+{
+    static const int iterations = 10;
+
+    BlockAllocator temp_alloc;
+
+    const char *filename = CreateUniqueFile(GetTemporaryDirectory(), "bench", ".txt", &temp_alloc);
+    if (!filename)
+        return;
+    RG_DEFER { UnlinkFile(filename); };
+
+    // Roughly shaped like RSS files
+    {
+        StreamWriter writer(filename);
+        FastRandom rng(42);
+
+        for (Size i = 0; i < 400000; i++) {
+            for (int j = 0; j < 16; j++) {
+                Print(&writer, "%1", FmtHex(rng.GetInt(0, INT_MAX)).Pad0(-8));
+            }
+            PrintLn(&writer);
+        }
+
+        if (!writer.Close())
+            return;
+    }
+
+    Size total = 0;
+
+    RunBenchmark("LineReader::Next", iterations, [&]() {
+        StreamReader st(filename);
+        LineReader reader(&st);
+
+        Span<const char> line;
+        while (reader.Next(&line)) {
+            total += line.len;
+        }
+    });
+
+    RunBenchmark("LineReader::NextView", iterations, [&]() {
+        StreamReader st(filename);
+        LineReader reader(&st);
+
+        Span<const char> line;
+        while (reader.NextView(&line)) {
+            total += line.len;
+        }
+    });
+
+    RunBenchmark("LineReader::NextView (mapped)", iterations, [&]() {
+        StreamReader st;
+        st.SetMapping(true);
+        st.Open(filename);
+
+        LineReader reader(&st);
+
+        Span<const char> line;
+        while (reader.NextView(&line)) {
+            total += line.len;
+        }
+    });
+}
+
+BENCHMARK_FUNCTION("base/SplitLines")
+{
+    static const int iterations = 20;
+
+    HeapArray<char> data;
+    {
+        FastRandom rng(42);
+
+        while (data.len < Mebibytes(64)) {
+            Fmt(&data, "%1;%2;%3;%4;%5\n", rng.GetInt(0, 100000), FmtHex(rng.GetInt(0, INT_MAX)).Pad0(-8),
+                rng.GetInt(0, 16), FmtHex(rng.GetInt(0, INT_MAX)), FmtHex(rng.GetInt(0, INT_MAX)).Pad0(-24));
+        }
+    }
+
+    Size total = 0;
+
+    RunBenchmark("Lines (scalar)", iterations, [&]() {
+        Size start = 0;
+
+        for (Size i = 0; i < data.len; i++) {
+            if (data[i] == '\n') {
+                total += i - start;
+                start = i + 1;
+            }
+        }
+    });
+
+    RunBenchmark("Lines (SplitStrLine)", iterations, [&]() {
+        Span<const char> remain = data;
+
+        while (remain.len) {
+            Span<const char> line = SplitStrLine(remain, &remain);
+            total += line.len;
+        }
+    });
+
+    RunBenchmark("Fields (SplitStr)", iterations, [&]() {
+        Span<const char> remain = data;
+
+        while (remain.len) {
+            Span<const char> line = SplitStrLine(remain, &remain);
+
+            while (line.len) {
+                Span<const char> field = SplitStr(line, ';', &line);
+                total += field.len;
+            }
+        }
+    });
+
+    RunBenchmark("Fields (SplitFields)", iterations, [&]() {
+        Span<const char> remain = data;
+
+        while (remain.len) {
+            Span<const char> line = SplitStrLine(remain, &remain);
+
+            Span<const char> fields[8];
+            Size count = SplitFields(line, ';', fields);
+
+            for (Size i = 0; i < count; i++) {
+                total += fields[i].len;
+            }
+        }
+    });
+}
+
+
+BENCHMARK_FUNCTION("base/Log")
+{
+    static const int iterations = 20;
+    static const int threads = 4;
+    static const int messages = 10000;
+
+#ifdef _WIN32
+    StreamWriter writer("NUL");
+#else
+    StreamWriter writer("/dev/null");
+#endif
+
+    SetLogHandler([&](LogLevel, const char *ctx, const char *msg) {
+        Print(&writer, "%1%2\n", ctx ? ctx : "", msg);
+    });
+    RG_DEFER { SetLogHandler(DefaultLogHandler); };
+
+    const auto run = []() {
+        Async async;
+
+        for (int i = 0; i < threads; i++) {
+            async.Run([=]() {
+                for (int j = 0; j < messages / threads; j++) {
+                    LogInfo("Thread %1: message %2 (%3)", i, j, "foobar");
+                }
+                return true;
+            });
+        }
+
+        async.Sync();
+    };
+
+    RunBenchmark("Synchronous", iterations, run);
+
+    EnableAsyncLog();
+    RG_DEFER { DisableAsyncLog(); };
+
+    RunBenchmark("Asynchronous", iterations, [&]() {
+        run();
+        FlushLog();
+    });
+}
+
+
+BENCHMARK_FUNCTION("base/PoolAllocator")
+{
+    static const int iterations = 20;
+    static const int threads = 4;
+    static const int slots = 4096;
+    static const int churn = 100000;
+
+    // Each thread replaces random objects in its own set
+    const auto run_churn = [](FunctionRef<Allocator *()> get_alloc) {
+        Async async;
+
+        for (int i = 0; i < threads; i++) {
+            async.Run([&, i]() {
+                Allocator *alloc = get_alloc();
+                FastRandom rng(i);
+
+                Span<uint8_t> objects[slots] = {};
+
+                for (int j = 0; j < churn; j++) {
+                    Span<uint8_t> *obj = &objects[rng.GetInt(0, slots)];
+
+                    ReleaseSpan(alloc, *obj);
+                    *obj = AllocateSpan<uint8_t>(alloc, rng.GetInt(16, 512));
+                    obj->ptr[0] = (uint8_t)j;
+                }
+
+                for (Span<uint8_t> obj: objects) {
+                    ReleaseSpan(alloc, obj);
+                }
+
+                return true;
+            });
+        }
+
+        async.Sync();
+    };
+
+    // Objects are released by another thread than the one which allocated them
+    const auto run_cross = [](Allocator *alloc) {
+        static Span<uint8_t> objects[threads][slots];
+
+        for (int round = 0; round < 10; round++) {
+            Async async;
+
+            for (int i = 0; i < threads; i++) {
+                async.Run([=]() {
+                    FastRandom rng(round * threads + i);
+
+                    for (Span<uint8_t> &obj: objects[i]) {
+                        obj = AllocateSpan<uint8_t>(alloc, rng.GetInt(16, 512));
+                    }
+                    return true;
+                });
+            }
+            async.Sync();
+
+            for (int i = 0; i < threads; i++) {
+                async.Run([=]() {
+                    for (Span<uint8_t> &obj: objects[(i + 1) % threads]) {
+                        ReleaseSpan(alloc, obj);
+                    }
+                    return true;
+                });
+            }
+            async.Sync();
+        }
+    };
+
+    RunBenchmark("Churn (malloc)", iterations, [&]() {
+        run_churn([]() { return GetDefaultAllocator(); });
+    });
+
+    RunBenchmark("Churn (LinkedAllocator)", iterations, [&]() {
+        LinkedAllocator allocators[threads];
+        std::atomic_int next { 0 };
+
+        run_churn([&]() { return (Allocator *)&allocators[next++]; });
+    });
+
+    {
+        PoolAllocator pool;
+
+        RunBenchmark("Churn (PoolAllocator)", iterations, [&]() {
+            run_churn([&]() { return (Allocator *)&pool; });
+        });
+    }
+
+    RunBenchmark("Cross-thread (malloc)", iterations, [&]() { run_cross(GetDefaultAllocator()); });
+
+    {
+        PoolAllocator pool;
+        RunBenchmark("Cross-thread (PoolAllocator)", iterations, [&]() { run_cross(&pool); });
+    }
+}
+
+
+BENCHMARK_FUNCTION("base/BlockAllocator")
+{
+    static const int iterations = 10;
+
+    // Mimic builders which copy many small strings (file paths, codes, labels)
+    const auto run = [](BlockAllocator *alloc) {
+        FastRandom rng(42);
+
+        for (Size i = 0; i < 2000000; i++) {
+            Size len = rng.GetInt(4, 64);
+
+            char *str = (char *)AllocateRaw(alloc, len);
+            str[0] = (char)i;
+        }
+
+        alloc->ReleaseAll();
+    };
+
+    RunBenchmark("Fixed 4 kiB blocks", iterations, [&]() {
+        BlockAllocator alloc(Kibibytes(4), Kibibytes(4));
+        run(&alloc);
+    });
+
+    RunBenchmark("Growing blocks", iterations, [&]() {
+        BlockAllocator alloc;
+        run(&alloc);
+    });
+
+    RunBenchmark("Growing blocks (huge pages)", iterations, [&]() {
+        BlockAllocator alloc(RG_BLOCK_ALLOCATOR_DEFAULT_SIZE, RG_BLOCK_ALLOCATOR_MAX_SIZE,
+                             (int)BlockAllocatorFlag::HugePages);
+        run(&alloc);
+    });
+}
+
 }
@@ -0,0 +1,1130 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see https://www.gnu.org/licenses/.
+
+#include "src/core/base/base.hh"
+#include "src/core/http/http.hh"
+#include "test.hh"
+
+#ifdef __linux__
+    #include <poll.h>
+    #include <sys/resource.h>
+    #include <sys/socket.h>
+    #include <unistd.h>
+#endif
+
+namespace RG {
+
+TEST_FUNCTION("http/Histogram")
+{
+    // Small values get exact buckets
+    for (int64_t i = 0; i < 8; i++) {
+        TEST_EQ(http_Histogram::GetBucket(i), i);
+        TEST_EQ(http_Histogram::GetBucketLimit((int)i), i + 1);
+    }
+
+    // Each bucket must contain its lower bound and stop right before its limit
+    for (int i = 1; i < http_Histogram::Buckets - 1; i++) {
+        int64_t limit = http_Histogram::GetBucketLimit(i);
+
+        TEST_EQ(http_Histogram::GetBucket(limit - 1), i);
+        TEST_EQ(http_Histogram::GetBucket(limit), i + 1);
+    }
+    TEST_EQ(http_Histogram::GetBucket(INT64_MAX), http_Histogram::Buckets - 1);
+
+    // Relative error stays under 12.5%
+    {
+        http_Histogram histogram;
+
+        for (int64_t i = 1; i <= 100000; i++) {
+            histogram.Add(i);
+        }
+
+        TEST_EQ(histogram.count, 100000);
+        TEST_EQ(histogram.sum, (int64_t)100000 * 100001 / 2);
+        TEST_EQ(histogram.max, 100000);
+
+        TEST(std::abs(histogram.GetPercentile(50.0) - 50000) <= 50000 / 8);
+        TEST(std::abs(histogram.GetPercentile(99.0) - 99000) <= 99000 / 8);
+        TEST_EQ(histogram.GetPercentile(100.0), 100000);
+    }
+
+    // Percentiles never exceed the maximum value
+    {
+        http_Histogram histogram;
+
+        histogram.Add(1000, 99);
+        histogram.Add(1000000);
+
+        TEST(histogram.GetPercentile(50.0) >= 1000 && histogram.GetPercentile(50.0) < 1125);
+        TEST_EQ(histogram.GetPercentile(99.9), 1000000);
+    }
+}
+
+#ifdef __linux__
+
+static bool WriteAll(int fd, Span<const uint8_t> buf)
+{
+    while (buf.len) {
+        ssize_t len = RG_RESTART_EINTR(send(fd, buf.ptr, (size_t)buf.len, MSG_NOSIGNAL), < 0);
+
+        if (len < 0) {
+            LogError("Failed to write to socket: %1", strerror(errno));
+            return false;
+        }
+
+        buf.ptr += len;
+        buf.len -= (Size)len;
+    }
+
+    return true;
+}
+
+static bool ReadAll(int fd, Span<uint8_t> out_buf)
+{
+    while (out_buf.len) {
+        ssize_t len = RG_RESTART_EINTR(recv(fd, out_buf.ptr, (size_t)out_buf.len, 0), < 0);
+
+        if (len < 0) {
+            LogError("Failed to read from socket: %1", strerror(errno));
+            return false;
+        } else if (!len) {
+            LogError("Unexpected end of stream");
+            return false;
+        }
+
+        out_buf.ptr += len;
+        out_buf.len -= (Size)len;
+    }
+
+    return true;
+}
+
+// Returns the path of the Unix socket, which lives in a temporary directory
+static const char *StartDaemon(http_Daemon *daemon, int max_connections,
+                               std::function<void(const http_RequestInfo &request, http_IO *io)> func,
+                               Allocator *alloc, bool metrics = false, Size file_cache_size = 0,
+                               FunctionRef<void(http_Config *config)> configure = {})
+{
+    const char *temp_directory = CreateUniqueDirectory(GetTemporaryDirectory(), "bench", alloc);
+    if (!temp_directory)
+        return nullptr;
+    RG_DEFER_N(err_guard) { UnlinkDirectory(temp_directory); };
+
+    http_Config config;
+    config.sock_type = SocketType::Unix;
+    config.unix_path = Fmt(alloc, "%1%/http.sock", temp_directory).ptr;
+    config.max_connections = max_connections;
+    config.metrics = metrics;
+    config.metrics_path = metrics ? "/metrics" : nullptr;
+    config.file_cache_size = file_cache_size;
+    if (configure.IsValid()) {
+        configure(&config);
+    }
+
+    PushLogFilter([](LogLevel, const char *, const char *, FunctionRef<LogFunc>) {});
+    RG_DEFER { PopLogFilter(); };
+
+    if (!daemon->Start(config, func, false))
+        return nullptr;
+
+    err_guard.Disable();
+    return config.unix_path;
+}
+
+static void StopDaemon(http_Daemon *daemon, const char *socket_path)
+{
+    daemon->Stop();
+
+    char temp_directory[4096];
+    CopyString(GetPathDirectory(socket_path), temp_directory);
+
+    UnlinkFile(socket_path);
+    UnlinkDirectory(temp_directory);
+}
+
+static int ConnectWebSocket(const char *socket_path)
+{
+    static const char request[] = "GET /ws HTTP/1.1\r\n"
+                                  "Host: localhost\r\n"
+                                  "Connection: Upgrade\r\n"
+                                  "Upgrade: websocket\r\n"
+                                  "Sec-WebSocket-Version: 13\r\n"
+                                  "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                                  "\r\n";
+
+    int fd = ConnectToUnixSocket(socket_path);
+    if (fd < 0)
+        return -1;
+    RG_DEFER_N(err_guard) { CloseSocket(fd); };
+
+    if (!WriteAll(fd, MakeSpan((const uint8_t *)request, RG_SIZE(request) - 1)))
+        return -1;
+
+    // Read response headers byte by byte, so we don't eat into WebSocket frames
+    LocalArray<char, 1024> response;
+    while (!EndsWith(response, "\r\n\r\n")) {
+        if (!response.Available()) {
+            LogError("Excessive HTTP response size");
+            return -1;
+        }
+        if (!ReadAll(fd, MakeSpan((uint8_t *)response.end(), 1)))
+            return -1;
+        response.len++;
+    }
+
+    if (!StartsWith(response, "HTTP/1.1 101")) {
+        LogError("WebSocket upgrade failed");
+        return -1;
+    }
+
+    err_guard.Disable();
+    return fd;
+}
+
+static bool EchoMessage(int fd, Span<const uint8_t> msg)
+{
+    RG_ASSERT(msg.len < 126);
+
+    // Client frames must be masked, use a zero mask to keep things simple
+    static const uint8_t mask[4] = {};
+
+    LocalArray<uint8_t, 256> frame;
+    frame.Append(0x82);
+    frame.Append((uint8_t)(0x80 | msg.len));
+    frame.Append(mask);
+    frame.Append(msg);
+
+    return WriteAll(fd, frame);
+}
+
+static bool ReceiveEcho(int fd, Span<const uint8_t> msg)
+{
+    uint8_t header[2];
+    uint8_t payload[128];
+
+    if (!ReadAll(fd, header))
+        return false;
+    if (header[0] != 0x82 || header[1] != msg.len) {
+        LogError("Unexpected WebSocket frame");
+        return false;
+    }
+    if (!ReadAll(fd, MakeSpan(payload, msg.len)))
+        return false;
+
+    return !memcmp(payload, msg.ptr, (size_t)msg.len);
+}
+
+BENCHMARK_FUNCTION("http/WebSocket")
+{
+    static const int iterations = 2000;
+    static const Size ActiveClients = 100;
+    static const Size IdleClients = 10000;
+
+    BlockAllocator temp_alloc;
+
+    // Each connection needs two descriptors (client and server), keep some for everything else
+    Size idle_clients = IdleClients;
+    {
+        struct rlimit lim;
+
+        if (getrlimit(RLIMIT_NOFILE, &lim) < 0) {
+            LogError("getrlimit(RLIMIT_NOFILE) failed: %1", strerror(errno));
+            return;
+        }
+        if (lim.rlim_cur < lim.rlim_max) {
+            lim.rlim_cur = lim.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &lim);
+        }
+
+        Size max_clients = ((Size)lim.rlim_cur - 512) / 2 - ActiveClients;
+
+        if (max_clients < idle_clients) {
+            LogWarning("Limiting idle connections to %1 (open file limit)", max_clients);
+            idle_clients = std::max(max_clients, (Size)0);
+        }
+    }
+
+    http_Daemon daemon;
+    const char *socket_path = StartDaemon(&daemon, (int)(ActiveClients + idle_clients + 64),
+                                          [](const http_RequestInfo &, http_IO *io) {
+        io->RunAsync([io]() {
+            if (!io->UpgradeToWS(0))
+                return;
+
+            io->AttachWS([](http_WebSocket *ws, Span<const uint8_t> msg) { ws->Send(msg); });
+        });
+    }, &temp_alloc);
+    if (!socket_path)
+        return;
+    RG_DEFER { StopDaemon(&daemon, socket_path); };
+
+    HeapArray<int> active;
+    HeapArray<int> idle;
+    RG_DEFER {
+        for (int fd: active) {
+            CloseSocket(fd);
+        }
+        for (int fd: idle) {
+            CloseSocket(fd);
+        }
+    };
+
+    for (Size i = 0; i < ActiveClients; i++) {
+        int fd = ConnectWebSocket(socket_path);
+        if (fd < 0)
+            return;
+        active.Append(fd);
+    }
+
+    static const uint8_t msg[] = "Hello World! This is a WebSocket message.";
+
+    const auto run = [&]() {
+        for (int fd: active) {
+            EchoMessage(fd, msg);
+        }
+        for (int fd: active) {
+            ReceiveEcho(fd, msg);
+        }
+    };
+
+    RunBenchmark("Echo (no idle connections)", iterations, run);
+
+    // Open many connections that stay quiet, this must not affect active ones
+    {
+        int64_t start = GetMonotonicTime();
+
+        for (Size i = 0; i < idle_clients; i++) {
+            int fd = ConnectWebSocket(socket_path);
+            if (fd < 0)
+                return;
+            idle.Append(fd);
+        }
+
+        int64_t time = GetMonotonicTime() - start;
+        PrintLn("  %!..+%1%!0 %!c..%2 ms%!0 %!D..(%3 connections)%!0",
+                FmtArg("Open idle connections").Pad(34), time, idle_clients);
+    }
+
+    RunBenchmark(Fmt(&temp_alloc, "Echo (%1 idle connections)", idle_clients).ptr, iterations, run);
+}
+
+static Size DownloadResource(const char *socket_path, const char *url)
+{
+    int fd = ConnectToUnixSocket(socket_path);
+    if (fd < 0)
+        return -1;
+    RG_DEFER { CloseSocket(fd); };
+
+    LocalArray<char, 512> request;
+    request.len = Fmt(request.data, "GET %1 HTTP/1.1\r\n"
+                                    "Host: localhost\r\n"
+                                    "Connection: close\r\n"
+                                    "\r\n", url).len;
+
+    if (!WriteAll(fd, request.As<const uint8_t>()))
+        return -1;
+
+    // Count everything (including headers and chunk markers), that's good enough
+    Size total = 0;
+    for (;;) {
+        static thread_local uint8_t buf[Kibibytes(256)];
+        ssize_t len = RG_RESTART_EINTR(recv(fd, buf, RG_SIZE(buf), 0), < 0);
+
+        if (len < 0) {
+            LogError("Failed to read from socket: %1", strerror(errno));
+            return -1;
+        } else if (!len) {
+            break;
+        }
+
+        total += (Size)len;
+    }
+
+    return total;
+}
+
+BENCHMARK_FUNCTION("http/Download")
+{
+    static const int iterations = 1;
+    static const Size TotalSize = Mebibytes(1024);
+
+    BlockAllocator temp_alloc;
+
+    // Incompressible payload, written in big pieces (rekkord-like)
+    static HeapArray<uint8_t> blob;
+    if (!blob.len) {
+        blob.AppendDefault(Mebibytes(1));
+        FillRandomSafe(blob);
+    }
+
+    http_Daemon daemon;
+    const char *socket_path = StartDaemon(&daemon, 64, [](const http_RequestInfo &request, http_IO *io) {
+        io->RunAsync([&request, io]() {
+            StreamWriter writer;
+            if (!io->OpenForWrite(200, -1, &writer))
+                return;
+
+            if (TestStr(request.url, "/export")) {
+                // Many small rows, similar to goupile exports
+                char row[256];
+                Size written = 0;
+
+                for (Size i = 0; written < TotalSize; i++) {
+                    Span<const char> line = Fmt(row, "{\"__ulid\": \"%1\", \"__version\": %2, \"age\": %3, \"name\": \"Participant %4\"},\n",
+                                                FmtHex(i).Pad0(-26), i % 7, 18 + i % 60, i);
+                    writer.Write(line);
+
+                    written += line.len;
+                }
+            } else {
+                for (Size written = 0; written < TotalSize; written += blob.len) {
+                    writer.Write(blob);
+                }
+            }
+
+            writer.Close();
+        });
+    }, &temp_alloc);
+    if (!socket_path)
+        return;
+    RG_DEFER { StopDaemon(&daemon, socket_path); };
+
+    // Make sure everything works before we measure anything
+    for (const char *url: { "/blob", "/export" }) {
+        Size size = DownloadResource(socket_path, url);
+
+        if (size < TotalSize) {
+            LogError("Truncated download (%1 < %2)", FmtMemSize(size), FmtMemSize(TotalSize));
+            return;
+        }
+    }
+
+    RunBenchmark("Download 1 GiB (large writes)", iterations, [&]() { DownloadResource(socket_path, "/blob"); });
+    RunBenchmark("Download 1 GiB (small rows)", iterations, [&]() { DownloadResource(socket_path, "/export"); });
+}
+
+// Wait until the response contains marker, or give up after timeout (in milliseconds)
+static bool WaitForResponse(int fd, const char *marker, int timeout, HeapArray<char> *out_response)
+{
+    int64_t start = GetMonotonicTime();
+
+    while (!memmem(out_response->ptr, out_response->len, marker, strlen(marker))) {
+        int64_t delay = start + timeout - GetMonotonicTime();
+        if (delay <= 0)
+            return false;
+
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (RG_RESTART_EINTR(poll(&pfd, 1, (int)delay), < 0) <= 0)
+            continue;
+
+        out_response->Grow(Kibibytes(64));
+
+        ssize_t len = RG_RESTART_EINTR(recv(fd, out_response->end(), (size_t)out_response->Available(), 0), < 0);
+        if (len <= 0)
+            return false;
+        out_response->len += (Size)len;
+    }
+
+    return true;
+}
+
+TEST_FUNCTION("http/StreamTrickle")
+{
+    BlockAllocator temp_alloc;
+
+    std::atomic_bool received { false };
+
+    http_Daemon daemon;
+    const char *socket_path = StartDaemon(&daemon, 64, [&](const http_RequestInfo &request, http_IO *io) {
+        io->RunAsync([&, io]() {
+            StreamWriter writer;
+            if (!io->OpenForWrite(200, -1, &writer))
+                return;
+
+            if (TestStr(request.url, "/flush")) {
+                // Headers and first bytes go out with an explicit flush
+                writer.Write("[HEAD]");
+                io->FlushWrite();
+            } else {
+                // Fill a whole chunk, let libmicrohttpd send it and run dry
+                HeapArray<char> padding;
+                padding.AppendDefault(Kibibytes(80));
+                MemSet(padding.ptr, '.', padding.len);
+
+                writer.Write(padding);
+                WaitDelay(100);
+                writer.Write("[TAIL]");
+            }
+
+            // Don't end the stream until the client has seen the bytes, or gave up
+            for (int i = 0; i < 100 && !received; i++) {
+                WaitDelay(20);
+            }
+
+            writer.Close();
+        });
+    }, &temp_alloc);
+    if (!socket_path)
+        return;
+    RG_DEFER { StopDaemon(&daemon, socket_path); };
+
+    for (const char *url: { "/flush", "/trickle" }) {
+        const char *marker = TestStr(url, "/flush") ? "[HEAD]" : "[TAIL]";
+
+        int fd = ConnectToUnixSocket(socket_path);
+        if (fd < 0)
+            return;
+        RG_DEFER { CloseSocket(fd); };
+
+        received = false;
+
+        char request[256];
+        Fmt(request, "GET %1 HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n", url);
+        TEST(WriteAll(fd, MakeSpan((const uint8_t *)request, strlen(request))));
+
+        HeapArray<char> response;
+        bool success = WaitForResponse(fd, marker, 1000, &response);
+
+        received = true;
+
+        TEST_EX(success, "Stream %1 stalled before %2", url, marker);
+
+        // Read the end of the stream, so the server does not complain about a closed socket
+        for (;;) {
+            response.Grow(Kibibytes(64));
+
+            ssize_t len = RG_RESTART_EINTR(recv(fd, response.end(), (size_t)response.Available(), 0), < 0);
+            if (len <= 0)
+                break;
+            response.len += (Size)len;
+        }
+    }
+}
+
+// Send request on keep-alive connection, and return status code
+static int ExecuteRequest(int fd, const char *url, const char *cookies, HeapArray<char> *out_response,
+                          const char *headers = nullptr)
+{
+    LocalArray<char, 1024> request;
+    request.len = Fmt(request.data, "GET %1 HTTP/1.1\r\n"
+                                    "Host: localhost\r\n", url).len;
+    if (cookies) {
+        request.len += Fmt(request.TakeAvailable(), "Cookie: %1\r\n", cookies).len;
+    }
+    if (headers) {
+        request.len += Fmt(request.TakeAvailable(), "%1", headers).len;
+    }
+    request.len += Fmt(request.TakeAvailable(), "\r\n").len;
+
+    if (!WriteAll(fd, request.As<const uint8_t>()))
+        return -1;
+
+    out_response->RemoveFrom(0);
+
+    Size body = -1;
+    Size content_len = -1;
+
+    while (body < 0 || out_response->len < body + content_len) {
+        out_response->Grow(Kibibytes(4));
+
+        ssize_t len = RG_RESTART_EINTR(recv(fd, out_response->end(), (size_t)out_response->Available(), 0), < 0);
+
+        if (len < 0) {
+            LogError("Failed to read from socket: %1", strerror(errno));
+            return -1;
+        } else if (!len) {
+            LogError("Unexpected end of stream");
+            return -1;
+        }
+        out_response->len += (Size)len;
+
+        if (body < 0) {
+            const char *end = (const char *)memmem(out_response->ptr, out_response->len, "\r\n\r\n", 4);
+
+            if (end) {
+                Size headers_len = end - out_response->ptr;
+                const char *str = (const char *)memmem(out_response->ptr, headers_len, "Content-Length: ", 16);
+
+                body = headers_len + 4;
+                content_len = str ? (Size)strtoll(str + 16, nullptr, 10) : 0;
+            }
+        }
+    }
+
+    return (int)strtol(out_response->ptr + 9, nullptr, 10);
+}
+
+static Span<const char> GetResponseHeaders(Span<const char> response)
+{
+    const char *end = (const char *)memmem(response.ptr, response.len, "\r\n\r\n", 4);
+    return end ? MakeSpan(response.ptr, end - response.ptr + 2) : response;
+}
+
+static Span<const char> GetResponseBody(Span<const char> response)
+{
+    const char *end = (const char *)memmem(response.ptr, response.len, "\r\n\r\n", 4);
+    return end ? MakeSpan(end + 4, response.end() - end - 4) : Span<const char>();
+}
+
+static bool HasHeader(Span<const char> response, const char *header)
+{
+    Span<const char> headers = GetResponseHeaders(response);
+    char line[256];
+
+    Fmt(line, "\r\n%1\r\n", header);
+    return memmem(headers.ptr, headers.len, line, strlen(line));
+}
+
+TEST_FUNCTION("http/Shedding")
+{
+    static const int Clients = 24;
+
+    BlockAllocator temp_alloc;
+
+    http_Daemon daemon;
+    const char *socket_path = StartDaemon(&daemon, 64, [](const http_RequestInfo &request, http_IO *io) {
+        if (TestStr(request.url, "/slow")) {
+            io->RunAsync([io]() {
+                WaitDelay(200);
+                io->AttachText(200, "Slow");
+            });
+        } else if (TestStr(request.url, "/fast")) {
+            io->RunAsync([io]() { io->AttachText(200, "Fast"); }, http_Priority::High);
+        } else if (TestStr(request.url, "/low")) {
+            io->RunAsync([io]() { io->AttachText(200, "Low"); }, http_Priority::Low);
+        } else {
+            io->AttachError(404);
+        }
+    }, &temp_alloc, false, 0, [](http_Config *config) {
+        config->async_threads = 3;
+        config->fast_threads = 3;
+        config->shed_target = 5;
+        config->shed_interval = 100;
+    });
+    if (!socket_path)
+        return;
+    RG_DEFER { StopDaemon(&daemon, socket_path); };
+
+    // Shedding is logged from daemon threads, where thread-local log filters don't reach
+    SetLogHandler([](LogLevel, const char *, const char *) {});
+    RG_DEFER { SetLogHandler(DefaultLogHandler); };
+
+    // Rejected requests may not keep the connection alive, use a new one each time
+    const auto probe = [&](const char *url) {
+        int fd = ConnectToUnixSocket(socket_path);
+        if (fd < 0)
+            return -1;
+        RG_DEFER { CloseSocket(fd); };
+
+        HeapArray<char> response;
+        return ExecuteRequest(fd, url, nullptr, &response);
+    };
+
+    // Nothing is shed as long as the queue keeps up
+    TEST_EQ(probe("/slow"), 200);
+    TEST_EQ(probe("/low"), 200);
+
+    // Flood the normal queue with slow requests from many keep-alive connections
+    std::atomic_bool stop { false };
+    std::atomic_int served { 0 };
+    std::atomic_int shed { 0 };
+    std::atomic_bool retry_after { true };
+
+    Async async(Clients + 1);
+
+    for (Size i = 0; i < Clients; i++) {
+        async.Run([&]() {
+            int client = ConnectToUnixSocket(socket_path);
+            if (client < 0)
+                return false;
+            RG_DEFER { CloseSocket(client); };
+
+            HeapArray<char> response;
+
+            while (!stop) {
+                int status = ExecuteRequest(client, "/slow", nullptr, &response);
+
+                if (status == 200) {
+                    served++;
+                } else if (status == 503) {
+                    shed++;
+                    retry_after = retry_after && HasHeader(response, "Retry-After: 1");
+                } else {
+                    return false;
+                }
+            }
+
+            return true;
+        });
+    }
+
+    // Low priority requests get rejected once the queue is overloaded, high priority ones never wait
+    {
+        bool low_shed = false;
+        bool fast_served = true;
+        int64_t fast_delay = 0;
+
+        for (int i = 0; i < 100 && (i < 10 || !low_shed || !shed); i++) {
+            WaitDelay(20);
+
+            low_shed |= (probe("/low") == 503);
+
+            int64_t start = GetMonotonicTime();
+            fast_served &= (probe("/fast") == 200);
+            fast_delay = std::max(fast_delay, GetMonotonicTime() - start);
+        }
+
+        stop = true;
+        bool success = async.Sync();
+
+        TEST(success);
+        TEST(served > 0);
+        TEST(shed > 0);
+        TEST(retry_after);
+        TEST(low_shed);
+        TEST(fast_served);
+        TEST_EX(fast_delay < 100, "High priority requests took up to %1 ms", fast_delay);
+    }
+
+    // Once the flood is gone, the overload ends even if only low priority requests come in
+    {
+        int status = -1;
+
+        for (int i = 0; i < 20 && status != 200; i++) {
+            WaitDelay(50);
+            status = probe("/low");
+        }
+
+        TEST_EQ(status, 200);
+    }
+}
+
+static void ServeStaticFile(const char *root_directory, const http_RequestInfo &request, http_IO *io,
+                            bool quiet = false)
+{
+    io->RunAsync([=, &request]() {
+        // Log filters are thread-local, so push it in the thread that logs
+        if (quiet) {
+            PushLogFilter([](LogLevel, const char *, const char *, FunctionRef<LogFunc>) {});
+        }
+        RG_DEFER {
+            if (quiet) {
+                PopLogFilter();
+            }
+        };
+
+        // Files below /raw are served without sidecars
+        Span<const char> path = request.url;
+        bool sidecars = !StartsWith(path, "/raw/");
+        if (!sidecars) {
+            path = path.Take(4, path.len - 4);
+        }
+
+        const char *filename = Fmt(&io->allocator, "%1%2", root_directory, path).ptr;
+
+        if (!io->AttachFile(200, filename, "text/plain", sidecars)) {
+            io->AttachError(404);
+        }
+    });
+}
+
+TEST_FUNCTION("http/AttachFile")
+{
+    BlockAllocator temp_alloc;
+
+    const char *root_directory = CreateUniqueDirectory(GetTemporaryDirectory(), "test", &temp_alloc);
+    if (!root_directory)
+        return;
+    RG_DEFER { UnlinkDirectory(root_directory); };
+
+    const char *filename = Fmt(&temp_alloc, "%1%/hello.txt", root_directory).ptr;
+    const char *gzip_filename = Fmt(&temp_alloc, "%1%/hello.txt.gz", root_directory).ptr;
+    RG_DEFER {
+        UnlinkFile(filename);
+        UnlinkFile(gzip_filename);
+    };
+
+    // Sidecar content does not need to be valid, the server does not look inside
+    if (!WriteFile("Hello World!", filename))
+        return;
+    if (!WriteFile("GZIP", gzip_filename))
+        return;
+
+    // Set around requests that log expected errors
+    std::atomic_bool quiet { false };
+
+    const char *sub_directory = Fmt(&temp_alloc, "%1%/sub", root_directory).ptr;
+    const char *sub_filename = Fmt(&temp_alloc, "%1%/page.txt", sub_directory).ptr;
+    RG_DEFER {
+        UnlinkFile(sub_filename);
+        UnlinkDirectory(sub_directory);
+    };
+
+    // The smallest cache keeps evicting entries (and dropping their watches)
+    for (Size cache_size: { (Size)0, Kibibytes(1), Mebibytes(1) }) {
+        http_Daemon daemon;
+        const char *socket_path = StartDaemon(&daemon, 64, [&](const http_RequestInfo &request, http_IO *io) {
+            ServeStaticFile(root_directory, request, io, quiet);
+        }, &temp_alloc, false, cache_size);
+        if (!socket_path)
+            return;
+        RG_DEFER { StopDaemon(&daemon, socket_path); };
+
+        int fd = ConnectToUnixSocket(socket_path);
+        if (fd < 0)
+            return;
+        RG_DEFER { CloseSocket(fd); };
+
+        HeapArray<char> response;
+
+        // Plain file
+        TEST_EQ(ExecuteRequest(fd, "/hello.txt", nullptr, &response), 200);
+        TEST_STR(GetResponseBody(response), "Hello World!");
+        TEST(HasHeader(response, "Vary: Accept-Encoding"));
+        TEST(HasHeader(response, "Accept-Ranges: bytes"));
+
+        // Sidecar negotiation
+        TEST_EQ(ExecuteRequest(fd, "/hello.txt", nullptr, &response, "Accept-Encoding: br, gzip\r\n"), 200);
+        TEST_STR(GetResponseBody(response), "GZIP");
+        TEST(HasHeader(response, "Content-Encoding: gzip"));
+        TEST_EQ(ExecuteRequest(fd, "/hello.txt", nullptr, &response, "Accept-Encoding: br\r\n"), 200);
+        TEST_STR(GetResponseBody(response), "Hello World!");
+        TEST_EQ(ExecuteRequest(fd, "/raw/hello.txt", nullptr, &response, "Accept-Encoding: gzip\r\n"), 200);
+        TEST_STR(GetResponseBody(response), "Hello World!");
+        TEST(!HasHeader(response, "Vary: Accept-Encoding"));
+
+        // Ranges
+        TEST_EQ(ExecuteRequest(fd, "/hello.txt", nullptr, &response, "Range: bytes=6-10\r\n"), 206);
+        TEST_STR(GetResponseBody(response), "World");
+        TEST(HasHeader(response, "Content-Range: bytes 6-10/12"));
+        TEST_EQ(ExecuteRequest(fd, "/hello.txt", nullptr, &response, "Range: bytes=-6\r\n"), 206);
+        TEST_STR(GetResponseBody(response), "World!");
+        TEST_EQ(ExecuteRequest(fd, "/hello.txt", nullptr, &response, "Range: bytes=0-0, 2-3\r\n"), 200);
+        TEST_STR(GetResponseBody(response), "Hello World!");
+        {
+            quiet = true;
+            RG_DEFER { quiet = false; };
+
+            TEST_EQ(ExecuteRequest(fd, "/hello.txt", nullptr, &response, "Range: bytes=20-30\r\n"), 200);
+            TEST_STR(GetResponseBody(response), "Hello World!");
+            TEST_EQ(ExecuteRequest(fd, "/hello.txt", nullptr, &response, "Range: bytes=abc\r\n"), 200);
+            TEST_STR(GetResponseBody(response), "Hello World!");
+            TEST_EQ(ExecuteRequest(fd, "/hello.txt", nullptr, &response, "Range: lines=0-1\r\n"), 200);
+            TEST_STR(GetResponseBody(response), "Hello World!");
+        }
+
+        // Changes must be visible right away, including removed sidecars
+        TEST(WriteFile("Hello Cache!", filename));
+        TEST(UnlinkFile(gzip_filename));
+        TEST_EQ(ExecuteRequest(fd, "/hello.txt", nullptr, &response, "Accept-Encoding: gzip\r\n"), 200);
+        TEST_STR(GetResponseBody(response), "Hello Cache!");
+        TEST(!HasHeader(response, "Vary: Accept-Encoding"));
+
+        // Replace a whole directory
+        TEST(MakeDirectory(sub_directory, false));
+        TEST(WriteFile("Page 1", sub_filename));
+        TEST_EQ(ExecuteRequest(fd, "/sub/page.txt", nullptr, &response), 200);
+        TEST_STR(GetResponseBody(response), "Page 1");
+        TEST_EQ(ExecuteRequest(fd, "/hello.txt", nullptr, &response), 200);
+        TEST(UnlinkFile(sub_filename));
+        TEST(UnlinkDirectory(sub_directory));
+        TEST(MakeDirectory(sub_directory));
+        TEST(WriteFile("Page 2", sub_filename));
+        TEST_EQ(ExecuteRequest(fd, "/sub/page.txt", nullptr, &response), 200);
+        TEST_STR(GetResponseBody(response), "Page 2");
+        TEST(UnlinkFile(sub_filename));
+        TEST(UnlinkDirectory(sub_directory));
+
+        // Restore for next iteration
+        TEST(WriteFile("Hello World!", filename));
+        TEST(WriteFile("GZIP", gzip_filename));
+    }
+}
+
+BENCHMARK_FUNCTION("http/StaticFiles")
+{
+    static const int Iterations = 20000;
+
+    BlockAllocator temp_alloc;
+
+    const char *root_directory = CreateUniqueDirectory(GetTemporaryDirectory(), "bench", &temp_alloc);
+    if (!root_directory)
+        return;
+    RG_DEFER { UnlinkDirectory(root_directory); };
+
+    const char *filename = Fmt(&temp_alloc, "%1%/page.html", root_directory).ptr;
+    const char *gzip_filename = Fmt(&temp_alloc, "%1%/page.html.gz", root_directory).ptr;
+    RG_DEFER {
+        UnlinkFile(filename);
+        UnlinkFile(gzip_filename);
+    };
+
+    // Typical small asset
+    {
+        HeapArray<uint8_t> blob;
+        blob.AppendDefault(Kibibytes(24));
+        FillRandomSafe(blob);
+
+        if (!WriteFile(blob, filename))
+            return;
+        if (!WriteFile(blob.Take(0, Kibibytes(6)), gzip_filename))
+            return;
+    }
+
+    for (Size cache_size: { (Size)0, Mebibytes(32) }) {
+        http_Daemon daemon;
+        const char *socket_path = StartDaemon(&daemon, 64, [&](const http_RequestInfo &request, http_IO *io) {
+            ServeStaticFile(root_directory, request, io);
+        }, &temp_alloc, false, cache_size);
+        if (!socket_path)
+            return;
+        RG_DEFER { StopDaemon(&daemon, socket_path); };
+
+        int fd = ConnectToUnixSocket(socket_path);
+        if (fd < 0)
+            return;
+        RG_DEFER { CloseSocket(fd); };
+
+        HeapArray<char> response;
+
+        if (ExecuteRequest(fd, "/page.html", nullptr, &response) != 200) {
+            LogError("Failed to get static file");
+            return;
+        }
+
+        const char *title = cache_size ? "Static file (with cache)" : "Static file (no cache)";
+        const char *title_gzip = cache_size ? "Static file, gzip (with cache)" : "Static file, gzip (no cache)";
+
+        RunBenchmark(title, Iterations, [&]() { ExecuteRequest(fd, "/page.html", nullptr, &response); });
+        RunBenchmark(title_gzip, Iterations, [&]() {
+            ExecuteRequest(fd, "/page.html", nullptr, &response, "Accept-Encoding: gzip\r\n");
+        });
+    }
+}
+
+BENCHMARK_FUNCTION("http/SessionManager")
+{
+    static const int iterations = 2000;
+    static const int Clients = 16;
+    static const int Requests = 20;
+
+    struct BenchSession: public RetainObject<BenchSession> {
+        int64_t counter = 0;
+    };
+
+    BlockAllocator temp_alloc;
+
+    static http_SessionManager<BenchSession> sessions;
+
+    http_Daemon daemon;
+    const char *socket_path = StartDaemon(&daemon, 256, [](const http_RequestInfo &request, http_IO *io) {
+        // libmicrohttpd closes the connection when the response is queued right away
+        io->RunAsync([&request, io]() {
+            if (TestStr(request.url, "/login")) {
+                BenchSession *session = new BenchSession;
+                RetainPtr<BenchSession> ptr(session, [](BenchSession *session) { delete session; });
+
+                sessions.Open(request, io, ptr);
+                io->AttachText(200, "Done!");
+            } else if (TestStr(request.url, "/check")) {
+                RetainPtr<BenchSession> session = sessions.Find(request, io);
+
+                if (session) {
+                    session->counter++;
+                    io->AttachText(200, "Done!");
+                } else {
+                    io->AttachError(401);
+                }
+            } else if (TestStr(request.url, "/prune")) {
+                sessions.Prune();
+                io->AttachText(200, "Done!");
+            } else {
+                io->AttachError(404);
+            }
+        });
+    }, &temp_alloc);
+    if (!socket_path)
+        return;
+    RG_DEFER { StopDaemon(&daemon, socket_path); };
+
+    struct Client {
+        int fd = -1;
+        char cookies[256];
+        HeapArray<char> response;
+    };
+
+    Client clients[Clients];
+    RG_DEFER {
+        for (Client &client: clients) {
+            CloseSocket(client.fd);
+        }
+    };
+
+    // Open keep-alive connections and log in
+    for (Client &client: clients) {
+        client.fd = ConnectToUnixSocket(socket_path);
+        if (client.fd < 0)
+            return;
+
+        if (ExecuteRequest(client.fd, "/login", nullptr, &client.response) != 200)
+            return;
+
+        Span<const char> remain = client.response;
+        LocalArray<char, 256> cookies;
+
+        while (remain.len) {
+            Span<const char> line = SplitStrLine(remain, &remain);
+
+            if (StartsWith(line, "Set-Cookie: ")) {
+                Span<const char> cookie = SplitStr(line.Take(12, line.len - 12), ';');
+                cookies.len += Fmt(cookies.TakeAvailable(), "%1%2", cookies.len ? "; " : "", cookie).len;
+            }
+        }
+
+        CopyString(cookies, client.cookies);
+    }
+
+    Async async(Clients);
+
+    const auto run = [&](FunctionRef<const char *(Size idx)> func) {
+        for (Size i = 0; i < Clients; i++) {
+            async.Run([&, i]() {
+                Client *client = &clients[i];
+                const char *url = func(i);
+
+                for (Size j = 0; j < Requests; j++) {
+                    int status = ExecuteRequest(client->fd, url, client->cookies, &client->response);
+                    if (status < 0 || status >= 500)
+                        return false;
+                }
+
+                return true;
+            });
+        }
+
+        async.Sync();
+    };
+
+    RunBenchmark("Find (16 clients)", iterations, [&]() {
+        run([](Size) { return "/check"; });
+    });
+
+    RunBenchmark("Login storm (16 clients)", iterations, [&]() {
+        run([](Size) { return "/login"; });
+    });
+
+    RunBenchmark("Find during login storm", iterations, [&]() {
+        run([](Size idx) { return (idx % 2) ? "/login" : "/check"; });
+    });
+
+    RunBenchmark("Find during login storm and prune", iterations, [&]() {
+        run([](Size idx) {
+            switch (idx % 4) {
+                case 0: return "/prune";
+                case 1: return "/login";
+                default: return "/check";
+            }
+        });
+    });
+}
+
+BENCHMARK_FUNCTION("http/Metrics")
+{
+    static const int iterations = 4000;
+    static const int Clients = 8;
+    static const int Requests = 20;
+
+    BlockAllocator temp_alloc;
+
+    const auto handle = [](const http_RequestInfo &request, http_IO *io) {
+        io->RunAsync([&request, io]() {
+            if (TestStr(request.url, "/api/item")) {
+                io->SetMetricsRoute("/api/item");
+                io->AttachText(200, "Done!");
+            } else {
+                io->AttachError(404);
+            }
+        });
+    };
+
+    // Raw cost of recording a request, without any HTTP around it
+    {
+        http_Metrics metrics;
+
+        RunBenchmark("Record request", 10000000, [&]() {
+            metrics.RequestStarted();
+            metrics.RequestCompleted("/api/item", 200, 5, 40, 120);
+        });
+    }
+
+    for (bool enable: { false, true }) {
+        http_Daemon daemon;
+        const char *socket_path = StartDaemon(&daemon, 64, handle, &temp_alloc, enable);
+        if (!socket_path)
+            return;
+        RG_DEFER { StopDaemon(&daemon, socket_path); };
+
+        int fds[Clients];
+        std::fill_n(fds, Clients, -1);
+        RG_DEFER {
+            for (int fd: fds) {
+                CloseSocket(fd);
+            }
+        };
+
+        for (int &fd: fds) {
+            fd = ConnectToUnixSocket(socket_path);
+            if (fd < 0)
+                return;
+        }
+
+        Async async(Clients);
+
+        RunBenchmark(enable ? "Requests (metrics enabled)" : "Requests (metrics disabled)", iterations, [&]() {
+            for (int fd: fds) {
+                async.Run([&, fd]() {
+                    HeapArray<char> response;
+
+                    for (Size j = 0; j < Requests; j++) {
+                        if (ExecuteRequest(fd, "/api/item", nullptr, &response) != 200)
+                            return false;
+                    }
+
+                    return true;
+                });
+            }
+
+            async.Sync();
+        });
+
+        if (enable) {
+            HeapArray<char> response;
+            if (ExecuteRequest(fds[0], "/metrics", nullptr, &response) != 200) {
+                LogError("Failed to fetch metrics");
+                return;
+            }
+
+            http_MetricsSnapshot snapshot;
+            daemon.GetMetrics(&snapshot);
+
+            for (const http_RouteMetrics &route: snapshot.routes) {
+                PrintLn("  %1: %2 requests, p50 = %3 us, p99 = %4 us", route.route, route.requests,
+                        route.total.GetPercentile(50.0), route.total.GetPercentile(99.0));
+            }
+        }
+    }
+}
+
+#endif
+
+}
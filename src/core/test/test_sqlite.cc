@@ -0,0 +1,179 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see https://www.gnu.org/licenses/.
+
+
+#include "src/core/base/base.hh"
+#include "src/core/sqlite/sqlite.hh"
+#include "test.hh"
+
+namespace RG {
+
+// Returns the path of the database file, which lives in a temporary directory
+static const char *CreateTestDatabase(sq_Database *db, Allocator *alloc)
+{
+    const char *temp_directory = CreateUniqueDirectory(GetTemporaryDirectory(), "test", alloc);
+    if (!temp_directory)
+        return nullptr;
+    RG_DEFER_N(err_guard) { UnlinkDirectory(temp_directory); };
+
+    const char *filename = Fmt(alloc, "%1%/test.db", temp_directory).ptr;
+
+    if (!db->Open(filename, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE))
+        return nullptr;
+    if (!db->SetWAL(true))
+        return nullptr;
+    if (!db->SetSynchronousFull(true))
+        return nullptr;
+    if (!db->Run("CREATE TABLE items (id INTEGER PRIMARY KEY, value INTEGER UNIQUE)"))
+        return nullptr;
+
+    err_guard.Disable();
+    return filename;
+}
+
+static void DeleteTestDatabase(sq_Database *db, const char *filename)
+{
+    db->Close();
+
+    char temp_directory[4096];
+    CopyString(GetPathDirectory(filename), temp_directory);
+
+    for (const char *suffix: { "", "-wal", "-shm" }) {
+        char path[4096];
+        Fmt(path, "%1%2", filename, suffix);
+
+        UnlinkFile(path);
+    }
+    UnlinkDirectory(temp_directory);
+}
+
+TEST_FUNCTION("sqlite/GroupTransaction")
+{
+    static const int Threads = 16;
+    static const int Iterations = 40;
+
+    BlockAllocator temp_alloc;
+
+    sq_Database db;
+    const char *filename = CreateTestDatabase(&db, &temp_alloc);
+    if (!filename)
+        return;
+    RG_DEFER { DeleteTestDatabase(&db, filename); };
+
+    // Every third insert fails, either on purpose (after the insert succeeded) or because
+    // of a UNIQUE constraint, and must not affect the other members of the batch.
+    std::atomic_int successes { 0 };
+    std::atomic_int unexpected { 0 };
+    {
+        PushLogFilter([](LogLevel, const char *, const char *, FunctionRef<LogFunc>) {});
+        RG_DEFER { PopLogFilter(); };
+
+        std::thread threads[Threads];
+
+        for (int i = 0; i < Threads; i++) {
+            threads[i] = std::thread([&, i]() {
+                // Log filters are thread-local
+                PushLogFilter([](LogLevel, const char *, const char *, FunctionRef<LogFunc>) {});
+                RG_DEFER { PopLogFilter(); };
+
+                for (int j = 0; j < Iterations; j++) {
+                    int value = i * Iterations + j;
+
+                    bool success = db.GroupTransaction([&]() {
+                        switch (value % 3) {
+                            case 0: return db.Run("INSERT INTO items (value) VALUES (?1)", value);
+                            case 1: {
+                                db.Run("INSERT INTO items (value) VALUES (?1)", value);
+                                return false;
+                            } break;
+                            case 2: return db.Run("INSERT INTO items (value) VALUES (-1), (-1)");
+                        }
+
+                        RG_UNREACHABLE();
+                    });
+
+                    successes += success;
+                    unexpected += (success != !(value % 3));
+                }
+            });
+        }
+
+        for (std::thread &thread: threads) {
+            thread.join();
+        }
+    }
+
+    TEST_EQ(unexpected.load(), 0);
+
+    // Everything (and only that) must have been committed
+    {
+        sq_Statement stmt;
+        if (!db.Prepare("SELECT COUNT(*), SUM(value % 3) FROM items", &stmt))
+            return;
+        TEST(stmt.Step());
+
+        TEST_EQ(sqlite3_column_int(stmt, 0), successes.load());
+        TEST_EQ(sqlite3_column_int(stmt, 1), 0);
+    }
+
+    // Nested group transactions run inside the outer one
+    {
+        bool success = db.Transaction([&]() {
+            return db.GroupTransaction([&]() { return db.Run("INSERT INTO items (value) VALUES (-2)"); });
+        });
+        TEST(success);
+
+        sq_Statement stmt;
+        if (!db.Prepare("SELECT id FROM items WHERE value = -2", &stmt))
+            return;
+        TEST(stmt.Step());
+    }
+}
+
+BENCHMARK_FUNCTION("sqlite/GroupTransaction")
+{
+    static const int Threads = 16;
+    static const int Iterations = 20;
+
+    BlockAllocator temp_alloc;
+
+    sq_Database db;
+    const char *filename = CreateTestDatabase(&db, &temp_alloc);
+    if (!filename)
+        return;
+    RG_DEFER { DeleteTestDatabase(&db, filename); };
+
+    std::atomic_int value { 0 };
+
+    const auto run = [&](bool group) {
+        std::thread threads[Threads];
+
+        for (std::thread &thread: threads) {
+            thread = std::thread([&]() {
+                for (int i = 0; i < Iterations; i++) {
+                    const auto insert = [&]() { return db.Run("INSERT INTO items (value) VALUES (?1)", value++); };
+                    group ? db.GroupTransaction(insert) : db.Transaction(insert);
+                }
+            });
+        }
+
+        for (std::thread &thread: threads) {
+            thread.join();
+        }
+    };
+
+    RunBenchmark("320 inserts (Transaction)", 4, [&]() { run(false); });
+    RunBenchmark("320 inserts (GroupTransaction)", 4, [&]() { run(true); });
+}
+
+}
@@ -448,6 +448,8 @@ Test options:)");
     HashTable<int32_t, mco_Test> tests;
     {
         mco_StaySetBuilder stay_set_builder;
+        stay_set_builder.SetMapping(true);
+
         for (const char *filename: filenames) {
             LogInfo("Load '%1'", filename);
             if (!stay_set_builder.LoadFiles(filename, test_flags ? &tests : nullptr))
@@ -825,6 +827,7 @@ Pack options:
     mco_StaySet stay_set;
     {
         mco_StaySetBuilder stay_set_builder;
+        stay_set_builder.SetMapping(true);
 
         if (!stay_set_builder.LoadFiles(filenames))
             return 1;
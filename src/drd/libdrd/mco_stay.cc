@@ -827,7 +827,7 @@ bool mco_StaySetBuilder::LoadAtih(StreamReader *st,
         RG_DEFER { PopLogFilter(); };
 
         Span<const char> line;
-        while (reader.Next(&line)) {
+        while (reader.NextView(&line)) {
             errors += !(this->*parse_func)(line, out_tests);
         }
         if (!reader.IsValid())
@@ -872,7 +872,7 @@ bool mco_StaySetBuilder::LoadFichComp(StreamReader *st, HashTable<int32_t, mco_T
         RG_DEFER { PopLogFilter(); };
 
         Span<const char> line;
-        while (reader.Next(&line)) {
+        while (reader.NextView(&line)) {
             lines++;
 
             if (line.len < 92) {
@@ -968,8 +968,10 @@ bool mco_StaySetBuilder::LoadFiles(Span<const char *const> filenames,
             continue;
         }
 
-        StreamReader st(filename, compression_type);
-        if (!st.IsValid()) {
+        StreamReader st;
+        st.SetMapping(mapping);
+
+        if (st.Open(filename, compression_type) != OpenResult::Success) {
             success = false;
             continue;
         }
@@ -191,9 +191,16 @@ class mco_StaySetBuilder {
 
     HeapArray<FichCompData> fichcomps;
 
+    bool mapping = false;
+
 public:
     mco_StaySetBuilder() = default;
 
+    // Map uncompressed stay files instead of reading them. This avoids copies, but a file
+    // truncated or rewritten while it is mapped kills the process (SIGBUS), so only enable
+    // this in short-lived tools that own their input files.
+    void SetMapping(bool enable) { mapping = enable; }
+
     bool LoadPack(StreamReader *st, HashTable<int32_t, mco_Test> *out_tests = nullptr);
     bool LoadRss(StreamReader *st, HashTable<int32_t, mco_Test> *out_tests = nullptr);
     bool LoadRsa(StreamReader *st, HashTable<int32_t, mco_Test> *out_tests = nullptr);
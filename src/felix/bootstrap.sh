@@ -19,7 +19,7 @@ fi
 if command -v clang++ >/dev/null 2>&1; then
     echo "Bootstrapping felix with Clang..."
     mkdir -p $TEMP
-    clang++ -std=gnu++17 -O0 -I../.. -DNDEBUG $SRC -Wno-everything -pthread -o $TEMP/felix
+    clang++ -std=gnu++2a -O0 -I../.. -DNDEBUG $SRC -Wno-everything -pthread -o $TEMP/felix
     $TEMP/felix -p$PRESET felix $*
     ln -sf bin/$PRESET/felix $BINARY
 
@@ -33,7 +33,7 @@ fi
 if command -v g++ >/dev/null 2>&1; then
     echo "Bootstrapping felix with GCC..."
     mkdir -p $TEMP
-    g++ -std=gnu++17 -O0 -I../.. -DNDEBUG $SRC -w -pthread -o $TEMP/felix
+    g++ -std=gnu++2a -O0 -I../.. -DNDEBUG $SRC -w -pthread -o $TEMP/felix
     $TEMP/felix -p$PRESET felix $*
     ln -sf bin/$PRESET/felix $BINARY
 
@@ -923,6 +923,54 @@ void Builder::LoadCache()
 
     cache.Leak();
     clear_guard.Disable();
+
+    PrefetchModificationTimes();
+}
+
+void Builder::PrefetchModificationTimes()
+{
+    HeapArray<const char *> filenames;
+    HashSet<const char *> known;
+
+    // Most files checked by NeedsRebuild() are known once the cache is loaded, so stat them
+    // all at once instead of one syscall at a time. Filenames live in the leaked cache buffer.
+    for (const CacheEntry &entry: cache_map) {
+        bool inserted;
+        known.TrySet(entry.filename, &inserted);
+
+        if (inserted) {
+            filenames.Append(entry.filename);
+        }
+    }
+    for (const DependencyEntry &dep: cache_dependencies) {
+        bool inserted;
+        known.TrySet(dep.filename, &inserted);
+
+        if (inserted) {
+            filenames.Append(dep.filename);
+        }
+    }
+
+    HeapArray<int64_t> mtimes;
+    mtimes.AppendDefault(filenames.len);
+
+    IoBatch batch;
+
+    for (Size i = 0; i < filenames.len; i++) {
+        int64_t *ptr = &mtimes[i];
+
+        batch.Stat(filenames[i], (int)StatFlag::IgnoreMissing, [=](StatResult ret, const FileInfo &file_info) {
+            *ptr = (ret == StatResult::Success) ? file_info.mtime : -1;
+        });
+    }
+
+    // Skip prefetch on error, GetFileModificationTime() will do it the slow way
+    if (!batch.Sync())
+        return;
+
+    for (Size i = 0; i < filenames.len; i++) {
+        mtime_map.Set(filenames[i], mtimes[i]);
+    }
 }
 
 const char *Builder::BuildObjectPath(Span<const char> src_filename, const char *output_directory,
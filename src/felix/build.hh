@@ -153,6 +153,7 @@ private:
 
     void SaveCache();
     void LoadCache();
+    void PrefetchModificationTimes();
 
     bool PrepareQtSdk(int64_t version);
     bool PrepareEsbuild();
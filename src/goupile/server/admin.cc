@@ -17,6 +17,8 @@
 #include "file.hh"
 #include "goupile.hh"
 #include "instance.hh"
+#include "record.hh"
+#include "record_history.hh"
 #include "user.hh"
 #include "src/core/password/password.hh"
 #include "src/core/wrap/json.hh"
@@ -781,6 +783,100 @@ Options:
     return 0;
 }
 
+int RunKeyframes(Span<const char *> arguments)
+{
+    BlockAllocator temp_alloc;
+
+    // Options
+    const char *config_filename = "goupile.ini";
+
+    const auto print_usage = [=](StreamWriter *st) {
+        PrintLn(st,
+R"(Usage: %!..+%1 keyframes [options]%!0
+
+Options:
+    %!..+-C, --config_file <file>%!0     Set configuration file
+                                 %!D..(default: %2)%!0
+
+Keyframes speed up the reconstruction of historical record data. They are written
+by the server when records are saved, use this command to create them for existing
+records.)", FelixTarget, config_filename);
+    };
+
+    // Parse arguments
+    {
+        OptionParser opt(arguments);
+
+        while (opt.Next()) {
+            if (opt.Test("--help")) {
+                print_usage(StdOut);
+                return 0;
+            } else if (opt.Test("-C", "--config_file", OptionType::Value)) {
+                if (IsDirectory(opt.current_value)) {
+                    config_filename = Fmt(&temp_alloc, "%1%/goupile.ini", TrimStrRight(opt.current_value, RG_PATH_SEPARATORS)).ptr;
+                } else {
+                    config_filename = opt.current_value;
+                }
+            } else {
+                opt.LogUnknownError();
+                return 1;
+            }
+        }
+
+        opt.LogUnusedArguments();
+    }
+
+    DomainConfig config;
+    if (!LoadConfig(config_filename, &config))
+        return 1;
+
+    sq_Database db;
+    if (!db.Open(config.database_filename, SQLITE_OPEN_READONLY))
+        return 1;
+
+    sq_Statement stmt;
+    if (!db.Prepare("SELECT instance FROM dom_instances", &stmt))
+        return 1;
+
+    bool success = true;
+
+    while (stmt.Step()) {
+        const char *key = (const char *)sqlite3_column_text(stmt, 0);
+        const char *filename = MakeInstanceFileName(config.instances_directory, key, &temp_alloc);
+
+        sq_Database instance_db;
+        if (!instance_db.Open(filename, SQLITE_OPEN_READWRITE)) {
+            success = false;
+            continue;
+        }
+
+        // Keyframes need an up-to-date schema
+        int version;
+        if (!MigrateInstance(&instance_db) || !instance_db.GetUserVersion(&version)) {
+            success = false;
+            continue;
+        }
+        if (version != InstanceVersion) {
+            LogInfo("Skipping legacy instance '%1'", key);
+            continue;
+        }
+
+        Size written;
+        if (!BackfillRecordKeyframes(&instance_db, &written)) {
+            success = false;
+            continue;
+        }
+
+        LogInfo("Created %1 keyframes in instance '%2'", written, key);
+
+        success &= instance_db.Close();
+    }
+    if (!stmt.IsValid())
+        return 1;
+
+    return !success;
+}
+
 int RunKeys(Span<const char *> arguments)
 {
     BlockAllocator temp_alloc;
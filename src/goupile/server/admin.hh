@@ -20,6 +20,7 @@ namespace RG {
 
 int RunInit(Span<const char *> arguments);
 int RunMigrate(Span<const char *> arguments);
+int RunKeyframes(Span<const char *> arguments);
 int RunKeys(Span<const char *> arguments);
 
 int RunUnseal(Span<const char *> arguments);
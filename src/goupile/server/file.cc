@@ -213,7 +213,7 @@ bool HandleFileGet(InstanceHolder *instance, const http_RequestInfo &request, ht
 
         MHD_Response *response =
             MHD_create_response_from_buffer((size_t)src_len, (void *)ptr, MHD_RESPMEM_PERSISTENT);
-        io->AttachResponse(200, response);
+        io->AttachResponse(200, response, src_len);
         io->AddEncodingHeader(dest_encoding);
         AddMimeTypeHeader(filename.ptr, io);
 
@@ -387,7 +387,7 @@ bool HandleFileGet(InstanceHolder *instance, const http_RequestInfo &request, ht
             SpliceStream(&reader, -1, &writer);
             writer.Close();
         }
-    });
+    }, http_Priority::High);
 
     return true;
 }
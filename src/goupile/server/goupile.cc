@@ -280,7 +280,7 @@ static void AttachStatic(const AssetInfo &asset, int64_t max_age, const char *et
     } else {
         const char *mimetype = GetMimeType(GetPathExtension(asset.name));
 
-        io->AttachBinary(200, asset.data, mimetype, asset.compression_type);
+        io->AttachBinary(200, asset.data, mimetype, asset.compression_type, http_Priority::High);
         io->AddCachingHeaders(max_age, etag);
     }
 }
@@ -905,6 +905,7 @@ Options:
 Other commands:
     %!..+init%!0                         Create new domain
     %!..+migrate%!0                      Migrate existing domain
+    %!..+keyframes%!0                    Create record keyframes for existing data
     %!..+keys%!0                         Generate archive key pairs
     %!..+unseal%!0                       Unseal domain archive
 
@@ -1181,6 +1182,8 @@ int Main(int argc, char **argv)
         return RunInit(arguments);
     } else if (TestStr(cmd, "migrate")) {
         return RunMigrate(arguments);
+    } else if (TestStr(cmd, "keyframes")) {
+        return RunKeyframes(arguments);
     } else if (TestStr(cmd, "keys")) {
         return RunKeys(arguments);
     } else if (TestStr(cmd, "unseal")) {
@@ -23,7 +23,7 @@
 namespace RG {
 
 // If you change InstanceVersion, don't forget to update the migration switch!
-const int InstanceVersion = 118;
+const int InstanceVersion = 119;
 const int LegacyVersion = 60;
 
 bool InstanceHolder::Open(int64_t unique, InstanceHolder *master, const char *key, sq_Database *db, bool migrate)
@@ -2246,9 +2246,25 @@ bool MigrateInstance(sq_Database *db, int target)
                 )");
                 if (!success)
                     return false;
+            } [[fallthrough]];
+
+            case 118: {
+                bool success = db->RunMany(R"(
+                    CREATE TABLE rec_keyframes (
+                        anchor INTEGER PRIMARY KEY REFERENCES rec_fragments (anchor) ON DELETE CASCADE,
+                        eid TEXT NOT NULL,
+                        data TEXT,
+                        meta TEXT
+                    );
+                    CREATE INDEX rec_keyframes_ea ON rec_keyframes (eid, anchor);
+
+                    CREATE INDEX rec_fragments_p ON rec_fragments (previous);
+                )");
+                if (!success)
+                    return false;
             } // [[fallthrough]];
 
-            static_assert(InstanceVersion == 118);
+            static_assert(InstanceVersion == 119);
         }
 
         if (!db->Run("INSERT INTO adm_migrations (version, build, time) VALUES (?, ?, ?)",
@@ -0,0 +1,157 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see https://www.gnu.org/licenses/.
+
+#include "src/core/base/base.hh"
+#include "record_history.hh"
+
+namespace RG {
+
+// Keyframes with NULL data mark deleted states. They are never used as a starting point to
+// rebuild records (historical reconstruction needs the last state that came before the
+// deletion), but they give the save path a place to count fragments from.
+const char *const RecordHistorySql =
+    R"(WITH RECURSIVE rec (idx, eid, anchor, mtime, data, meta, tags) AS (
+           SELECT 1, f.eid AS eid, f.anchor AS anchor, f.mtime AS mtime,
+                  IIF(k.anchor IS NOT NULL, k.data, f.data) AS data,
+                  IIF(k.anchor IS NOT NULL, k.meta, f.meta) AS meta,
+                  f.tags AS tags
+               FROM rec_fragments f
+               LEFT JOIN rec_keyframes k ON (k.anchor = f.anchor)
+               WHERE (f.tid = ?1 OR ?1 IS NULL) AND f.anchor <= ?3 AND
+                     f.anchor = IFNULL((SELECT MAX(anchor) FROM rec_keyframes
+                                               WHERE eid = f.eid AND anchor <= ?3 AND data IS NOT NULL),
+                                       IIF(f.previous IS NULL, f.anchor, NULL))
+           UNION ALL
+           SELECT rec.idx + 1, f.eid, f.anchor, f.mtime,
+               IIF(?6 = 1, json_patch(rec.data, f.data), NULL) AS data,
+               IIF(?7 = 1, json_patch(rec.meta, f.meta), NULL) AS meta,
+               f.tags
+               FROM rec_fragments f, rec
+               WHERE f.anchor <= ?3 AND f.previous = rec.anchor
+           ORDER BY anchor
+       ))";
+
+// Replay fragments from the previous keyframe (or from the first fragment) up to anchor.
+// Once data is NULL (deleted) it stays NULL, so starting from a deletion marker is fine here.
+static bool WriteKeyframe(sq_Database *db, const char *eid, int64_t anchor)
+{
+    return db->Run(R"(INSERT INTO rec_keyframes (anchor, eid, data, meta)
+                          WITH RECURSIVE rec (anchor, data, meta) AS (
+                              SELECT f.anchor, IIF(k.anchor IS NOT NULL, k.data, f.data),
+                                               IIF(k.anchor IS NOT NULL, k.meta, f.meta)
+                                  FROM rec_fragments f
+                                  LEFT JOIN rec_keyframes k ON (k.anchor = f.anchor)
+                                  WHERE f.anchor = IFNULL((SELECT MAX(anchor) FROM rec_keyframes
+                                                                 WHERE eid = ?1 AND anchor <= ?2),
+                                                          (SELECT anchor FROM rec_fragments
+                                                                 WHERE eid = ?1 AND previous IS NULL))
+                              UNION ALL
+                              SELECT f.anchor, json_patch(rec.data, f.data), json_patch(rec.meta, f.meta)
+                                  FROM rec_fragments f, rec
+                                  WHERE f.anchor <= ?2 AND f.previous = rec.anchor
+                          )
+                          SELECT anchor, ?1, data, meta FROM rec WHERE anchor = ?2
+                      ON CONFLICT DO NOTHING)", eid, anchor);
+}
+
+bool UpdateRecordKeyframe(sq_Database *db, const char *eid, int64_t anchor)
+{
+    int64_t fragments;
+    {
+        sq_Statement stmt;
+        if (!db->Prepare(R"(SELECT COUNT(*) FROM rec_fragments
+                            WHERE eid = ?1 AND anchor > IFNULL((SELECT MAX(anchor) FROM rec_keyframes WHERE eid = ?1), 0))",
+                         &stmt, eid))
+            return false;
+        if (!stmt.GetSingleValue(&fragments))
+            return false;
+    }
+
+    if (fragments < RecordKeyframeInterval)
+        return true;
+
+    return WriteKeyframe(db, eid, anchor);
+}
+
+bool BackfillRecordKeyframes(sq_Database *db, Size *out_written)
+{
+    // Keep transactions short, the instance stays online during the backfill
+    static const Size BatchSize = 256;
+
+    struct MissingKeyframe {
+        const char *eid;
+        int64_t anchor;
+    };
+
+    BlockAllocator temp_alloc;
+    HeapArray<MissingKeyframe> missing;
+
+    // List everything first, instead of inserting into rec_keyframes while stepping a query
+    // that reads it. Fragments of an entry form a chain, and anchors increase along the chain.
+    {
+        sq_Statement stmt;
+        if (!db->Prepare(R"(SELECT f.eid, f.anchor, IIF(k.anchor IS NOT NULL, 1, 0) AS keyframe
+                            FROM rec_fragments f
+                            LEFT JOIN rec_keyframes k ON (k.anchor = f.anchor)
+                            ORDER BY f.eid, f.anchor)", &stmt))
+            return false;
+
+        const char *eid = "";
+        int fragments = 0;
+
+        while (stmt.Step()) {
+            const char *new_eid = (const char *)sqlite3_column_text(stmt, 0);
+            int64_t anchor = sqlite3_column_int64(stmt, 1);
+            bool keyframe = sqlite3_column_int(stmt, 2);
+
+            if (!TestStr(new_eid, eid)) {
+                eid = DuplicateString(new_eid, &temp_alloc).ptr;
+                fragments = 0;
+            }
+
+            if (keyframe) {
+                fragments = 0;
+            } else if (++fragments >= RecordKeyframeInterval) {
+                missing.Append({ eid, anchor });
+                fragments = 0;
+            }
+        }
+        if (!stmt.IsValid())
+            return false;
+    }
+
+    // Keyframes of each entry are written in order, so each one can start from the previous one
+    Size written = 0;
+    for (Size i = 0; i < missing.len; i += BatchSize) {
+        Span<const MissingKeyframe> batch = missing.Take(i, std::min(BatchSize, missing.len - i));
+
+        bool success = db->Transaction([&]() {
+            for (const MissingKeyframe &keyframe: batch) {
+                if (!WriteKeyframe(db, keyframe.eid, keyframe.anchor))
+                    return false;
+                written += sqlite3_changes(*db);
+            }
+
+            return true;
+        });
+        if (!success)
+            return false;
+    }
+
+    if (out_written) {
+        *out_written = written;
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,33 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see https://www.gnu.org/licenses/.
+
+#pragma once
+
+#include "src/core/base/base.hh"
+#include "src/core/sqlite/sqlite.hh"
+
+namespace RG {
+
+// Full entry state (data and meta) is materialized every RecordKeyframeInterval fragments,
+// so that historical reconstruction never needs to replay more fragments than that.
+static const int RecordKeyframeInterval = 32;
+
+// Recursive CTE named rec (idx, eid, anchor, mtime, data, meta, tags), with the state of each
+// entry after each of its fragments up to anchor ?3. Entries of thread ?1 are used (or all
+// of them if NULL), set ?6 and ?7 to 1 to compute data and meta.
+extern const char *const RecordHistorySql;
+
+bool UpdateRecordKeyframe(sq_Database *db, const char *eid, int64_t anchor);
+bool BackfillRecordKeyframes(sq_Database *db, Size *out_written = nullptr);
+
+}
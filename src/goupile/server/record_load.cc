@@ -16,6 +16,7 @@
 #include "goupile.hh"
 #include "instance.hh"
 #include "record.hh"
+#include "record_history.hh"
 #include "user.hh"
 #include "src/core/wrap/json.hh"
 
@@ -79,7 +80,7 @@ private:
 
 bool RecordWalker::Prepare(InstanceHolder *instance, int64_t userid, const RecordFilter &filter)
 {
-    LocalArray<char, 2048> sql;
+    LocalArray<char, 4096> sql;
 
     if (filter.audit_anchor < 0) {
         sql.len += Fmt(sql.TakeAvailable(),
@@ -111,20 +112,7 @@ bool RecordWalker::Prepare(InstanceHolder *instance, int64_t userid, const Recor
         RG_ASSERT(!filter.use_claims);
 
         sql.len += Fmt(sql.TakeAvailable(),
-                       R"(WITH RECURSIVE rec (idx, eid, anchor, mtime, data, meta, tags) AS (
-                              SELECT 1, eid, anchor, mtime, data, meta, tags
-                                  FROM rec_fragments
-                                  WHERE (tid = ?1 OR ?1 IS NULL) AND
-                                        anchor <= ?3 AND previous IS NULL
-                              UNION ALL
-                              SELECT rec.idx + 1, f.eid, f.anchor, f.mtime,
-                                  IIF(?6 = 1, json_patch(rec.data, f.data), NULL) AS data,
-                                  IIF(?7 = 1, json_patch(rec.meta, f.meta), NULL) AS meta,
-                                  f.tags
-                                  FROM rec_fragments f, rec
-                                  WHERE f.anchor <= ?3 AND f.previous = rec.anchor
-                              ORDER BY anchor
-                          )
+                       R"(%1
                           SELECT t.rowid AS t, t.tid, t.locked,
                                  e.rowid AS e, e.eid, IIF(rec.data IS NULL, 1, 0) AS deleted,
                                  rec.anchor, e.ctime, rec.mtime, e.store, e.sequence,
@@ -132,7 +120,7 @@ bool RecordWalker::Prepare(InstanceHolder *instance, int64_t userid, const Recor
                               FROM rec
                               INNER JOIN rec_entries e ON (e.eid = rec.eid)
                               INNER JOIN rec_threads t ON (t.tid = e.tid)
-                              WHERE 1+1)").len;
+                              WHERE 1+1)", RecordHistorySql).len;
 
         if (!filter.allow_deleted) {
             sql.len += Fmt(sql.TakeAvailable(), " AND rec.data IS NOT NULL").len;
@@ -14,6 +14,7 @@
 #include "src/core/base/base.hh"
 #include "instance.hh"
 #include "record.hh"
+#include "record_history.hh"
 #include "user.hh"
 #include "src/core/wrap/json.hh"
 
@@ -304,7 +305,8 @@ void HandleRecordSave(InstanceHolder *instance, const http_RequestInfo &request,
             }
         }
 
-        bool success = instance->db->Transaction([&]() {
+        // Concurrent saves share the same commit (and fsync), see GroupTransaction()
+        bool success = instance->db->GroupTransaction([&]() {
             int64_t now = GetUnixTime();
 
             // Get existing entry and check for lock or mismatch
@@ -477,6 +479,10 @@ void HandleRecordSave(InstanceHolder *instance, const http_RequestInfo &request,
             if (!instance->db->Run("INSERT INTO rec_threads (tid) VALUES (?1) ON CONFLICT DO NOTHING", tid))
                 return false;
 
+            // Materialize entry state from time to time, for historical reconstruction
+            if (!UpdateRecordKeyframe(instance->db, fragment.eid, new_anchor))
+                return false;
+
             // Update entry and fragment tags
             if (!instance->db->Run("DELETE FROM rec_tags WHERE eid = ?1", fragment.eid))
                 return false;
@@ -0,0 +1,303 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see https://www.gnu.org/licenses/.
+
+
+#include "src/core/base/base.hh"
+#include "src/core/sqlite/sqlite.hh"
+#include "src/core/test/test.hh"
+#include "../server/record_history.hh"
+
+namespace RG {
+
+// Returns the path of the database file, which lives in a temporary directory
+static const char *CreateTestDatabase(sq_Database *db, Allocator *alloc)
+{
+    const char *temp_directory = CreateUniqueDirectory(GetTemporaryDirectory(), "test", alloc);
+    if (!temp_directory)
+        return nullptr;
+    RG_DEFER_N(err_guard) { UnlinkDirectory(temp_directory); };
+
+    const char *filename = Fmt(alloc, "%1%/test.db", temp_directory).ptr;
+
+    if (!db->Open(filename, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE))
+        return nullptr;
+    if (!db->SetWAL(true))
+        return nullptr;
+
+    err_guard.Disable();
+    return filename;
+}
+
+static void DeleteTestDatabase(sq_Database *db, const char *filename)
+{
+    db->Close();
+
+    char temp_directory[4096];
+    CopyString(GetPathDirectory(filename), temp_directory);
+
+    for (const char *suffix: { "", "-wal", "-shm" }) {
+        char path[4096];
+        Fmt(path, "%1%2", filename, suffix);
+
+        UnlinkFile(path);
+    }
+    UnlinkDirectory(temp_directory);
+}
+
+// Subset of the goupile instance schema (see MigrateInstance), with the columns used to
+// rebuild historical record data. Keyframe code and queries are the real ones.
+static bool CreateHistoryTables(sq_Database *db)
+{
+    return db->RunMany(R"(
+        CREATE TABLE rec_fragments (
+            anchor INTEGER PRIMARY KEY AUTOINCREMENT,
+            previous INTEGER REFERENCES rec_fragments (anchor),
+            tid TEXT NOT NULL,
+            eid TEXT NOT NULL,
+            mtime INTEGER NOT NULL,
+            data TEXT,
+            meta TEXT,
+            tags TEXT NOT NULL
+        );
+        CREATE INDEX rec_fragments_p ON rec_fragments (previous);
+        CREATE INDEX rec_fragments_ea ON rec_fragments (eid, anchor);
+
+        CREATE TABLE rec_keyframes (
+            anchor INTEGER PRIMARY KEY REFERENCES rec_fragments (anchor) ON DELETE CASCADE,
+            eid TEXT NOT NULL,
+            data TEXT,
+            meta TEXT
+        );
+        CREATE INDEX rec_keyframes_ea ON rec_keyframes (eid, anchor);
+    )");
+}
+
+// Same thing as the save path, data is NULL for deletions
+static int64_t AddHistoryFragment(sq_Database *db, int64_t previous, const char *eid,
+                                  const char *data, const char *meta)
+{
+    int64_t anchor;
+    {
+        sq_Statement stmt;
+        if (!db->Prepare(R"(INSERT INTO rec_fragments (previous, tid, eid, mtime, data, meta, tags)
+                            VALUES (?1, ?2, ?2, 0, ?3, ?4, '[]')
+                            RETURNING anchor)",
+                         &stmt, previous ? sq_Binding(previous) : sq_Binding(), eid, data, meta))
+            return -1;
+        if (!stmt.GetSingleValue(&anchor))
+            return -1;
+    }
+
+    if (!UpdateRecordKeyframe(db, eid, anchor))
+        return -1;
+
+    return anchor;
+}
+
+// Gives what RecordWalker returns for each entry at this anchor, with and without deleted states
+static bool RebuildHistory(sq_Database *db, int64_t anchor, HeapArray<char> *out_buf)
+{
+    char sql[4096];
+    Fmt(sql, "%1 SELECT eid, data, meta FROM rec ORDER BY eid, idx DESC", RecordHistorySql);
+
+    sq_Statement stmt;
+    if (!db->Prepare(sql, &stmt, sq_Binding(), sq_Binding(), anchor, sq_Binding(), sq_Binding(), 1, 1))
+        return false;
+
+    HeapArray<char> eid;
+    bool latest = false;
+    bool found = false;
+
+    while (stmt.Step()) {
+        const char *new_eid = (const char *)sqlite3_column_text(stmt, 0);
+        const char *data = (const char *)sqlite3_column_text(stmt, 1);
+        const char *meta = (const char *)sqlite3_column_text(stmt, 2);
+
+        if (!eid.len || !TestStr(new_eid, eid.ptr)) {
+            eid.RemoveFrom(0);
+            Fmt(&eid, "%1", new_eid);
+
+            latest = false;
+            found = false;
+        }
+
+        if (!latest) {
+            Fmt(out_buf, "%1 %2 %3\n", eid.ptr, data ? data : "deleted", meta ? meta : "deleted");
+            latest = true;
+        }
+        if (!found && data) {
+            Fmt(out_buf, "%1 (last) %2 %3\n", eid.ptr, data, meta);
+            found = true;
+        }
+    }
+
+    return stmt.IsValid();
+}
+
+TEST_FUNCTION("goupile/HistoryKeyframes")
+{
+    static const int Entries = 4;
+    static const int Fragments = 320;
+
+    BlockAllocator temp_alloc;
+
+    sq_Database db;
+    const char *filename = CreateTestDatabase(&db, &temp_alloc);
+    if (!filename)
+        return;
+    RG_DEFER { DeleteTestDatabase(&db, filename); };
+
+    TEST(CreateHistoryTables(&db));
+
+    // Random patches, with a few deletions (later fragments keep the entry deleted)
+    int64_t max_anchor = 0;
+    {
+        FastRandom rng(42);
+
+        int64_t previous[Entries] = {};
+
+        bool success = db.Transaction([&]() {
+            for (int i = 0; i < Fragments; i++) {
+                int j = rng.GetInt(0, Entries);
+
+                char eid[16];
+                char data[256];
+                char meta[64];
+                Fmt(eid, "e%1", j);
+                Fmt(data, "{\"v%1\": %2, \"v%3\": null}", rng.GetInt(0, 20), i, rng.GetInt(0, 20));
+                Fmt(meta, "{\"m%1\": %2}", rng.GetInt(0, 4), i);
+
+                bool remove = previous[j] && !rng.GetInt(0, 40);
+
+                previous[j] = AddHistoryFragment(&db, previous[j], eid, remove ? nullptr : data,
+                                                 remove ? nullptr : meta);
+                if (previous[j] < 0)
+                    return false;
+
+                max_anchor = previous[j];
+            }
+
+            return true;
+        });
+        TEST(success);
+    }
+
+    // Keyframes must keep up with every entry, including deleted ones
+    {
+        sq_Statement stmt;
+        TEST(db.Prepare(R"(SELECT MAX(fragments), SUM(deleted)
+                           FROM (SELECT COUNT(*) AS fragments,
+                                        (SELECT COUNT(*) FROM rec_keyframes k WHERE k.eid = f.eid AND k.data IS NULL) AS deleted
+                                     FROM rec_fragments f
+                                     WHERE f.anchor > IFNULL((SELECT MAX(anchor) FROM rec_keyframes k WHERE k.eid = f.eid), 0)
+                                     GROUP BY f.eid))", &stmt));
+        TEST(stmt.Step());
+
+        TEST_EX(sqlite3_column_int64(stmt, 0) < RecordKeyframeInterval, "Too many fragments since last keyframe (%1)",
+                sqlite3_column_int64(stmt, 0));
+        TEST(sqlite3_column_int64(stmt, 1) > 0);
+    }
+
+    const auto rebuild_all = [&](HeapArray<HeapArray<char>> *out_states) {
+        for (int64_t anchor = 1; anchor <= max_anchor; anchor++) {
+            HeapArray<char> *state = out_states->AppendDefault();
+            if (!RebuildHistory(&db, anchor, state))
+                return false;
+        }
+        return true;
+    };
+
+    HeapArray<HeapArray<char>> with_keyframes;
+    HeapArray<HeapArray<char>> full_replay;
+    HeapArray<HeapArray<char>> backfilled;
+
+    TEST(rebuild_all(&with_keyframes));
+    TEST(db.Run("DELETE FROM rec_keyframes"));
+    TEST(rebuild_all(&full_replay));
+    TEST(BackfillRecordKeyframes(&db));
+    TEST(rebuild_all(&backfilled));
+
+    TEST_EQ(with_keyframes.len, max_anchor);
+    TEST_EQ(full_replay.len, max_anchor);
+    TEST_EQ(backfilled.len, max_anchor);
+
+    Size mismatches = 0;
+    for (Size i = 0; i < full_replay.len && i < with_keyframes.len && i < backfilled.len; i++) {
+        Span<const char> expect = full_replay[i];
+
+        mismatches += (with_keyframes[i].As<const char>() != expect);
+        mismatches += (backfilled[i].As<const char>() != expect);
+    }
+    TEST_EQ(mismatches, 0);
+}
+
+BENCHMARK_FUNCTION("goupile/HistoryKeyframes")
+{
+    static const int Entries = 20;
+    static const int Fragments = 400;
+
+    BlockAllocator temp_alloc;
+
+    sq_Database db;
+    const char *filename = CreateTestDatabase(&db, &temp_alloc);
+    if (!filename)
+        return;
+    RG_DEFER { DeleteTestDatabase(&db, filename); };
+
+    if (!CreateHistoryTables(&db))
+        return;
+
+    // Synthetic long histories, each fragment changes a few of 100 variables
+    int64_t max_anchor = 0;
+    bool success = db.Transaction([&]() {
+        int64_t previous[Entries] = {};
+
+        for (int i = 0; i < Fragments; i++) {
+            for (int j = 0; j < Entries; j++) {
+                char eid[16];
+                char data[256];
+                Fmt(eid, "e%1", j);
+                Fmt(data, "{\"v%1\": %2, \"v%3\": \"%4\", \"v%5\": null}",
+                    GetRandomInt(0, 100), GetRandomInt(0, 1000), GetRandomInt(0, 100),
+                    FmtHex(GetRandomInt64(0, INT64_MAX)), GetRandomInt(0, 100));
+
+                previous[j] = AddHistoryFragment(&db, previous[j], eid, data, "{}");
+                if (previous[j] < 0)
+                    return false;
+
+                max_anchor = previous[j];
+            }
+        }
+
+        return true;
+    });
+    if (!success)
+        return;
+
+    HeapArray<char> buf;
+
+    RunBenchmark("Reconstruct 20 x 400 (keyframes)", 4, [&]() {
+        buf.RemoveFrom(0);
+        RebuildHistory(&db, max_anchor, &buf);
+    });
+
+    if (!db.Run("DELETE FROM rec_keyframes"))
+        return;
+
+    RunBenchmark("Reconstruct 20 x 400 (full replay)", 4, [&]() {
+        buf.RemoveFrom(0);
+        RebuildHistory(&db, max_anchor, &buf);
+    });
+}
+
+}
@@ -114,13 +114,26 @@ bool LocalDisk::Init(const char *full_pwd, const char *write_pwd)
         if (!make_directory("tmp"))
             return false;
 
-        for (int i = 0; i < 4096; i++) {
-            char name[128];
-            Fmt(name, "blobs/%1", FmtHex(i).Pad0(-3));
+        // Queue blob directories in one batch, this is a lot of mkdir calls otherwise
+        IoBatch batch;
+        bool success = true;
 
-            if (!make_directory(name))
-                return false;
+        for (int i = 0; i < 4096; i++) {
+            const char *path = Fmt(&temp_alloc, "%1%/blobs/%2", url, FmtHex(i).Pad0(-3)).ptr;
+
+            batch.MakeDirectory(path, true, [&, path](bool ok) {
+                if (ok) {
+                    directories.Append(path);
+                } else {
+                    success = false;
+                }
+            });
         }
+
+        if (!batch.Sync())
+            return false;
+        if (!success)
+            return false;
     }
 
     if (!InitDefault(full_pwd, write_pwd))
@@ -133,7 +146,7 @@ bool LocalDisk::Init(const char *full_pwd, const char *write_pwd)
 Size LocalDisk::ReadRaw(const char *path, Span<uint8_t> out_buf)
 {
     LocalArray<char, MaxPathSize + 128> filename;
-    filename.len = Fmt(filename.data, "%1%/%2", url, path).len;
+    filename.len = Fmt<"%1%/%2">(filename.data, url, path).len;
 
     return ReadFile(filename.data, out_buf);
 }
@@ -141,7 +154,7 @@ Size LocalDisk::ReadRaw(const char *path, Span<uint8_t> out_buf)
 Size LocalDisk::ReadRaw(const char *path, HeapArray<uint8_t> *out_buf)
 {
     LocalArray<char, MaxPathSize + 128> filename;
-    filename.len = Fmt(filename.data, "%1%/%2", url, path).len;
+    filename.len = Fmt<"%1%/%2">(filename.data, url, path).len;
 
     return ReadFile(filename.data, Mebibytes(256), out_buf);
 }
@@ -149,7 +162,7 @@ Size LocalDisk::ReadRaw(const char *path, HeapArray<uint8_t> *out_buf)
 Size LocalDisk::WriteRaw(const char *path, FunctionRef<bool(FunctionRef<bool(Span<const uint8_t>)>)> func)
 {
     LocalArray<char, MaxPathSize + 128> filename;
-    filename.len = Fmt(filename.data, "%1%/%2", url, path).len;
+    filename.len = Fmt<"%1%/%2">(filename.data, url, path).len;
 
     // Create temporary file
     int fd = -1;
@@ -205,7 +218,7 @@ Size LocalDisk::WriteRaw(const char *path, FunctionRef<bool(FunctionRef<bool(Spa
 bool LocalDisk::DeleteRaw(const char *path)
 {
     LocalArray<char, MaxPathSize + 128> filename;
-    filename.len = Fmt(filename.data, "%1%/%2", url, path).len;
+    filename.len = Fmt<"%1%/%2">(filename.data, url, path).len;
 
     return UnlinkFile(filename.data);
 }
@@ -259,7 +272,7 @@ bool LocalDisk::ListRaw(const char *path, FunctionRef<bool(const char *path)> fu
 StatResult LocalDisk::TestRaw(const char *path)
 {
     LocalArray<char, MaxPathSize + 128> filename;
-    filename.len = Fmt(filename.data, "%1%/%2", url, path).len;
+    filename.len = Fmt<"%1%/%2">(filename.data, url, path).len;
 
     FileInfo file_info;
     StatResult ret = StatFile(filename.data, (int)StatFlag::IgnoreMissing, &file_info);
@@ -275,7 +288,7 @@ StatResult LocalDisk::TestRaw(const char *path)
 bool LocalDisk::CreateDirectory(const char *path)
 {
     LocalArray<char, MaxPathSize + 128> filename;
-    filename.len = Fmt(filename.data, "%1%/%2", url, path).len;
+    filename.len = Fmt<"%1%/%2">(filename.data, url, path).len;
 
     return MakeDirectory(filename.data, false);
 }
@@ -283,7 +296,7 @@ bool LocalDisk::CreateDirectory(const char *path)
 bool LocalDisk::DeleteDirectory(const char *path)
 {
     LocalArray<char, MaxPathSize + 128> filename;
-    filename.len = Fmt(filename.data, "%1%/%2", url, path).len;
+    filename.len = Fmt<"%1%/%2">(filename.data, url, path).len;
 
     return UnlinkDirectory(filename.data);
 }
@@ -0,0 +1,155 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see https://www.gnu.org/licenses/.
+
+#pragma once
+
+#include "src/core/base/base.hh"
+
+namespace RG {
+
+// Entries must inherit from RetainObject<T>, and provide key (used as hash key),
+// data (both owned by the entry), and prev/next pointers (least recently used at the end).
+template <typename T>
+class LruCache {
+    RG_DELETE_COPY(LruCache)
+
+    std::mutex mutex;
+
+    HashTable<const char *, T *> map;
+    T *first = nullptr;
+    T *last = nullptr;
+    Size total_size = 0;
+
+public:
+    LruCache() = default;
+    ~LruCache() { Clear(); }
+
+    // Returned entries must be given back with ReleaseEntry()
+    T *Find(const char *key)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        T *entry = map.FindValue(key, nullptr);
+
+        if (entry) {
+            Unlink(entry);
+            Link(entry);
+
+            entry->Ref();
+        }
+
+        return entry;
+    }
+
+    // The new entry gets one reference for the caller, which must give it back with ReleaseEntry()
+    void Insert(T *entry, Size max_size)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        entry->prev = nullptr;
+        entry->next = nullptr;
+
+        // One reference for the caller
+        entry->Ref();
+
+        // Don't let a single big entry flush everything else
+        Size entry_size = ComputeEntrySize(entry);
+        if (entry_size > max_size / 4)
+            return;
+
+        // Concurrent requests may have computed the same thing
+        if (T *prev_entry = map.FindValue(entry->key, nullptr); prev_entry) {
+            map.Remove(prev_entry->key);
+            Unlink(prev_entry);
+            ReleaseEntry(prev_entry);
+        }
+
+        while (last && total_size + entry_size > max_size) {
+            T *evict = last;
+
+            map.Remove(evict->key);
+            Unlink(evict);
+            ReleaseEntry(evict);
+        }
+
+        // And one for the cache
+        entry->Ref();
+        map.Set(entry);
+        Link(entry);
+    }
+
+    void Clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        while (first) {
+            T *entry = first;
+
+            Unlink(entry);
+            ReleaseEntry(entry);
+        }
+        map.Clear();
+
+        RG_ASSERT(!total_size);
+    }
+
+    static void ReleaseEntry(T *entry)
+    {
+        if (!entry->Unref()) {
+            ReleaseRaw(nullptr, entry->key, -1);
+            ReleaseSpan(nullptr, entry->data);
+
+            delete entry;
+        }
+    }
+
+private:
+    void Link(T *entry)
+    {
+        entry->prev = nullptr;
+        entry->next = first;
+
+        if (first) {
+            first->prev = entry;
+        } else {
+            last = entry;
+        }
+        first = entry;
+
+        total_size += ComputeEntrySize(entry);
+    }
+
+    void Unlink(T *entry)
+    {
+        if (entry->prev) {
+            entry->prev->next = entry->next;
+        } else {
+            first = entry->next;
+        }
+        if (entry->next) {
+            entry->next->prev = entry->prev;
+        } else {
+            last = entry->prev;
+        }
+
+        entry->prev = nullptr;
+        entry->next = nullptr;
+
+        total_size -= ComputeEntrySize(entry);
+    }
+
+    static Size ComputeEntrySize(const T *entry)
+        { return RG_SIZE(*entry) + (Size)strlen(entry->key) + entry->data.len; }
+};
+
+}
@@ -29,6 +29,10 @@ bool Config::Validate() const
         LogError("HTTP MaxAge must be >= 0");
         valid = false;
     }
+    if (mco_aggregate_cache < 0) {
+        LogError("MCO AggregateCache must be >= 0");
+        valid = false;
+    }
 
     return valid;
 }
@@ -92,6 +96,8 @@ bool LoadConfig(StreamReader *st, Config *out_config)
                         const char *filename = NormalizePath(prop.value, root_directory,
                                                              &config.str_alloc).ptr;
                         config.mco_stay_filenames.Append(filename);
+                    } else if (prop.key == "AggregateCache") {
+                        valid &= ParseSize(prop.value, &config.mco_aggregate_cache);
                     } else {
                         LogError("Unknown attribute '%1'", prop.key);
                         valid = false;
@@ -29,6 +29,7 @@ struct Config {
     mco_DispenseMode mco_dispense_mode = mco_DispenseMode::J;
     HeapArray<const char *> mco_stay_directories;
     HeapArray<const char *> mco_stay_filenames;
+    Size mco_aggregate_cache = Mebibytes(256);
 
     http_Config http { 8888 };
     const char *base_url = "/";
@@ -13,10 +13,12 @@
 
 #include "src/core/base/base.hh"
 #include "mco.hh"
+#include "mco_casemix.hh"
 #include "config.hh"
 #include "structure.hh"
 #include "thop.hh"
 #include "user.hh"
+#include "vendor/libsodium/src/libsodium/include/sodium.h"
 
 namespace RG {
 
@@ -24,15 +26,161 @@ mco_TableSet mco_table_set;
 McoCacheSet mco_cache_set;
 
 mco_AuthorizationSet mco_authorization_set;
-mco_StaySet mco_stay_set;
-LocalDate mco_stay_set_dates[2];
 
-HeapArray<mco_Result> mco_results;
-HeapArray<mco_Result> mco_mono_results;
-HashMap<mco_GhmRootCode, Span<const mco_Result *>> mco_results_by_ghm_root;
-HashMap<const void *, const mco_Result *> mco_results_to_mono;
+static std::mutex dataset_mutex;
+static RetainPtr<const McoDataset> current_dataset;
+static int64_t last_generation = 0;
 
-static HeapArray<const mco_Result *> results_by_ghm_root_ptrs;
+// Signature of stay files seen during last check, waiting to settle before reload
+static uint8_t pending_signature[16];
+
+bool McoResultBitmap::Test(Size idx) const
+{
+    Size base = idx & ~(Size)0xFFFF;
+
+    const Chunk *chunk = std::lower_bound(chunks.begin(), chunks.end(), base,
+                                          [](const Chunk &chunk, Size base) { return chunk.base < base; });
+    if (chunk == chunks.end() || chunk->base != base)
+        return false;
+
+    uint16_t offset = (uint16_t)(idx - base);
+
+    if (chunk->words) {
+        return chunk->words[offset / 64] & (1ull << (offset % 64));
+    } else {
+        return std::binary_search(chunk->values.begin(), chunk->values.end(), offset);
+    }
+}
+
+// Beyond this, a bitset (8 kiB) is smaller than the sorted array
+static const Size MaxSparseValues = 4096;
+
+void McoResultBitmapBuilder::Add(Size idx)
+{
+    Size base = idx & ~(Size)0xFFFF;
+
+    if (base != chunk_base) {
+        RG_ASSERT(base > chunk_base);
+
+        FlushChunk();
+        chunk_base = base;
+    }
+
+    uint16_t offset = (uint16_t)(idx - base);
+
+    if (!values.len || values[values.len - 1] != offset) {
+        RG_ASSERT(!values.len || values[values.len - 1] < offset);
+        values.Append(offset);
+    }
+}
+
+void McoResultBitmapBuilder::Finish(McoResultBitmap *out_bitmap)
+{
+    FlushChunk();
+    std::swap(bitmap, *out_bitmap);
+}
+
+void McoResultBitmapBuilder::Union(Span<const McoResultBitmap *const> bitmaps, Allocator *alloc,
+                                   McoResultBitmap *out_bitmap)
+{
+    McoResultBitmapBuilder builder(alloc);
+
+    HeapArray<Size> bases;
+    for (const McoResultBitmap *bitmap: bitmaps) {
+        for (const McoResultBitmap::Chunk &chunk: bitmap->chunks) {
+            bases.Append(chunk.base);
+        }
+    }
+    std::sort(bases.begin(), bases.end());
+    bases.RemoveFrom(std::unique(bases.begin(), bases.end()) - bases.begin());
+
+    HeapArray<Size> cursors;
+    cursors.AppendDefault(bitmaps.len);
+
+    for (Size base: bases) {
+        uint64_t words[1024] = {};
+
+        for (Size i = 0; i < bitmaps.len; i++) {
+            const McoResultBitmap *bitmap = bitmaps[i];
+
+            if (cursors[i] < bitmap->chunks.len && bitmap->chunks[cursors[i]].base == base) {
+                const McoResultBitmap::Chunk &chunk = bitmap->chunks[cursors[i]++];
+
+                if (chunk.words) {
+                    for (Size j = 0; j < RG_LEN(words); j++) {
+                        words[j] |= chunk.words[j];
+                    }
+                } else {
+                    for (uint16_t value: chunk.values) {
+                        words[value / 64] |= 1ull << (value % 64);
+                    }
+                }
+            }
+        }
+
+        Size count = 0;
+        for (uint64_t word: words) {
+            count += PopCount(word);
+        }
+
+        if (count > MaxSparseValues) {
+            McoResultBitmap::Chunk chunk = {};
+
+            uint64_t *copy = (uint64_t *)AllocateRaw(alloc, RG_SIZE(words));
+            MemCpy(copy, words, RG_SIZE(words));
+
+            chunk.base = base;
+            chunk.count = count;
+            chunk.words = copy;
+
+            builder.bitmap.chunks.Append(chunk);
+            builder.bitmap.count += count;
+        } else {
+            for (Size i = 0; i < RG_LEN(words); i++) {
+                uint64_t word = words[i];
+
+                while (word) {
+                    builder.Add(base + i * 64 + CountTrailingZeros(word));
+                    word &= word - 1;
+                }
+            }
+            builder.FlushChunk();
+        }
+    }
+
+    builder.Finish(out_bitmap);
+}
+
+void McoResultBitmapBuilder::FlushChunk()
+{
+    if (!values.len)
+        return;
+
+    McoResultBitmap::Chunk chunk = {};
+
+    chunk.base = chunk_base;
+    chunk.count = values.len;
+
+    if (values.len > MaxSparseValues) {
+        uint64_t *words = (uint64_t *)AllocateRaw(alloc, 1024 * RG_SIZE(uint64_t), (int)AllocFlag::Zero);
+
+        for (uint16_t value: values) {
+            words[value / 64] |= 1ull << (value % 64);
+        }
+
+        chunk.words = words;
+    } else {
+        Span<uint16_t> copy = AllocateSpan<uint16_t>(alloc, values.len);
+        MemCpy(copy.ptr, values.ptr, values.len * RG_SIZE(*values.ptr));
+
+        chunk.values = copy;
+    }
+
+    bitmap.chunks.Append(chunk);
+    bitmap.count += chunk.count;
+
+    values.RemoveFrom(0);
+}
 
 bool InitMcoTables(Span<const char *const> table_directories)
 {
@@ -98,58 +246,85 @@ bool InitMcoProfile(const char *profile_directory, const char *authorization_fil
     return true;
 }
 
-bool InitMcoStays(Span<const char *const> stay_directories, Span<const char *const> stay_filenames)
+static bool ListStayFiles(Span<const char *const> stay_directories, Span<const char *const> stay_filenames,
+                          Allocator *alloc, HeapArray<const char *> *out_filenames)
 {
-    BlockAllocator temp_alloc;
+    const auto enumerate_directory_files = [&](const char *dir) {
+        EnumResult ret = EnumerateDirectory(dir, nullptr, 1024,
+                                            [&](const char *basename, FileType file_type) {
+            const char *filename = Fmt(alloc, "%1%/%2", dir, basename).ptr;
+
+            CompressionType compression_type;
+            Span<const char> ext = GetPathExtension(basename, &compression_type);
+
+            if (file_type == FileType::Link) {
+                FileInfo file_info;
+                if (StatFile(filename, (int)StatFlag::FollowSymlink, &file_info) != StatResult::Success)
+                    return true;
+                file_type = file_info.type;
+            }
 
-    LogInfo("Load MCO stays");
+            if (file_type == FileType::File &&
+                    (ext == ".grp" || ext == ".rss" || ext == ".dmpak" || ext == ".txt")) {
+                out_filenames->Append(filename);
+            }
 
-    // Aggregate stay files
-    HeapArray<const char *> filenames;
-    {
-        const auto enumerate_directory_files = [&](const char *dir) {
-            EnumResult ret = EnumerateDirectory(dir, nullptr, 1024,
-                                                [&](const char *basename, FileType file_type) {
-                const char *filename = Fmt(&temp_alloc, "%1%/%2", dir, basename).ptr;
-
-                CompressionType compression_type;
-                Span<const char> ext = GetPathExtension(basename, &compression_type);
-
-                if (file_type == FileType::Link) {
-                    FileInfo file_info;
-                    if (StatFile(filename, (int)StatFlag::FollowSymlink, &file_info) != StatResult::Success)
-                        return true;
-                    file_type = file_info.type;
-                }
+            return true;
+        });
 
-                if (file_type == FileType::File &&
-                        (ext == ".grp" || ext == ".rss" || ext == ".dmpak" || ext == ".txt")) {
-                    filenames.Append(filename);
-                }
+        bool success = (ret == EnumResult::Success || ret == EnumResult::PartialEnum);
+        return success;
+    };
 
-                return true;
-            });
+    bool success = true;
+    for (const char *dir: stay_directories) {
+        success &= enumerate_directory_files(dir);
+    }
+    out_filenames->Append(stay_filenames);
 
-            bool success = (ret == EnumResult::Success || ret == EnumResult::PartialEnum);
-            return success;
-        };
+    return success;
+}
 
-        bool success = true;
-        for (const char *dir: stay_directories) {
-            success &= enumerate_directory_files(dir);
-        }
-        filenames.Append(stay_filenames);
-        if (!success)
+// Changes whenever a stay file is added, removed or modified
+static bool ComputeStaySignature(Span<const char *const> filenames, uint8_t out_signature[16])
+{
+    HeapArray<const char *> sorted;
+    sorted.Append(filenames);
+    std::sort(sorted.begin(), sorted.end(),
+              [](const char *filename1, const char *filename2) { return CmpStr(filename1, filename2) < 0; });
+
+    crypto_generichash_state state;
+    crypto_generichash_init(&state, nullptr, 0, 16);
+
+    for (const char *filename: sorted) {
+        FileInfo file_info;
+        if (StatFile(filename, (int)StatFlag::FollowSymlink, &file_info) != StatResult::Success)
             return false;
+
+        crypto_generichash_update(&state, (const uint8_t *)filename, strlen(filename) + 1);
+        crypto_generichash_update(&state, (const uint8_t *)&file_info.size, RG_SIZE(file_info.size));
+        crypto_generichash_update(&state, (const uint8_t *)&file_info.mtime, RG_SIZE(file_info.mtime));
     }
 
+    crypto_generichash_final(&state, out_signature, 16);
+
+    return true;
+}
+
+static bool LoadStays(Span<const char *const> filenames, const uint8_t signature[16])
+{
+    RetainPtr<McoDataset> dataset(new McoDataset, [](McoDataset *dataset) { delete dataset; });
+    MemCpy(dataset->signature, signature, RG_SIZE(dataset->signature));
+
+    LogInfo("Load MCO stays");
+
     // Load stays
     mco_StaySetBuilder stay_set_builder;
     if (!stay_set_builder.LoadFiles(filenames))
         return false;
-    if (!stay_set_builder.Finish(&mco_stay_set))
+    if (!stay_set_builder.Finish(&dataset->stay_set))
         return false;
-    if (!mco_stay_set.stays.len) {
+    if (!dataset->stay_set.stays.len) {
         LogError("Cannot continue without any loaded stay");
         return false;
     }
@@ -166,7 +341,7 @@ bool InitMcoStays(Span<const char *const> stay_directories, Span<const char *con
         }
 
         bool valid = true;
-        for (const mco_Stay &stay: mco_stay_set.stays) {
+        for (const mco_Stay &stay: dataset->stay_set.stays) {
             if (stay.unit.number && !known_units.Find(stay.unit)) {
                 LogError("Structure set is missing unit %1", stay.unit);
                 known_units.Set(stay.unit);
@@ -182,7 +357,7 @@ bool InitMcoStays(Span<const char *const> stay_directories, Span<const char *con
     {
         HeapArray<Span<const mco_Stay>> groups;
         {
-            Span<const mco_Stay> remain = mco_stay_set.stays;
+            Span<const mco_Stay> remain = dataset->stay_set.stays;
             while (remain.len) {
                 Span<const mco_Stay> group = mco_Split(remain, 1, &remain);
                 groups.Append(group);
@@ -197,7 +372,7 @@ bool InitMcoStays(Span<const char *const> stay_directories, Span<const char *con
             LocalDate exit_date = group[group.len - 1].exit.date;
 
             if (exit_date.IsValid()) [[likely]] {
-                mco_stay_set_dates[0] = exit_date;
+                dataset->stay_set_dates[0] = exit_date;
                 break;
             }
         }
@@ -206,79 +381,266 @@ bool InitMcoStays(Span<const char *const> stay_directories, Span<const char *con
             LocalDate exit_date = group[group.len - 1].exit.date;
 
             if (exit_date.IsValid()) [[likely]] {
-                mco_stay_set_dates[1] = exit_date + 1;
+                dataset->stay_set_dates[1] = exit_date + 1;
                 break;
             }
         }
-        if (!mco_stay_set_dates[1].value) {
+        if (!dataset->stay_set_dates[1].value) {
             LogError("Could not determine date range for stay set");
             return false;
         }
 
-        HeapArray<mco_Stay> stays(mco_stay_set.stays.len);
+        HeapArray<mco_Stay> stays(dataset->stay_set.stays.len);
         for (Span<const mco_Stay> group: groups) {
             stays.Append(group);
         }
 
-        std::swap(stays, mco_stay_set.stays);
+        std::swap(stays, dataset->stay_set.stays);
     }
 
     LogInfo("Classify MCO stays");
 
     // Classify
-    mco_Classify(mco_table_set, mco_authorization_set, thop_config.sector, mco_stay_set.stays, 0,
-                 &mco_results, &mco_mono_results);
-    mco_results.Trim();
-    mco_mono_results.Trim();
+    mco_Classify(mco_table_set, mco_authorization_set, thop_config.sector, dataset->stay_set.stays, 0,
+                 &dataset->results, &dataset->mono_results);
+    dataset->results.Trim();
+    dataset->mono_results.Trim();
 
     LogInfo("Index MCO results");
 
     // Index results
-    for (Size i = 0, j = 0; i < mco_results.len;) {
-        const mco_Result &result = mco_results[i];
+    for (Size i = 0, j = 0; i < dataset->results.len;) {
+        const mco_Result &result = dataset->results[i];
 
-        results_by_ghm_root_ptrs.Append(&result);
-        mco_results_to_mono.TrySet(&result, &mco_mono_results[j]);
+        dataset->results_by_ghm_root_ptrs.Append(&result);
+        dataset->results_to_mono.TrySet(&result, &dataset->mono_results[j]);
 
         i++;
         j += result.stays.len;
     }
-    mco_results_to_mono.TrySet(mco_results.end(), mco_mono_results.end());
+    dataset->results_to_mono.TrySet(dataset->results.end(), dataset->mono_results.end());
 
     // Finalize index by GHM
-    std::stable_sort(results_by_ghm_root_ptrs.begin(), results_by_ghm_root_ptrs.end(),
+    std::stable_sort(dataset->results_by_ghm_root_ptrs.begin(), dataset->results_by_ghm_root_ptrs.end(),
                      [](const mco_Result *result1, const mco_Result *result2) {
         return result1->ghm.Root() < result2->ghm.Root();
     });
-    for (Size i = 0; i < results_by_ghm_root_ptrs.len;) {
-        Span<const mco_Result *> ptrs = MakeSpan(&results_by_ghm_root_ptrs[i], 1);
+    for (Size i = 0; i < dataset->results_by_ghm_root_ptrs.len;) {
+        Span<const mco_Result *> ptrs = MakeSpan(&dataset->results_by_ghm_root_ptrs[i], 1);
         const mco_GhmRootCode ghm_root = ptrs[0]->ghm.Root();
 
-        while (++i < results_by_ghm_root_ptrs.len &&
-               results_by_ghm_root_ptrs[i]->ghm.Root() == ghm_root) {
+        while (++i < dataset->results_by_ghm_root_ptrs.len &&
+               dataset->results_by_ghm_root_ptrs[i]->ghm.Root() == ghm_root) {
             ptrs.len++;
         }
 
-        mco_results_by_ghm_root.Set(ghm_root, ptrs);
+        dataset->results_by_ghm_root.Set(ghm_root, ptrs);
+    }
+
+    LogInfo("Build MCO result columns");
+
+    // Precompute columns, with prices for each coefficient setting
+    {
+        const Size split_size = 65536;
+
+        McoResultColumns *columns = &dataset->columns;
+
+        columns->exit_dates.Reserve(dataset->results.len);
+        columns->ghms.Reserve(dataset->results.len);
+        columns->ghs.Reserve(dataset->results.len);
+        columns->durations.Reserve(dataset->results.len);
+        columns->deaths.Reserve(dataset->results.len);
+        columns->exb.Reserve(dataset->results.len);
+        columns->price_cents[0].Reserve(dataset->results.len);
+        columns->price_cents[1].Reserve(dataset->results.len);
+        columns->mono_offsets.Reserve(dataset->results.len + 1);
+        columns->mono_units.Reserve(dataset->mono_results.len);
+        columns->mono_durations.Reserve(dataset->mono_results.len);
+        columns->mono_ghs_cents.Reserve(dataset->mono_results.len);
+        columns->mono_price_cents.Reserve(dataset->mono_results.len);
+
+        // Reuse for performance
+        HeapArray<mco_Pricing> pricings;
+        HeapArray<mco_Pricing> coefficient_pricings;
+        HeapArray<mco_Pricing> mono_pricings;
+
+        for (Size i = 0, j = 0; i < dataset->results.len; i += split_size) {
+            Size split_len = std::min(split_size, dataset->results.len - i);
+            Span<const mco_Result> split_results = dataset->results.Take(i, split_len);
+            Span<const mco_Result> split_mono_results =
+                MakeSpan(dataset->results_to_mono.FindValue(split_results.begin(), nullptr),
+                         dataset->results_to_mono.FindValue(split_results.end(), nullptr));
+
+            pricings.RemoveFrom(0);
+            coefficient_pricings.RemoveFrom(0);
+            mono_pricings.RemoveFrom(0);
+            mco_Price(split_results, false, &pricings);
+            mco_Price(split_results, true, &coefficient_pricings);
+            mco_Price(split_mono_results, false, &mono_pricings);
+
+            for (Size k = 0; k < split_results.len; k++) {
+                const mco_Result &result = split_results[k];
+                const mco_Stay &last_stay = result.stays[result.stays.len - 1];
+
+                columns->exit_dates.Append(last_stay.exit.date);
+                columns->ghms.Append(result.ghm);
+                columns->ghs.Append(result.ghs);
+                columns->durations.Append(result.duration);
+                columns->deaths.Append(last_stay.exit.mode == '9');
+                columns->exb.Append(pricings[k].exb_exh < 0);
+                columns->price_cents[0].Append(pricings[k].price_cents);
+                columns->price_cents[1].Append(coefficient_pricings[k].price_cents);
+                columns->mono_offsets.Append(j);
+
+                j += result.stays.len;
+            }
+
+            for (Size k = 0; k < split_mono_results.len; k++) {
+                const mco_Result &mono_result = split_mono_results[k];
+                const mco_Pricing &mono_pricing = mono_pricings[k];
+
+                columns->mono_units.Append(mono_result.stays[0].unit);
+                columns->mono_durations.Append(mono_pricing.duration);
+                columns->mono_ghs_cents.Append(mono_pricing.ghs_cents);
+                columns->mono_price_cents.Append(mono_pricing.price_cents);
+            }
+        }
+        columns->mono_offsets.Append(dataset->mono_results.len);
+    }
+
+    LogInfo("Build MCO unit bitmaps");
+
+    // Index results by unit
+    {
+        struct UnitResult {
+            drd_UnitCode unit;
+            Size idx;
+        };
+
+        HeapArray<UnitResult> pairs(dataset->mono_results.len);
+        for (Size i = 0; i < dataset->results.len; i++) {
+            const mco_Result &result = dataset->results[i];
+
+            for (const mco_Stay &stay: result.stays) {
+                pairs.Append({ stay.unit, i });
+            }
+        }
+        std::sort(pairs.begin(), pairs.end(), [](const UnitResult &pair1, const UnitResult &pair2) {
+            return MultiCmp(pair1.unit.number - pair2.unit.number, pair1.idx - pair2.idx) < 0;
+        });
+
+        for (Size i = 0; i < pairs.len;) {
+            drd_UnitCode unit = pairs[i].unit;
+
+            McoResultBitmapBuilder builder(&dataset->bitmaps_alloc);
+            for (; i < pairs.len && pairs[i].unit == unit; i++) {
+                builder.Add(pairs[i].idx);
+            }
+
+            McoResultBitmap *bitmap = dataset->bitmaps.AppendDefault();
+            builder.Finish(bitmap);
+
+            dataset->bitmaps_by_unit.Set(unit, bitmap);
+        }
     }
 
+    // Combine unit bitmaps for each set of allowed units
+    for (const User &user: thop_user_set.users) {
+        if (dataset->bitmaps_by_user_units.Find(user.mco_units_hash))
+            continue;
+
+        HeapArray<const McoResultBitmap *> unit_bitmaps;
+        for (drd_UnitCode unit: user.mco_allowed_units.table) {
+            const McoResultBitmap *bitmap = dataset->bitmaps_by_unit.FindValue(unit, nullptr);
+
+            if (bitmap) {
+                unit_bitmaps.Append(bitmap);
+            }
+        }
+
+        McoResultBitmap *bitmap = dataset->bitmaps.AppendDefault();
+        McoResultBitmapBuilder::Union(unit_bitmaps, &dataset->bitmaps_alloc, bitmap);
+
+        // Scanning everything is faster when the user can see most results
+        bool restricted = (bitmap->count < dataset->results.len / 2);
+        dataset->bitmaps_by_user_units.Set(user.mco_units_hash, restricted ? bitmap : nullptr);
+    }
+
+    // Publish new generation, requests in progress keep using the previous one
+    RetainPtr<const McoDataset> prev_dataset;
+    {
+        std::lock_guard<std::mutex> lock(dataset_mutex);
+
+        dataset->generation = ++last_generation;
+
+        prev_dataset = current_dataset;
+        current_dataset = dataset;
+    }
+
+    // Cached aggregates are now obsolete
+    InvalidateMcoAggregateCache();
+
     return true;
 }
 
-static Span<const mco_Result> GetResultsRange(LocalDate min_date, LocalDate max_date)
+bool InitMcoStays(Span<const char *const> stay_directories, Span<const char *const> stay_filenames)
 {
-    const mco_Result *start =
-        std::lower_bound(mco_results.begin(), mco_results.end(), min_date,
-                         [](const mco_Result &result, LocalDate date) {
-        return result.stays[result.stays.len - 1].exit.date < date;
-    });
-    const mco_Result *end =
-        std::upper_bound(start, (const mco_Result *)mco_results.end(), max_date - 1,
-                         [](LocalDate date, const mco_Result &result) {
-        return date < result.stays[result.stays.len - 1].exit.date;
-    });
+    BlockAllocator temp_alloc;
 
-    return MakeSpan(start, end);
+    HeapArray<const char *> filenames;
+    uint8_t signature[16];
+    if (!ListStayFiles(stay_directories, stay_filenames, &temp_alloc, &filenames))
+        return false;
+    if (!ComputeStaySignature(filenames, signature))
+        return false;
+
+    return LoadStays(filenames, signature);
+}
+
+bool ReloadMcoStays(Span<const char *const> stay_directories, Span<const char *const> stay_filenames, bool force)
+{
+    BlockAllocator temp_alloc;
+
+    HeapArray<const char *> filenames;
+    uint8_t signature[16];
+    if (!ListStayFiles(stay_directories, stay_filenames, &temp_alloc, &filenames))
+        return false;
+    if (!ComputeStaySignature(filenames, signature))
+        return false;
+
+    if (!force) {
+        RetainPtr<const McoDataset> dataset = GetMcoDataset();
+
+        if (!memcmp(signature, dataset->signature, RG_SIZE(signature)))
+            return true;
+
+        // Wait until files stop changing, to avoid loading files that are still being copied
+        if (memcmp(signature, pending_signature, RG_SIZE(signature))) {
+            LogInfo("MCO stay files have changed, waiting for next check to reload");
+            MemCpy(pending_signature, signature, RG_SIZE(signature));
+
+            return true;
+        }
+    }
+
+    LogInfo("Reload MCO stays");
+    return LoadStays(filenames, signature);
+}
+
+RetainPtr<const McoDataset> GetMcoDataset()
+{
+    std::lock_guard<std::mutex> lock(dataset_mutex);
+    return current_dataset;
+}
+
+static Span<const mco_Result> GetResultsRange(const McoDataset &dataset, LocalDate min_date, LocalDate max_date)
+{
+    Span<const LocalDate> dates = dataset.columns.exit_dates;
+
+    Size start = std::lower_bound(dates.begin(), dates.end(), min_date) - dates.ptr;
+    Size end = std::lower_bound(dates.begin() + start, dates.end(), max_date) - dates.ptr;
+
+    return dataset.results.Take(start, end - start);
 }
 
 static Span<const mco_Result *> GetIndexRange(Span<const mco_Result *> index,
@@ -302,10 +664,14 @@ bool McoResultProvider::Run(FunctionRef<void(Span<const mco_Result>, Span<const
 {
     RG_ASSERT(min_date.IsValid() && max_date.IsValid());
 
+    stop = false;
+
     if (filter) {
         return RunFilter(func);
     } else if (ghm_root.IsValid()) {
         return RunIndex(func);
+    } else if (bitmap) {
+        return RunBitmap(func);
     } else {
         return RunDirect(func);
     }
@@ -317,7 +683,7 @@ bool McoResultProvider::RunFilter(FunctionRef<void(Span<const mco_Result>, Span<
 
     const Size split_size = 8192;
 
-    Span<const mco_Result> results = GetResultsRange(min_date, max_date);
+    Span<const mco_Result> results = GetResultsRange(*dataset, min_date, max_date);
 
     mco_FilterRunner filter_runner;
     if (!filter_runner.Init(filter))
@@ -330,13 +696,13 @@ bool McoResultProvider::RunFilter(FunctionRef<void(Span<const mco_Result>, Span<
     HeapArray<mco_Result> results_buf;
     HeapArray<mco_Result> mono_results_buf;
 
-    for (Size i = 0; i < results.len; i += split_size) {
+    for (Size i = 0; i < results.len && !stop; i += split_size) {
         Size split_len = std::min(split_size, results.len - i);
 
         Span<const mco_Result> split_results = results.Take(i, split_len);
         Span<const mco_Result> split_mono_results =
-            MakeSpan(mco_results_to_mono.FindValue(split_results.begin(), nullptr),
-                     mco_results_to_mono.FindValue(split_results.end(), nullptr));
+            MakeSpan(dataset->results_to_mono.FindValue(split_results.begin(), nullptr),
+                     dataset->results_to_mono.FindValue(split_results.end(), nullptr));
 
         // Run filter
         index.RemoveFrom(0);
@@ -403,21 +769,25 @@ bool McoResultProvider::RunIndex(FunctionRef<void(Span<const mco_Result>, Span<c
 
     const Size split_size = 8192;
 
-    Span<const mco_Result *> index = mco_results_by_ghm_root.FindValue(ghm_root, {});
+    Span<const mco_Result *> index = dataset->results_by_ghm_root.FindValue(ghm_root, {});
     index = GetIndexRange(index, min_date, max_date);
 
     // Reuse for performance
     HeapArray<mco_Result> results_buf;
     HeapArray<mco_Result> mono_results_buf;
 
-    for (Size i = 0; i < index.len; i += split_size) {
+    for (Size i = 0; i < index.len && !stop; i += split_size) {
         Size split_len = std::min(split_size, index.len - i);
 
         results_buf.RemoveFrom(0);
         mono_results_buf.RemoveFrom(0);
         for (Size j = 0; j < split_len; j++) {
             const mco_Result &result = *index[i + j];
-            const mco_Result *mono_result = mco_results_to_mono.FindValue(&result, nullptr);
+
+            if (bitmap && !bitmap->Test(&result - dataset->results.ptr))
+                continue;
+
+            const mco_Result *mono_result = dataset->results_to_mono.FindValue(&result, nullptr);
 
             results_buf.Append(result);
             mono_results_buf.Append(MakeSpan(mono_result, result.stays.len));
@@ -435,14 +805,14 @@ bool McoResultProvider::RunDirect(FunctionRef<void(Span<const mco_Result>, Span<
 
     const Size split_size = 65536;
 
-    Span<const mco_Result> results = GetResultsRange(min_date, max_date);
+    Span<const mco_Result> results = GetResultsRange(*dataset, min_date, max_date);
 
-    for (Size i = 0; i < results.len; i += split_size) {
+    for (Size i = 0; i < results.len && !stop; i += split_size) {
         Size split_len = std::min(split_size, results.len - i);
         Span<const mco_Result> split_results = results.Take(i, split_len);
         Span<const mco_Result> split_mono_results =
-            MakeSpan(mco_results_to_mono.FindValue(split_results.begin(), nullptr),
-                     mco_results_to_mono.FindValue(split_results.end(), nullptr));
+            MakeSpan(dataset->results_to_mono.FindValue(split_results.begin(), nullptr),
+                     dataset->results_to_mono.FindValue(split_results.end(), nullptr));
 
         func(split_results, split_mono_results);
     }
@@ -450,4 +820,104 @@ bool McoResultProvider::RunDirect(FunctionRef<void(Span<const mco_Result>, Span<
     return true;
 }
 
+bool McoResultProvider::RunBitmap(FunctionRef<void(Span<const mco_Result>, Span<const mco_Result>)> func)
+{
+    RG_ASSERT(!ghm_root.IsValid());
+    RG_ASSERT(bitmap);
+
+    const Size split_size = 8192;
+
+    Span<const mco_Result> results = GetResultsRange(*dataset, min_date, max_date);
+    Size start = results.ptr - dataset->results.ptr;
+    Size end = start + results.len;
+
+    // Reuse for performance
+    HeapArray<mco_Result> results_buf;
+    HeapArray<mco_Result> mono_results_buf;
+
+    bitmap->ForEach(start, end, [&](Size idx) {
+        if (stop)
+            return;
+
+        const mco_Result &result = dataset->results[idx];
+        const mco_Result *mono_result = dataset->results_to_mono.FindValue(&result, nullptr);
+
+        results_buf.Append(result);
+        mono_results_buf.Append(MakeSpan(mono_result, result.stays.len));
+
+        if (results_buf.len >= split_size) {
+            func(results_buf, mono_results_buf);
+
+            results_buf.RemoveFrom(0);
+            mono_results_buf.RemoveFrom(0);
+        }
+    });
+    if (results_buf.len && !stop) {
+        func(results_buf, mono_results_buf);
+    }
+
+    return true;
+}
+
+bool McoResultProvider::RunColumns(FunctionRef<void(Span<const Size>)> func)
+{
+    RG_ASSERT(!filter);
+
+    const Size split_size = 65536;
+
+    // Reuse for performance
+    HeapArray<Size> indexes;
+
+    const auto flush = [&]() {
+        if (indexes.len) {
+            func(indexes);
+            indexes.RemoveFrom(0);
+        }
+    };
+
+    if (ghm_root.IsValid()) {
+        Span<const mco_Result *> index = dataset->results_by_ghm_root.FindValue(ghm_root, {});
+        index = GetIndexRange(index, min_date, max_date);
+
+        for (const mco_Result *result: index) {
+            Size idx = result - dataset->results.ptr;
+
+            if (bitmap && !bitmap->Test(idx))
+                continue;
+
+            indexes.Append(idx);
+            if (indexes.len >= split_size) {
+                flush();
+            }
+        }
+    } else {
+        Span<const mco_Result> results = GetResultsRange(*dataset, min_date, max_date);
+        Size start = results.ptr - dataset->results.ptr;
+        Size end = start + results.len;
+
+        if (bitmap) {
+            bitmap->ForEach(start, end, [&](Size idx) {
+                indexes.Append(idx);
+                if (indexes.len >= split_size) {
+                    flush();
+                }
+            });
+        } else {
+            for (Size i = start; i < end; i += split_size) {
+                Size split_end = std::min(end, i + split_size);
+
+                indexes.Grow(split_end - i);
+                for (Size j = i; j < split_end; j++) {
+                    indexes.ptr[indexes.len++] = j;
+                }
+
+                flush();
+            }
+        }
+    }
+    flush();
+
+    return true;
+}
+
 }
@@ -28,35 +28,162 @@ struct McoCacheSet {
     BlockAllocator str_alloc;
 };
 
+// Compressed set of indexes into dataset results, loosely modeled on Roaring bitmaps: indexes
+// are split in 65536-wide chunks, stored as sorted arrays when sparse and bitsets otherwise.
+class McoResultBitmap {
+public:
+    struct Chunk {
+        Size base;
+        Size count;
+
+        Span<const uint16_t> values; // Sparse chunks
+        const uint64_t *words; // Dense chunks (1024 words)
+    };
+
+    HeapArray<Chunk> chunks;
+    Size count = 0;
+
+    bool Test(Size idx) const;
+
+    template <typename Func>
+    void ForEach(Size start, Size end, Func func) const
+    {
+        const Chunk *chunk = std::lower_bound(chunks.begin(), chunks.end(), start & ~(Size)0xFFFF,
+                                              [](const Chunk &chunk, Size base) { return chunk.base < base; });
+
+        for (; chunk < chunks.end() && chunk->base < end; chunk++) {
+            if (chunk->words) {
+                Size from = std::max(start - chunk->base, (Size)0) / 64;
+                Size to = (std::min(end - chunk->base, (Size)65536) + 63) / 64;
+
+                for (Size i = from; i < to; i++) {
+                    uint64_t word = chunk->words[i];
+
+                    while (word) {
+                        Size idx = chunk->base + i * 64 + CountTrailingZeros(word);
+
+                        if (idx >= start && idx < end) {
+                            func(idx);
+                        }
+
+                        word &= word - 1;
+                    }
+                }
+            } else {
+                const uint16_t *it = std::lower_bound(chunk->values.begin(), chunk->values.end(),
+                                                      std::max(start - chunk->base, (Size)0));
+
+                for (; it < chunk->values.end(); it++) {
+                    Size idx = chunk->base + *it;
+                    if (idx >= end)
+                        break;
+
+                    func(idx);
+                }
+            }
+        }
+    }
+};
+
+class McoResultBitmapBuilder {
+    Allocator *alloc;
+
+    McoResultBitmap bitmap;
+
+    Size chunk_base = -1;
+    HeapArray<uint16_t> values;
+
+public:
+    McoResultBitmapBuilder(Allocator *alloc) : alloc(alloc) {}
+
+    // Indexes must be added in increasing order
+    void Add(Size idx);
+    void Finish(McoResultBitmap *out_bitmap);
+
+    static void Union(Span<const McoResultBitmap *const> bitmaps, Allocator *alloc, McoResultBitmap *out_bitmap);
+
+private:
+    void FlushChunk();
+};
+
+// Columnar copy of the result fields used by casemix aggregation. Mono results are stored
+// in CSR form: values for result i are in [mono_offsets[i], mono_offsets[i + 1]). Result
+// prices are given without and with GHS coefficient, mono prices are not dispensed.
+struct McoResultColumns {
+    HeapArray<LocalDate> exit_dates;
+    HeapArray<mco_GhmCode> ghms;
+    HeapArray<mco_GhsCode> ghs;
+    HeapArray<int16_t> durations;
+    HeapArray<uint8_t> deaths;
+    HeapArray<uint8_t> exb; // exb_exh < 0
+    HeapArray<int64_t> price_cents[2];
+
+    HeapArray<Size> mono_offsets;
+    HeapArray<drd_UnitCode> mono_units;
+    HeapArray<int32_t> mono_durations;
+    HeapArray<int64_t> mono_ghs_cents;
+    HeapArray<int64_t> mono_price_cents;
+};
+
 extern mco_TableSet mco_table_set;
 extern McoCacheSet mco_cache_set;
 
 extern mco_AuthorizationSet mco_authorization_set;
 
-extern mco_StaySet mco_stay_set;
-extern LocalDate mco_stay_set_dates[2];
-
-extern HeapArray<mco_Result> mco_results;
-extern HeapArray<mco_Result> mco_mono_results;
-extern HashMap<mco_GhmRootCode, Span<const mco_Result *>> mco_results_by_ghm_root;
-extern HashMap<const void *, const mco_Result *> mco_results_to_mono;
+// Loaded stays and everything derived from them, never modified once published.
+// Reloading builds a new dataset, and requests keep the one they started with.
+struct McoDataset: public RetainObject<McoDataset> {
+    int64_t generation;
+    uint8_t signature[16]; // Stay files (names, sizes and modification times)
+
+    mco_StaySet stay_set;
+    LocalDate stay_set_dates[2];
+
+    HeapArray<mco_Result> results;
+    HeapArray<mco_Result> mono_results;
+    HashMap<mco_GhmRootCode, Span<const mco_Result *>> results_by_ghm_root;
+    HashMap<const void *, const mco_Result *> results_to_mono;
+    McoResultColumns columns;
+
+    HeapArray<const mco_Result *> results_by_ghm_root_ptrs;
+    BucketArray<McoResultBitmap> bitmaps;
+    HashMap<drd_UnitCode, const McoResultBitmap *> bitmaps_by_unit;
+    HashMap<const char *, const McoResultBitmap *> bitmaps_by_user_units;
+    LinkedAllocator bitmaps_alloc;
+
+    // Returns nullptr when the user can see most results, in which case scanning everything is faster
+    const McoResultBitmap *FindUserBitmap(const User *user) const
+        { return bitmaps_by_user_units.FindValue(user->mco_units_hash, nullptr); }
+};
 
 bool InitMcoTables(Span<const char *const> table_directories);
 bool InitMcoProfile(const char *profile_directory, const char *authorization_filename);
 bool InitMcoStays(Span<const char *const> stay_directories, Span<const char *const> stay_filenames);
 
+// Unless forced, stays are only reloaded once changed files have stopped changing between two calls
+bool ReloadMcoStays(Span<const char *const> stay_directories, Span<const char *const> stay_filenames, bool force);
+
+RetainPtr<const McoDataset> GetMcoDataset();
+
 class McoResultProvider {
     RG_DELETE_COPY(McoResultProvider)
 
+    RetainPtr<const McoDataset> dataset;
+
     // Parameters
     LocalDate min_date = {};
     LocalDate max_date = {};
     const char *filter = nullptr;
     bool allow_mutation = false;
     mco_GhmRootCode ghm_root = {};
+    const McoResultBitmap *bitmap = nullptr;
+
+    bool stop = false;
 
 public:
-    McoResultProvider() = default;
+    McoResultProvider() : dataset(GetMcoDataset()) {}
+
+    const McoDataset &GetDataset() const { return *dataset; }
 
     void SetDateRange(LocalDate min_date, LocalDate max_date)
     {
@@ -68,13 +195,21 @@ public:
         this->allow_mutation = allow_mutation;
     }
     void SetGhmRoot(mco_GhmRootCode ghm_root) { this->ghm_root = ghm_root; }
+    void SetBitmap(const McoResultBitmap *bitmap) { this->bitmap = bitmap; }
 
     bool Run(FunctionRef<void(Span<const mco_Result>, Span<const mco_Result>)> func);
 
+    // Call from the Run() callback to skip the remaining results
+    void Stop() { stop = true; }
+
+    // Gives indexes into dataset results and columns, filters are not supported
+    bool RunColumns(FunctionRef<void(Span<const Size>)> func);
+
 private:
     bool RunFilter(FunctionRef<void(Span<const mco_Result>, Span<const mco_Result>)> func);
     bool RunIndex(FunctionRef<void(Span<const mco_Result>, Span<const mco_Result>)> func);
     bool RunDirect(FunctionRef<void(Span<const mco_Result>, Span<const mco_Result>)> func);
+    bool RunBitmap(FunctionRef<void(Span<const mco_Result>, Span<const mco_Result>)> func);
 };
 
 }
@@ -17,6 +17,7 @@
 #include "mco.hh"
 #include "thop.hh"
 #include "user.hh"
+#include "cache.hh"
 
 namespace RG {
 
@@ -193,6 +194,8 @@ class AggregateSetBuilder {
 
     // Reuse for performance
     HashMap<drd_UnitCode, Aggregate::Part> agg_parts_map;
+    HeapArray<double> coefficients;
+    HeapArray<int64_t> mono_price_cents;
 
 public:
     AggregateSetBuilder(const User *user, unsigned int flags)
@@ -201,6 +204,8 @@ public:
     void Process(Span<const mco_Result> results, Span<const mco_Result> mono_results,
                  Span<const mco_Pricing> pricings, Span<const mco_Pricing> mono_pricings,
                  int multiplier = 1);
+    void ProcessColumns(const McoResultColumns &columns, Span<const Size> indexes,
+                        bool apply_coefficient, mco_DispenseMode dispense_mode, int multiplier = 1);
 
     void Finish(AggregateSet *out_set, HeapArray<mco_GhmRootCode> *out_ghm_roots = nullptr);
 };
@@ -327,6 +332,193 @@ void AggregateSetBuilder::Process(Span<const mco_Result> results, Span<const mco
     }
 }
 
+// Same as ComputeCoefficients() in libdrd, but works on mono columns
+static double ComputeColumnCoefficients(const McoResultColumns &columns, Size idx, mco_DispenseMode mode,
+                                        HeapArray<double> *out_coefficients)
+{
+    Size from = columns.mono_offsets[idx];
+    Size len = columns.mono_offsets[idx + 1] - from;
+
+    const int32_t *durations = columns.mono_durations.ptr + from;
+    const int64_t *ghs_cents = columns.mono_ghs_cents.ptr + from;
+    const int64_t *price_cents = columns.mono_price_cents.ptr + from;
+    bool exb = columns.exb[idx];
+
+    out_coefficients->RemoveFrom(0);
+    out_coefficients->Grow(len);
+
+    double *coefficients = out_coefficients->ptr;
+    out_coefficients->len = len;
+
+    switch (mode) {
+        case mco_DispenseMode::E: {
+            for (Size i = 0; i < len; i++) {
+                coefficients[i] = (double)ghs_cents[i];
+            }
+        } break;
+
+        case mco_DispenseMode::Ex: {
+            for (Size i = 0; i < len; i++) {
+                coefficients[i] = (double)price_cents[i];
+            }
+        } break;
+
+        case mco_DispenseMode::Ex2: {
+            const int64_t *cents = exb ? price_cents : ghs_cents;
+
+            for (Size i = 0; i < len; i++) {
+                coefficients[i] = (double)cents[i];
+            }
+        } break;
+
+        case mco_DispenseMode::J: {
+            for (Size i = 0; i < len; i++) {
+                coefficients[i] = std::max(durations[i], 1);
+            }
+        } break;
+
+        case mco_DispenseMode::ExJ: {
+            for (Size i = 0; i < len; i++) {
+                coefficients[i] = std::max(durations[i], 1) * (double)price_cents[i];
+            }
+        } break;
+
+        case mco_DispenseMode::ExJ2: {
+            const int64_t *cents = exb ? price_cents : ghs_cents;
+
+            for (Size i = 0; i < len; i++) {
+                coefficients[i] = std::max(durations[i], 1) * (double)cents[i];
+            }
+        } break;
+    }
+
+    double total = 0;
+    for (Size i = 0; i < len; i++) {
+        total += coefficients[i];
+    }
+
+    return total;
+}
+
+void AggregateSetBuilder::ProcessColumns(const McoResultColumns &columns, Span<const Size> indexes,
+                                         bool apply_coefficient, mco_DispenseMode dispense_mode, int multiplier)
+{
+    for (Size idx: indexes) {
+        agg_parts_map.RemoveAll();
+
+        Size mono_from = columns.mono_offsets[idx];
+        Size mono_len = columns.mono_offsets[idx + 1] - mono_from;
+        Span<const drd_UnitCode> mono_units = columns.mono_units.Take(mono_from, mono_len);
+
+        // Skip dispensation unless we need it
+        bool match = false;
+        for (drd_UnitCode unit: mono_units) {
+            if (user->mco_allowed_units.Find(unit)) {
+                match = true;
+                break;
+            }
+        }
+        if (!match)
+            continue;
+
+        int64_t price_cents = columns.price_cents[apply_coefficient][idx];
+
+        // Dispense price among mono results, same as mco_Dispense()
+        {
+            double coefficients_total = ComputeColumnCoefficients(columns, idx, dispense_mode, &coefficients);
+            if (!coefficients_total) [[unlikely]] {
+                coefficients_total = ComputeColumnCoefficients(columns, idx, mco_DispenseMode::J, &coefficients);
+            }
+
+            mono_price_cents.RemoveFrom(0);
+            mono_price_cents.Grow(mono_len);
+            mono_price_cents.len = mono_len;
+
+            int64_t total_price_cents = 0;
+            for (Size k = 0; k < mono_len; k++) {
+                double fraction = coefficients[k] / coefficients_total;
+
+                mono_price_cents[k] = (int64_t)round(price_cents * fraction);
+                total_price_cents += mono_price_cents[k];
+            }
+
+            // Attribute missing cents to last stay (rounding errors)
+            mono_price_cents[mono_len - 1] += price_cents - total_price_cents;
+        }
+
+        HeapArray<drd_UnitCode> agg_units(&units_alloc);
+        for (Size k = 0; k < mono_len; k++) {
+            drd_UnitCode unit = mono_units[k];
+
+            if (user->mco_allowed_units.Find(unit)) {
+                bool inserted;
+                auto bucket = agg_parts_map.TrySetDefault(unit, &inserted);
+
+                bucket->value.mono_count += multiplier;
+                bucket->value.price_cents += multiplier * mono_price_cents[k];
+
+                if ((flags & (int)AggregationFlag::KeyOnUnits) && inserted) {
+                    agg_units.Append(unit);
+                }
+            }
+        }
+
+        std::sort(agg_units.begin(), agg_units.end());
+
+        HeapArray<Aggregate::Part> agg_parts(&parts_alloc);
+        for (drd_UnitCode unit: agg_units) {
+            Aggregate::Part *part = agg_parts_map.Find(unit);
+            if (part) {
+                agg_parts.Append(*part);
+            }
+        }
+
+        Aggregate::Key key = {};
+        key.ghm = columns.ghms[idx];
+        key.ghs = columns.ghs[idx];
+        if (flags & (int)AggregationFlag::KeyOnDuration) {
+            key.duration = columns.durations[idx];
+        }
+        if (flags & (int)AggregationFlag::KeyOnUnits) {
+            key.units = agg_units.TrimAndLeak();
+        }
+
+        Aggregate *agg;
+        {
+            bool inserted;
+            Size *ptr = aggregates_map.TrySet(key, set.aggregates.len, &inserted);
+
+            if (inserted) {
+                agg = set.aggregates.AppendDefault();
+                agg->key = key;
+            } else {
+                agg = &set.aggregates[*ptr];
+            }
+        }
+
+        agg->count += multiplier;
+        agg->deaths += multiplier * columns.deaths[idx];
+        agg->mono_count += multiplier * (int32_t)mono_len;
+        agg->price_cents += multiplier * price_cents;
+        if (agg->parts.ptr) {
+            RG_ASSERT(agg->parts.len == agg_parts.len);
+            for (Size k = 0; k < agg->parts.len; k++) {
+                agg->parts[k].mono_count += agg_parts[k].mono_count;
+                agg->parts[k].price_cents += agg_parts[k].price_cents;
+            }
+        } else {
+            agg->parts = agg_parts.TrimAndLeak();
+        }
+
+        bool inserted;
+        ghm_roots_set.TrySet(key.ghm.Root(), &inserted);
+
+        if (inserted) {
+            ghm_roots.Append(key.ghm.Root());
+        }
+    }
+}
+
 void AggregateSetBuilder::Finish(AggregateSet *out_set, HeapArray<mco_GhmRootCode> *out_ghm_roots)
 {
     std::sort(set.aggregates.begin(), set.aggregates.end(),
@@ -397,6 +589,54 @@ static void GatherGhmGhsInfo(Span<const mco_GhmRootCode> ghm_roots, LocalDate mi
     }
 }
 
+struct AggregateCacheEntry: public RetainObject<AggregateCacheEntry> {
+    const char *key;
+    Span<const uint8_t> data;
+    CompressionType encoding;
+    char etag[64];
+
+    // Least recently used entries are at the end
+    AggregateCacheEntry *prev;
+    AggregateCacheEntry *next;
+
+    RG_HASHTABLE_HANDLER(AggregateCacheEntry, key);
+};
+
+static LruCache<AggregateCacheEntry> aggregate_cache;
+static std::atomic_int64_t aggregate_sequence { 0 };
+
+// Takes ownership of the entry reference
+static void AttachAggregateEntry(const http_RequestInfo &request, http_IO *io, AggregateCacheEntry *entry)
+{
+    const char *client_etag = request.GetHeaderValue("If-None-Match");
+
+    if (client_etag && TestStr(client_etag, entry->etag)) {
+        MHD_Response *response = MHD_create_response_empty((MHD_ResponseFlags)0);
+        io->AttachResponse(304, response);
+    } else {
+        const auto release_entry = [](void *udata) {
+            AggregateCacheEntry *entry = (AggregateCacheEntry *)udata;
+            LruCache<AggregateCacheEntry>::ReleaseEntry(entry);
+        };
+
+        entry->Ref();
+
+        MHD_Response *response =
+            MHD_create_response_from_buffer_with_free_callback_cls((size_t)entry->data.len, entry->data.ptr,
+                                                                   release_entry, entry);
+        io->AttachResponse(200, response, entry->data.len);
+        io->AddEncodingHeader(entry->encoding);
+        io->AddHeader("Content-Type", "application/json");
+    }
+
+    // Aggregates depend on user permissions, so only the browser may keep them
+    io->AddHeader("Cache-Control", "private, no-cache");
+    io->AddHeader("Vary", "Accept-Encoding");
+    io->AddHeader("ETag", entry->etag);
+
+    LruCache<AggregateCacheEntry>::ReleaseEntry(entry);
+}
+
 void ProduceMcoAggregate(const http_RequestInfo &request, const User *user, http_IO *io)
 {
     if (!user || !user->CheckPermission(UserPermission::McoCasemix)) {
@@ -445,10 +685,34 @@ void ProduceMcoAggregate(const http_RequestInfo &request, const User *user, http
         return;
     }
 
-    // Prepare query
+    CompressionType encoding;
+    if (!io->NegociateEncoding(CompressionType::Brotli, CompressionType::Gzip, &encoding))
+        return;
+
+    // Stick to this dataset, even if stays get reloaded in the meantime
     McoResultProvider provider;
+    const McoDataset &dataset = provider.GetDataset();
+
+    // Reuse previous result if possible, users with identical units share entries
+    HeapArray<char> cache_key;
+    {
+        bool allow_mutation = user->CheckPermission(UserPermission::McoMutate);
+
+        Fmt(&cache_key, "%1:%2:%3:%4:%5:%6:%7:%8", period[0].value, period[1].value, diff[0].value, diff[1].value,
+                                                   (int)dispense_mode, apply_coefficient, ghm_root.value, (int)encoding);
+        Fmt(&cache_key, ":%1:%2:%3:%4%5", dataset.generation, user->mco_units_hash, allow_mutation,
+                                          filter ? "F" : "N", filter ? filter : "");
+
+        if (AggregateCacheEntry *entry = aggregate_cache.Find(cache_key.ptr); entry) {
+            AttachAggregateEntry(request, io, entry);
+            return;
+        }
+    }
+
+    // Prepare query
     int flags;
     provider.SetFilter(filter, user->CheckPermission(UserPermission::McoMutate));
+    provider.SetBitmap(dataset.FindUserBitmap(user));
     if (ghm_root.IsValid()) {
         provider.SetGhmRoot(ghm_root);
         flags = (int)AggregationFlag::KeyOnUnits | (int)AggregationFlag::KeyOnDuration;
@@ -469,6 +733,14 @@ void ProduceMcoAggregate(const http_RequestInfo &request, const User *user, http
         const auto aggregate_period = [&](LocalDate min_date, LocalDate max_date, int multiplier) {
             provider.SetDateRange(min_date, max_date);
 
+            // Filters can mutate results, which are not part of the precomputed columns
+            if (!filter) {
+                return provider.RunColumns([&](Span<const Size> indexes) {
+                    aggregate_set_builder.ProcessColumns(dataset.columns, indexes,
+                                                         apply_coefficient, dispense_mode, multiplier);
+                });
+            }
+
             return provider.Run([&](Span<const mco_Result> results,
                                     Span<const mco_Result> mono_results) {
                 pricings.RemoveFrom(0);
@@ -502,9 +774,9 @@ void ProduceMcoAggregate(const http_RequestInfo &request, const User *user, http
     }
 
     // Export data
-    http_JsonPageBuilder json;
-    if (!json.Init(io))
-        return;
+    HeapArray<uint8_t> body;
+    StreamWriter st(&body, nullptr, encoding);
+    json_Writer json(&st);
     char buf[32];
 
     json.StartObject();
@@ -562,7 +834,284 @@ void ProduceMcoAggregate(const http_RequestInfo &request, const User *user, http
 
     json.EndObject();
 
-    json.Finish();
+    json.Flush();
+    if (!st.Close()) {
+        io->AttachError(500);
+        return;
+    }
+
+    AggregateCacheEntry *entry = new AggregateCacheEntry;
+
+    entry->key = DuplicateString(cache_key.ptr, GetDefaultAllocator()).ptr;
+    entry->data = body.TrimAndLeak();
+    entry->encoding = encoding;
+    Fmt(entry->etag, "%1-%2", thop_etag, FmtHex(++aggregate_sequence).Pad0(-8));
+
+    aggregate_cache.Insert(entry, thop_config.mco_aggregate_cache);
+    AttachAggregateEntry(request, io, entry);
+}
+
+enum class ResultField {
+    AdminId = 1 << 0,
+    BillId = 1 << 1,
+    IndexDate = 1 << 2,
+    Duration = 1 << 3,
+    Sex = 1 << 4,
+    Age = 1 << 5,
+    MainStay = 1 << 6,
+    Ghm = 1 << 7,
+    MainError = 1 << 8,
+    Ghs = 1 << 9,
+    GhsDuration = 1 << 10,
+    ExbExh = 1 << 11,
+    PriceCents = 1 << 12,
+    TotalCents = 1 << 13,
+    Stays = 1 << 14
+};
+static const char *const ResultFieldNames[] = {
+    "admin_id",
+    "bill_id",
+    "index_date",
+    "duration",
+    "sex",
+    "age",
+    "main_stay",
+    "ghm",
+    "main_error",
+    "ghs",
+    "ghs_duration",
+    "exb_exh",
+    "price_cents",
+    "total_cents",
+    "stays"
+};
+
+static bool GetQueryResultFields(const http_RequestInfo &request, const char *key,
+                                 http_IO *io, unsigned int *out_fields)
+{
+    const char *str = request.GetQueryValue(key);
+    if (!str) {
+        *out_fields = UINT_MAX;
+        return true;
+    }
+
+    unsigned int fields = 0;
+    {
+        Span<const char> remain = str;
+
+        while (remain.len) {
+            Span<const char> part = TrimStr(SplitStr(remain, ',', &remain));
+
+            if (part.len && !OptionToFlag(ResultFieldNames, part, &fields)) {
+                LogError("Invalid '%1' parameter value '%2'", key, part);
+                io->AttachError(422);
+                return false;
+            }
+        }
+    }
+
+    *out_fields = fields;
+    return true;
+}
+
+static bool GetQuerySize(const http_RequestInfo &request, const char *key,
+                         http_IO *io, Size *out_value)
+{
+    const char *str = request.GetQueryValue(key);
+    if (!str)
+        return true;
+
+    Size value;
+    if (!ParseInt(str, &value)) {
+        io->AttachError(422);
+        return false;
+    }
+    if (value < 0) {
+        LogError("Parameter '%1' must be positive or zero", key);
+        io->AttachError(422);
+        return false;
+    }
+
+    *out_value = value;
+    return true;
+}
+
+static void WriteResult(const User *user, const mco_Result &result, const mco_Pricing &pricing,
+                        Span<const mco_Result> sub_mono_results, Span<const mco_Pricing> sub_mono_pricings,
+                        unsigned int fields, json_Writer *json)
+{
+    char buf[32];
+
+    const mco_GhmRootInfo *ghm_root_info = nullptr;
+    const mco_DiagnosisInfo *main_diag_info = nullptr;
+    const mco_DiagnosisInfo *linked_diag_info = nullptr;
+    if (result.index) [[likely]] {
+        const mco_Stay &main_stay = result.stays[result.main_stay_idx];
+
+        ghm_root_info = result.index->FindGhmRoot(result.ghm.Root());
+        main_diag_info = result.index->FindDiagnosis(main_stay.main_diagnosis, main_stay.sex);
+        linked_diag_info = result.index->FindDiagnosis(main_stay.linked_diagnosis, main_stay.sex);
+    }
+
+    json->StartObject();
+
+    if (fields & (int)ResultField::AdminId) {
+        json->Key("admin_id"); json->Int(result.stays[0].admin_id);
+    }
+    if (fields & (int)ResultField::BillId) {
+        json->Key("bill_id"); json->Int(result.stays[0].bill_id);
+    }
+    if ((fields & (int)ResultField::IndexDate) && result.index) [[likely]] {
+        json->Key("index_date"); json->String(Fmt(buf, "%1", result.index->limit_dates[0]).ptr);
+    }
+    if ((fields & (int)ResultField::Duration) && result.duration >= 0) {
+        json->Key("duration"); json->Int(result.duration);
+    }
+    if (fields & (int)ResultField::Sex) {
+        json->Key("sex"); json->Int(result.stays[0].sex);
+    }
+    if ((fields & (int)ResultField::Age) && result.age >= 0) {
+        json->Key("age"); json->Int(result.age);
+    }
+    if (fields & (int)ResultField::MainStay) {
+        json->Key("main_stay"); json->Int(result.main_stay_idx);
+    }
+    if (fields & (int)ResultField::Ghm) {
+        json->Key("ghm"); json->String(result.ghm.ToString(buf).ptr);
+    }
+    if (fields & (int)ResultField::MainError) {
+        json->Key("main_error"); json->Int(result.main_error);
+    }
+    if (fields & (int)ResultField::Ghs) {
+        json->Key("ghs"); json->Int(result.ghs.number);
+    }
+    if (fields & (int)ResultField::GhsDuration) {
+        json->Key("ghs_duration"); json->Int(result.ghs_duration);
+    }
+    if (fields & (int)ResultField::ExbExh) {
+        json->Key("exb_exh"); json->Int(pricing.exb_exh);
+    }
+    if (fields & (int)ResultField::PriceCents) {
+        json->Key("price_cents"); json->Int((int)pricing.price_cents);
+    }
+    if (fields & (int)ResultField::TotalCents) {
+        json->Key("total_cents"); json->Int((int)pricing.total_cents);
+    }
+
+    if (fields & (int)ResultField::Stays) {
+        json->Key("stays"); json->StartArray();
+        for (Size k = 0; k < result.stays.len; k++) {
+            const mco_Stay &stay = result.stays[k];
+            const mco_Result &mono_result = sub_mono_results[k];
+            const mco_Pricing &mono_pricing = sub_mono_pricings[k];
+
+            json->StartObject();
+
+            if (mono_result.duration >= 0) {
+                json->Key("duration"); json->Int(mono_result.duration);
+            }
+            json->Key("unit"); json->Int(stay.unit.number);
+            if (user->mco_allowed_units.Find(stay.unit)) {
+                json->Key("sex"); json->Int(stay.sex);
+                json->Key("age"); json->Int(mono_result.age);
+                json->Key("birthdate"); json->String(Fmt(buf, "%1", stay.birthdate).ptr);
+                json->Key("entry_date"); json->String(Fmt(buf, "%1", stay.entry.date).ptr);
+                json->Key("entry_mode"); json->String(&stay.entry.mode, 1);
+                if (stay.entry.origin) {
+                    json->Key("entry_origin"); json->String(&stay.entry.origin, 1);
+                }
+                json->Key("exit_date"); json->String(Fmt(buf, "%1", stay.exit.date).ptr);
+                json->Key("exit_mode"); json->String(&stay.exit.mode, 1);
+                if (stay.exit.destination) {
+                    json->Key("exit_destination"); json->String(&stay.exit.destination, 1);
+                }
+                if (stay.bed_authorization) {
+                    json->Key("bed_authorization"); json->Int(stay.bed_authorization);
+                }
+                if (stay.session_count) {
+                    json->Key("session_count"); json->Int(stay.session_count);
+                }
+                if (stay.igs2) {
+                    json->Key("igs2"); json->Int(stay.igs2);
+                }
+                if (stay.last_menstrual_period.value) {
+                    json->Key("last_menstrual_period"); json->String(Fmt(buf, "%1", stay.last_menstrual_period).ptr);
+                }
+                if (stay.gestational_age) {
+                    json->Key("gestational_age"); json->Int(stay.gestational_age);
+                }
+                if (stay.newborn_weight) {
+                    json->Key("newborn_weight"); json->Int(stay.newborn_weight);
+                }
+                if (stay.flags & (int)mco_Stay::Flag::Confirmed) {
+                    json->Key("confirm"); json->Bool(true);
+                }
+                if (stay.flags & (int)mco_Stay::Flag::RAAC) {
+                    json->Key("raac"); json->Bool(true);
+                }
+                if (stay.flags & (int)mco_Stay::Flag::UCD) {
+                    json->Key("ucd"); json->Bool(stay.flags & (int)mco_Stay::Flag::UCD);
+                }
+                if (stay.dip_count) {
+                    json->Key("dip_count"); json->Int(stay.dip_count);
+                }
+
+                if (stay.main_diagnosis.IsValid()) [[likely]] {
+                    json->Key("main_diagnosis"); json->String(stay.main_diagnosis.str);
+                }
+                if (stay.linked_diagnosis.IsValid()) {
+                    json->Key("linked_diagnosis"); json->String(stay.linked_diagnosis.str);
+                }
+
+                json->Key("other_diagnoses"); json->StartArray();
+                for (drd_DiagnosisCode diag: stay.other_diagnoses) {
+                    const mco_DiagnosisInfo *diag_info =
+                        result.index ? result.index->FindDiagnosis(diag, stay.sex) : nullptr;
+
+                    json->StartObject();
+                    json->Key("diag"); json->String(diag.str);
+                    if (!result.ghm.IsError() && ghm_root_info && main_diag_info && diag_info) {
+                        json->Key("severity"); json->Int(diag_info->severity);
+
+                        if (mco_TestExclusion(*result.index, result.age, *diag_info,
+                                              *ghm_root_info, *main_diag_info, linked_diag_info)) {
+                            json->Key("exclude"); json->Bool(true);
+                        }
+                    }
+                    json->EndObject();
+                }
+                json->EndArray();
+
+                json->Key("procedures"); json->StartArray();
+                for (const mco_ProcedureRealisation &proc: stay.procedures) {
+                    json->StartObject();
+                    json->Key("proc"); json->String(proc.proc.str);
+                    if (proc.phase) {
+                        json->Key("phase"); json->Int(proc.phase);
+                    }
+                    json->Key("activity"); json->Int(proc.activity);
+                    if (proc.extension) {
+                        json->Key("extension"); json->Int(proc.extension);
+                    }
+                    json->String("date"); json->String(Fmt(buf, "%1", proc.date).ptr);
+                    json->String("count"); json->Int(proc.count);
+                    if (proc.doc) {
+                        json->String("doc"); json->String(&proc.doc, 1);
+                    }
+                    json->EndObject();
+                }
+                json->EndArray();
+            }
+
+            json->Key("price_cents"); json->Int64(mono_pricing.price_cents);
+            json->Key("total_cents"); json->Int64(mono_pricing.total_cents);
+
+            json->EndObject();
+        }
+        json->EndArray();
+    }
+
+    json->EndObject();
 }
 
 void ProduceMcoResults(const http_RequestInfo &request, const User *user, http_IO *io)
@@ -580,6 +1129,10 @@ void ProduceMcoResults(const http_RequestInfo &request, const User *user, http_I
     const char *filter;
     mco_DispenseMode dispense_mode = mco_DispenseMode::J;
     bool apply_coefficent = false;
+    Size offset = 0;
+    Size limit = -1;
+    unsigned int fields;
+    bool ndjson = false;
     if (!GetQueryDateRange(request, "period", io, &period[0], &period[1]))
         return;
     if (!GetQueryGhmRoot(request, "ghm_root", io, &ghm_root))
@@ -589,6 +1142,21 @@ void ProduceMcoResults(const http_RequestInfo &request, const User *user, http_I
         return;
     if (!GetQueryApplyCoefficient(request, "apply_coefficient", io, &apply_coefficent))
         return;
+    if (!GetQuerySize(request, "offset", io, &offset))
+        return;
+    if (!GetQuerySize(request, "limit", io, &limit))
+        return;
+    if (!GetQueryResultFields(request, "fields", io, &fields))
+        return;
+    if (const char *str = request.GetQueryValue("format"); str) {
+        if (TestStr(str, "ndjson")) {
+            ndjson = true;
+        } else if (!TestStr(str, "json")) {
+            LogError("Invalid 'format' parameter value '%1'", str);
+            io->AttachError(422);
+            return;
+        }
+    }
 
     // Check permissions
     if (!user->CheckMcoDispenseMode(dispense_mode)) {
@@ -602,194 +1170,152 @@ void ProduceMcoResults(const http_RequestInfo &request, const User *user, http_I
         return;
     }
 
-    // Prepare query
-    McoResultProvider provider;
-    provider.SetDateRange(period[0], period[1]);
-    provider.SetFilter(filter, user->CheckPermission(UserPermission::McoMutate));
-    provider.SetGhmRoot(ghm_root);
+    CompressionType encoding;
+    if (!io->NegociateEncoding(CompressionType::Brotli, CompressionType::Gzip, &encoding))
+        return;
 
-    // Reuse for performance
-    HeapArray<mco_Pricing> pricings;
-    HeapArray<mco_Pricing> mono_pricings;
+    // Rows are sent while they are produced
+    io->RunAsync([=]() {
+        McoResultProvider provider;
+        provider.SetDateRange(period[0], period[1]);
+        provider.SetFilter(filter, user->CheckPermission(UserPermission::McoMutate));
+        provider.SetGhmRoot(ghm_root);
 
-    // Export data
-    http_JsonPageBuilder json;
-    if (!json.Init(io))
-        return;
+        // Reuse for performance
+        HeapArray<mco_Pricing> pricings;
+        HeapArray<mco_Pricing> mono_pricings;
 
-    json.StartArray();
-    bool success = provider.Run([&](Span<const mco_Result> results,
-                                    Span<const mco_Result> mono_results) {
-        // Compute prices
-        pricings.RemoveFrom(0);
-        mono_pricings.RemoveFrom(0);
-        mco_Price(results, apply_coefficent, &pricings);
-        mco_Dispense(pricings, mono_results, dispense_mode, &mono_pricings);
-
-        for (Size i = 0, j = 0; i < results.len; i++) {
-            char buf[32];
-
-            const mco_Result &result = results[i];
-            const mco_Pricing &pricing = pricings[i];
-            Span<const mco_Result> sub_mono_results = mono_results.Take(j, result.stays.len);
-            Span<const mco_Pricing> sub_mono_pricings = mono_pricings.Take(j, result.stays.len);
-            j += result.stays.len;
-
-            const mco_GhmRootInfo *ghm_root_info = nullptr;
-            const mco_DiagnosisInfo *main_diag_info = nullptr;
-            const mco_DiagnosisInfo *linked_diag_info = nullptr;
-            if (result.index) [[likely]] {
-                const mco_Stay &main_stay = result.stays[result.main_stay_idx];
-
-                ghm_root_info = result.index->FindGhmRoot(result.ghm.Root());
-                main_diag_info = result.index->FindDiagnosis(main_stay.main_diagnosis, main_stay.sex);
-                linked_diag_info = result.index->FindDiagnosis(main_stay.linked_diagnosis, main_stay.sex);
-            }
-
-            json.StartObject();
-
-            json.Key("admin_id"); json.Int(result.stays[0].admin_id);
-            json.Key("bill_id"); json.Int(result.stays[0].bill_id);
-            if (result.index) [[likely]] {
-                json.Key("index_date"); json.String(Fmt(buf, "%1", result.index->limit_dates[0]).ptr);
-            }
-            if (result.duration >= 0) {
-                json.Key("duration"); json.Int(result.duration);
-            }
-            json.Key("sex"); json.Int(result.stays[0].sex);
-            if (result.age >= 0) {
-                json.Key("age"); json.Int(result.age);
-            }
-            json.Key("main_stay"); json.Int(result.main_stay_idx);
-            json.Key("ghm"); json.String(result.ghm.ToString(buf).ptr);
-            json.Key("main_error"); json.Int(result.main_error);
-            json.Key("ghs"); json.Int(result.ghs.number);
-            json.Key("ghs_duration"); json.Int(result.ghs_duration);
-            json.Key("exb_exh"); json.Int(pricing.exb_exh);
-            json.Key("price_cents"); json.Int((int)pricing.price_cents);
-            json.Key("total_cents"); json.Int((int)pricing.total_cents);
-
-            json.Key("stays"); json.StartArray();
-            for (Size k = 0; k < result.stays.len; k++) {
-                const mco_Stay &stay = result.stays[k];
-                const mco_Result &mono_result = sub_mono_results[k];
-                const mco_Pricing &mono_pricing = sub_mono_pricings[k];
-
-                json.StartObject();
-
-                if (mono_result.duration >= 0) {
-                    json.Key("duration"); json.Int(mono_result.duration);
+        // Open the stream late, errors can still be reported until something is produced
+        StreamWriter st;
+        json_Writer json(&st);
+        bool started = false;
+        bool flushed = false;
+        const auto start = [&]() {
+            if (started)
+                return true;
+            if (!io->OpenForWrite(200, -1, encoding, &st))
+                return false;
+
+            io->AddEncodingHeader(encoding);
+            io->AddHeader("Content-Type", ndjson ? "application/x-ndjson" : "application/json");
+
+            if (!ndjson) {
+                json.StartArray();
+            }
+
+            started = true;
+            return true;
+        };
+
+        Size skip = offset;
+        Size remain = limit;
+
+        bool success = provider.Run([&](Span<const mco_Result> results,
+                                        Span<const mco_Result> mono_results) {
+            // Apply pagination before doing anything expensive
+            {
+                Size skip_len = std::min(skip, results.len);
+                Size skip_mono_len = 0;
+                for (const mco_Result &result: results.Take(0, skip_len)) {
+                    skip_mono_len += result.stays.len;
                 }
-                json.Key("unit"); json.Int(stay.unit.number);
-                if (user->mco_allowed_units.Find(stay.unit)) {
-                    json.Key("sex"); json.Int(stay.sex);
-                    json.Key("age"); json.Int(mono_result.age);
-                    json.Key("birthdate"); json.String(Fmt(buf, "%1", stay.birthdate).ptr);
-                    json.Key("entry_date"); json.String(Fmt(buf, "%1", stay.entry.date).ptr);
-                    json.Key("entry_mode"); json.String(&stay.entry.mode, 1);
-                    if (stay.entry.origin) {
-                        json.Key("entry_origin"); json.String(&stay.entry.origin, 1);
-                    }
-                    json.Key("exit_date"); json.String(Fmt(buf, "%1", stay.exit.date).ptr);
-                    json.Key("exit_mode"); json.String(&stay.exit.mode, 1);
-                    if (stay.exit.destination) {
-                        json.Key("exit_destination"); json.String(&stay.exit.destination, 1);
-                    }
-                    if (stay.bed_authorization) {
-                        json.Key("bed_authorization"); json.Int(stay.bed_authorization);
-                    }
-                    if (stay.session_count) {
-                        json.Key("session_count"); json.Int(stay.session_count);
-                    }
-                    if (stay.igs2) {
-                        json.Key("igs2"); json.Int(stay.igs2);
-                    }
-                    if (stay.last_menstrual_period.value) {
-                        json.Key("last_menstrual_period"); json.String(Fmt(buf, "%1", stay.last_menstrual_period).ptr);
-                    }
-                    if (stay.gestational_age) {
-                        json.Key("gestational_age"); json.Int(stay.gestational_age);
-                    }
-                    if (stay.newborn_weight) {
-                        json.Key("newborn_weight"); json.Int(stay.newborn_weight);
-                    }
-                    if (stay.flags & (int)mco_Stay::Flag::Confirmed) {
-                        json.Key("confirm"); json.Bool(true);
-                    }
-                    if (stay.flags & (int)mco_Stay::Flag::RAAC) {
-                        json.Key("raac"); json.Bool(true);
-                    }
-                    if (stay.flags & (int)mco_Stay::Flag::UCD) {
-                        json.Key("ucd"); json.Bool(stay.flags & (int)mco_Stay::Flag::UCD);
-                    }
-                    if (stay.dip_count) {
-                        json.Key("dip_count"); json.Int(stay.dip_count);
-                    }
 
-                    if (stay.main_diagnosis.IsValid()) [[likely]] {
-                        json.Key("main_diagnosis"); json.String(stay.main_diagnosis.str);
+                results = results.Take(skip_len, results.len - skip_len);
+                mono_results = mono_results.Take(skip_mono_len, mono_results.len - skip_mono_len);
+                skip -= skip_len;
+
+                if (remain >= 0) {
+                    Size keep_len = std::min(remain, results.len);
+                    Size keep_mono_len = 0;
+                    for (const mco_Result &result: results.Take(0, keep_len)) {
+                        keep_mono_len += result.stays.len;
                     }
-                    if (stay.linked_diagnosis.IsValid()) {
-                        json.Key("linked_diagnosis"); json.String(stay.linked_diagnosis.str);
+
+                    results = results.Take(0, keep_len);
+                    mono_results = mono_results.Take(0, keep_mono_len);
+                    remain -= keep_len;
+
+                    // Don't scan (and filter) results we won't send
+                    if (!remain) {
+                        provider.Stop();
                     }
+                }
+            }
+            if (!results.len)
+                return;
 
-                    json.Key("other_diagnoses"); json.StartArray();
-                    for (drd_DiagnosisCode diag: stay.other_diagnoses) {
-                        const mco_DiagnosisInfo *diag_info =
-                            result.index ? result.index->FindDiagnosis(diag, stay.sex) : nullptr;
+            if (!start())
+                return;
 
-                        json.StartObject();
-                        json.Key("diag"); json.String(diag.str);
-                        if (!result.ghm.IsError() && ghm_root_info && main_diag_info && diag_info) {
-                            json.Key("severity"); json.Int(diag_info->severity);
+            // Compute prices
+            pricings.RemoveFrom(0);
+            mono_pricings.RemoveFrom(0);
+            mco_Price(results, apply_coefficent, &pricings);
+            mco_Dispense(pricings, mono_results, dispense_mode, &mono_pricings);
 
-                            if (mco_TestExclusion(*result.index, result.age, *diag_info,
-                                                  *ghm_root_info, *main_diag_info, linked_diag_info)) {
-                                json.Key("exclude"); json.Bool(true);
-                            }
-                        }
-                        json.EndObject();
-                    }
-                    json.EndArray();
-
-                    json.Key("procedures"); json.StartArray();
-                    for (const mco_ProcedureRealisation &proc: stay.procedures) {
-                        json.StartObject();
-                        json.Key("proc"); json.String(proc.proc.str);
-                        if (proc.phase) {
-                            json.Key("phase"); json.Int(proc.phase);
-                        }
-                        json.Key("activity"); json.Int(proc.activity);
-                        if (proc.extension) {
-                            json.Key("extension"); json.Int(proc.extension);
-                        }
-                        json.String("date"); json.String(Fmt(buf, "%1", proc.date).ptr);
-                        json.String("count"); json.Int(proc.count);
-                        if (proc.doc) {
-                            json.String("doc"); json.String(&proc.doc, 1);
-                        }
-                        json.EndObject();
-                    }
-                    json.EndArray();
+            for (Size i = 0, j = 0; i < results.len; i++) {
+                const mco_Result &result = results[i];
+                const mco_Pricing &pricing = pricings[i];
+                Span<const mco_Result> sub_mono_results = mono_results.Take(j, result.stays.len);
+                Span<const mco_Pricing> sub_mono_pricings = mono_pricings.Take(j, result.stays.len);
+                j += result.stays.len;
+
+                if (ndjson) {
+                    json_Writer row(&st);
+
+                    WriteResult(user, result, pricing, sub_mono_results, sub_mono_pricings, fields, &row);
+                    row.Flush();
+
+                    st.Write('\n');
+                } else {
+                    WriteResult(user, result, pricing, sub_mono_results, sub_mono_pricings, fields, &json);
                 }
+            }
 
-                json.Key("price_cents"); json.Int64(mono_pricing.price_cents);
-                json.Key("total_cents"); json.Int64(mono_pricing.total_cents);
+            // Send rows as we go, the first ones must not wait for the first chunk to fill up
+            json.Flush();
+            if (!flushed) {
+                io->FlushWrite();
+                flushed = true;
+            }
+        });
+        if (!success) {
+            if (!started) {
+                io->AttachError(422);
+                return;
+            }
+
+            // Make sure the client can't mistake truncated results for a complete response
+            if (ndjson) {
+                json_Writer row(&st);
 
-                json.EndObject();
+                row.StartObject();
+                row.Key("error"); row.String("Failed to produce all results");
+                row.EndObject();
+                row.Flush();
+
+                st.Write('\n');
+                st.Close();
+            } else {
+                io->AbortWrite();
             }
-            json.EndArray();
 
-            json.EndObject();
+            return;
         }
+        if (!start())
+            return;
+
+        if (!ndjson) {
+            json.EndArray();
+        }
+        json.Flush();
+        st.Close();
     });
-    if (!success) {
-        io->AttachError(422);
-        return;
-    }
-    json.EndArray();
+}
 
-    json.Finish();
+void InvalidateMcoAggregateCache()
+{
+    aggregate_cache.Clear();
 }
 
 }
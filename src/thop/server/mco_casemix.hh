@@ -22,4 +22,6 @@ namespace RG {
 void ProduceMcoAggregate(const http_RequestInfo &request, const User *user, http_IO *io);
 void ProduceMcoResults(const http_RequestInfo &request, const User *user, http_IO *io);
 
+void InvalidateMcoAggregateCache();
+
 }
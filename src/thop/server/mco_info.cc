@@ -16,9 +16,117 @@
 #include "config.hh"
 #include "mco_info.hh"
 #include "mco.hh"
+#include "cache.hh"
 
 namespace RG {
 
+// Query parameters come from clients, but keys are built from the resolved table index and
+// normalized parameters, so the number of distinct entries stays bounded. Least recently used
+// entries are evicted past the size limit.
+static const Size MaxInfoCacheSize = Mebibytes(64);
+
+struct InfoCacheEntry: public RetainObject<InfoCacheEntry> {
+    const char *key;
+    Span<const uint8_t> data;
+    CompressionType encoding;
+
+    // Least recently used entries are at the end
+    InfoCacheEntry *prev;
+    InfoCacheEntry *next;
+
+    RG_HASHTABLE_HANDLER(InfoCacheEntry, key);
+};
+
+static LruCache<InfoCacheEntry> info_cache;
+
+// Takes ownership of the entry reference
+static void AttachInfoEntry(http_IO *io, InfoCacheEntry *entry)
+{
+    const auto release_entry = [](void *udata) {
+        InfoCacheEntry *entry = (InfoCacheEntry *)udata;
+        LruCache<InfoCacheEntry>::ReleaseEntry(entry);
+    };
+
+    MHD_Response *response =
+        MHD_create_response_from_buffer_with_free_callback_cls((size_t)entry->data.len, (void *)entry->data.ptr,
+                                                               release_entry, entry);
+
+    io->AttachResponse(200, response, entry->data.len);
+    io->AddEncodingHeader(entry->encoding);
+    io->AddHeader("Content-Type", "application/json");
+    io->AddCachingHeaders(thop_config.max_age, thop_etag);
+}
+
+// Same as http_JsonPageBuilder, but responses are cached by table index and parameters
+class InfoPageBuilder: public json_Writer {
+    http_IO *io = nullptr;
+
+    HeapArray<char> key;
+    HeapArray<uint8_t> buf;
+    StreamWriter st;
+    CompressionType encoding;
+
+public:
+    InfoPageBuilder(): json_Writer(&st) {}
+
+    // Parameters must be normalized by the caller, raw query values would let clients
+    // create as many entries as they want for the same content.
+    // Returns false if the response has already been sent (from cache) or if something failed.
+    bool Init(http_IO *io, const char *name, const mco_TableIndex *index, const char *params = "");
+    void Finish();
+};
+
+bool InfoPageBuilder::Init(http_IO *io, const char *name, const mco_TableIndex *index, const char *params)
+{
+    RG_ASSERT(!this->io);
+
+    if (!io->NegociateEncoding(CompressionType::Brotli, CompressionType::Gzip, &encoding))
+        return false;
+
+    Fmt(&key, "%1:%2:%3:%4", name, index - mco_table_set.indexes.ptr, (int)encoding, params);
+
+    if (InfoCacheEntry *entry = info_cache.Find(key.ptr); entry) {
+        AttachInfoEntry(io, entry);
+        return false;
+    }
+
+    if (!st.Open(&buf, nullptr, encoding))
+        return false;
+
+    this->io = io;
+    return true;
+}
+
+void InfoPageBuilder::Finish()
+{
+    Flush();
+
+    bool success = st.Close();
+    RG_ASSERT(success);
+
+    InfoCacheEntry *entry = new InfoCacheEntry;
+
+    entry->key = DuplicateString(key.ptr, GetDefaultAllocator()).ptr;
+    entry->data = buf.TrimAndLeak();
+    entry->encoding = encoding;
+
+    info_cache.Insert(entry, MaxInfoCacheSize);
+    AttachInfoEntry(io, entry);
+}
+
+static const char *FormatSpecifierKey(const mco_ListSpecifier &spec, Span<char> out_buf)
+{
+    switch (spec.type) {
+        case mco_ListSpecifier::Type::All: return Fmt(out_buf, "*").ptr;
+        case mco_ListSpecifier::Type::Mask: return Fmt(out_buf, "%1/%2", spec.u.mask.offset, spec.u.mask.mask).ptr;
+        case mco_ListSpecifier::Type::ReverseMask: return Fmt(out_buf, "~%1/%2", spec.u.mask.offset, spec.u.mask.mask).ptr;
+        case mco_ListSpecifier::Type::Cmd: return Fmt(out_buf, "D%1", spec.u.cmd).ptr;
+        case mco_ListSpecifier::Type::CmdJump: return Fmt(out_buf, "D%1.%2", spec.u.cmd_jump.cmd, spec.u.cmd_jump.jump).ptr;
+    }
+
+    RG_UNREACHABLE();
+}
+
 static const mco_TableIndex *GetIndexFromRequest(const http_RequestInfo &request, http_IO *io,
                                                  drd_Sector *out_sector = nullptr)
 {
@@ -87,11 +195,12 @@ void ProduceMcoDiagnoses(const http_RequestInfo &request, const User *, http_IO
         }
     }
 
-    http_JsonPageBuilder json;
-    if (!json.Init(io))
-        return;
     char buf[512];
 
+    InfoPageBuilder json;
+    if (!json.Init(io, "diagnoses", index, FormatSpecifierKey(spec, buf)))
+        return;
+
     json.StartArray();
     for (const mco_DiagnosisInfo &diag_info: index->diagnoses) {
         if (spec.Match(diag_info.raw)) {
@@ -119,7 +228,6 @@ void ProduceMcoDiagnoses(const http_RequestInfo &request, const User *, http_IO
     }
     json.EndArray();
 
-    io->AddCachingHeaders(thop_config.max_age, thop_etag);
     return json.Finish();
 }
 
@@ -142,11 +250,12 @@ void ProduceMcoProcedures(const http_RequestInfo &request, const User *, http_IO
         }
     }
 
-    http_JsonPageBuilder json;
-    if (!json.Init(io))
-        return;
     char buf[512];
 
+    InfoPageBuilder json;
+    if (!json.Init(io, "procedures", index, FormatSpecifierKey(spec, buf)))
+        return;
+
     json.StartArray();
     for (const mco_ProcedureInfo &proc_info: index->procedures) {
         if (spec.Match(proc_info.bytes)) {
@@ -169,7 +278,6 @@ void ProduceMcoProcedures(const http_RequestInfo &request, const User *, http_IO
     }
     json.EndArray();
 
-    io->AddCachingHeaders(thop_config.max_age, thop_etag);
     return json.Finish();
 }
 
@@ -183,8 +291,8 @@ void ProduceMcoGhmGhs(const http_RequestInfo &request, const User *, http_IO *io
     const HashTable<mco_GhmCode, mco_GhmConstraint> &constraints =
         *mco_cache_set.index_to_constraints.FindValue(index, nullptr);
 
-    http_JsonPageBuilder json;
-    if (!json.Init(io))
+    InfoPageBuilder json;
+    if (!json.Init(io, "ghm_ghs", index, drd_SectorNames[(int)sector]))
         return;
     char buf[512];
 
@@ -295,7 +403,6 @@ void ProduceMcoGhmGhs(const http_RequestInfo &request, const User *, http_IO *io
     }
     json.EndArray();
 
-    io->AddCachingHeaders(thop_config.max_age, thop_etag);
     return json.Finish();
 }
 
@@ -308,8 +415,8 @@ void ProduceMcoTree(const http_RequestInfo &request, const User *, http_IO *io)
     const HeapArray<mco_ReadableGhmNode> *readable_nodes;
     readable_nodes = mco_cache_set.readable_nodes.Find(index);
 
-    http_JsonPageBuilder json;
-    if (!json.Init(io))
+    InfoPageBuilder json;
+    if (!json.Init(io, "tree", index))
         return;
 
     json.StartArray();
@@ -333,7 +440,6 @@ void ProduceMcoTree(const http_RequestInfo &request, const User *, http_IO *io)
     }
     json.EndArray();
 
-    io->AddCachingHeaders(thop_config.max_age, thop_etag);
     json.Finish();
 }
 
@@ -533,10 +639,15 @@ void ProduceMcoHighlight(const http_RequestInfo &request, const User *, http_IO
     HighlightContext ctx = {};
     ctx.ghm_nodes = index->ghm_nodes;
 
+    // Normalized codes, for the cache key
+    const char *diag_key = "";
+    const char *proc_key = "";
+
     // Diagnosis?
     if (const char *code = request.GetQueryValue("diag"); code && code[0]) {
         if (TestStr(code, "*")) {
             ctx.ignore_diagnoses = true;
+            diag_key = "*";
         } else {
             drd_DiagnosisCode diag =
                 drd_DiagnosisCode::Parse(code, RG_DEFAULT_PARSE_FLAGS & ~(int)ParseFlag::Log);
@@ -554,6 +665,8 @@ void ProduceMcoHighlight(const http_RequestInfo &request, const User *, http_IO
                 io->AttachError(404);
                 return;
             }
+
+            diag_key = DuplicateString(diag.str, &io->allocator).ptr;
         }
     }
 
@@ -561,6 +674,7 @@ void ProduceMcoHighlight(const http_RequestInfo &request, const User *, http_IO
     if (const char *code = request.GetQueryValue("proc"); code && code[0]) {
         if (TestStr(code, "*")) {
             ctx.ignore_procedures = true;
+            proc_key = "*";
         } else {
             drd_ProcedureCode proc =
                 drd_ProcedureCode::Parse(code, RG_DEFAULT_PARSE_FLAGS & ~(int)ParseFlag::Log);
@@ -579,6 +693,8 @@ void ProduceMcoHighlight(const http_RequestInfo &request, const User *, http_IO
                 io->AttachError(404);
                 return;
             }
+
+            proc_key = DuplicateString(proc.str, &io->allocator).ptr;
         }
     }
 
@@ -596,15 +712,15 @@ void ProduceMcoHighlight(const http_RequestInfo &request, const User *, http_IO
         }
     }
 
+    // Reuse previous result if possible
+    InfoPageBuilder json;
+    if (!json.Init(io, "highlight", index, Fmt(&io->allocator, "%1:%2", diag_key, proc_key).ptr))
+        return;
+
     // Run highlighter
     HashMap<int16_t, uint16_t> matches;
     HighlightNodes(ctx, 0, 0xF, &matches);
 
-    // Output matches!
-    http_JsonPageBuilder json;
-    if (!json.Init(io))
-        return;
-
     json.StartObject();
     for (const auto &it: matches.table) {
         char buf[16];
@@ -612,7 +728,6 @@ void ProduceMcoHighlight(const http_RequestInfo &request, const User *, http_IO
     }
     json.EndObject();
 
-    io->AddCachingHeaders(thop_config.max_age, thop_etag);
     json.Finish();
 }
 
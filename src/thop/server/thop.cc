@@ -113,8 +113,10 @@ static void ProduceSettings(const http_RequestInfo &, const User *user, http_IO
 
         json.Key("casemix"); json.StartObject();
         if (user) {
-            json.Key("min_date"); json.String(Fmt(buf, "%1", mco_stay_set_dates[0]).ptr);
-            json.Key("max_date"); json.String(Fmt(buf, "%1", mco_stay_set_dates[1]).ptr);
+            RetainPtr<const McoDataset> dataset = GetMcoDataset();
+
+            json.Key("min_date"); json.String(Fmt(buf, "%1", dataset->stay_set_dates[0]).ptr);
+            json.Key("max_date"); json.String(Fmt(buf, "%1", dataset->stay_set_dates[1]).ptr);
 
             json.Key("algorithms"); json.StartArray();
             for (Size i = 0; i < RG_LEN(mco_DispenseModeOptions); i++) {
@@ -438,7 +440,7 @@ static void HandleRequest(const http_RequestInfo &request, http_IO *io)
     switch (route->type) {
         case Route::Type::Asset: {
             io->AttachBinary(200, route->u.st.asset.data, route->u.st.mime_type,
-                             route->u.st.asset.compression_type);
+                             route->u.st.asset.compression_type, http_Priority::High);
             io->AddCachingHeaders(thop_config.max_age, thop_etag);
         } break;
 
@@ -593,6 +595,12 @@ Options:
             if (ret == WaitForResult::Interrupt) {
                 LogInfo("Exit requested");
                 run = false;
+            } else if (thop_has_casemix) {
+                bool force = (ret == WaitForResult::Message);
+
+                // Keep serving current stays if anything goes wrong
+                LogDebug("Check MCO stays");
+                ReloadMcoStays(thop_config.mco_stay_directories, thop_config.mco_stay_filenames, force);
             }
 
             LogDebug("Prune sessions");
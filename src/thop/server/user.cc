@@ -263,6 +263,20 @@ void UserSetBuilder::Finish(const StructureSet &structure_set, UserSet *out_set)
             }
         }
 
+        // Hash sorted unit list, this is used to share cached aggregates between users
+        {
+            HeapArray<int16_t> numbers;
+            for (drd_UnitCode unit: user.mco_allowed_units.table) {
+                numbers.Append(unit.number);
+            }
+            std::sort(numbers.begin(), numbers.end());
+
+            uint8_t hash[16];
+            crypto_generichash(hash, RG_SIZE(hash), (const uint8_t *)numbers.ptr,
+                               (size_t)(numbers.len * RG_SIZE(*numbers.ptr)), nullptr, 0);
+            Fmt(user.mco_units_hash, "%1", FmtSpan(hash, FmtType::SmallHex, "").Pad0(-2));
+        }
+
         set.map.Set(&user);
     }
 
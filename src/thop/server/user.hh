@@ -44,6 +44,7 @@ struct User: public RetainObject<User> {
     unsigned int permissions;
     unsigned int mco_dispense_modes;
     HashSet<drd_UnitCode> mco_allowed_units;
+    char mco_units_hash[33]; // Same for users with the same allowed units
 
     bool CheckPermission(UserPermission permission) const { return permissions & (int)permission; }
     bool CheckMcoDispenseMode(mco_DispenseMode dispense_mode) const